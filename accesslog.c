@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "accesslog.h"
+#include "metrics.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define FLUSH_INTERVAL_MS 100
+#define BLOCK_WAIT_US 1000      //a blocked worker rechecks its ring this often
+#define MAX_RECORD 4096
+#define MAX_LOGGED_PATH 2048    //escaped bytes, longer paths are cut
+#define MAX_LOGGED_METHOD 16
+#define MAX_IOVECS 1024         //IOV_MAX on Linux
+
+//the ring of the calling thread. a process has a single access log,
+//tRingLog only guards against logging to one that was not created yet.
+static __thread log_ring_t* tRing = NULL;
+static __thread access_log_t* tRingLog = NULL;
+
+//"2026-10-18T12:28:53" of the last second this thread formatted
+static __thread time_t tSecond = -1;
+static __thread char tSecondText[32];
+
+static void* runFlusher(void*);
+static void flushRings(access_log_t*);
+static void writeBatch(access_log_t*, struct iovec*, int);
+static void rotateFile(access_log_t*);
+static void wakeFlusher(access_log_t*);
+static log_ring_t* getThreadRing(access_log_t*);
+static int formatRecord(char*, const access_record_t*);
+static char* appendEscaped(char*, const char*, int, int);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+access_log_t* create_access_log(const char* path, size_t ring_size, int policy) {
+
+        access_log_t* log = (access_log_t*)calloc(1, sizeof(access_log_t));
+        if(!log)
+                return NULL;
+
+        log->path = strdup(path);
+        log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(!log->path || log->fd < 0) {
+                if(log->fd >= 0)
+                        close(log->fd);
+                free(log->path);
+                free(log);
+                return NULL;
+        }
+
+        //room for a couple of records at least, and a power of two to mask offsets
+        log->ring_size = 2 * MAX_RECORD;
+        while(log->ring_size < ring_size)
+                log->ring_size <<= 1;
+        log->policy = policy;
+
+        pthread_mutex_init(&log->lock, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&log->wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if(pthread_create(&log->flusher, NULL, runFlusher, log)) {
+                pthread_mutex_destroy(&log->lock);
+                pthread_cond_destroy(&log->wake);
+                close(log->fd);
+                free(log->path);
+                free(log);
+                return NULL;
+        }
+
+        return log;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void log_access(access_log_t* log, const access_record_t* record) {
+
+        log_ring_t* ring = getThreadRing(log);
+        if(!ring) {
+                metric_inc(METRIC_LOG_DROPPED);
+                return;
+        }
+
+        char text[MAX_RECORD];
+        size_t length = formatRecord(text, record);
+
+        //only this thread moves head, the flusher moves tail
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        while(ring->size - (head - tail) < length) {
+
+                if(log->policy == ACCESS_LOG_DROP) {
+                        metric_inc(METRIC_LOG_DROPPED);
+                        return;
+                }
+
+                wakeFlusher(log);
+                usleep(BLOCK_WAIT_US);
+                tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        }
+
+        size_t offset = head & (ring->size - 1);
+        size_t first = ring->size - offset < length ? ring->size - offset : length;
+        memcpy(ring->data + offset, text, first);
+        memcpy(ring->data, text + first, length - first);
+        __atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+
+        if(head + length - tail > ring->size / 2)
+                wakeFlusher(log);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void rotate_access_log(access_log_t* log) {
+
+        pthread_mutex_lock(&log->lock);
+        log->rotate = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_access_log(access_log_t* log) {
+
+        pthread_mutex_lock(&log->lock);
+        log->stop = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(log->flusher, NULL);
+
+        while(log->rings) {
+                log_ring_t* ring = log->rings;
+                log->rings = ring->next;
+                free(ring->data);
+                free(ring);
+        }
+
+        close(log->fd);
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->wake);
+        free(log->path);
+        free(log);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//flushes every FLUSH_INTERVAL_MS, or when woken by a filling ring
+static void* runFlusher(void* arg) {
+
+        access_log_t* log = (access_log_t*)arg;
+
+        pthread_mutex_lock(&log->lock);
+        while(!log->stop) {
+
+                if(!__atomic_load_n(&log->pending, __ATOMIC_ACQUIRE) && !log->rotate) {
+                        struct timespec deadline;
+                        clock_gettime(CLOCK_MONOTONIC, &deadline);
+                        deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+                        if(deadline.tv_nsec >= 1000000000L) {
+                                deadline.tv_sec++;
+                                deadline.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+                }
+
+                __atomic_store_n(&log->pending, 0, __ATOMIC_RELEASE);
+                int rotate = log->rotate;
+                log->rotate = 0;
+                pthread_mutex_unlock(&log->lock);
+
+                flushRings(log);
+                if(rotate)
+                        rotateFile(log);
+
+                pthread_mutex_lock(&log->lock);
+        }
+        pthread_mutex_unlock(&log->lock);
+
+        flushRings(log);
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//everything the rings hold goes out in as few writev calls as possible
+static void flushRings(access_log_t* log) {
+
+        pthread_mutex_lock(&log->lock);
+        log_ring_t* ring = log->rings;  //new rings are pushed in front, next never changes
+        pthread_mutex_unlock(&log->lock);
+
+        struct iovec iov[MAX_IOVECS];
+        log_ring_t* owners[MAX_IOVECS / 2];
+        size_t heads[MAX_IOVECS / 2];
+        int iovcnt = 0;
+        int count = 0;
+
+        for(; ring; ring = ring->next) {
+
+                size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                size_t tail = ring->tail;
+                if(head == tail)
+                        continue;
+
+                //the used part of a ring is at most two pieces
+                size_t offset = tail & (ring->size - 1);
+                size_t length = head - tail;
+                size_t first = ring->size - offset < length ? ring->size - offset : length;
+                iov[iovcnt].iov_base = ring->data + offset;
+                iov[iovcnt++].iov_len = first;
+                if(length > first) {
+                        iov[iovcnt].iov_base = ring->data;
+                        iov[iovcnt++].iov_len = length - first;
+                }
+                owners[count] = ring;
+                heads[count++] = head;
+
+                if(count == MAX_IOVECS / 2) {
+                        writeBatch(log, iov, iovcnt);
+                        while(count > 0) {
+                                count--;
+                                __atomic_store_n(&owners[count]->tail, heads[count], __ATOMIC_RELEASE);
+                        }
+                        iovcnt = 0;
+                }
+        }
+
+        if(count > 0) {
+                writeBatch(log, iov, iovcnt);
+                while(count > 0) {
+                        count--;
+                        __atomic_store_n(&owners[count]->tail, heads[count], __ATOMIC_RELEASE);
+                }
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a failed write loses the batch - the workers must not wait on a full disk
+static void writeBatch(access_log_t* log, struct iovec* iov, int iovcnt) {
+
+        while(iovcnt > 0) {
+
+                ssize_t nBytes = writev(log->fd, iov, iovcnt);
+                if(nBytes < 0) {
+                        perror("access log");
+                        return;
+                }
+
+                while(iovcnt > 0 && nBytes >= (ssize_t)iov->iov_len) {
+                        nBytes -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if(iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + nBytes;
+                        iov->iov_len -= nBytes;
+                }
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//<path> becomes <path>.1, replacing the previous one. if the file was moved
+//away already (logrotate) the rename fails and only a new file is opened.
+static void rotateFile(access_log_t* log) {
+
+        char rotated[strlen(log->path) + 3];
+        sprintf(rotated, "%s.1", log->path);
+        rename(log->path, rotated);
+
+        int fd = open(log->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(fd < 0) {
+                perror("access log");
+                return; //keep writing to the old file
+        }
+
+        close(log->fd);
+        log->fd = fd;
+        debug_print("rotateFile - %s\n", log->path);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//one signal per flush - the flag keeps the other workers off the mutex
+static void wakeFlusher(access_log_t* log) {
+
+        if(__atomic_exchange_n(&log->pending, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the first record of a thread registers its ring. returns NULL on failure
+static log_ring_t* getThreadRing(access_log_t* log) {
+
+        if(tRingLog == log)
+                return tRing;
+
+        log_ring_t* ring = (log_ring_t*)calloc(1, sizeof(log_ring_t));
+        if(!ring)
+                return NULL;
+
+        ring->size = log->ring_size;
+        ring->data = (char*)malloc(ring->size);
+        if(!ring->data) {
+                free(ring);
+                return NULL;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        ring->next = log->rings;
+        log->rings = ring;
+        pthread_mutex_unlock(&log->lock);
+
+        tRing = ring;
+        tRingLog = log;
+        return ring;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//{"time":"2026-10-18T12:28:53.123Z","method":"GET","path":"/a.html","status":200,"bytes":512,"duration_us":87}
+//returns length of the line written to buf (MAX_RECORD bytes)
+static int formatRecord(char* buf, const access_record_t* record) {
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if(now.tv_sec != tSecond) {
+                struct tm tm;
+                gmtime_r(&now.tv_sec, &tm);
+                strftime(tSecondText, sizeof(tSecondText), "%Y-%m-%dT%H:%M:%S", &tm);
+                tSecond = now.tv_sec;
+        }
+
+        char* pos = buf;
+        pos += sprintf(pos, "{\"time\":\"%s.%03ldZ\",\"method\":\"", tSecondText, now.tv_nsec / 1000000);
+        pos = appendEscaped(pos, record->method, record->method_length, MAX_LOGGED_METHOD);
+
+        if(record->path) {
+                pos += sprintf(pos, "\",\"path\":\"");
+                pos = appendEscaped(pos, record->path, strlen(record->path), MAX_LOGGED_PATH);
+                pos += sprintf(pos, "\"");
+        } else {
+                pos += sprintf(pos, "\",\"path\":null");
+        }
+
+        pos += sprintf(pos, ",\"status\":%d,\"bytes\":%ld,\"duration_us\":%ld}\n",
+                       record->status, record->bytes, record->duration_us);
+        return pos - buf;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//appends str as the inside of a JSON string, at most room bytes.
+//returns the new end of buf
+static char* appendEscaped(char* buf, const char* str, int length, int room) {
+
+        char* end = buf + room;
+        int i;
+        for(i = 0; i < length; i++) {
+
+                unsigned char c = str[i];
+                if(c == '"' || c == '\\') {
+                        if(end - buf < 2)
+                                break;
+                        *buf++ = '\\';
+                        *buf++ = c;
+                } else if(c < 0x20 || c == 0x7f) {
+                        if(end - buf < 6)
+                                break;
+                        buf += sprintf(buf, "\\u%04x", c);
+                } else {
+                        if(end - buf < 1)
+                                break;
+                        *buf++ = c;
+                }
+        }
+
+        return buf;
+}
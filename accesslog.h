@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * accesslog.h
+ *
+ * Asynchronous access log, one JSON object per line.
+ * A worker formats its record and copies it into a ring buffer only that
+ * thread writes to, so logging takes no lock. A flusher thread collects
+ * every ring and appends them to the file with a single writev, about ten
+ * times a second or sooner when a ring fills up.
+ * A full ring either drops the record (counted as METRIC_LOG_DROPPED) or
+ * makes the worker wait for the flusher, see create_access_log.
+ * rotate_access_log renames the file to <path>.1 and starts a new one.
+ */
+
+#define ACCESS_LOG_DROP 0       //a full ring drops records
+#define ACCESS_LOG_BLOCK 1      //a full ring blocks the worker
+
+typedef struct log_ring_st {
+        char* data;
+        size_t size;                    //power of two
+        size_t head;                    //advanced by the owning worker
+        size_t tail;                    //advanced by the flusher
+        struct log_ring_st* next;
+} log_ring_t;
+
+typedef struct access_log_st {
+        char* path;
+        int fd;
+        int policy;
+        size_t ring_size;
+        log_ring_t* rings;              //one per thread that logged
+
+        pthread_mutex_t lock;           //guards rings and the flags below
+        pthread_cond_t wake;
+        int pending;                    //a ring is more than half full
+        int rotate;
+        int stop;
+        pthread_t flusher;
+} access_log_t;
+
+typedef struct access_record_st {
+        const char* method;
+        int method_length;
+        const char* path;       //NULL if the request had none
+        int status;
+        long bytes;             //sent, headers included
+        long duration_us;
+} access_record_t;
+
+
+/**
+ * create_access_log opens path for appending and starts the flusher.
+ * every logging thread gets a ring of ring_size bytes (rounded up to a
+ * power of two), policy is ACCESS_LOG_DROP or ACCESS_LOG_BLOCK.
+ * returns the log, NULL on failure.
+ */
+access_log_t* create_access_log(const char* path, size_t ring_size, int policy);
+
+/**
+ * appends record, stamped with the current time, to the calling thread's ring.
+ */
+void log_access(access_log_t* log, const access_record_t* record);
+
+/**
+ * asks the flusher to rotate the file once it wrote what is buffered.
+ * not async-signal-safe - call it from a thread, not a signal handler.
+ */
+void rotate_access_log(access_log_t* log);
+
+/**
+ * flushes every ring, stops the flusher and closes the file.
+ * no thread may log anymore.
+ */
+void destroy_access_log(access_log_t* log);
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bufpool.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+buffer_pool_t* create_buffer_pool(int size, int max_free) {
+
+        if(size < (int)sizeof(char*) || max_free < 0)
+                return NULL;
+
+        buffer_pool_t* pool = (buffer_pool_t*)calloc(1, sizeof(buffer_pool_t));
+        if(!pool)
+                return NULL;
+
+        pool->size = size;
+        pool->max_free = max_free;
+        pthread_mutex_init(&pool->lock, NULL);
+        return pool;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+char* take_buffer(buffer_pool_t* pool) {
+
+        pthread_mutex_lock(&pool->lock);
+        char* buffer = pool->free;
+        if(buffer) {
+                pool->free = *(char**)buffer;
+                pool->num_of_free--;
+        }
+        if(++pool->in_use > pool->peak)
+                pool->peak = pool->in_use;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(buffer || (buffer = (char*)malloc(pool->size)))
+                return buffer;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->in_use--;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void release_buffer(buffer_pool_t* pool, char* buffer) {
+
+        pthread_mutex_lock(&pool->lock);
+        pool->in_use--;
+        int keep = pool->num_of_free < pool->max_free;
+        if(keep) {
+                *(char**)buffer = pool->free;
+                pool->free = buffer;
+                pool->num_of_free++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if(!keep)
+                free(buffer);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_buffer_pool(buffer_pool_t* pool) {
+
+        debug_print("destroy_buffer_pool - peak %d in use\n", pool->peak);
+        while(pool->free) {
+                char* buffer = pool->free;
+                pool->free = *(char**)buffer;
+                free(buffer);
+        }
+
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+}
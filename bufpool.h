@@ -0,0 +1,43 @@
+#include <pthread.h>
+
+/**
+ * bufpool.h
+ *
+ * Fixed size buffers shared by every connection, taken while a request is
+ * in flight and given back as soon as it is answered. A connection that
+ * waits for its next request holds none.
+ * Up to max_free released buffers are kept for reuse, the rest are freed.
+ */
+
+typedef struct buffer_pool_st {
+        int size;                       //of each buffer
+        int max_free;
+        char* free;                     //linked through their first bytes
+        int num_of_free;
+        int in_use;
+        int peak;                       //of in_use
+        pthread_mutex_t lock;
+} buffer_pool_t;
+
+
+/**
+ * create_buffer_pool creates a pool of buffers of size bytes (at least a
+ * pointer's) keeping up to max_free of them for reuse.
+ * returns NULL on failure.
+ */
+buffer_pool_t* create_buffer_pool(int size, int max_free);
+
+/**
+ * returns a buffer of the pool's size, NULL on failure. thread safe.
+ */
+char* take_buffer(buffer_pool_t* pool);
+
+/**
+ * gives back a buffer taken from pool. thread safe.
+ */
+void release_buffer(buffer_pool_t* pool, char* buffer);
+
+/**
+ * frees the pool and its free buffers. every buffer must be released.
+ */
+void destroy_buffer_pool(buffer_pool_t* pool);
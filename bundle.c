@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+static bundle_t* openBundle(const char*);
+static int isValid(const char*, uint64_t);
+static int inBounds(uint64_t, uint64_t, uint64_t);
+static void unmapBundle(bundle_t*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+bundle_store_t* create_bundle_store(const char* file) {
+
+        bundle_store_t* store = (bundle_store_t*)calloc(1, sizeof(bundle_store_t));
+        if(!store)
+                return NULL;
+
+        store->file = strdup(file);
+        if(!store->file || !(store->current = openBundle(file))) {
+                free(store->file);
+                free(store);
+                return NULL;
+        }
+
+        pthread_mutex_init(&store->lock, NULL);
+        return store;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int reload_bundle(bundle_store_t* store) {
+
+        bundle_t* bundle = openBundle(store->file);
+        if(!bundle)
+                return -1;
+
+        pthread_mutex_lock(&store->lock);
+        bundle_t* old = store->current;
+        store->current = bundle;
+        int unused = --old->refs == 0;
+        pthread_mutex_unlock(&store->lock);
+
+        if(unused)
+                unmapBundle(old);
+
+        debug_print("reload_bundle - %lu entries\n", (unsigned long)bundle->count);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+bundle_t* acquire_bundle(bundle_store_t* store) {
+
+        pthread_mutex_lock(&store->lock);
+        bundle_t* bundle = store->current;
+        bundle->refs++;
+        pthread_mutex_unlock(&store->lock);
+
+        return bundle;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void release_bundle(bundle_store_t* store, bundle_t* bundle) {
+
+        pthread_mutex_lock(&store->lock);
+        int unused = --bundle->refs == 0;
+        pthread_mutex_unlock(&store->lock);
+
+        if(unused)
+                unmapBundle(bundle);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+const bundle_entry_t* lookup_bundle(bundle_t* bundle, const char* path, int length) {
+
+        uint64_t low = 0;
+        uint64_t high = bundle->count;
+        while(low < high) {
+
+                uint64_t middle = low + (high - low) / 2;
+                const bundle_entry_t* entry = &bundle->entries[middle];
+                int order = compare_bundle_paths(bundle->data + entry->path_offset, entry->path_length, path, length);
+                if(!order)
+                        return entry;
+
+                if(order < 0)
+                        low = middle + 1;
+                else
+                        high = middle;
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int compare_bundle_paths(const char* a, int a_length, const char* b, int b_length) {
+
+        int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+        if(order)
+                return order;
+
+        return a_length - b_length;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_bundle_store(bundle_store_t* store) {
+
+        unmapBundle(store->current);
+        pthread_mutex_destroy(&store->lock);
+        free(store->file);
+        free(store);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//maps and checks the bundle at file.
+//returns it with one reference (the store's), NULL on failure
+static bundle_t* openBundle(const char* file) {
+
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+                return NULL;
+
+        struct stat st;
+        if(fstat(fd, &st) || st.st_size < (off_t)sizeof(bundle_header_t)) {
+                close(fd);
+                return NULL;
+        }
+
+        char* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) {
+                close(fd);
+                return NULL;
+        }
+
+        bundle_t* bundle = (bundle_t*)calloc(1, sizeof(bundle_t));
+        if(!bundle || !isValid(data, st.st_size)) {
+                fprintf(stderr, "%s: not a valid bundle\n", file);
+                free(bundle);
+                munmap(data, st.st_size);
+                close(fd);
+                return NULL;
+        }
+
+        const bundle_header_t* header = (const bundle_header_t*)data;
+        bundle->fd = fd;
+        bundle->data = data;
+        bundle->size = st.st_size;
+        bundle->entries = (const bundle_entry_t*)(data + header->index_offset);
+        bundle->count = header->index_count;
+        bundle->refs = 1;
+
+        //the index is hit by every request, the bodies only by their own
+        madvise(data + header->index_offset, header->index_count * sizeof(bundle_entry_t), MADV_WILLNEED);
+        return bundle;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//every offset of the index points inside the file, so a damaged bundle is
+//refused at load instead of crashing a worker later.
+//returns 1 if valid, 0 otherwise
+static int isValid(const char* data, uint64_t size) {
+
+        const bundle_header_t* header = (const bundle_header_t*)data;
+        if(memcmp(header->magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LENGTH) || header->size != size)
+                return 0;
+
+        if(header->index_offset % sizeof(uint64_t) ||
+           header->index_count > size / sizeof(bundle_entry_t) ||
+           !inBounds(header->index_offset, header->index_count * sizeof(bundle_entry_t), size))
+                return 0;
+
+        const bundle_entry_t* entries = (const bundle_entry_t*)(data + header->index_offset);
+        uint64_t i;
+        for(i = 0; i < header->index_count; i++) {
+
+                const bundle_entry_t* entry = &entries[i];
+                if(entry->path_length > BUNDLE_MAX_PATH || !inBounds(entry->path_offset, entry->path_length, size) ||
+                   !inBounds(entry->type_offset, entry->type_length, size))
+                        return 0;
+
+                const bundle_body_t* bodies[] = { &entry->identity, &entry->gzip };
+                int j;
+                for(j = 0; j < 2; j++) {
+                        const bundle_body_t* body = bodies[j];
+                        if(!inBounds(body->offset, body->length, size) ||
+                           !inBounds(body->headers_offset, body->headers_length, size) ||
+                           !inBounds(body->etag_offset, body->etag_length, size))
+                                return 0;
+                }
+
+                //sorted, or lookups would miss
+                if(i > 0 && compare_bundle_paths(data + entries[i - 1].path_offset, entries[i - 1].path_length,
+                                                 data + entry->path_offset, entry->path_length) >= 0)
+                        return 0;
+        }
+
+        return 1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int inBounds(uint64_t offset, uint64_t length, uint64_t size) {
+
+        return offset <= size && length <= size - offset;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void unmapBundle(bundle_t* bundle) {
+
+        debug_print("unmapBundle - %lu entries\n", (unsigned long)bundle->count);
+        munmap(bundle->data, bundle->size);
+        close(bundle->fd);
+        free(bundle);
+}
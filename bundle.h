@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * bundle.h
+ *
+ * A whole static site packed into one immutable file by tools/bundle:
+ * every servable file's body (and optionally a gzip variant of it), its
+ * precomputed HTTP/1.x header lines, and an index sorted by path.
+ * The server maps the bundle once; answering a GET is a binary search of
+ * the index and a single writev of status line, Date, the stored headers
+ * and the body straight from the mapping - no stat, open or permission
+ * walk, however many files the site has.
+ * The bundle in use is swapped atomically by reload_bundle. A request holds
+ * a reference to the bundle it started with, so an old mapping is unmapped
+ * only once its last response is written.
+ *
+ * File layout: bundle_header_t, then the bodies, then the strings (paths,
+ * types, ETags, header blocks), then index_count bundle_entry_t.
+ * All integers are in the byte order of the machine that packed it.
+ */
+
+#define BUNDLE_MAGIC "HTBUNDL1"
+#define BUNDLE_MAGIC_LENGTH 8
+#define BUNDLE_MAX_PATH 4000       //longer paths can't be requested anyway
+
+typedef struct bundle_header_st {
+        char magic[BUNDLE_MAGIC_LENGTH];
+        uint64_t size;                  //of the whole file, catches a truncated copy
+        uint64_t index_offset;
+        uint64_t index_count;
+} bundle_header_t;
+
+//one representation of a file
+typedef struct bundle_body_st {
+        uint64_t offset;
+        uint64_t length;                //0 with offset 0 - the variant is missing
+        uint64_t headers_offset;        //"Content-Type: ...\r\n" ... through the blank line
+        uint64_t headers_length;
+        uint64_t etag_offset;           //quoted, as in the ETag header
+        uint64_t etag_length;
+} bundle_body_t;
+
+typedef struct bundle_entry_st {
+        uint64_t path_offset;           //"/dir/file", "/dir/" for a directory's index.html
+        uint64_t path_length;
+        uint64_t type_offset;           //MIME type, type_length 0 if unknown
+        uint64_t type_length;
+        int64_t mtime;
+        bundle_body_t identity;
+        bundle_body_t gzip;
+} bundle_entry_t;
+
+typedef struct bundle_st {
+        int fd;                         //kept open for sendfile() and a swap-proof identity
+        char* data;
+        uint64_t size;
+        const bundle_entry_t* entries;
+        uint64_t count;
+        int refs;                       //holders, +1 while current
+} bundle_t;
+
+typedef struct bundle_store_st {
+        char* file;
+        bundle_t* current;
+        pthread_mutex_t lock;           //guards current and every refs
+} bundle_store_t;
+
+
+/**
+ * create_bundle_store maps the bundle at file.
+ * returns NULL if it can't be read or is not a valid bundle.
+ */
+bundle_store_t* create_bundle_store(const char* file);
+
+/**
+ * maps the bundle at the store's path again and makes it current - deploy
+ * by renaming a new bundle over the old one, then reloading.
+ * returns 0 on success, -1 if the new bundle is invalid (the current one
+ * stays in use).
+ */
+int reload_bundle(bundle_store_t* store);
+
+/**
+ * returns the current bundle, which stays mapped until released.
+ */
+bundle_t* acquire_bundle(bundle_store_t* store);
+
+/**
+ * drops a reference taken by acquire_bundle.
+ */
+void release_bundle(bundle_store_t* store, bundle_t* bundle);
+
+/**
+ * returns the entry of path (length bytes), NULL if the bundle has none.
+ */
+const bundle_entry_t* lookup_bundle(bundle_t* bundle, const char* path, int length);
+
+/**
+ * orders paths the way the index is sorted. tools/bundle sorts with it.
+ */
+int compare_bundle_paths(const char* a, int a_length, const char* b, int b_length);
+
+/**
+ * unmaps the current bundle and frees the store. no bundle may be held anymore.
+ */
+void destroy_bundle_store(bundle_store_t* store);
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "datecache.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+static char sDateHeader[DATE_HEADER_LENGTH + 1] = "Date: ";
+static time_t sDateSecond = 0;
+static unsigned sDateSeq = 0;   //odd while sDateHeader is being rewritten
+static pthread_mutex_t sDateLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void updateDateHeader(time_t);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int get_date_header(char* buf) {
+
+        time_t now = time(NULL);
+        if(now != __atomic_load_n(&sDateSecond, __ATOMIC_ACQUIRE))
+                updateDateHeader(now);
+
+        unsigned before;
+        unsigned after;
+        do {
+                before = __atomic_load_n(&sDateSeq, __ATOMIC_ACQUIRE);
+                memcpy(buf, sDateHeader, DATE_HEADER_LENGTH);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                after = __atomic_load_n(&sDateSeq, __ATOMIC_RELAXED);
+        } while((before & 1) || before != after);
+
+        return DATE_HEADER_LENGTH;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//only one thread formats the new second, the others keep reading the old one
+static void updateDateHeader(time_t now) {
+
+        //before the first update there is nothing to fall back on - wait for it
+        if(__atomic_load_n(&sDateSecond, __ATOMIC_ACQUIRE) ? pthread_mutex_trylock(&sDateLock) : pthread_mutex_lock(&sDateLock))
+                return;
+
+        if(now != sDateSecond) {
+                debug_print("updateDateHeader - %ld\n", (long)now);
+                char value[DATE_VALUE_LENGTH + 1];
+                format_http_date(now, value);
+
+                __atomic_store_n(&sDateSeq, sDateSeq + 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                memcpy(sDateHeader + DATE_VALUE_OFFSET, value, DATE_VALUE_LENGTH);
+                memcpy(sDateHeader + DATE_VALUE_OFFSET + DATE_VALUE_LENGTH, "\r\n", 2);
+                __atomic_store_n(&sDateSeq, sDateSeq + 1, __ATOMIC_RELEASE);
+                __atomic_store_n(&sDateSecond, now, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&sDateLock);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int format_http_date(time_t t, char* buf) {
+
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        return (int)strftime(buf, DATE_VALUE_LENGTH + 1, RFC1123FMT, &tm);
+}
@@ -0,0 +1,30 @@
+/**
+ * datecache.h
+ *
+ * The "Date:" response header, formatted at most once per second into a
+ * buffer shared by all threads.
+ * Readers never block: the buffer is published through a sequence counter
+ * (seqlock), so a reader retries in the rare case it raced the once a second
+ * update.
+ */
+
+#include <time.h>
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" - RFC1123 dates have a fixed width
+#define DATE_HEADER_LENGTH 37
+#define DATE_VALUE_OFFSET 6
+#define DATE_VALUE_LENGTH 29
+
+
+/**
+ * copies the current "Date: ...\r\n" header line into buf
+ * (exactly DATE_HEADER_LENGTH bytes, not NUL terminated).
+ * returns DATE_HEADER_LENGTH.
+ */
+int get_date_header(char* buf);
+
+/**
+ * formats t as an RFC1123 date into buf (DATE_VALUE_LENGTH bytes + NUL).
+ * thread safe, unlike gmtime().
+ */
+int format_http_date(time_t t, char* buf);
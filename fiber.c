@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "fiber.h"
+#include "metrics.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+//the fiber running on this thread under a scheduler
+static __thread fiber_t* tFiber = NULL;
+
+static void startFiber(fiber_scheduler_t*, fiber_t*);
+static void runFiber(fiber_scheduler_t*, fiber_t*);
+static void unparkFiber(fiber_scheduler_t*, fiber_t*);
+static char* takeStack(fiber_scheduler_t*);
+static void releaseStack(fiber_scheduler_t*, char*);
+static void prepareStack(fiber_scheduler_t*, fiber_t*);
+static void switchIn(fiber_t*);
+static void switchOut(fiber_t*);
+static void fiberStart();
+
+#if defined(__x86_64__)
+//saves the callee-saved registers on the current stack, stores its pointer
+//in *from and continues on stack to - where another fiberSwitch (or
+//prepareStack) left the same registers and a return address.
+void fiberSwitch(void** from, void* to);
+__asm__(".text\n"
+        ".globl fiberSwitch\n"
+        ".hidden fiberSwitch\n"
+        ".type fiberSwitch, @function\n"
+        "fiberSwitch:\n"
+        "        pushq %rbp\n"
+        "        pushq %rbx\n"
+        "        pushq %r12\n"
+        "        pushq %r13\n"
+        "        pushq %r14\n"
+        "        pushq %r15\n"
+        "        movq %rsp, (%rdi)\n"
+        "        movq %rsi, %rsp\n"
+        "        popq %r15\n"
+        "        popq %r14\n"
+        "        popq %r13\n"
+        "        popq %r12\n"
+        "        popq %rbx\n"
+        "        popq %rbp\n"
+        "        ret\n"
+        ".size fiberSwitch, .-fiberSwitch\n");
+#endif
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+fiber_scheduler_t* create_fiber_scheduler(long stack_size, void (*detach)(fiber_t*)) {
+
+        long page = sysconf(_SC_PAGESIZE);
+        if(stack_size <= 0 || !detach)
+                return NULL;
+
+        fiber_scheduler_t* scheduler = (fiber_scheduler_t*)calloc(1, sizeof(fiber_scheduler_t));
+        if(!scheduler)
+                return NULL;
+
+        scheduler->epfd = epoll_create1(EPOLL_CLOEXEC);
+        scheduler->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        //the eventfd is the only one registered without a fiber
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if(scheduler->epfd < 0 || scheduler->wakefd < 0 ||
+           epoll_ctl(scheduler->epfd, EPOLL_CTL_ADD, scheduler->wakefd, &event)) {
+                if(scheduler->epfd >= 0)
+                        close(scheduler->epfd);
+                if(scheduler->wakefd >= 0)
+                        close(scheduler->wakefd);
+                free(scheduler);
+                return NULL;
+        }
+
+        scheduler->stack_size = (stack_size + page - 1) / page * page;
+        scheduler->detach = detach;
+        pthread_mutex_init(&scheduler->lock, NULL);
+        pthread_cond_init(&scheduler->stop, NULL);
+        return scheduler;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int spawn_fiber(fiber_scheduler_t* scheduler, fiber_fn fn, void* arg) {
+
+        fiber_t* fiber = (fiber_t*)calloc(1, sizeof(fiber_t));
+        if(!fiber)
+                return -1;
+
+        fiber->fn = fn;
+        fiber->arg = arg;
+        fiber->fd = -1;
+        fiber->scheduler = scheduler;
+
+        pthread_mutex_lock(&scheduler->lock);
+        int wasEmpty = !scheduler->inbox;
+        if(wasEmpty)
+                scheduler->inbox = fiber;
+        else
+                scheduler->inbox_tail->next = fiber;
+        scheduler->inbox_tail = fiber;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        //a non-empty inbox was signaled already and is not taken yet
+        uint64_t one = 1;
+        if(wasEmpty && write(scheduler->wakefd, &one, sizeof(one)) < 0)
+                perror("write");
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int run_fiber_scheduler(void* arg) {
+
+        fiber_scheduler_t* scheduler = (fiber_scheduler_t*)arg;
+        struct epoll_event events[FIBER_EVENTS];
+
+        while(1) {
+
+                //count only changes on this thread
+                pthread_mutex_lock(&scheduler->lock);
+                fiber_t* spawned = scheduler->inbox;
+                scheduler->inbox = scheduler->inbox_tail = NULL;
+                int stopping = scheduler->stopping;
+                int done = stopping && !scheduler->count && !spawned && !scheduler->parked;
+                pthread_mutex_unlock(&scheduler->lock);
+                if(done)
+                        break;
+
+                while(spawned) {
+                        fiber_t* fiber = spawned;
+                        spawned = fiber->next;
+                        fiber->next = NULL;
+                        startFiber(scheduler, fiber);
+                }
+
+                //nothing is worth waiting for once stopping. the list is taken
+                //as a whole, a fiber parked meanwhile is started next round.
+                fiber_t* parked = stopping ? scheduler->parked : NULL;
+                while(parked) {
+                        fiber_t* fiber = parked;
+                        parked = fiber->next;
+                        epoll_ctl(scheduler->epfd, EPOLL_CTL_DEL, fiber->fd, NULL);
+                        unparkFiber(scheduler, fiber);
+                        startFiber(scheduler, fiber);
+                }
+
+                int nEvents = epoll_wait(scheduler->epfd, events, FIBER_EVENTS,
+                                         stopping && scheduler->parked ? 0 : -1);
+                if(nEvents < 0 && errno != EINTR) {
+                        perror("epoll_wait");
+                        continue;
+                }
+
+                int i;
+                for(i = 0; i < nEvents; i++) {
+
+                        fiber_t* fiber = (fiber_t*)events[i].data.ptr;
+                        if(fiber && !fiber->stack) {
+                                unparkFiber(scheduler, fiber);
+                                startFiber(scheduler, fiber);
+                                continue;
+                        }
+                        if(fiber) {
+                                runFiber(scheduler, fiber);
+                                continue;
+                        }
+
+                        uint64_t value;
+                        if(read(scheduler->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                                perror("read");
+                }
+        }
+
+        debug_print("run_fiber_scheduler - %d stopped\n", scheduler->epfd);
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->stopped = 1;
+        pthread_cond_signal(&scheduler->stop);
+        pthread_mutex_unlock(&scheduler->lock);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void stop_fiber_scheduler(fiber_scheduler_t* scheduler) {
+
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->stopping = 1;
+
+        uint64_t one = 1;
+        if(write(scheduler->wakefd, &one, sizeof(one)) < 0)
+                perror("write");
+
+        while(!scheduler->stopped)
+                pthread_cond_wait(&scheduler->stop, &scheduler->lock);
+        pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_fiber_scheduler(fiber_scheduler_t* scheduler) {
+
+        long page = sysconf(_SC_PAGESIZE);
+        while(scheduler->stacks) {
+                char* stack = scheduler->stacks;
+                scheduler->stacks = *(char**)(stack + page);
+                munmap(stack, page + scheduler->stack_size);
+        }
+
+        close(scheduler->epfd);
+        close(scheduler->wakefd);
+        pthread_cond_destroy(&scheduler->stop);
+        pthread_mutex_destroy(&scheduler->lock);
+        free(scheduler);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+fiber_t* current_fiber() {
+
+        return tFiber;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int wait_for_fd(int fd, int events) {
+
+        fiber_t* fiber = tFiber;
+        if(!fiber)
+                return -1;
+
+        //one-shot: a woken fiber is not reported again before it waits again.
+        //a fd may still be registered after a close while a dup is open.
+        struct epoll_event event;
+        event.events = events | EPOLLONESHOT;
+        event.data.ptr = fiber;
+        int epfd = fiber->scheduler->epfd;
+        int op = fiber->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if(epoll_ctl(epfd, op, fd, &event) &&
+           epoll_ctl(epfd, op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event))
+                return -1;
+
+        fiber->fd = fd;
+        metric_inc(METRIC_FIBER_WAITS);
+        switchOut(fiber);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int park_fiber(int fd, fiber_fn fn, void* arg) {
+
+        fiber_t* current = tFiber;
+        if(!current)
+                return -1;
+
+        fiber_scheduler_t* scheduler = current->scheduler;
+        fiber_t* fiber = (fiber_t*)calloc(1, sizeof(fiber_t));
+        if(!fiber)
+                return -1;
+
+        fiber->fn = fn;
+        fiber->arg = arg;
+        fiber->fd = fd;
+        fiber->scheduler = scheduler;
+
+        //fd is most likely still registered for the current fiber
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = fiber;
+        if(epoll_ctl(scheduler->epfd, EPOLL_CTL_MOD, fd, &event) &&
+           epoll_ctl(scheduler->epfd, EPOLL_CTL_ADD, fd, &event)) {
+                free(fiber);
+                return -1;
+        }
+        if(current->fd == fd)
+                current->fd = -1;
+
+        fiber->next = scheduler->parked;
+        if(scheduler->parked)
+                scheduler->parked->prev = fiber;
+        scheduler->parked = fiber;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int detach_fiber() {
+
+        fiber_t* fiber = tFiber;
+        if(!fiber)
+                return -1;
+
+        fiber->detaching = 1;
+        switchOut(fiber);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void run_detached_fiber(fiber_t* fiber) {
+
+        //without a scheduler it can't suspend, so it only comes back at its end
+        switchIn(fiber);
+        releaseStack(fiber->scheduler, fiber->stack);
+        free(fiber);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+static void startFiber(fiber_scheduler_t* scheduler, fiber_t* fiber) {
+
+        if(!(fiber->stack = takeStack(scheduler))) {
+                //the fiber's function owns arg, it runs here without a fiber
+                perror("mmap");
+                fiber->fn(fiber->arg);
+                free(fiber);
+                return;
+        }
+
+        prepareStack(scheduler, fiber);
+        scheduler->count++;
+        runFiber(scheduler, fiber);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs fiber until it suspends, ends or detaches
+static void runFiber(fiber_scheduler_t* scheduler, fiber_t* fiber) {
+
+        tFiber = fiber;
+        switchIn(fiber);
+        tFiber = NULL;
+
+        if(fiber->done) {
+                scheduler->count--;
+                releaseStack(scheduler, fiber->stack);
+                free(fiber);
+                return;
+        }
+
+        if(fiber->detaching) {
+                fiber->detaching = 0;
+                if(fiber->fd >= 0)
+                        epoll_ctl(scheduler->epfd, EPOLL_CTL_DEL, fiber->fd, NULL);
+                fiber->fd = -1;
+                scheduler->count--;
+                metric_inc(METRIC_FIBER_DETACHED);
+                scheduler->detach(fiber);
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//takes a fiber off the parked list, it keeps its fd for the next wait
+static void unparkFiber(fiber_scheduler_t* scheduler, fiber_t* fiber) {
+
+        if(fiber->prev)
+                fiber->prev->next = fiber->next;
+        else
+                scheduler->parked = fiber->next;
+        if(fiber->next)
+                fiber->next->prev = fiber->prev;
+        fiber->next = fiber->prev = NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns a stack mapping, guard page first, NULL on failure
+static char* takeStack(fiber_scheduler_t* scheduler) {
+
+        long page = sysconf(_SC_PAGESIZE);
+
+        pthread_mutex_lock(&scheduler->lock);
+        char* stack = scheduler->stacks;
+        if(stack) {
+                scheduler->stacks = *(char**)(stack + page);
+                scheduler->num_of_stacks--;
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+        if(stack)
+                return stack;
+
+        stack = mmap(NULL, page + scheduler->stack_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if(stack == MAP_FAILED)
+                return NULL;
+
+        //an overflow faults instead of writing over a neighbour
+        if(mprotect(stack, page, PROT_NONE)) {
+                munmap(stack, page + scheduler->stack_size);
+                return NULL;
+        }
+
+        return stack;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the link lives in the stack's lowest word, the last one a fiber reaches
+static void releaseStack(fiber_scheduler_t* scheduler, char* stack) {
+
+        long page = sysconf(_SC_PAGESIZE);
+
+        pthread_mutex_lock(&scheduler->lock);
+        int keep = scheduler->num_of_stacks < FIBER_MAX_POOLED_STACKS;
+        if(keep) {
+                *(char**)(stack + page) = scheduler->stacks;
+                scheduler->stacks = stack;
+                scheduler->num_of_stacks++;
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if(!keep)
+                munmap(stack, page + scheduler->stack_size);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sets fiber up so that switching in enters fiberStart on its own stack
+static void prepareStack(fiber_scheduler_t* scheduler, fiber_t* fiber) {
+
+        char* bottom = fiber->stack + sysconf(_SC_PAGESIZE);
+
+#if defined(__x86_64__)
+        //what fiberSwitch pops: six registers and a return address, so that
+        //fiberStart starts as if called, 16 byte aligned
+        void** sp = (void**)(bottom + scheduler->stack_size);
+        *--sp = NULL;
+        *--sp = (void*)fiberStart;
+        sp -= 6;
+        memset(sp, 0, 6 * sizeof(void*));
+        fiber->sp = sp;
+#else
+        getcontext(&fiber->context);
+        fiber->context.uc_stack.ss_sp = bottom;
+        fiber->context.uc_stack.ss_size = scheduler->stack_size;
+        fiber->context.uc_link = NULL;
+        makecontext(&fiber->context, fiberStart, 0);
+#endif
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void switchIn(fiber_t* fiber) {
+
+#if defined(__x86_64__)
+        fiberSwitch(&fiber->caller_sp, fiber->sp);
+#else
+        swapcontext(&fiber->caller, &fiber->context);
+#endif
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void switchOut(fiber_t* fiber) {
+
+#if defined(__x86_64__)
+        fiberSwitch(&fiber->sp, fiber->caller_sp);
+#else
+        swapcontext(&fiber->context, &fiber->caller);
+#endif
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a fiber's first frame. it never returns: its end switches out for good.
+static void fiberStart() {
+
+        fiber_t* fiber = tFiber;
+        fiber->fn(fiber->arg);
+        fiber->done = 1;
+        switchOut(fiber);
+}
@@ -0,0 +1,140 @@
+#include <pthread.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/**
+ * fiber.h
+ *
+ * Stackful fibers: a function running on a small stack of its own, that
+ * suspends itself instead of blocking on a socket.
+ * A scheduler owns one epoll and runs as a single long-lived job, i.e. on
+ * one pool thread. Its fibers run one at a time on that thread. A fiber
+ * that would block waits for its socket with wait_for_fd, which switches
+ * back to the scheduler; the scheduler resumes the fiber once epoll reports
+ * the socket ready. Thousands of slow connections cost a stack each, not a
+ * thread each.
+ * A fiber about to run code that blocks in ways the scheduler can't see
+ * (TLS, an upstream) detaches: it leaves the scheduler and continues on
+ * whatever thread the scheduler's detach callback hands it to.
+ * Stacks are mmapped with a guard page below them and reused.
+ * A fiber that has nothing to do until its socket is readable again can
+ * park instead: it ends, leaving a stackless record behind that starts a
+ * new fiber once the socket is. An idle connection costs a record, not a
+ * stack.
+ */
+
+#define FIBER_MAX_POOLED_STACKS 256     //free stacks a scheduler keeps for reuse
+#define FIBER_EVENTS 64                 //epoll events taken per wait
+
+typedef int (*fiber_fn)(void*);
+
+typedef struct fiber_st {
+#if defined(__x86_64__)
+        void* sp;                       //while suspended
+        void* caller_sp;                //of the context that resumed it
+#else
+        ucontext_t context;
+        ucontext_t caller;
+#endif
+        char* stack;                    //the mapping, guard page first
+        fiber_fn fn;
+        void* arg;
+        int done;
+        int detaching;
+        int fd;                         //last registered with the epoll, -1 if none
+        struct fiber_scheduler_st* scheduler;   //started it, its stack goes back there
+        struct fiber_st* next;          //inbox or parked list
+        struct fiber_st* prev;          //parked list
+} fiber_t;
+
+typedef struct fiber_scheduler_st {
+        int epfd;
+        int wakefd;                     //eventfd: new fibers, stop
+        long stack_size;                //usable, without the guard page
+        void (*detach)(fiber_t*);       //hands a detached fiber to another thread
+        pthread_mutex_t lock;           //inbox, stopping and stacks
+        fiber_t* inbox;                 //spawned, not started yet
+        fiber_t* inbox_tail;
+        int stopping;
+        int stopped;                    //run_fiber_scheduler returned
+        pthread_cond_t stop;            //signaled when it does
+        int count;                      //fibers started and not ended or detached
+        char* stacks;                   //free ones, linked through their lowest word
+        int num_of_stacks;
+        fiber_t* parked;                //without a stack, only touched by the scheduler's thread
+} fiber_scheduler_t;
+
+
+/**
+ * create_fiber_scheduler creates a scheduler whose fibers get stacks of
+ * stack_size bytes. detached fibers are passed to detach, which must make
+ * some other thread call run_detached_fiber with them.
+ * returns NULL on failure.
+ */
+fiber_scheduler_t* create_fiber_scheduler(long stack_size, void (*detach)(fiber_t*));
+
+/**
+ * spawn_fiber queues fn(arg) to run as a fiber of scheduler. thread safe.
+ * returns 0 on success, -1 on failure (fn was not queued).
+ */
+int spawn_fiber(fiber_scheduler_t* scheduler, fiber_fn fn, void* arg);
+
+/**
+ * runs scheduler on the calling thread until it was stopped and its last
+ * fiber ended. a dispatch_fn, so it can be dispatched to a threadpool.
+ * returns 0.
+ */
+int run_fiber_scheduler(void* scheduler);
+
+/**
+ * makes run_fiber_scheduler return once its fibers ended, and waits until
+ * it did. it must be running or queued to run. fibers spawned meanwhile
+ * still run. thread safe.
+ */
+void stop_fiber_scheduler(fiber_scheduler_t* scheduler);
+
+/**
+ * frees the scheduler. run_fiber_scheduler must have returned and every
+ * fiber detached from it must have ended.
+ */
+void destroy_fiber_scheduler(fiber_scheduler_t* scheduler);
+
+/**
+ * returns the fiber running on the calling thread under a scheduler, NULL
+ * on a plain thread or in a detached fiber.
+ */
+fiber_t* current_fiber();
+
+/**
+ * suspends the current fiber until fd is ready for events (EPOLLIN,
+ * EPOLLOUT), reported closed or in error. other fibers run meanwhile.
+ * a fiber waits for one fd at a time.
+ * returns 0 once ready, -1 if not called from a scheduler's fiber.
+ */
+int wait_for_fd(int fd, int events);
+
+/**
+ * park_fiber leaves fn(arg) waiting for fd to be readable (or reported
+ * closed or in error) without a stack: once it is, fn starts as a new fiber
+ * of the current fiber's scheduler. the current fiber must end right after,
+ * without waiting for fd again. a stopping scheduler starts its parked
+ * fibers at once.
+ * returns 0 on success, -1 if not called from a scheduler's fiber or on
+ * failure (fn will not run).
+ */
+int park_fiber(int fd, fiber_fn fn, void* arg);
+
+/**
+ * moves the current fiber off its scheduler. it returns on the thread
+ * that called run_detached_fiber, where the fiber runs to its end without
+ * a scheduler: wait_for_fd fails from then on.
+ * returns 0 once detached, -1 if not called from a scheduler's fiber.
+ */
+int detach_fiber();
+
+/**
+ * runs a fiber given to a scheduler's detach callback until it ends, on
+ * the calling thread, and frees it.
+ */
+void run_detached_fiber(fiber_t* fiber);
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "filecache.h"
+#include "flight.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define NUM_OF_BUCKETS 1024
+
+static mapped_file_t* mapFile(const char*, const struct stat*);
+static void unmapFile(mapped_file_t*);
+static mapped_file_t** findBucket(file_cache_t*, const char*);
+static void removeFile(file_cache_t*, mapped_file_t*);
+static void touchFile(file_cache_t*, mapped_file_t*);
+static int isSameVersion(mapped_file_t*, const struct stat*);
+static mapped_file_t* findVersion(file_cache_t*, const char*, const struct stat*);
+static void discardFile(void*, void*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+file_cache_t* create_file_cache(size_t max_bytes) {
+
+        file_cache_t* cache = (file_cache_t*)calloc(1, sizeof(file_cache_t));
+        if(!cache)
+                return NULL;
+
+        cache->buckets = (mapped_file_t**)calloc(NUM_OF_BUCKETS, sizeof(mapped_file_t*));
+        cache->flights = create_flight_group(discardFile, cache);
+        if(!cache->buckets || !cache->flights) {
+                if(cache->flights)
+                        destroy_flight_group(cache->flights);
+                free(cache->buckets);
+                free(cache);
+                return NULL;
+        }
+
+        cache->num_of_buckets = NUM_OF_BUCKETS;
+        cache->max_bytes = max_bytes;
+        pthread_mutex_init(&cache->lock, NULL);
+        return cache;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+mapped_file_t* acquire_mapped_file(file_cache_t* cache, const char* path, const struct stat* st, int wait) {
+
+        if(st->st_size <= 0 || st->st_size > cache->max_bytes)
+                return NULL;
+
+        mapped_file_t* file = findVersion(cache, path, st);
+        if(file)
+                return file;
+
+        //one miss maps the file, the ones arriving meanwhile wait for it
+        int leader;
+        flight_t* flight = join_flight(cache->flights, path, &leader, wait);
+        if(flight && !leader) {
+
+                mapped_file_t* shared = (mapped_file_t*)flight->result;
+                if(shared && isSameVersion(shared, st)) {
+                        pthread_mutex_lock(&cache->lock);
+                        shared->refs++;
+                        pthread_mutex_unlock(&cache->lock);
+                        leave_flight(cache->flights, flight);
+                        return shared;
+                }
+
+                leave_flight(cache->flights, flight);
+                if(!shared)
+                        return NULL; //not mapped yet, or the leader could not map it either
+
+                //the leader saw another version, map this one separately
+                flight = NULL;
+        }
+
+        //a flight that landed just before this one was joined
+        file = flight ? findVersion(cache, path, st) : NULL;
+
+        //map outside the lock, hits on other files go on meanwhile
+        mapped_file_t* mapped = file ? NULL : mapFile(path, st);
+
+        pthread_mutex_lock(&cache->lock);
+
+        //another thread may have mapped the same version in the meantime
+        if(mapped) {
+                file = *findBucket(cache, path);
+                if(file && isSameVersion(file, st)) {
+                        file->refs++;
+                        touchFile(cache, file);
+                } else {
+
+                        //stale version - holders keep their reference
+                        if(file)
+                                removeFile(cache, file);
+
+                        mapped_file_t** bucket = findBucket(cache, path);
+                        mapped->next = *bucket;
+                        *bucket = mapped;
+                        mapped->refs = 2; //the cache and the caller
+                        touchFile(cache, mapped);
+                        cache->bytes += mapped->size;
+
+                        while(cache->bytes > cache->max_bytes && cache->lru_tail != mapped)
+                                removeFile(cache, cache->lru_tail);
+
+                        file = mapped;
+                        mapped = NULL;
+                }
+        }
+
+        //the waiters' share, dropped by discardFile once they all left
+        if(flight && file)
+                file->refs++;
+
+        pthread_mutex_unlock(&cache->lock);
+
+        if(mapped)
+                unmapFile(mapped);
+        if(flight) {
+                land_flight(cache->flights, flight, file);
+                leave_flight(cache->flights, flight);
+        }
+
+        return file;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void release_mapped_file(file_cache_t* cache, mapped_file_t* file) {
+
+        pthread_mutex_lock(&cache->lock);
+        int refs = --file->refs;
+        pthread_mutex_unlock(&cache->lock);
+
+        if(!refs)
+                unmapFile(file);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_file_cache(file_cache_t* cache) {
+
+        while(cache->lru_head)
+                removeFile(cache, cache->lru_head);
+
+        destroy_flight_group(cache->flights);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->buckets);
+        free(cache);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+static mapped_file_t* mapFile(const char* path, const struct stat* st) {
+        debug_print("mapFile - %s\n", path);
+
+        mapped_file_t* file = (mapped_file_t*)calloc(1, sizeof(mapped_file_t));
+        if(!file)
+                return NULL;
+
+        file->path = strdup(path);
+        int fd = open(path, O_RDONLY);
+        if(!file->path || fd < 0) {
+                if(fd >= 0)
+                        close(fd);
+                free(file->path);
+                free(file);
+                return NULL;
+        }
+
+        //the mapping outlives the descriptor
+        file->data = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(file->data == MAP_FAILED) {
+                free(file->path);
+                free(file);
+                return NULL;
+        }
+
+        //large files are sent front to back, let the kernel read ahead
+        madvise(file->data, st->st_size, st->st_size >= FILECACHE_SEQUENTIAL_SIZE ? MADV_SEQUENTIAL : MADV_WILLNEED);
+
+        file->size = st->st_size;
+        file->dev = st->st_dev;
+        file->ino = st->st_ino;
+        file->mtime = st->st_mtim;
+        return file;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void unmapFile(mapped_file_t* file) {
+        debug_print("unmapFile - %s\n", file->path);
+
+        munmap(file->data, file->size);
+        free(file->path);
+        free(file);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the link pointing at path's entry (or at the end of its chain)
+static mapped_file_t** findBucket(file_cache_t* cache, const char* path) {
+
+        mapped_file_t** link = &cache->buckets[fnv1a(path, strlen(path)) & (cache->num_of_buckets - 1)];
+        while(*link && strcmp((*link)->path, path))
+                link = &(*link)->next;
+
+        return link;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//takes file out of the cache, unmapped once nobody holds it. lock held.
+static void removeFile(file_cache_t* cache, mapped_file_t* file) {
+
+        mapped_file_t** link = findBucket(cache, file->path);
+        if(*link == file)
+                *link = file->next;
+
+        if(file->prev_lru)
+                file->prev_lru->next_lru = file->next_lru;
+        else
+                cache->lru_head = file->next_lru;
+        if(file->next_lru)
+                file->next_lru->prev_lru = file->prev_lru;
+        else
+                cache->lru_tail = file->prev_lru;
+
+        cache->bytes -= file->size;
+        if(!--file->refs)
+                unmapFile(file);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//moves file to the front of the LRU list. lock held.
+static void touchFile(file_cache_t* cache, mapped_file_t* file) {
+
+        if(cache->lru_head == file)
+                return;
+
+        //unlink, unless file is new
+        if(file->prev_lru)
+                file->prev_lru->next_lru = file->next_lru;
+        if(file->next_lru)
+                file->next_lru->prev_lru = file->prev_lru;
+        else if(cache->lru_tail == file)
+                cache->lru_tail = file->prev_lru;
+
+        file->prev_lru = NULL;
+        file->next_lru = cache->lru_head;
+        if(cache->lru_head)
+                cache->lru_head->prev_lru = file;
+        cache->lru_head = file;
+        if(!cache->lru_tail)
+                cache->lru_tail = file;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int isSameVersion(mapped_file_t* file, const struct stat* st) {
+
+        return file->size == st->st_size && file->ino == st->st_ino && file->dev == st->st_dev &&
+               file->mtime.tv_sec == st->st_mtim.tv_sec && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the cached mapping of path if it is the version st describes,
+//with a reference taken. NULL otherwise
+static mapped_file_t* findVersion(file_cache_t* cache, const char* path, const struct stat* st) {
+
+        pthread_mutex_lock(&cache->lock);
+        mapped_file_t* file = *findBucket(cache, path);
+        if(file && isSameVersion(file, st)) {
+                file->refs++;
+                touchFile(cache, file);
+        } else {
+                file = NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return file;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a flight's result nobody waits on anymore
+static void discardFile(void* cache, void* file) {
+
+        release_mapped_file((file_cache_t*)cache, (mapped_file_t*)file);
+}
@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * filecache.h
+ *
+ * Shared cache of mmap()ed files.
+ * A file is mapped once and its mapping is handed to every thread that
+ * serves it, so a response can be written straight from the mapping with a
+ * single writev. Mappings are reference counted: a file that changed on
+ * disk (different size, mtime or inode) is remapped, and the old mapping
+ * stays valid until its last holder releases it.
+ * The cache keeps at most max_bytes mapped, evicting the least recently used
+ * files. Concurrent misses for a file are coalesced: one thread maps it and
+ * the others share its mapping.
+ */
+
+struct flight_group_st;
+
+#define FILECACHE_SEQUENTIAL_SIZE (1024 * 1024) //from this size on, read ahead hard
+
+typedef struct mapped_file_st {
+        char* path;
+        char* data;
+        size_t size;
+
+        //identity of the mapped version of the file
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+
+        int refs;                       //holders, +1 while in the cache
+        struct mapped_file_st* next;    //hash chain
+        struct mapped_file_st* prev_lru;
+        struct mapped_file_st* next_lru;
+} mapped_file_t;
+
+typedef struct file_cache_st {
+        mapped_file_t** buckets;
+        int num_of_buckets;             //always a power of two
+        mapped_file_t* lru_head;        //most recently used
+        mapped_file_t* lru_tail;
+        size_t bytes;
+        size_t max_bytes;
+        struct flight_group_st* flights;        //misses being mapped
+        pthread_mutex_t lock;
+} file_cache_t;
+
+
+/**
+ * create_file_cache creates an empty cache that maps up to max_bytes.
+ * returns NULL on failure.
+ */
+file_cache_t* create_file_cache(size_t max_bytes);
+
+/**
+ * returns the mapping of path, mapping it if it is not cached or if st
+ * (the caller's fresh stat of path) shows the cached version is stale.
+ * a miss for a file another thread is mapping waits for that mapping, unless
+ * wait is 0.
+ * returns NULL for empty files, files larger than the cache, a file being
+ * mapped when the caller must not wait, or on failure - the caller should
+ * fall back to reading the file.
+ * every returned mapping must be released with release_mapped_file.
+ */
+mapped_file_t* acquire_mapped_file(file_cache_t* cache, const char* path, const struct stat* st, int wait);
+
+/**
+ * drops a reference taken by acquire_mapped_file.
+ */
+void release_mapped_file(file_cache_t* cache, mapped_file_t* file);
+
+/**
+ * destroy_file_cache unmaps every file and frees the cache.
+ * no mapping may be held anymore.
+ */
+void destroy_file_cache(file_cache_t* cache);
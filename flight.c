@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flight.h"
+#include "metrics.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define NUM_OF_BUCKETS 64          //flights are short, few are ever in the air
+
+static flight_t** findFlight(flight_group_t*, const char*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+flight_group_t* create_flight_group(void (*discard)(void*, void*), void* arg) {
+
+        flight_group_t* group = (flight_group_t*)calloc(1, sizeof(flight_group_t));
+        if(!group)
+                return NULL;
+
+        group->buckets = (flight_t**)calloc(NUM_OF_BUCKETS, sizeof(flight_t*));
+        if(!group->buckets) {
+                free(group);
+                return NULL;
+        }
+
+        group->num_of_buckets = NUM_OF_BUCKETS;
+        group->discard = discard;
+        group->arg = arg;
+        pthread_mutex_init(&group->lock, NULL);
+        pthread_cond_init(&group->landed, NULL);
+        return group;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+flight_t* join_flight(flight_group_t* group, const char* key, int* leader, int wait) {
+
+        pthread_mutex_lock(&group->lock);
+        flight_t** link = findFlight(group, key);
+        flight_t* flight = *link;
+
+        if(flight) {
+                flight->refs++;
+                *leader = 0;
+                debug_print("join_flight - waiting for %s\n", key);
+                while(wait && !flight->landed && !flight->result)
+                        pthread_cond_wait(&group->landed, &group->lock);
+                pthread_mutex_unlock(&group->lock);
+
+                metric_inc(METRIC_COALESCED);
+                return flight;
+        }
+
+        flight = (flight_t*)calloc(1, sizeof(flight_t));
+        if(!flight || !(flight->key = strdup(key))) {
+                pthread_mutex_unlock(&group->lock);
+                free(flight);
+                return NULL;
+        }
+
+        flight->refs = 1;
+        *link = flight;
+        *leader = 1;
+        pthread_mutex_unlock(&group->lock);
+        return flight;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void* publish_flight(flight_group_t* group, flight_t* flight, void* result) {
+
+        pthread_mutex_lock(&group->lock);
+        if(!flight->result) {
+                flight->result = result;
+                pthread_cond_broadcast(&group->landed);
+        }
+        result = flight->result;
+        pthread_mutex_unlock(&group->lock);
+        return result;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void land_flight(flight_group_t* group, flight_t* flight, void* result) {
+
+        pthread_mutex_lock(&group->lock);
+        if(result)
+                flight->result = result;
+        flight->landed = 1;
+        *findFlight(group, flight->key) = flight->next;
+        flight->next = NULL;
+        pthread_cond_broadcast(&group->landed);
+        pthread_mutex_unlock(&group->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void leave_flight(flight_group_t* group, flight_t* flight) {
+
+        pthread_mutex_lock(&group->lock);
+        int refs = --flight->refs;
+        pthread_mutex_unlock(&group->lock);
+
+        if(refs)
+                return;
+
+        if(flight->result)
+                group->discard(group->arg, flight->result);
+        free(flight->key);
+        free(flight);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_flight_group(flight_group_t* group) {
+
+        pthread_cond_destroy(&group->landed);
+        pthread_mutex_destroy(&group->lock);
+        free(group->buckets);
+        free(group);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//returns the link pointing at key's flight (or at the end of its chain). lock held.
+static flight_t** findFlight(flight_group_t* group, const char* key) {
+
+        flight_t** link = &group->buckets[fnv1a(key, strlen(key)) & (group->num_of_buckets - 1)];
+        while(*link && strcmp((*link)->key, key))
+                link = &(*link)->next;
+
+        return link;
+}
+
@@ -0,0 +1,82 @@
+#include <pthread.h>
+
+/**
+ * flight.h
+ *
+ * Single-flight coalescing of loads.
+ * The first thread to ask for a key that is not loaded leads a flight: it
+ * does the load alone and lands the flight with the result. Threads asking
+ * for the same key meanwhile join the flight, wait for it to land and share
+ * the leader's result instead of loading it again, so a burst of misses for
+ * one key costs a single load.
+ * A result that can be used while it is still being loaded (e.g. a file
+ * growing as it is written) can be published early, by the leader or by a
+ * waiter that loads it while the leader is busy otherwise: waiters return
+ * with it right away, and the flight stays in the air until it lands, so
+ * later requests keep joining it.
+ * A thread that must not block (e.g. a fiber) joins without waiting, and
+ * loads on its own if nothing was published yet.
+ * A landed flight leaves the table right away - later requests go back to
+ * the caller's cache. Its result is discarded once the leader and every
+ * waiter have left it.
+ */
+
+typedef struct flight_st {
+        char* key;
+        void* result;                   //NULL until published, or if the load failed
+        int landed;
+        int refs;                       //the leader and its waiters
+        struct flight_st* next;         //hash chain, while in flight
+} flight_t;
+
+typedef struct flight_group_st {
+        flight_t** buckets;
+        int num_of_buckets;             //always a power of two
+        void (*discard)(void*, void*);  //called with arg and a result no one holds
+        void* arg;
+        pthread_mutex_t lock;
+        pthread_cond_t landed;
+} flight_group_t;
+
+
+/**
+ * create_flight_group creates a group of flights whose results are freed
+ * with discard(arg, result).
+ * returns NULL on failure.
+ */
+flight_group_t* create_flight_group(void (*discard)(void*, void*), void* arg);
+
+/**
+ * joins the flight for key, leading it if there is none.
+ * a leader (*leader set to 1) loads and then calls land_flight. a waiter
+ * (*leader set to 0) returns once the flight landed or its result was
+ * published, with the result in flight->result - or right away if wait is 0,
+ * with flight->result NULL if nothing was published yet.
+ * either way the flight must be left with leave_flight.
+ * returns NULL on failure - the caller loads on its own.
+ */
+flight_t* join_flight(flight_group_t* group, const char* key, int* leader, int wait);
+
+/**
+ * hands result to the waiters and wakes them before the load is done, unless
+ * a result was published already. the flight stays in the air until the
+ * leader lands it.
+ * returns the result published - result, or the one published before.
+ */
+void* publish_flight(flight_group_t* group, flight_t* flight, void* result);
+
+/**
+ * hands result to the waiters and wakes them. NULL (the load failed) keeps a
+ * result published before.
+ */
+void land_flight(flight_group_t* group, flight_t* flight, void* result);
+
+/**
+ * drops a flight taken by join_flight. the result must not be used anymore.
+ */
+void leave_flight(flight_group_t* group, flight_t* flight);
+
+/**
+ * frees the group. no flight may be in the air anymore.
+ */
+void destroy_flight_group(flight_group_t* group);
@@ -0,0 +1,36 @@
+/**
+ * fnv.h
+ *
+ * 32 bit FNV-1a, the hash of every table in the server (MIME types, hosts,
+ * the manifest, the file cache, in-flight loads, rate limiter clients and
+ * bulk targets). Header only, so each table's lookup inlines it.
+ */
+
+#include <stddef.h>
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+
+/**
+ * returns hash with one more byte mixed in, for callers that transform the
+ * bytes as they go. start from FNV_OFFSET.
+ */
+static inline unsigned fnv1a_add(unsigned hash, unsigned char byte) {
+
+        return (hash ^ byte) * FNV_PRIME;
+}
+
+/**
+ * returns the hash of length bytes at data.
+ */
+static inline unsigned fnv1a(const void* data, size_t length) {
+
+        const unsigned char* bytes = (const unsigned char*)data;
+        unsigned hash = FNV_OFFSET;
+        size_t i;
+        for(i = 0; i < length; i++)
+                hash = fnv1a_add(hash, bytes[i]);
+
+        return hash;
+}
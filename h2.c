@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "h2.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+/***********************/
+/***** Size Macros *****/
+/***********************/
+#define FRAME_HEADER_LENGTH 9
+#define DEFAULT_FRAME_SIZE 16384        //ours, and the peer's until it says otherwise
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffL
+#define SIZE_READ_BUFFER (FRAME_HEADER_LENGTH + DEFAULT_FRAME_SIZE)
+#define SIZE_HEADER_BLOCK (2 * DEFAULT_FRAME_SIZE)
+#define SIZE_HEADER_STRINGS (2 * SIZE_HEADER_BLOCK) //Huffman decoding expands
+#define SIZE_SOURCE_FRAME DEFAULT_FRAME_SIZE //most read from a source per DATA frame
+
+/***********************/
+/***** Frame Types *****/
+/***********************/
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+/***********************/
+/***** Error Codes *****/
+/***********************/
+#define NO_ERROR 0x0
+#define PROTOCOL_ERROR 0x1
+#define INTERNAL_ERROR 0x2
+#define FLOW_CONTROL_ERROR 0x3
+#define FRAME_SIZE_ERROR 0x6
+#define REFUSED_STREAM 0x7
+#define COMPRESSION_ERROR 0x9
+#define ENHANCE_YOUR_CALM 0xb
+
+//a stream whose response body is (partly) unsent
+typedef struct h2_stream_st {
+        unsigned id;            //0 - free slot
+        long window;
+        char* body;
+        int fd;
+        long base;              //where the body starts in fd
+        long offset;            //sent so far
+        long length;            //-1 - read from source until it ends
+        h2_read_fn read;
+        void (*close)(void* source);
+        void* source;
+} h2_stream_t;
+
+typedef struct h2_conn_st {
+        int sockfd;
+        h2_handler_fn handler;
+        unsigned char in[SIZE_READ_BUFFER];
+        int in_length;
+
+        hpack_table_t decoder;
+        unsigned char header_block[SIZE_HEADER_BLOCK];
+        int header_block_length;
+        unsigned header_stream;         //stream of an unfinished header block, 0 - none
+        int trailers;                   //the header block belongs to a known stream
+        unsigned last_stream;
+
+        long window;                    //connection send window
+        long initial_window;            //peer's SETTINGS_INITIAL_WINDOW_SIZE
+        int max_frame;                  //peer's SETTINGS_MAX_FRAME_SIZE
+        int goaway;                     //peer is done opening streams
+        int error;                      //connection error to report, -1 - none
+        int next;                       //round robin position
+
+        h2_stream_t streams[H2_MAX_STREAMS];
+        h2_response_t response;         //reused for every request
+        char strings[SIZE_HEADER_STRINGS];
+        hpack_header_t headers[H2_MAX_REQUEST_HEADERS];
+} h2_conn_t;
+
+static int readPreface(h2_conn_t*);
+static int runConnection(h2_conn_t*);
+static int processFrames(h2_conn_t*);
+static int processFrame(h2_conn_t*, int, int, unsigned, unsigned char*, int);
+static int processHeaders(h2_conn_t*, int, unsigned, unsigned char*, int);
+static int processSettings(h2_conn_t*, int, unsigned char*, int);
+static int processWindowUpdate(h2_conn_t*, unsigned, unsigned char*, int);
+static int completeHeaders(h2_conn_t*);
+static int sendData(h2_conn_t*);
+static int hasSendableStream(h2_conn_t*);
+static h2_stream_t* findStream(h2_conn_t*, unsigned);
+static void releaseStream(h2_stream_t*);
+static int writeFrame(h2_conn_t*, int, int, unsigned, const void*, int);
+static int writeCode(h2_conn_t*, int, unsigned, unsigned);
+static void putFrameHeader(unsigned char*, int, int, int, unsigned);
+static unsigned getUint32(const unsigned char*);
+static void putUint32(unsigned char*, unsigned);
+static int writeVector(int, struct iovec*, int);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int serve_h2(int sockfd, const char* received, int received_length, h2_handler_fn handler) {
+        debug_print("serve_h2 - %d\n", sockfd);
+
+        if(received_length > SIZE_READ_BUFFER)
+                return -1;
+
+        h2_conn_t* conn = (h2_conn_t*)calloc(1, sizeof(h2_conn_t));
+        if(!conn)
+                return -1;
+
+        if(init_hpack_table(&conn->decoder, HPACK_DEFAULT_TABLE_SIZE)) {
+                free(conn);
+                return -1;
+        }
+
+        conn->sockfd = sockfd;
+        conn->handler = handler;
+        conn->window = DEFAULT_WINDOW;
+        conn->initial_window = DEFAULT_WINDOW;
+        conn->max_frame = DEFAULT_FRAME_SIZE;
+        conn->error = -1;
+        memcpy(conn->in, received, received_length);
+        conn->in_length = received_length;
+
+        //frames are coalesced by hand (MSG_MORE, writev) - a DATA frame that
+        //exhausts a window must not wait for the client's delayed ACK
+        int on = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        int ret = -1;
+        if(!readPreface(conn))
+                ret = runConnection(conn);
+
+        int i;
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+                releaseStream(&conn->streams[i]);
+        free_hpack_table(&conn->decoder);
+        free(conn);
+
+        debug_print("serve_h2 END - %d\n", ret);
+        return ret;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//returns 0 once the client preface was consumed and our SETTINGS sent
+static int readPreface(h2_conn_t* conn) {
+
+        while(conn->in_length < H2_PREFACE_LENGTH) {
+
+                int nBytes = recv(conn->sockfd, conn->in + conn->in_length, SIZE_READ_BUFFER - conn->in_length, 0);
+                if(nBytes <= 0)
+                        return -1;
+                conn->in_length += nBytes;
+        }
+
+        if(memcmp(conn->in, H2_PREFACE, H2_PREFACE_LENGTH))
+                return -1;
+
+        conn->in_length -= H2_PREFACE_LENGTH;
+        memmove(conn->in, conn->in + H2_PREFACE_LENGTH, conn->in_length);
+
+        unsigned char settings[6];
+        settings[0] = 0;
+        settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+        putUint32(settings + 2, H2_MAX_STREAMS);
+        return writeFrame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//reads frames while there is nothing to send, polls for them between DATA frames
+static int runConnection(h2_conn_t* conn) {
+
+        //the first read may have brought frames along with the preface
+        if(processFrames(conn))
+                return -1;
+
+        while(conn->error < 0) {
+
+                int sendable = hasSendableStream(conn);
+                if(conn->goaway && !sendable)
+                        break;
+
+                int nBytes = recv(conn->sockfd, conn->in + conn->in_length, SIZE_READ_BUFFER - conn->in_length,
+                                  sendable ? MSG_DONTWAIT : 0);
+                if(!nBytes)
+                        break; //client closed the connection
+
+                if(nBytes < 0) {
+                        if(errno == EINTR)
+                                continue;
+                        if(!sendable || (errno != EAGAIN && errno != EWOULDBLOCK))
+                                return -1;
+                } else {
+                        conn->in_length += nBytes;
+                        if(processFrames(conn))
+                                return -1;
+                }
+
+                if(conn->error < 0 && sendable && sendData(conn))
+                        return -1;
+        }
+
+        if(conn->error >= 0) {
+                debug_print("runConnection - connection error %d\n", conn->error);
+                unsigned char goaway[8];
+                putUint32(goaway, conn->last_stream);
+                putUint32(goaway + 4, conn->error);
+                writeFrame(conn, FRAME_GOAWAY, 0, 0, goaway, sizeof(goaway));
+                return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//handles every complete frame in the read buffer.
+//returns -1 if the socket failed, protocol errors are left in conn->error
+static int processFrames(h2_conn_t* conn) {
+
+        int pos = 0;
+        while(conn->error < 0 && conn->in_length - pos >= FRAME_HEADER_LENGTH) {
+
+                unsigned char* frame = conn->in + pos;
+                int length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+                if(length > DEFAULT_FRAME_SIZE) {
+                        conn->error = FRAME_SIZE_ERROR;
+                        break;
+                }
+                if(conn->in_length - pos < FRAME_HEADER_LENGTH + length)
+                        break;
+
+                unsigned stream_id = getUint32(frame + 5) & 0x7fffffff;
+                if(processFrame(conn, frame[3], frame[4], stream_id, frame + FRAME_HEADER_LENGTH, length))
+                        return -1;
+
+                pos += FRAME_HEADER_LENGTH + length;
+        }
+
+        conn->in_length -= pos;
+        memmove(conn->in, conn->in + pos, conn->in_length);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int processFrame(h2_conn_t* conn, int type, int flags, unsigned stream_id, unsigned char* payload, int length) {
+        debug_print("processFrame - type %d, flags %x, stream %u, length %d\n", type, flags, stream_id, length);
+
+        //a header block must not be interleaved with other frames
+        if(conn->header_stream && (type != FRAME_CONTINUATION || stream_id != conn->header_stream)) {
+                conn->error = PROTOCOL_ERROR;
+                return 0;
+        }
+
+        switch(type) {
+
+        case FRAME_DATA:
+                if(!stream_id) {
+                        conn->error = PROTOCOL_ERROR;
+                        return 0;
+                }
+                //request bodies are not used - give the window straight back
+                return length ? writeCode(conn, FRAME_WINDOW_UPDATE, 0, length) : 0;
+
+        case FRAME_HEADERS:
+                return processHeaders(conn, flags, stream_id, payload, length);
+
+        case FRAME_CONTINUATION:
+                if(!conn->header_stream) {
+                        conn->error = PROTOCOL_ERROR;
+                        return 0;
+                }
+                if(conn->header_block_length + length > SIZE_HEADER_BLOCK) {
+                        conn->error = ENHANCE_YOUR_CALM;
+                        return 0;
+                }
+                memcpy(conn->header_block + conn->header_block_length, payload, length);
+                conn->header_block_length += length;
+                return (flags & FLAG_END_HEADERS) ? completeHeaders(conn) : 0;
+
+        case FRAME_PRIORITY:
+                if(length != 5)
+                        conn->error = FRAME_SIZE_ERROR;
+                return 0; //streams are served round robin
+
+        case FRAME_RST_STREAM:
+                if(!stream_id || length != 4)
+                        conn->error = stream_id ? FRAME_SIZE_ERROR : PROTOCOL_ERROR;
+                else
+                        releaseStream(findStream(conn, stream_id));
+                return 0;
+
+        case FRAME_SETTINGS:
+                return processSettings(conn, flags, payload, length);
+
+        case FRAME_PUSH_PROMISE:
+                conn->error = PROTOCOL_ERROR; //clients never push
+                return 0;
+
+        case FRAME_PING:
+                if(stream_id || length != 8) {
+                        conn->error = stream_id ? PROTOCOL_ERROR : FRAME_SIZE_ERROR;
+                        return 0;
+                }
+                return (flags & FLAG_ACK) ? 0 : writeFrame(conn, FRAME_PING, FLAG_ACK, 0, payload, 8);
+
+        case FRAME_GOAWAY:
+                conn->goaway = 1;
+                return 0;
+
+        case FRAME_WINDOW_UPDATE:
+                return processWindowUpdate(conn, stream_id, payload, length);
+
+        }
+
+        return 0; //unknown frame types are ignored
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a request (new stream) or trailers (known stream)
+static int processHeaders(h2_conn_t* conn, int flags, unsigned stream_id, unsigned char* payload, int length) {
+
+        if(!stream_id || !(stream_id & 1)) {
+                conn->error = PROTOCOL_ERROR;
+                return 0;
+        }
+
+        int start = 0;
+        int padding = 0;
+        if(flags & FLAG_PADDED) {
+                padding = length ? payload[0] : 0;
+                start = 1;
+        }
+        if(flags & FLAG_PRIORITY)
+                start += 5;
+        if(start + padding > length) {
+                conn->error = PROTOCOL_ERROR;
+                return 0;
+        }
+
+        conn->trailers = stream_id <= conn->last_stream;
+        if(!conn->trailers)
+                conn->last_stream = stream_id;
+
+        conn->header_stream = stream_id;
+        conn->header_block_length = length - start - padding;
+        memcpy(conn->header_block, payload + start, conn->header_block_length);
+
+        return (flags & FLAG_END_HEADERS) ? completeHeaders(conn) : 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int processSettings(h2_conn_t* conn, int flags, unsigned char* payload, int length) {
+
+        if(flags & FLAG_ACK) {
+                if(length)
+                        conn->error = FRAME_SIZE_ERROR;
+                return 0;
+        }
+        if(length % 6) {
+                conn->error = FRAME_SIZE_ERROR;
+                return 0;
+        }
+
+        int pos;
+        for(pos = 0; pos < length; pos += 6) {
+
+                int id = (payload[pos] << 8) | payload[pos + 1];
+                unsigned value = getUint32(payload + pos + 2);
+
+                if(id == SETTINGS_INITIAL_WINDOW_SIZE) {
+
+                        if(value > MAX_WINDOW) {
+                                conn->error = FLOW_CONTROL_ERROR;
+                                return 0;
+                        }
+
+                        //applies to the streams already open too
+                        int i;
+                        for(i = 0; i < H2_MAX_STREAMS; i++)
+                                if(conn->streams[i].id)
+                                        conn->streams[i].window += (long)value - conn->initial_window;
+                        conn->initial_window = value;
+
+                } else if(id == SETTINGS_MAX_FRAME_SIZE) {
+
+                        if(value < DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                                conn->error = PROTOCOL_ERROR;
+                                return 0;
+                        }
+                        conn->max_frame = value;
+                }
+        }
+
+        return writeFrame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int processWindowUpdate(h2_conn_t* conn, unsigned stream_id, unsigned char* payload, int length) {
+
+        if(length != 4) {
+                conn->error = FRAME_SIZE_ERROR;
+                return 0;
+        }
+
+        long increment = getUint32(payload) & 0x7fffffff;
+        if(!stream_id) {
+                if(!increment || conn->window + increment > MAX_WINDOW)
+                        conn->error = increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR;
+                else
+                        conn->window += increment;
+                return 0;
+        }
+
+        h2_stream_t* stream = findStream(conn, stream_id);
+        if(!stream)
+                return 0; //already done with it
+
+        if(!increment || stream->window + increment > MAX_WINDOW) {
+                releaseStream(stream);
+                return writeCode(conn, FRAME_RST_STREAM, stream_id, increment ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+        }
+
+        stream->window += increment;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//decodes the finished header block and answers the request
+static int completeHeaders(h2_conn_t* conn) {
+
+        unsigned stream_id = conn->header_stream;
+        conn->header_stream = 0;
+
+        //decoded even if unused, the dynamic table must stay in sync
+        int count = hpack_decode(&conn->decoder, conn->header_block, conn->header_block_length,
+                                 conn->strings, sizeof(conn->strings), conn->headers, H2_MAX_REQUEST_HEADERS);
+        if(count < 0) {
+                conn->error = COMPRESSION_ERROR;
+                return 0;
+        }
+        if(conn->trailers)
+                return 0;
+
+        h2_stream_t* stream = findStream(conn, 0);
+        if(!stream)
+                return writeCode(conn, FRAME_RST_STREAM, stream_id, REFUSED_STREAM);
+
+        h2_request_t request;
+        memset(&request, 0, sizeof(request));
+        request.stream_id = stream_id;
+        request.headers = conn->headers;
+        request.num_of_headers = count;
+
+        int i;
+        for(i = 0; i < count; i++) {
+                if(!strcmp(conn->headers[i].name, ":method"))
+                        request.method = conn->headers[i].value;
+                else if(!strcmp(conn->headers[i].name, ":path"))
+                        request.path = conn->headers[i].value;
+                else if(!strcmp(conn->headers[i].name, ":authority"))
+                        request.authority = conn->headers[i].value;
+        }
+
+        h2_response_t* response = &conn->response;
+        response->headers_length = 0;
+        response->body = NULL;
+        response->fd = -1;
+        response->offset = 0;
+        response->length = 0;
+        response->read = NULL;
+        response->source = NULL;
+        conn->handler(&request, response);
+
+        int flags = FLAG_END_HEADERS | (response->length ? 0 : FLAG_END_STREAM);
+        if(writeFrame(conn, FRAME_HEADERS, flags, stream_id, response->headers, response->headers_length)) {
+                free(response->body);
+                if(response->fd >= 0)
+                        close(response->fd);
+                if(response->source)
+                        response->close(response->source);
+                return -1;
+        }
+
+        stream->id = stream_id;
+        stream->window = conn->initial_window;
+        stream->body = response->body;
+        stream->fd = response->fd;
+        stream->base = response->offset;
+        stream->offset = 0;
+        stream->length = response->length;
+        stream->read = response->read;
+        stream->close = response->close;
+        stream->source = response->source;
+        if(!response->length)
+                releaseStream(stream);
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sends one DATA frame of the next stream (round robin) the windows allow
+static int sendData(h2_conn_t* conn) {
+
+        int i;
+        for(i = 0; i < H2_MAX_STREAMS; i++) {
+
+                int index = (conn->next + i) % H2_MAX_STREAMS;
+                h2_stream_t* stream = &conn->streams[index];
+                if(!stream->id || stream->window <= 0 || stream->offset == stream->length)
+                        continue;
+                conn->next = (index + 1) % H2_MAX_STREAMS;
+
+                long chunk = stream->source ? SIZE_SOURCE_FRAME : stream->length - stream->offset;
+                if(chunk > stream->window)
+                        chunk = stream->window;
+                if(chunk > conn->window)
+                        chunk = conn->window;
+                if(chunk > conn->max_frame)
+                        chunk = conn->max_frame;
+
+                int last = stream->offset + chunk == stream->length;
+                unsigned char header[FRAME_HEADER_LENGTH];
+                putFrameHeader(header, chunk, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id);
+
+                if(stream->source) {
+
+                        //the source ends with an empty frame, it can't tell ahead
+                        char data[SIZE_SOURCE_FRAME];
+                        int nBytes = stream->read(stream->source, data, chunk);
+                        if(nBytes < 0) {
+                                unsigned id = stream->id;
+                                releaseStream(stream);
+                                return writeCode(conn, FRAME_RST_STREAM, id, INTERNAL_ERROR);
+                        }
+
+                        chunk = nBytes;
+                        last = !nBytes;
+                        if(writeFrame(conn, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id, data, chunk))
+                                return -1;
+
+                } else if(stream->body) {
+
+                        struct iovec iov[2];
+                        iov[0].iov_base = header;
+                        iov[0].iov_len = FRAME_HEADER_LENGTH;
+                        iov[1].iov_base = stream->body + stream->offset;
+                        iov[1].iov_len = chunk;
+                        if(writeVector(conn->sockfd, iov, 2))
+                                return -1;
+
+                } else {
+
+                        //the frame header is held back to go out with the file bytes
+                        if(send(conn->sockfd, header, FRAME_HEADER_LENGTH, MSG_MORE) != FRAME_HEADER_LENGTH)
+                                return -1;
+
+                        off_t offset = stream->base + stream->offset;
+                        long left = chunk;
+                        while(left > 0) {
+                                ssize_t nBytes = sendfile(conn->sockfd, stream->fd, &offset, left);
+                                if(nBytes <= 0)
+                                        return -1; //failed, or the file shrank under us
+                                left -= nBytes;
+                        }
+                }
+
+                stream->offset += chunk;
+                stream->window -= chunk;
+                conn->window -= chunk;
+                if(last)
+                        releaseStream(stream);
+                return 0;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int hasSendableStream(h2_conn_t* conn) {
+
+        if(conn->window <= 0)
+                return 0;
+
+        int i;
+        for(i = 0; i < H2_MAX_STREAMS; i++) {
+                h2_stream_t* stream = &conn->streams[i];
+                if(stream->id && stream->window > 0 && (stream->source || stream->offset < stream->length))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//stream_id 0 finds a free slot. returns NULL if there is none
+static h2_stream_t* findStream(h2_conn_t* conn, unsigned stream_id) {
+
+        int i;
+        for(i = 0; i < H2_MAX_STREAMS; i++)
+                if(conn->streams[i].id == stream_id)
+                        return &conn->streams[i];
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void releaseStream(h2_stream_t* stream) {
+
+        if(!stream || !stream->id)
+                return;
+
+        free(stream->body);
+        if(stream->fd >= 0)
+                close(stream->fd);
+        if(stream->source)
+                stream->close(stream->source);
+        memset(stream, 0, sizeof(h2_stream_t));
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int writeFrame(h2_conn_t* conn, int type, int flags, unsigned stream_id, const void* payload, int length) {
+
+        unsigned char header[FRAME_HEADER_LENGTH];
+        putFrameHeader(header, length, type, flags, stream_id);
+
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = FRAME_HEADER_LENGTH;
+        iov[1].iov_base = (void*)payload;
+        iov[1].iov_len = length;
+        return writeVector(conn->sockfd, iov, length ? 2 : 1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//RST_STREAM and WINDOW_UPDATE - a frame carrying one 32 bit value
+static int writeCode(h2_conn_t* conn, int type, unsigned stream_id, unsigned value) {
+
+        unsigned char payload[4];
+        putUint32(payload, value);
+        return writeFrame(conn, type, 0, stream_id, payload, sizeof(payload));
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void putFrameHeader(unsigned char* header, int length, int type, int flags, unsigned stream_id) {
+
+        header[0] = length >> 16;
+        header[1] = length >> 8;
+        header[2] = length;
+        header[3] = type;
+        header[4] = flags;
+        putUint32(header + 5, stream_id);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static unsigned getUint32(const unsigned char* buf) {
+        return ((unsigned)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void putUint32(unsigned char* buf, unsigned value) {
+
+        buf[0] = value >> 24;
+        buf[1] = value >> 16;
+        buf[2] = value >> 8;
+        buf[3] = value;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//writev until every iovec was written, returns 0 on success, -1 on failure
+static int writeVector(int fd, struct iovec* iov, int iovcnt) {
+
+        while(iovcnt > 0) {
+
+                ssize_t nBytes = writev(fd, iov, iovcnt);
+                if(nBytes < 0) {
+                        if(errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                while(iovcnt > 0 && nBytes >= (ssize_t)iov->iov_len) {
+                        nBytes -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if(iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + nBytes;
+                        iov->iov_len -= nBytes;
+                }
+        }
+
+        return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * h2.h
+ *
+ * Cleartext HTTP/2 with prior knowledge (h2c).
+ * serve_h2 runs a whole connection on the calling thread: it reads and
+ * answers frames, hands every complete request to the server's handler and
+ * multiplexes the response bodies as DATA frames, round robin over the
+ * streams whose flow control windows allow it. File bodies go out with
+ * sendfile(), so their bytes are never copied through user space. A body
+ * whose length is not known up front is read from its source a frame at a
+ * time as it is sent, and ends with an empty END_STREAM frame.
+ */
+
+#include "hpack.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_MAX_STREAMS 32               //advertised SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_MAX_REQUEST_HEADERS 64
+#define H2_SIZE_RESPONSE_HEADERS 8192
+
+typedef struct h2_request_st {
+        unsigned stream_id;
+        char* method;           //NULL if missing
+        char* path;
+        char* authority;
+        hpack_header_t* headers;
+        int num_of_headers;
+} h2_request_t;
+
+//returns the next bytes (at most size) of a body, 0 at its end, -1 on failure
+typedef int (*h2_read_fn)(void* source, char* buf, int size);
+
+typedef struct h2_response_st {
+        char headers[H2_SIZE_RESPONSE_HEADERS]; //HPACK block, see hpack_encode_*
+        int headers_length;
+        char* body;             //allocated body, freed once sent
+        int fd;                 //or a file, closed once sent (-1 - none)
+        long offset;            //where the body starts in fd
+        long length;            //of the body or the file, -1 to read it from source
+        h2_read_fn read;        //or a source, passed to close once sent (NULL - none)
+        void (*close)(void* source);
+        void* source;
+} h2_response_t;
+
+/**
+ * builds the response to request. always called on the connection's thread.
+ */
+typedef void (*h2_handler_fn)(h2_request_t* request, h2_response_t* response);
+
+
+/**
+ * serves an h2c connection until the client closes it or a connection
+ * error. received holds what was already read from sockfd (at least the
+ * start of the preface).
+ * returns 0 on a clean close, -1 on error.
+ */
+int serve_h2(int sockfd, const char* received, int received_length, h2_handler_fn handler);
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define HANDOFF_MESSAGE "listener"
+#define READY_MESSAGE "READY=1"
+
+static int fillAddress(struct sockaddr_un*, const char*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int create_handoff_socket(const char* path) {
+
+        struct sockaddr_un addr;
+        if(fillAddress(&addr, path))
+                return -1;
+
+        int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(sockfd < 0)
+                return -1;
+
+        //the previous owner handed its socket over already (or died)
+        unlink(path);
+        if(bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sockfd, 1) < 0) {
+                close(sockfd);
+                return -1;
+        }
+
+        return sockfd;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int send_listener(int handoff_socket, int listen_fd) {
+
+        int client = accept(handoff_socket, NULL, NULL);
+        if(client < 0)
+                return -1;
+        debug_print("send_listener - %d\n", listen_fd);
+
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        struct iovec iov;
+        iov.iov_base = HANDOFF_MESSAGE;
+        iov.iov_len = strlen(HANDOFF_MESSAGE);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+        int ret = sendmsg(client, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+        close(client);
+        return ret;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int receive_listener(const char* path) {
+
+        struct sockaddr_un addr;
+        if(fillAddress(&addr, path))
+                return -1;
+
+        int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(sockfd < 0)
+                return -1;
+
+        if(connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                debug_print("receive_listener - nobody at %s\n", path);
+                close(sockfd);
+                return -1;
+        }
+
+        char buf[sizeof(HANDOFF_MESSAGE)];
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int fd = -1;
+        if(recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) > 0) {
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        close(sockfd);
+        return fd;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int notify_ready() {
+
+        const char* path = getenv("NOTIFY_SOCKET");
+        struct sockaddr_un addr;
+        if(!path)
+                return 0;
+        if(fillAddress(&addr, path))
+                return -1;
+
+        //"@name" is in the abstract namespace
+        socklen_t length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+        if(path[0] == '@')
+                addr.sun_path[0] = '\0';
+
+        int sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if(sockfd < 0)
+                return -1;
+
+        int ret = sendto(sockfd, READY_MESSAGE, strlen(READY_MESSAGE), MSG_NOSIGNAL,
+                         (struct sockaddr*)&addr, length) < 0 ? -1 : 0;
+        close(sockfd);
+        debug_print("notify_ready - %s: %d\n", path, ret);
+        return ret;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//returns 0 on success, -1 if path doesn't fit
+static int fillAddress(struct sockaddr_un* addr, const char* path) {
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        if(strlen(path) >= sizeof(addr->sun_path))
+                return -1;
+
+        strcpy(addr->sun_path, path);
+        return 0;
+}
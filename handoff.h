@@ -0,0 +1,36 @@
+/**
+ * handoff.h
+ *
+ * Passing the listening socket from a running server to its replacement.
+ * The running server listens on a Unix socket at a well known path; a new
+ * process connects to it and receives the listening fd (SCM_RIGHTS). Both
+ * processes then share one accept queue, so no connection is refused or
+ * reset while the old process drains.
+ * A supervisor is told the server is ready (sd_notify protocol) only once it
+ * listens, after its warm-up - until then the old process keeps serving.
+ */
+
+
+/**
+ * creates the Unix listening socket at path, replacing a stale one.
+ * returns the socket, -1 on failure.
+ */
+int create_handoff_socket(const char* path);
+
+/**
+ * waits for a replacement on handoff_socket and sends it listen_fd.
+ * returns 0 once sent, -1 on failure.
+ */
+int send_listener(int handoff_socket, int listen_fd);
+
+/**
+ * asks the server listening at path for its listening socket.
+ * returns the received fd, -1 if there is no server to take over from.
+ */
+int receive_listener(const char* path);
+
+/**
+ * sends "READY=1" to the supervisor's $NOTIFY_SOCKET, if there is one.
+ * returns 0 on success or without a supervisor, -1 on failure.
+ */
+int notify_ready();
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hpack.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define INITIAL_ENTRIES 32
+#define HUFFMAN_MAX_LENGTH 30
+
+typedef struct hpack_static_st {
+        const char* name;
+        const char* value;
+} hpack_static_t;
+
+//RFC 7541 appendix B, indexed by symbol
+static const unsigned sHuffmanCodes[256] = {
+        0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+        0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+        0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+        0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+        0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+        0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+        0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+        0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+        0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+        0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+        0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+        0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+        0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+        0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+        0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+        0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+        0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+        0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+        0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+        0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+        0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+        0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+        0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+        0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+        0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+        0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+        0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+        0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+        0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+        0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+        0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+        0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const unsigned char sHuffmanLengths[256] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const hpack_static_t sStaticTable[] = {
+        { ":authority", "" },
+        { ":method", "GET" },
+        { ":method", "POST" },
+        { ":path", "/" },
+        { ":path", "/index.html" },
+        { ":scheme", "http" },
+        { ":scheme", "https" },
+        { ":status", "200" },
+        { ":status", "204" },
+        { ":status", "206" },
+        { ":status", "304" },
+        { ":status", "400" },
+        { ":status", "404" },
+        { ":status", "500" },
+        { "accept-charset", "" },
+        { "accept-encoding", "gzip, deflate" },
+        { "accept-language", "" },
+        { "accept-ranges", "" },
+        { "accept", "" },
+        { "access-control-allow-origin", "" },
+        { "age", "" },
+        { "allow", "" },
+        { "authorization", "" },
+        { "cache-control", "" },
+        { "content-disposition", "" },
+        { "content-encoding", "" },
+        { "content-language", "" },
+        { "content-length", "" },
+        { "content-location", "" },
+        { "content-range", "" },
+        { "content-type", "" },
+        { "cookie", "" },
+        { "date", "" },
+        { "etag", "" },
+        { "expect", "" },
+        { "expires", "" },
+        { "from", "" },
+        { "host", "" },
+        { "if-match", "" },
+        { "if-modified-since", "" },
+        { "if-none-match", "" },
+        { "if-range", "" },
+        { "if-unmodified-since", "" },
+        { "last-modified", "" },
+        { "link", "" },
+        { "location", "" },
+        { "max-forwards", "" },
+        { "proxy-authenticate", "" },
+        { "proxy-authorization", "" },
+        { "range", "" },
+        { "referer", "" },
+        { "refresh", "" },
+        { "retry-after", "" },
+        { "server", "" },
+        { "set-cookie", "" },
+        { "strict-transport-security", "" },
+        { "transfer-encoding", "" },
+        { "user-agent", "" },
+        { "vary", "" },
+        { "via", "" },
+        { "www-authenticate", "" },
+};
+
+#define NUM_OF_STATIC_ENTRIES (sizeof(sStaticTable) / sizeof(sStaticTable[0]))
+
+//canonical decoding tables: codes of one length are consecutive, in symbol order
+static unsigned sFirstCode[HUFFMAN_MAX_LENGTH + 1];
+static int sCodeCount[HUFFMAN_MAX_LENGTH + 1];
+static int sCodeOffset[HUFFMAN_MAX_LENGTH + 1];
+static unsigned char sSortedSymbols[256];
+static pthread_once_t sHuffmanOnce = PTHREAD_ONCE_INIT;
+
+static void initHuffman();
+static int decodeInteger(const unsigned char**, const unsigned char*, int, unsigned*);
+static int decodeString(const unsigned char**, const unsigned char*, char**, char*, char**, int*);
+static int decodeHuffman(const unsigned char*, int, char*, char*);
+static int getEntry(hpack_table_t*, unsigned, char**, int*, char**, int*);
+static int addEntry(hpack_table_t*, char*, int, char*, int);
+static void evictEntries(hpack_table_t*, int);
+static int encodeInteger(char*, int, int, unsigned);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int init_hpack_table(hpack_table_t* table, int max_size) {
+
+        pthread_once(&sHuffmanOnce, initHuffman);
+
+        memset(table, 0, sizeof(hpack_table_t));
+        table->entries = (hpack_entry_t*)calloc(INITIAL_ENTRIES, sizeof(hpack_entry_t));
+        if(!table->entries)
+                return -1;
+
+        table->capacity = INITIAL_ENTRIES;
+        table->max_size = max_size;
+        table->settings_size = max_size;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void free_hpack_table(hpack_table_t* table) {
+
+        evictEntries(table, 0);
+        free(table->entries);
+        table->entries = NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int hpack_decode(hpack_table_t* table, const unsigned char* block, int length,
+                 char* strings, int strings_size, hpack_header_t* headers, int max_headers) {
+
+        const unsigned char* pos = block;
+        const unsigned char* end = block + length;
+        char* out = strings;
+        char* out_end = strings + strings_size;
+        int count = 0;
+
+        while(pos < end) {
+
+                unsigned char first = *pos;
+                unsigned index;
+                char* name;
+                char* value;
+                int name_length;
+                int value_length;
+
+                //dynamic table size update
+                if((first & 0xe0) == 0x20) {
+                        if(decodeInteger(&pos, end, 5, &index) || index > table->settings_size)
+                                return -1;
+                        table->max_size = index;
+                        evictEntries(table, table->max_size);
+                        continue;
+                }
+
+                if(count == max_headers)
+                        return -1;
+
+                //indexed header field
+                if(first & 0x80) {
+
+                        if(decodeInteger(&pos, end, 7, &index) || !index)
+                                return -1;
+                        if(getEntry(table, index, &name, &name_length, &value, &value_length))
+                                return -1;
+
+                        //copy out, a later insertion may evict the entry
+                        if(out_end - out < name_length + value_length + 2)
+                                return -1;
+                        headers[count].name = out;
+                        headers[count].name_length = name_length;
+                        out = mempcpy(out, name, name_length);
+                        *out++ = '\0';
+                        headers[count].value = out;
+                        headers[count].value_length = value_length;
+                        out = mempcpy(out, value, value_length);
+                        *out++ = '\0';
+                        count++;
+                        continue;
+                }
+
+                //literal - with incremental indexing (6 bit prefix),
+                //without indexing or never indexed (4 bit prefix)
+                int indexing = (first & 0xc0) == 0x40;
+                if(decodeInteger(&pos, end, indexing ? 6 : 4, &index))
+                        return -1;
+
+                if(index) {
+                        char* entry_value;
+                        int entry_value_length;
+                        if(getEntry(table, index, &name, &name_length, &entry_value, &entry_value_length))
+                                return -1;
+                        if(out_end - out < name_length + 1)
+                                return -1;
+                        char* copy = out;
+                        out = mempcpy(out, name, name_length);
+                        *out++ = '\0';
+                        name = copy;
+                } else if(decodeString(&pos, end, &out, out_end, &name, &name_length)) {
+                        return -1;
+                }
+
+                if(decodeString(&pos, end, &out, out_end, &value, &value_length))
+                        return -1;
+
+                if(indexing && addEntry(table, name, name_length, value, value_length))
+                        return -1;
+
+                headers[count].name = name;
+                headers[count].name_length = name_length;
+                headers[count].value = value;
+                headers[count].value_length = value_length;
+                count++;
+        }
+
+        return count;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int hpack_encode_status(char* buf, int status) {
+
+        //statuses with a static entry of their own
+        switch(status) {
+        case 200: return encodeInteger(buf, 7, 0x80, 8);
+        case 204: return encodeInteger(buf, 7, 0x80, 9);
+        case 206: return encodeInteger(buf, 7, 0x80, 10);
+        case 304: return encodeInteger(buf, 7, 0x80, 11);
+        case 400: return encodeInteger(buf, 7, 0x80, 12);
+        case 404: return encodeInteger(buf, 7, 0x80, 13);
+        case 500: return encodeInteger(buf, 7, 0x80, 14);
+        }
+
+        char value[8];
+        snprintf(value, sizeof(value), "%03d", status % 1000);
+        return hpack_encode_header(buf, HPACK_STATUS, value, 3);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int hpack_encode_header(char* buf, int index, const char* value, int value_length) {
+
+        int length = encodeInteger(buf, 4, 0x00, index);
+        length += encodeInteger(buf + length, 7, 0x00, value_length);
+        memcpy(buf + length, value, value_length);
+        return length + value_length;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+static void initHuffman() {
+
+        int offset = 0;
+        int length;
+        for(length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+
+                sCodeOffset[length] = offset;
+                int symbol;
+                for(symbol = 0; symbol < 256; symbol++) {
+                        if(sHuffmanLengths[symbol] != length)
+                                continue;
+                        if(!sCodeCount[length])
+                                sFirstCode[length] = sHuffmanCodes[symbol];
+                        sCodeCount[length]++;
+                        sSortedSymbols[offset++] = symbol;
+                }
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on truncated or oversized integers
+static int decodeInteger(const unsigned char** pos, const unsigned char* end, int prefix, unsigned* value) {
+
+        if(*pos >= end)
+                return -1;
+
+        unsigned mask = (1 << prefix) - 1;
+        unsigned result = *(*pos)++ & mask;
+        if(result < mask) {
+                *value = result;
+                return 0;
+        }
+
+        int shift = 0;
+        unsigned char byte;
+        do {
+                if(*pos >= end || shift > 21)
+                        return -1;
+                byte = *(*pos)++;
+                result += (unsigned)(byte & 0x7f) << shift;
+                shift += 7;
+        } while(byte & 0x80);
+
+        *value = result;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//decodes a string literal into *out (NUL terminated), advancing both
+static int decodeString(const unsigned char** pos, const unsigned char* end, char** out, char* out_end,
+                        char** str, int* str_length) {
+
+        if(*pos >= end)
+                return -1;
+
+        int huffman = **pos & 0x80;
+        unsigned length;
+        if(decodeInteger(pos, end, 7, &length) || length > end - *pos)
+                return -1;
+
+        int decoded;
+        if(huffman) {
+                decoded = decodeHuffman(*pos, length, *out, out_end - 1);
+        } else {
+                decoded = length < out_end - *out ? length : -1;
+                if(decoded >= 0)
+                        memcpy(*out, *pos, length);
+        }
+        if(decoded < 0)
+                return -1;
+
+        *str = *out;
+        *str_length = decoded;
+        *out += decoded;
+        *(*out)++ = '\0';
+        *pos += length;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns decoded length, -1 on invalid codes, bad padding or no room
+static int decodeHuffman(const unsigned char* in, int length, char* out, char* out_end) {
+
+        char* start = out;
+        unsigned code = 0;
+        int bits = 0;
+
+        int i;
+        for(i = 0; i < length; i++) {
+
+                int bit;
+                for(bit = 7; bit >= 0; bit--) {
+
+                        code = (code << 1) | ((in[i] >> bit) & 1);
+                        bits++;
+
+                        unsigned index = code - sFirstCode[bits];
+                        if(sCodeCount[bits] && index < sCodeCount[bits]) {
+                                if(out == out_end)
+                                        return -1;
+                                *out++ = sSortedSymbols[sCodeOffset[bits] + index];
+                                code = 0;
+                                bits = 0;
+                        } else if(bits == HUFFMAN_MAX_LENGTH) {
+                                return -1; //EOS or garbage
+                        }
+                }
+        }
+
+        //padding: a prefix of EOS (all ones), shorter than a byte
+        if(bits > 7 || code != (1u << bits) - 1)
+                return -1;
+
+        return out - start;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//index is 1 based, static entries first then dynamic ones (newest first)
+static int getEntry(hpack_table_t* table, unsigned index, char** name, int* name_length,
+                    char** value, int* value_length) {
+
+        if(index <= NUM_OF_STATIC_ENTRIES) {
+                *name = (char*)sStaticTable[index - 1].name;
+                *name_length = strlen(*name);
+                *value = (char*)sStaticTable[index - 1].value;
+                *value_length = strlen(*value);
+                return 0;
+        }
+
+        index -= NUM_OF_STATIC_ENTRIES + 1;
+        if(index >= table->count)
+                return -1;
+
+        hpack_entry_t* entry = &table->entries[(table->head + index) % table->capacity];
+        *name = entry->name;
+        *name_length = entry->name_length;
+        *value = entry->value;
+        *value_length = entry->value_length;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on allocation failure
+static int addEntry(hpack_table_t* table, char* name, int name_length, char* value, int value_length) {
+
+        int size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+
+        //an entry larger than the table empties it and is not added
+        evictEntries(table, size > table->max_size ? 0 : table->max_size - size);
+        if(size > table->max_size)
+                return 0;
+
+        if(table->count == table->capacity) {
+
+                hpack_entry_t* entries = (hpack_entry_t*)calloc(table->capacity * 2, sizeof(hpack_entry_t));
+                if(!entries)
+                        return -1;
+
+                int i;
+                for(i = 0; i < table->count; i++)
+                        entries[i] = table->entries[(table->head + i) % table->capacity];
+                free(table->entries);
+                table->entries = entries;
+                table->head = 0;
+                table->capacity *= 2;
+        }
+
+        char* copy = (char*)malloc(name_length + value_length + 2);
+        if(!copy)
+                return -1;
+
+        table->head = (table->head + table->capacity - 1) % table->capacity;
+        hpack_entry_t* entry = &table->entries[table->head];
+        entry->name = copy;
+        entry->name_length = name_length;
+        memcpy(copy, name, name_length);
+        copy[name_length] = '\0';
+        entry->value = copy + name_length + 1;
+        entry->value_length = value_length;
+        memcpy(entry->value, value, value_length);
+        entry->value[value_length] = '\0';
+
+        table->count++;
+        table->size += size;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//drops the oldest entries until the table is at most size
+static void evictEntries(hpack_table_t* table, int size) {
+
+        while(table->count && table->size > size) {
+
+                hpack_entry_t* entry = &table->entries[(table->head + table->count - 1) % table->capacity];
+                table->size -= entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+                free(entry->name);
+                entry->name = NULL;
+                table->count--;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//flags are the representation bits above the prefix. returns bytes written
+static int encodeInteger(char* buf, int prefix, int flags, unsigned value) {
+
+        unsigned mask = (1 << prefix) - 1;
+        if(value < mask) {
+                buf[0] = flags | value;
+                return 1;
+        }
+
+        int length = 0;
+        buf[length++] = flags | mask;
+        value -= mask;
+        while(value >= 0x80) {
+                buf[length++] = (value & 0x7f) | 0x80;
+                value >>= 7;
+        }
+        buf[length++] = value;
+        return length;
+}
@@ -0,0 +1,84 @@
+/**
+ * hpack.h
+ *
+ * HPACK (RFC 7541) header compression for HTTP/2.
+ * The decoder keeps the connection's dynamic table and understands every
+ * representation, Huffman coded strings included. The encoder never indexes
+ * and never Huffman codes: responses reference the static table for names
+ * and send values as plain literals, so the peer's decoder state is not
+ * touched and no encoder state has to be kept.
+ */
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+
+//static table indexes of the names the server sends
+#define HPACK_STATUS 8
+#define HPACK_CONTENT_ENCODING 26
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_DATE 33
+#define HPACK_ETAG 34
+#define HPACK_LAST_MODIFIED 44
+#define HPACK_LOCATION 46
+#define HPACK_RETRY_AFTER 53
+#define HPACK_SERVER 54
+#define HPACK_VARY 59
+
+//a decoded header, name and value point into the caller's string buffer
+typedef struct hpack_header_st {
+        char* name;
+        int name_length;
+        char* value;
+        int value_length;
+} hpack_header_t;
+
+typedef struct hpack_entry_st {
+        char* name;             //name and value share one allocation
+        int name_length;
+        char* value;
+        int value_length;
+} hpack_entry_t;
+
+//dynamic table - a ring of entries, newest at head
+typedef struct hpack_table_st {
+        hpack_entry_t* entries;
+        int capacity;
+        int count;
+        int head;
+        int size;               //sum of entry sizes as defined by the RFC
+        int max_size;           //current limit, changed by size updates
+        int settings_size;      //upper bound the limit may be raised to
+} hpack_table_t;
+
+
+/**
+ * init_hpack_table sets up an empty dynamic table limited to max_size.
+ * returns 0 on success, -1 on failure.
+ */
+int init_hpack_table(hpack_table_t* table, int max_size);
+
+/**
+ * frees the entries of the table.
+ */
+void free_hpack_table(hpack_table_t* table);
+
+/**
+ * decodes a complete header block into headers (at most max_headers).
+ * decoded names and values are copied into strings (strings_size bytes).
+ * returns number of headers, -1 on a compression error (fatal for the
+ * connection) or if the block does not fit.
+ */
+int hpack_decode(hpack_table_t* table, const unsigned char* block, int length,
+                 char* strings, int strings_size, hpack_header_t* headers, int max_headers);
+
+/**
+ * encodes ":status" into buf. returns bytes written.
+ */
+int hpack_encode_status(char* buf, int status);
+
+/**
+ * encodes a header whose name is static table entry index, with value as a
+ * literal that is not indexed. returns bytes written.
+ */
+int hpack_encode_header(char* buf, int index, const char* value, int value_length);
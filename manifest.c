@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "mime.h"
+#include "manifest.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define INITIAL_CAPACITY 1024
+#define SIZE_LINE (PATH_MAX + 128)
+#define ENTRY_FORMAT "%ld %ld %ld %ld %lu %o %d "
+
+//a directory waiting to be read by a walker
+typedef struct walk_job_st {
+        char* path;
+        int permitted;          //of the directory itself
+        struct walk_job_st* next;
+} walk_job_t;
+
+//shared by the walkers of one build_manifest
+typedef struct walk_st {
+        manifest_t* manifest;
+        mime_table_t* mime;
+        pthread_mutex_t lock;   //guards everything below
+        pthread_cond_t cond;
+        walk_job_t* jobs;
+        int busy;               //walkers reading a directory
+        int count;              //entries added
+        int failed;
+} walk_t;
+
+static void* walkDirectories(void*);
+static int walkDirectory(walk_t*, walk_job_t*);
+static int pushJob(walk_t*, const char*, int);
+static int addEntry(manifest_t*, const char*, int, const struct stat*, int, mime_table_t*);
+static int insertEntry(manifest_t*, manifest_entry_t*);
+static int growTable(manifest_t*);
+static int isReadable(const struct stat*);
+static void revalidateEntries(manifest_t*, const char*);
+static int compareDepth(const void*, const void*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+manifest_t* create_manifest() {
+
+        manifest_t* manifest = (manifest_t*)calloc(1, sizeof(manifest_t));
+        if(!manifest)
+                return NULL;
+
+        manifest->capacity = INITIAL_CAPACITY;
+        manifest->entries = (manifest_entry_t**)calloc(manifest->capacity, sizeof(manifest_entry_t*));
+        if(!manifest->entries) {
+                free(manifest);
+                return NULL;
+        }
+
+        pthread_mutex_init(&manifest->lock, NULL);
+        return manifest;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int build_manifest(manifest_t* manifest, const char* root, mime_table_t* mime, int num_of_threads) {
+
+        //"" is the root of the file system, like a vhost_t's root
+        struct stat st;
+        if(stat(*root ? root : "/", &st) || !S_ISDIR(st.st_mode))
+                return -1;
+
+        walk_t walk;
+        memset(&walk, 0, sizeof(walk));
+        walk.manifest = manifest;
+        walk.mime = mime;
+        pthread_mutex_init(&walk.lock, NULL);
+        pthread_cond_init(&walk.cond, NULL);
+
+        int permitted = isReadable(&st);
+        if(addEntry(manifest, root, strlen(root), &st, permitted, mime) || pushJob(&walk, root, permitted))
+                walk.failed = 1;
+        walk.count = 1;
+
+        if(num_of_threads < 1)
+                num_of_threads = 1;
+        pthread_t threads[num_of_threads];
+        int i;
+        for(i = 0; i < num_of_threads; i++)
+                if(pthread_create(&threads[i], NULL, walkDirectories, &walk))
+                        break;
+
+        if(i == 0) //not even one walker, walk in this thread
+                walkDirectories(&walk);
+        while(i--)
+                pthread_join(threads[i], NULL);
+
+        pthread_mutex_destroy(&walk.lock);
+        pthread_cond_destroy(&walk.cond);
+
+        debug_print("build_manifest - %s: %d entries\n", root, walk.count);
+        return walk.failed ? -1 : walk.count;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//"size mtime mtime-ns ctime inode mode permitted /path" per line
+int save_manifest(manifest_t* manifest, const char* root, const char* file) {
+
+        FILE* fp = fopen(file, "w");
+        if(!fp)
+                return -1;
+
+        int root_length = strlen(root);
+        int count = 0;
+        int i;
+        for(i = 0; i < manifest->capacity; i++) {
+
+                manifest_entry_t* entry = manifest->entries[i];
+                if(!entry || strncmp(entry->path, root, root_length) || strchr(entry->path, '\n'))
+                        continue;
+
+                const char* relative = entry->path + root_length;
+                if(*relative && *relative != '/')
+                        continue; //a sibling of root sharing its prefix
+
+                fprintf(fp, ENTRY_FORMAT "%s\n", (long)entry->size, (long)entry->mtime.tv_sec,
+                        entry->mtime.tv_nsec, (long)entry->ctime, (unsigned long)entry->ino,
+                        entry->mode, entry->permitted, *relative ? relative : "/");
+                count++;
+        }
+
+        if(fclose(fp))
+                return -1;
+
+        return count;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int load_manifest(manifest_t* manifest, const char* root, mime_table_t* mime, const char* file) {
+
+        FILE* fp = fopen(file, "r");
+        if(!fp)
+                return -1;
+
+        int root_length = strlen(root);
+        char line[SIZE_LINE];
+        int count = 0;
+        while(fgets(line, sizeof(line), fp)) {
+
+                long size, mtime, mtime_ns, ctime;
+                unsigned long ino;
+                unsigned int mode;
+                int permitted;
+                int offset = -1;
+                sscanf(line, ENTRY_FORMAT "%n", &size, &mtime, &mtime_ns, &ctime, &ino, &mode, &permitted, &offset);
+                if(offset < 0 || line[offset] != '/')
+                        continue;
+
+                char* relative = line + offset;
+                int relative_length = strcspn(relative, "\n");
+                if(relative_length == 1)
+                        relative_length = 0; //the root itself
+
+                char path[root_length + relative_length + 1];
+                memcpy(path, root, root_length);
+                memcpy(path + root_length, relative, relative_length);
+                path[root_length + relative_length] = '\0';
+
+                struct stat st;
+                memset(&st, 0, sizeof(st));
+                st.st_size = size;
+                st.st_mtim.tv_sec = mtime;
+                st.st_mtim.tv_nsec = mtime_ns;
+                st.st_ctim.tv_sec = ctime;
+                st.st_ino = ino;
+                st.st_mode = mode;
+                if(addEntry(manifest, path, root_length + relative_length, &st, permitted, mime))
+                        break;
+                count++;
+        }
+
+        fclose(fp);
+        revalidateEntries(manifest, root);
+        debug_print("load_manifest - %s: %d entries\n", file, count);
+        return count;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+const manifest_entry_t* lookup_manifest(manifest_t* manifest, const char* path, const struct stat* st) {
+
+        int length = strlen(path);
+        if(length > 0 && path[length - 1] == '/')
+                length--;
+
+        unsigned mask = manifest->capacity - 1;
+        unsigned i = fnv1a(path, length) & mask;
+        for(; manifest->entries[i]; i = (i + 1) & mask) {
+
+                manifest_entry_t* entry = manifest->entries[i];
+                if(strncmp(entry->path, path, length) || entry->path[length])
+                        continue;
+
+                if(st && (entry->ino != st->st_ino || entry->size != st->st_size ||
+                   entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+                   entry->ctime != st->st_ctim.tv_sec || entry->mode != st->st_mode))
+                        return NULL; //changed since the manifest was made
+
+                return entry;
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int format_etag(char* buf, const struct stat* st) {
+
+        return snprintf(buf, MANIFEST_ETAG_SIZE, "\"%lx-%lx\"",
+                        (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_size);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_manifest(manifest_t* manifest) {
+
+        int i;
+        for(i = 0; i < manifest->capacity; i++) {
+                if(manifest->entries[i]) {
+                        free(manifest->entries[i]->path);
+                        free(manifest->entries[i]);
+                }
+        }
+
+        pthread_mutex_destroy(&manifest->lock);
+        free(manifest->entries);
+        free(manifest);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//walker thread: reads directories until none is queued and none is being
+//read (which could queue more)
+static void* walkDirectories(void* arg) {
+
+        walk_t* walk = (walk_t*)arg;
+
+        pthread_mutex_lock(&walk->lock);
+        while(1) {
+
+                while(!walk->jobs && walk->busy)
+                        pthread_cond_wait(&walk->cond, &walk->lock);
+                if(!walk->jobs)
+                        break;
+
+                walk_job_t* job = walk->jobs;
+                walk->jobs = job->next;
+                walk->busy++;
+                pthread_mutex_unlock(&walk->lock);
+
+                int count = walkDirectory(walk, job);
+                free(job->path);
+                free(job);
+
+                pthread_mutex_lock(&walk->lock);
+                walk->busy--;
+                if(count < 0)
+                        walk->failed = 1;
+                else
+                        walk->count += count;
+                pthread_cond_broadcast(&walk->cond);
+        }
+        pthread_mutex_unlock(&walk->lock);
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//adds the entries of one directory and queues its subdirectories.
+//returns the number of entries added, -1 on failure
+static int walkDirectory(walk_t* walk, walk_job_t* job) {
+
+        DIR* dir = opendir(*job->path ? job->path : "/");
+        if(!dir)
+                return 0; //unreadable - requests under it are refused anyway
+
+        int path_length = strlen(job->path);
+        int count = 0;
+        struct dirent* dirent;
+        while((dirent = readdir(dir))) {
+
+                if(!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+                        continue;
+
+                //the server follows symlinks, so does the entry
+                struct stat st;
+                if(fstatat(dirfd(dir), dirent->d_name, &st, 0))
+                        continue;
+
+                int length = path_length + 1 + strlen(dirent->d_name);
+                char path[length + 1];
+                sprintf(path, "%s/%s", job->path, dirent->d_name);
+
+                int permitted = job->permitted && isReadable(&st);
+                if(addEntry(walk->manifest, path, length, &st, permitted, walk->mime)) {
+                        closedir(dir);
+                        return -1;
+                }
+                count++;
+
+                //but never descends through one, a link to an ancestor would loop
+                int isDir = dirent->d_type == DT_DIR;
+                if(dirent->d_type == DT_UNKNOWN) {
+                        struct stat link;
+                        isDir = !fstatat(dirfd(dir), dirent->d_name, &link, AT_SYMLINK_NOFOLLOW) && S_ISDIR(link.st_mode);
+                }
+                if(isDir && S_ISDIR(st.st_mode) && pushJob(walk, path, permitted)) {
+                        closedir(dir);
+                        return -1;
+                }
+        }
+
+        closedir(dir);
+        return count;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int pushJob(walk_t* walk, const char* path, int permitted) {
+
+        walk_job_t* job = (walk_job_t*)malloc(sizeof(walk_job_t));
+        if(!job || !(job->path = strdup(path))) {
+                free(job);
+                return -1;
+        }
+        job->permitted = permitted;
+
+        pthread_mutex_lock(&walk->lock);
+        job->next = walk->jobs;
+        walk->jobs = job;
+        pthread_cond_signal(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int addEntry(manifest_t* manifest, const char* path, int length, const struct stat* st,
+                    int permitted, mime_table_t* mime) {
+
+        manifest_entry_t* entry = (manifest_entry_t*)calloc(1, sizeof(manifest_entry_t));
+        if(!entry || !(entry->path = strndup(path, length))) {
+                free(entry);
+                return -1;
+        }
+
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtim;
+        entry->ctime = st->st_ctim.tv_sec;
+        entry->ino = st->st_ino;
+        entry->mode = st->st_mode;
+        entry->permitted = permitted;
+        if(S_ISREG(st->st_mode)) {
+                entry->mime = mime ? lookup_mime_type(mime, strrchr(entry->path, '/')) : NULL;
+                entry->etag_length = format_etag(entry->etag, st);
+        }
+
+        pthread_mutex_lock(&manifest->lock);
+        int ret = insertEntry(manifest, entry);
+        pthread_mutex_unlock(&manifest->lock);
+
+        if(ret) {
+                free(entry->path);
+                free(entry);
+        }
+        return ret;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//replaces the entry of the same path, if any.
+//returns 0 on success, -1 on failure
+static int insertEntry(manifest_t* manifest, manifest_entry_t* entry) {
+
+        //keep the load factor at or below 1/2
+        if(2 * (manifest->count + 1) > manifest->capacity && growTable(manifest))
+                return -1;
+
+        unsigned mask = manifest->capacity - 1;
+        unsigned i = fnv1a(entry->path, strlen(entry->path)) & mask;
+        for(; manifest->entries[i]; i = (i + 1) & mask) {
+                if(!strcmp(manifest->entries[i]->path, entry->path)) {
+                        free(manifest->entries[i]->path);
+                        free(manifest->entries[i]);
+                        manifest->entries[i] = entry;
+                        return 0;
+                }
+        }
+
+        manifest->entries[i] = entry;
+        manifest->count++;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int growTable(manifest_t* manifest) {
+
+        int capacity = manifest->capacity * 2;
+        manifest_entry_t** entries = (manifest_entry_t**)calloc(capacity, sizeof(manifest_entry_t*));
+        if(!entries)
+                return -1;
+
+        unsigned mask = capacity - 1;
+        int i;
+        for(i = 0; i < manifest->capacity; i++) {
+
+                manifest_entry_t* entry = manifest->entries[i];
+                if(!entry)
+                        continue;
+
+                unsigned j = fnv1a(entry->path, strlen(entry->path)) & mask;
+                while(entries[j])
+                        j = (j + 1) & mask;
+                entries[j] = entry;
+        }
+
+        free(manifest->entries);
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//what hasPermissions requires of each path component: readable by others,
+//and searchable too for a directory
+//the verdicts of a file were reached whenever it was written, and an
+//ancestor may have been chmod'ed since - which the fresh stat of a file
+//checked at lookup doesn't show. the directories are stat'ed again and every
+//verdict under root recomputed from its parent's, top down
+static void revalidateEntries(manifest_t* manifest, const char* root) {
+
+        int root_length = strlen(root);
+        manifest_entry_t** entries = (manifest_entry_t**)malloc(manifest->count * sizeof(manifest_entry_t*));
+        if(!entries)
+                return;
+
+        int count = 0;
+        int i;
+        for(i = 0; i < manifest->capacity; i++) {
+                manifest_entry_t* entry = manifest->entries[i];
+                if(entry && !strncmp(entry->path, root, root_length) &&
+                   (!entry->path[root_length] || entry->path[root_length] == '/'))
+                        entries[count++] = entry;
+        }
+        qsort(entries, count, sizeof(manifest_entry_t*), compareDepth);
+
+        for(i = 0; i < count; i++) {
+
+                manifest_entry_t* entry = entries[i];
+                struct stat st;
+                st.st_mode = entry->mode;
+                if(S_ISDIR(entry->mode) && stat(*entry->path ? entry->path : "/", &st))
+                        st.st_mode = 0; //gone, nothing under it is served
+
+                int permitted = isReadable(&st);
+                if(entry->path[root_length]) {
+                        //the parent has a smaller depth, so it is already recomputed
+                        int parent_length = strrchr(entry->path, '/') - entry->path;
+                        char parent[parent_length + 1];
+                        memcpy(parent, entry->path, parent_length);
+                        parent[parent_length] = '\0';
+                        const manifest_entry_t* up = lookup_manifest(manifest, parent, NULL);
+                        permitted = permitted && up && up->permitted;
+                }
+
+                if(entry->permitted != permitted)
+                        debug_print("revalidateEntries - %s: %d\n", entry->path, permitted);
+                entry->permitted = permitted;
+        }
+
+        free(entries);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//orders entries by the number of '/' in their path
+static int compareDepth(const void* a, const void* b) {
+
+        const char* path;
+        int depth[2] = { 0, 0 };
+        int i;
+        for(i = 0; i < 2; i++)
+                for(path = (*(manifest_entry_t* const*)(i ? b : a))->path; *path; path++)
+                        depth[i] += *path == '/';
+
+        return depth[0] - depth[1];
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int isReadable(const struct stat* st) {
+
+        if(S_ISDIR(st->st_mode) && !(st->st_mode & S_IXOTH))
+                return 0;
+
+        return (st->st_mode & S_IROTH) != 0;
+}
+
@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * manifest.h
+ *
+ * Precomputed metadata of the files under a document root: size, mtime,
+ * ETag, MIME type and the permission verdict hasPermissions() would reach
+ * by stat()ing every ancestor directory.
+ * A manifest is built at startup by walking the roots with a few threads,
+ * or loaded from a file written by tools/manifest. Like the MIME and host
+ * tables it is an open addressing hash table keyed by absolute path, filled
+ * before serving and read-only afterwards, so lookups take no lock.
+ * An entry is only trusted while the file's fresh stat still matches it
+ * (inode, size, mtime and ctime - chmod changes the ctime); the ancestors
+ * are assumed not to change their permissions while the server runs.
+ */
+
+//defined in mime.h, which only the users looking types up need
+struct mime_type_st;
+struct mime_table_st;
+
+#define MANIFEST_ETAG_SIZE 40   //"<mtime hex>-<size hex>" with quotes
+
+typedef struct manifest_entry_st {
+        char* path;                     //absolute, without a trailing '/'
+        off_t size;
+        struct timespec mtime;
+        time_t ctime;
+        ino_t ino;
+        mode_t mode;
+        int permitted;                  //the path and every ancestor up to the root are readable
+        const struct mime_type_st* mime; //NULL if unknown or a directory
+        char etag[MANIFEST_ETAG_SIZE];
+        int etag_length;
+} manifest_entry_t;
+
+typedef struct manifest_st {
+        manifest_entry_t** entries;
+        int capacity;                   //always a power of two
+        int count;
+        pthread_mutex_t lock;           //taken by the walkers while building
+} manifest_t;
+
+
+/**
+ * create_manifest creates an empty manifest.
+ * returns NULL on failure.
+ */
+manifest_t* create_manifest();
+
+/**
+ * walks root with num_of_threads threads (symlinked directories are not
+ * followed) and adds an entry for root and everything under it. MIME types
+ * are looked up in mime, if not NULL.
+ * returns the number of entries added, -1 on failure.
+ */
+int build_manifest(manifest_t* manifest, const char* root, struct mime_table_st* mime, int num_of_threads);
+
+/**
+ * writes the entries under root to file, with paths relative to root.
+ * returns the number of entries written, -1 on failure.
+ */
+int save_manifest(manifest_t* manifest, const char* root, const char* file);
+
+/**
+ * adds the entries of a file written by save_manifest, placing them under
+ * root. MIME types are looked up in mime (if not NULL) - they depend on the
+ * server's mime.types, not the ones of whoever wrote the file.
+ * the directories are stat'ed again and the permission verdicts recomputed,
+ * an ancestor may have been chmod'ed since the file was written.
+ * returns the number of entries loaded, -1 if the file can't be read.
+ */
+int load_manifest(manifest_t* manifest, const char* root, struct mime_table_st* mime, const char* file);
+
+/**
+ * returns the entry of path (a trailing '/' is ignored) if st, a fresh stat
+ * of path, shows it is current, NULL otherwise. a NULL st only asks whether
+ * path has an entry.
+ */
+const manifest_entry_t* lookup_manifest(manifest_t* manifest, const char* path, const struct stat* st);
+
+/**
+ * formats the ETag header value of a file ("<mtime hex>-<size hex>" in
+ * quotes) into buf (MANIFEST_ETAG_SIZE bytes).
+ * returns its length.
+ */
+int format_etag(char* buf, const struct stat* st);
+
+/**
+ * frees the manifest and its entries.
+ */
+void destroy_manifest(manifest_t* manifest);
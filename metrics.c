@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include "metrics.h"
+
+#define CACHE_LINE 64
+
+typedef struct counter_st {
+        long value;
+} __attribute__((aligned(CACHE_LINE))) counter_t;
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+static counter_t sCounters[NUM_OF_METRICS];
+
+static const char* sNames[NUM_OF_METRICS] = {
+        [METRIC_CONNECTIONS] = "connections",
+        [METRIC_REQUESTS] = "requests",
+        [METRIC_ERRORS] = "errors",
+        [METRIC_TIMEOUT_HEADER] = "timeouts_header",
+        [METRIC_TIMEOUT_WRITE] = "timeouts_write",
+        [METRIC_TLS_HANDSHAKES] = "tls_handshakes",
+        [METRIC_TLS_OFFLOADED] = "tls_offloaded",
+        [METRIC_LOG_DROPPED] = "log_dropped",
+        [METRIC_UPSTREAM_ERRORS] = "upstream_errors",
+        [METRIC_UPSTREAM_EJECTIONS] = "upstream_ejections",
+        [METRIC_UPSTREAM_REUSED] = "upstream_reused",
+        [METRIC_REJECTED] = "rejected",
+        [METRIC_MANIFEST_HITS] = "manifest_hits",
+        [METRIC_COALESCED] = "coalesced",
+        [METRIC_BULK] = "bulk",
+        [METRIC_FIBER_WAITS] = "fiber_waits",
+        [METRIC_FIBER_DETACHED] = "fiber_detached",
+        [METRIC_KEPT_ALIVE] = "kept_alive",
+        [METRIC_TIMEOUT_IDLE] = "timeout_idle",
+};
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+void metric_add(metric_t metric, long value) {
+        __atomic_fetch_add(&sCounters[metric].value, value, __ATOMIC_RELAXED);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+long metric_get(metric_t metric) {
+        return __atomic_load_n(&sCounters[metric].value, __ATOMIC_RELAXED);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int format_metrics(char* buf, int size) {
+
+        int length = 0;
+        buf[0] = '\0';
+
+        int i;
+        for(i = 0; i < NUM_OF_METRICS && length < size; i++)
+                length += snprintf(buf + length, size - length, "%s %ld\n", sNames[i], metric_get(i));
+
+        return length < size ? length : size - 1;
+}
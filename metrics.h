@@ -0,0 +1,48 @@
+/**
+ * metrics.h
+ *
+ * Process wide event counters.
+ * Counters are plain atomics, each on its own cache line so threads bumping
+ * different counters don't contend.
+ */
+
+typedef enum metric_en {
+        METRIC_CONNECTIONS,             //accepted
+        METRIC_REQUESTS,                //answered with a 200
+        METRIC_ERRORS,                  //answered with an error or redirect
+        METRIC_TIMEOUT_HEADER,          //request headers not in time
+        METRIC_TIMEOUT_WRITE,           //client stopped reading the response
+        METRIC_TLS_HANDSHAKES,          //completed
+        METRIC_TLS_OFFLOADED,           //sessions handed to the kernel (kTLS)
+        METRIC_LOG_DROPPED,             //access log records lost to a full ring
+        METRIC_UPSTREAM_ERRORS,         //proxied requests an upstream failed
+        METRIC_UPSTREAM_EJECTIONS,      //upstreams taken out of rotation
+        METRIC_UPSTREAM_REUSED,         //proxied requests sent on a pooled connection
+        METRIC_REJECTED,                //connections refused with a 429
+        METRIC_MANIFEST_HITS,           //permission checks answered by the manifest
+        METRIC_COALESCED,               //loads shared with a concurrent request
+        METRIC_BULK,                    //connections dispatched to the bulk lane
+        METRIC_FIBER_WAITS,             //fibers suspended until their socket was ready
+        METRIC_FIBER_DETACHED,          //fibers moved off their scheduler to a pool thread
+        METRIC_KEPT_ALIVE,              //requests read off a kept-alive connection
+        METRIC_TIMEOUT_IDLE,            //kept-alive connections closed for sitting idle
+        NUM_OF_METRICS
+} metric_t;
+
+
+/**
+ * adds value to a counter. thread safe.
+ */
+void metric_add(metric_t metric, long value);
+#define metric_inc(metric) metric_add(metric, 1)
+
+/**
+ * returns the current value of a counter.
+ */
+long metric_get(metric_t metric);
+
+/**
+ * writes every counter as a "name value\n" line into buf (at most size bytes,
+ * NUL terminated). returns the length written.
+ */
+int format_metrics(char* buf, int size);
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mime.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define INITIAL_CAPACITY 64
+#define SIZE_LINE 1024
+#define CONTENT_TYPE_FORMAT "Content-Type: %s\r\n"
+
+//built-in fallback: "type ext1 ext2 ..." like a mime.types line
+static const char* sBuiltinTypes[] = {
+        "text/html html htm",
+        "text/css css",
+        "text/plain txt",
+        "text/javascript js mjs",
+        "application/json json",
+        "application/xml xml",
+        "application/pdf pdf",
+        "application/wasm wasm",
+        "application/zip zip",
+        "application/gzip gz",
+        "image/jpeg jpg jpeg",
+        "image/gif gif",
+        "image/png png",
+        "image/svg+xml svg",
+        "image/webp webp",
+        "image/x-icon ico",
+        "font/woff woff",
+        "font/woff2 woff2",
+        "audio/basic au",
+        "audio/wav wav",
+        "audio/mpeg mp3",
+        "video/x-msvideo avi",
+        "video/mpeg mpeg mpg",
+        "video/mp4 mp4",
+        "video/webm webm",
+};
+#define NUM_OF_BUILTIN_TYPES (sizeof(sBuiltinTypes) / sizeof(sBuiltinTypes[0]))
+
+static int addLine(mime_table_t*, char*);
+static mime_type_t* createMimeType(const char*);
+static int growTable(mime_table_t*);
+static int lowerExtension(const char*, char*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+mime_table_t* create_mime_table(mime_table_t* fallback) {
+
+        mime_table_t* table = (mime_table_t*)calloc(1, sizeof(mime_table_t));
+        if(!table)
+                return NULL;
+
+        table->entries = (mime_entry_t*)calloc(INITIAL_CAPACITY, sizeof(mime_entry_t));
+        if(!table->entries) {
+                free(table);
+                return NULL;
+        }
+
+        table->capacity = INITIAL_CAPACITY;
+        table->count = 0;
+        table->fallback = fallback;
+        return table;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int add_builtin_mime_types(mime_table_t* table) {
+
+        int i;
+        for(i = 0; i < NUM_OF_BUILTIN_TYPES; i++) {
+
+                char line[SIZE_LINE];
+                snprintf(line, sizeof(line), "%s", sBuiltinTypes[i]);
+                if(addLine(table, line) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int load_mime_types(mime_table_t* table, const char* fileName) {
+        debug_print("load_mime_types - %s\n", fileName);
+
+        FILE* file = fopen(fileName, "r");
+        if(!file)
+                return -1;
+
+        int loaded = 0;
+        char line[SIZE_LINE];
+        while(fgets(line, sizeof(line), file)) {
+
+                char* comment = strchr(line, '#');
+                if(comment)
+                        *comment = '\0';
+
+                int added = addLine(table, line);
+                if(added < 0) {
+                        fclose(file);
+                        return -1;
+                }
+                loaded += added;
+        }
+
+        fclose(file);
+        debug_print("\tloaded %d extensions\n", loaded);
+        return loaded;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int add_mime_type(mime_table_t* table, const char* ext, mime_type_t* mime) {
+
+        char lower[MIME_MAX_EXTENSION];
+        if(lowerExtension(ext, lower))
+                return 0; //too long to ever match, ignore
+
+        //keep load factor under 3/4
+        if((table->count + 1) * 4 > table->capacity * 3 && growTable(table))
+                return -1;
+
+        unsigned mask = table->capacity - 1;
+        unsigned i = fnv1a(lower, strlen(lower)) & mask;
+        while(table->entries[i].ext) {
+
+                if(!strcmp(table->entries[i].ext, lower)) {
+                        table->entries[i].mime = mime;
+                        return 0;
+                }
+                i = (i + 1) & mask;
+        }
+
+        table->entries[i].ext = strdup(lower);
+        if(!table->entries[i].ext)
+                return -1;
+        table->entries[i].mime = mime;
+        table->count++;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+const mime_type_t* lookup_mime_type(mime_table_t* table, const char* name) {
+
+        const char* ext = strrchr(name, '.');
+        if(!ext)
+                return NULL;
+
+        char lower[MIME_MAX_EXTENSION];
+        if(lowerExtension(ext + 1, lower))
+                return NULL;
+
+        unsigned hash = fnv1a(lower, strlen(lower));
+        for(; table; table = table->fallback) {
+
+                unsigned mask = table->capacity - 1;
+                unsigned i = hash & mask;
+                while(table->entries[i].ext) {
+
+                        if(!strcmp(table->entries[i].ext, lower))
+                                return table->entries[i].mime;
+                        i = (i + 1) & mask;
+                }
+        }
+
+        return NULL;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//parses "type ext1 ext2 ...", returns number of extensions added, -1 on failure
+static int addLine(mime_table_t* table, char* line) {
+
+        char* save;
+        char* type = strtok_r(line, " \t\r\n", &save);
+        if(!type)
+                return 0;
+
+        char* ext = strtok_r(NULL, " \t\r\n", &save);
+        if(!ext)
+                return 0;
+
+        //all extensions of a line share one type
+        mime_type_t* mime = createMimeType(type);
+        if(!mime)
+                return -1;
+
+        int added = 0;
+        for(; ext; ext = strtok_r(NULL, " \t\r\n", &save)) {
+                if(add_mime_type(table, ext, mime))
+                        return -1;
+                added++;
+        }
+
+        return added;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static mime_type_t* createMimeType(const char* type) {
+
+        mime_type_t* mime = (mime_type_t*)calloc(1, sizeof(mime_type_t));
+        if(!mime)
+                return NULL;
+
+        int length = snprintf(NULL, 0, CONTENT_TYPE_FORMAT, type);
+        mime->type = strdup(type);
+        mime->header = (char*)malloc(length + 1);
+        if(!mime->type || !mime->header) {
+                free(mime->type);
+                free(mime->header);
+                free(mime);
+                return NULL;
+        }
+
+        sprintf(mime->header, CONTENT_TYPE_FORMAT, type);
+        mime->header_length = length;
+        return mime;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static int growTable(mime_table_t* table) {
+
+        int capacity = table->capacity * 2;
+        mime_entry_t* entries = (mime_entry_t*)calloc(capacity, sizeof(mime_entry_t));
+        if(!entries)
+                return -1;
+
+        unsigned mask = capacity - 1;
+        int i;
+        for(i = 0; i < table->capacity; i++) {
+
+                if(!table->entries[i].ext)
+                        continue;
+
+                unsigned j = fnv1a(table->entries[i].ext, strlen(table->entries[i].ext)) & mask;
+                while(entries[j].ext)
+                        j = (j + 1) & mask;
+                entries[j] = table->entries[i];
+        }
+
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 if ext is empty or too long
+static int lowerExtension(const char* ext, char* lower) {
+
+        int i;
+        for(i = 0; ext[i]; i++) {
+                if(i == MIME_MAX_EXTENSION - 1)
+                        return -1;
+                lower[i] = tolower((unsigned char)ext[i]);
+        }
+        lower[i] = '\0';
+
+        return i ? 0 : -1;
+}
+
@@ -0,0 +1,62 @@
+/**
+ * mime.h
+ *
+ * Case-insensitive extension -> MIME type registry.
+ * A table is an open addressing hash table filled once at startup (from the
+ * built-in list and mime.types files) and read-only afterwards, so lookups
+ * need no locking and cost one hash of the extension.
+ */
+
+#define MIME_MAX_EXTENSION 32
+
+//a type with its precomputed "Content-Type: <type>\r\n" header line
+typedef struct mime_type_st {
+        char* type;
+        char* header;
+        int header_length;
+} mime_type_t;
+
+typedef struct mime_entry_st {
+        char* ext;              //lower case, without the '.'
+        mime_type_t* mime;
+} mime_entry_t;
+
+typedef struct mime_table_st {
+        mime_entry_t* entries;
+        int capacity;           //always a power of two
+        int count;
+        struct mime_table_st* fallback; //consulted when an extension is missing
+} mime_table_t;
+
+
+/**
+ * create_mime_table creates an empty table.
+ * lookups that miss are passed on to fallback (may be NULL).
+ * returns NULL on failure.
+ */
+mime_table_t* create_mime_table(mime_table_t* fallback);
+
+/**
+ * adds the built-in types to the table.
+ * returns 0 on success, -1 on failure.
+ */
+int add_builtin_mime_types(mime_table_t* table);
+
+/**
+ * loads a mime.types file ("type ext1 ext2 ..." per line, '#' comments).
+ * entries override the ones already in the table.
+ * returns number of extensions loaded, -1 if the file can't be read.
+ */
+int load_mime_types(mime_table_t* table, const char* fileName);
+
+/**
+ * maps extension (without '.', any case) to type, replacing a previous
+ * mapping. returns 0 on success, -1 on failure.
+ */
+int add_mime_type(mime_table_t* table, const char* ext, mime_type_t* mime);
+
+/**
+ * returns the type of the file name (the part after its last '.'),
+ * or NULL if the name has no extension or the extension is unknown.
+ */
+const mime_type_t* lookup_mime_type(mime_table_t* table, const char* name);
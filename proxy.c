@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include "proxy.h"
+#include "metrics.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define SIZE_PROXY_BUFFER 16384 //the upstream's response headers must fit
+#define KEEP_ALIVE_HEADER "Connection: keep-alive\r\n\r\n"
+#define CLOSE_HEADER "Connection: close\r\n\r\n"
+
+//relayResponse failure besides PROXY_FAILED and PROXY_TIMEOUT
+#define RELAY_STALE -3          //a pooled connection the upstream had closed
+
+//chunk parser states
+#define CHUNK_SIZE 0
+#define CHUNK_EXTENSION 1
+#define CHUNK_DATA 2
+#define CHUNK_DATA_END 3        //the CRLF after the data
+#define CHUNK_TRAILER 4
+#define CHUNK_DONE 5
+
+//follows a chunked body as it is relayed, to know where it ends
+typedef struct chunk_parser_st {
+        int state;
+        long remaining;         //of the chunk (or of its CRLF)
+        int line_length;        //of the trailer line being read
+} chunk_parser_t;
+
+static const char* sRequestHopHeaders[] = {
+        "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", NULL
+};
+static const char* sResponseHopHeaders[] = {
+        "connection", "keep-alive", "proxy-connection", "upgrade", NULL
+};
+
+static int buildRequest(char*, const char*, int);
+static upstream_t* pickUpstream(proxy_route_t*);
+static void recordFailure(upstream_t*);
+static int takeConnection(proxy_t*, upstream_t*, int*);
+static void releaseConnection(upstream_t*, int);
+static int connectUpstream(upstream_t*, int);
+static int relayResponse(upstream_t*, int, int, const char*, int, proxy_sink_t, void*);
+static int relayError(int);
+static int sendAll(int, const char*, int);
+static long scanChunks(chunk_parser_t*, const char*, long);
+static int headerName(const char*, int, const char*);
+static int isHopByHop(const char*, int, const char**);
+static int hasToken(const char*, int, const char*);
+static long monotonicMs();
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+proxy_t* create_proxy(int timeout_ms) {
+
+        proxy_t* proxy = (proxy_t*)calloc(1, sizeof(proxy_t));
+        if(!proxy)
+                return NULL;
+
+        proxy->timeout_ms = timeout_ms;
+        return proxy;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int add_proxy_route(proxy_t* proxy, const char* spec) {
+
+        const char* hosts = strchr(spec, '=');
+        if(!hosts || spec[0] != '/' || !hosts[1])
+                return -1;
+
+        proxy_route_t* route = (proxy_route_t*)calloc(1, sizeof(proxy_route_t));
+        if(!route)
+                return -1;
+        route->prefix = strndup(spec, hosts - spec);
+        route->prefix_length = hosts - spec;
+        hosts++;
+
+        int count = 1;
+        const char* pos;
+        for(pos = hosts; *pos; pos++)
+                count += *pos == ',';
+        route->upstreams = (upstream_t*)calloc(count, sizeof(upstream_t));
+        if(!route->prefix || !route->upstreams)
+                goto fail;
+
+        while(*hosts) {
+
+                int length = strcspn(hosts, ",");
+                char name[length + 1];
+                memcpy(name, hosts, length);
+                name[length] = '\0';
+                hosts += length + (hosts[length] == ',');
+
+                char* port = strrchr(name, ':');
+                if(!port || !port[1])
+                        goto fail;
+                *port++ = '\0';
+
+                struct addrinfo hints;
+                struct addrinfo* result;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                if(getaddrinfo(name, port, &hints, &result)) {
+                        fprintf(stderr, "cannot resolve upstream %s:%s\n", name, port);
+                        goto fail;
+                }
+
+                upstream_t* upstream = &route->upstreams[route->num_of_upstreams++];
+                memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+                upstream->addr_length = result->ai_addrlen;
+                freeaddrinfo(result);
+
+                port[-1] = ':';
+                upstream->name = strdup(name);
+                pthread_mutex_init(&upstream->lock, NULL);
+        }
+
+        //longest prefix first, the first match is the most specific one
+        proxy_route_t** link = &proxy->routes;
+        while(*link && (*link)->prefix_length >= route->prefix_length)
+                link = &(*link)->next_route;
+        route->next_route = *link;
+        *link = route;
+        return 0;
+
+fail:
+        while(route->num_of_upstreams--) {
+                free(route->upstreams[route->num_of_upstreams].name);
+                pthread_mutex_destroy(&route->upstreams[route->num_of_upstreams].lock);
+        }
+        free(route->upstreams);
+        free(route->prefix);
+        free(route);
+        return -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+proxy_route_t* match_proxy_route(proxy_t* proxy, const char* path) {
+
+        //a prefix matches whole segments: /api matches /api and /api/x, not /apix
+        proxy_route_t* route;
+        for(route = proxy->routes; route; route = route->next_route) {
+                int length = route->prefix_length;
+                if(!strncmp(path, route->prefix, length) &&
+                   (route->prefix[length - 1] == '/' || !path[length] || path[length] == '/'))
+                        return route;
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a GET has no body, so a request that failed before any response byte went
+//to the client can safely be sent again - to a fresh connection if the pooled
+//one was dead, and to the route's next upstream if the upstream failed.
+int proxy_forward(proxy_t* proxy, proxy_route_t* route, const char* request, int length,
+                  proxy_sink_t sink, void* arg) {
+
+        char upstreamRequest[length + sizeof(KEEP_ALIVE_HEADER)];
+        length = buildRequest(upstreamRequest, request, length);
+
+        int result = PROXY_FAILED;
+        int attempt;
+        for(attempt = 0; attempt < route->num_of_upstreams; attempt++) {
+
+                upstream_t* upstream = pickUpstream(route);
+                if(!upstream)
+                        break; //every upstream is ejected
+
+                do {
+                        int reused;
+                        int fd = takeConnection(proxy, upstream, &reused);
+                        if(fd < 0) {
+                                result = relayError(errno);
+                                break;
+                        }
+                        result = relayResponse(upstream, fd, reused, upstreamRequest, length, sink, arg);
+                } while(result == RELAY_STALE);
+
+                if(result > 0) {
+                        __atomic_store_n(&upstream->failures, 0, __ATOMIC_RELAXED);
+                        return result;
+                }
+
+                debug_print("proxy_forward - %s failed (%d)\n", upstream->name, result);
+                recordFailure(upstream);
+        }
+
+        return result;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_proxy(proxy_t* proxy) {
+
+        while(proxy->routes) {
+
+                proxy_route_t* route = proxy->routes;
+                proxy->routes = route->next_route;
+
+                int i;
+                for(i = 0; i < route->num_of_upstreams; i++) {
+                        upstream_t* upstream = &route->upstreams[i];
+                        while(upstream->num_of_idle)
+                                close(upstream->idle[--upstream->num_of_idle]);
+                        pthread_mutex_destroy(&upstream->lock);
+                        free(upstream->name);
+                }
+                free(route->upstreams);
+                free(route->prefix);
+                free(route);
+        }
+
+        free(proxy);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//copies the client's request line and headers into buf (length +
+//sizeof(KEEP_ALIVE_HEADER) bytes) without its hop-by-hop headers, asking the
+//upstream to keep the connection open. an HTTP/1.0 request stays HTTP/1.0,
+//so the response never comes chunked to a client that cannot read it.
+//returns the length of the request built
+static int buildRequest(char* buf, const char* request, int length) {
+
+        const char* end = request + length;
+        char* pos = buf;
+
+        const char* line = request;
+        while(line < end) {
+
+                const char* next = memchr(line, '\n', end - line);
+                if(!next)
+                        break; //cut off, the header block was too long
+                next++;
+
+                int lineLength = next - line;
+                if(lineLength <= 2 && line != request)
+                        break; //the empty line ending the headers
+
+                if(line == request || !isHopByHop(line, lineLength, sRequestHopHeaders))
+                        pos = mempcpy(pos, line, lineLength);
+                line = next;
+        }
+
+        pos = mempcpy(pos, KEEP_ALIVE_HEADER, strlen(KEEP_ALIVE_HEADER));
+        return pos - buf;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//round robin over the upstreams that are not ejected.
+//returns NULL if every one is
+static upstream_t* pickUpstream(proxy_route_t* route) {
+
+        long now = monotonicMs();
+        int i;
+        for(i = 0; i < route->num_of_upstreams; i++) {
+
+                unsigned int next = __atomic_fetch_add(&route->next, 1, __ATOMIC_RELAXED);
+                upstream_t* upstream = &route->upstreams[next % route->num_of_upstreams];
+                if(__atomic_load_n(&upstream->ejected_until, __ATOMIC_RELAXED) <= now)
+                        return upstream;
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//failures are not reset by the ejection, so an upstream that is still down
+//once it is tried again is ejected by its first failure
+static void recordFailure(upstream_t* upstream) {
+
+        metric_inc(METRIC_UPSTREAM_ERRORS);
+        if(__atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED) < PROXY_MAX_FAILURES)
+                return;
+
+        long now = monotonicMs();
+        if(__atomic_exchange_n(&upstream->ejected_until, now + PROXY_EJECT_MS, __ATOMIC_RELAXED) <= now) {
+                fprintf(stderr, "upstream %s ejected\n", upstream->name);
+                metric_inc(METRIC_UPSTREAM_EJECTIONS);
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a pooled connection if there is one still open, a new one otherwise.
+//returns the connection, -1 on failure (errno set)
+static int takeConnection(proxy_t* proxy, upstream_t* upstream, int* reused) {
+
+        while(1) {
+
+                int fd = -1;
+                pthread_mutex_lock(&upstream->lock);
+                if(upstream->num_of_idle)
+                        fd = upstream->idle[--upstream->num_of_idle];
+                pthread_mutex_unlock(&upstream->lock);
+                if(fd < 0)
+                        break;
+
+                //an idle connection has nothing to read, unless the upstream closed it
+                char byte;
+                if(recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        metric_inc(METRIC_UPSTREAM_REUSED);
+                        *reused = 1;
+                        return fd;
+                }
+                close(fd);
+        }
+
+        *reused = 0;
+        return connectUpstream(upstream, proxy->timeout_ms);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void releaseConnection(upstream_t* upstream, int fd) {
+
+        pthread_mutex_lock(&upstream->lock);
+        if(upstream->num_of_idle < PROXY_POOL_SIZE) {
+                upstream->idle[upstream->num_of_idle++] = fd;
+                fd = -1;
+        }
+        pthread_mutex_unlock(&upstream->lock);
+
+        if(fd >= 0)
+                close(fd);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//connects within timeout_ms, then bounds every read and write by it as well.
+//returns the connection, -1 on failure (errno set)
+static int connectUpstream(upstream_t* upstream, int timeout_ms) {
+
+        int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd < 0)
+                return -1;
+
+        int error = 0;
+        if(connect(fd, (struct sockaddr*)&upstream->addr, upstream->addr_length)) {
+
+                if(errno != EINPROGRESS) {
+                        error = errno;
+                } else {
+                        struct pollfd pfd = { fd, POLLOUT, 0 };
+                        socklen_t length = sizeof(error);
+                        int ready = poll(&pfd, 1, timeout_ms);
+                        if(ready < 0)
+                                error = errno;
+                        else if(!ready)
+                                error = ETIMEDOUT;
+                        else if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length))
+                                error = errno;
+                }
+        }
+
+        struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+        if(!error && (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) ||
+                      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+                      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))))
+                error = errno;
+
+        if(error) {
+                debug_print("connectUpstream - %s: %s\n", upstream->name, strerror(error));
+                close(fd);
+                errno = error;
+                return -1;
+        }
+
+        return fd;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sends request on fd and relays the response to sink, its headers rewritten
+//to end the client's connection. the body is passed on as it comes, framing
+//included, while following the framing to know if fd can be pooled again.
+//fd is pooled or closed.
+//returns the upstream's status, PROXY_FAILED, PROXY_TIMEOUT or RELAY_STALE
+//if nothing was sent
+static int relayResponse(upstream_t* upstream, int fd, int reused, const char* request, int length,
+                         proxy_sink_t sink, void* arg) {
+
+        if(sendAll(fd, request, length)) {
+                int error = errno;
+                close(fd);
+                return reused ? RELAY_STALE : relayError(error);
+        }
+
+        //read until the end of the headers
+        char buf[SIZE_PROXY_BUFFER];
+        char* headersEnd = NULL;
+        int received = 0;
+        while(!headersEnd) {
+
+                int nBytes = recv(fd, buf + received, sizeof(buf) - received, 0);
+                if(nBytes <= 0) {
+                        int error = nBytes ? errno : ECONNRESET;
+                        close(fd);
+                        return reused && !received && error != EAGAIN ? RELAY_STALE : relayError(error);
+                }
+
+                int from = received > 3 ? received - 3 : 0;
+                received += nBytes;
+                headersEnd = memmem(buf + from, received - from, "\r\n\r\n", 4);
+                if(!headersEnd && received == sizeof(buf)) {
+                        close(fd);
+                        return PROXY_FAILED;
+                }
+        }
+        headersEnd += 4;
+
+        int minor;
+        int status;
+        if(sscanf(buf, "HTTP/1.%d %3d", &minor, &status) != 2 || status < 100) {
+                close(fd);
+                return PROXY_FAILED;
+        }
+
+        //copy the headers for the client, noting how the body is framed
+        char headers[SIZE_PROXY_BUFFER + sizeof(CLOSE_HEADER)];
+        char* pos = headers;
+        long contentLength = -1;
+        int chunked = 0;
+        int keepAlive = minor >= 1;
+
+        char* line = buf;
+        while(line < headersEnd - 2) {
+
+                char* next = (char*)memchr(line, '\n', headersEnd - line) + 1;
+                int lineLength = next - line;
+                const char* value = memchr(line, ':', lineLength);
+                int valueLength = value ? next - ++value : 0;
+
+                if(headerName(line, lineLength, "content-length"))
+                        contentLength = strtol(value, NULL, 10);
+                else if(headerName(line, lineLength, "transfer-encoding"))
+                        chunked = hasToken(value, valueLength, "chunked");
+                else if(headerName(line, lineLength, "connection"))
+                        keepAlive = minor >= 1 ? !hasToken(value, valueLength, "close") :
+                                    hasToken(value, valueLength, "keep-alive");
+
+                if(line == buf || !isHopByHop(line, lineLength, sResponseHopHeaders))
+                        pos = mempcpy(pos, line, lineLength);
+                line = next;
+        }
+        pos = mempcpy(pos, CLOSE_HEADER, strlen(CLOSE_HEADER));
+
+        if(sink(arg, headers, pos - headers)) {
+                close(fd);
+                return status;
+        }
+
+        //a body without framing ends when the upstream closes the connection
+        int noBody = status < 200 || status == 204 || status == 304;
+        if(!noBody && !chunked && contentLength < 0)
+                keepAlive = 0;
+
+        chunk_parser_t parser;
+        memset(&parser, 0, sizeof(parser));
+        int done = noBody || (!chunked && !contentLength);
+
+        char* data = headersEnd;
+        long dataLength = buf + received - headersEnd;
+        while(1) {
+
+                if(dataLength > 0 && !done) {
+
+                        long relay = dataLength;
+                        if(chunked) {
+                                relay = scanChunks(&parser, data, dataLength);
+                                if(relay < 0) {
+                                        close(fd);
+                                        return status;
+                                }
+                                done = parser.state == CHUNK_DONE;
+                        } else if(contentLength >= 0) {
+                                if(relay > contentLength)
+                                        relay = contentLength;
+                                contentLength -= relay;
+                                done = !contentLength;
+                        }
+
+                        if(sink(arg, data, relay)) {
+                                close(fd);
+                                return status;
+                        }
+                        dataLength -= relay;
+                }
+
+                if(done)
+                        break;
+
+                dataLength = recv(fd, buf, sizeof(buf), 0);
+                if(dataLength <= 0) {
+                        close(fd);
+                        return status; //ended by the close if unframed, cut short otherwise
+                }
+                data = buf;
+        }
+
+        //bytes past the response mean the upstream is out of step
+        if(keepAlive && !dataLength)
+                releaseConnection(upstream, fd);
+        else
+                close(fd);
+
+        return status;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a read or write that hit SO_RCVTIMEO/SO_SNDTIMEO fails with EAGAIN
+static int relayError(int error) {
+        return error == EAGAIN || error == EWOULDBLOCK || error == ETIMEDOUT ? PROXY_TIMEOUT : PROXY_FAILED;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int sendAll(int fd, const char* data, int length) {
+
+        while(length > 0) {
+
+                int nBytes = send(fd, data, length, MSG_NOSIGNAL);
+                if(nBytes < 0)
+                        return -1;
+                data += nBytes;
+                length -= nBytes;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//advances parser over data, stopping at the end of the body.
+//returns the number of bytes that belong to the body, -1 if malformed
+static long scanChunks(chunk_parser_t* parser, const char* data, long length) {
+
+        long i;
+        for(i = 0; i < length && parser->state != CHUNK_DONE; i++) {
+
+                char c = data[i];
+                switch(parser->state) {
+
+                case CHUNK_SIZE:
+                case CHUNK_EXTENSION:
+                        if(c == '\n') {
+                                parser->state = parser->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                                parser->line_length = 0;
+                        } else if(parser->state == CHUNK_SIZE && isxdigit((unsigned char)c)) {
+                                if(parser->remaining > (1L << 40))
+                                        return -1;
+                                parser->remaining = parser->remaining * 16 +
+                                                    (isdigit((unsigned char)c) ? c - '0' : (c | 0x20) - 'a' + 10);
+                        } else if(c != '\r') {
+                                parser->state = CHUNK_EXTENSION;
+                        }
+                        break;
+
+                case CHUNK_DATA: {
+                        long skip = length - i < parser->remaining ? length - i : parser->remaining;
+                        parser->remaining -= skip;
+                        i += skip - 1;
+                        if(!parser->remaining) {
+                                parser->state = CHUNK_DATA_END;
+                                parser->remaining = 2;
+                        }
+                        break;
+                }
+
+                case CHUNK_DATA_END:
+                        if(!--parser->remaining)
+                                parser->state = CHUNK_SIZE;
+                        break;
+
+                case CHUNK_TRAILER:
+                        if(c == '\n') {
+                                if(!parser->line_length)
+                                        parser->state = CHUNK_DONE;
+                                parser->line_length = 0;
+                        } else if(c != '\r') {
+                                parser->line_length++;
+                        }
+                        break;
+                }
+        }
+
+        return i;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 1 if the header line is name (case insensitive), 0 otherwise
+static int headerName(const char* line, int length, const char* name) {
+
+        int nameLength = strlen(name);
+        return length > nameLength && line[nameLength] == ':' && !strncasecmp(line, name, nameLength);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 1 if the header line is one of names, 0 otherwise
+static int isHopByHop(const char* line, int length, const char** names) {
+
+        for(; *names; names++)
+                if(headerName(line, length, *names))
+                        return 1;
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 1 if token is in the comma separated header value, 0 otherwise
+static int hasToken(const char* value, int length, const char* token) {
+
+        int tokenLength = strlen(token);
+        const char* end = value + length;
+        while(value < end) {
+
+                while(value < end && (*value == ' ' || *value == '\t' || *value == ','))
+                        value++;
+                int itemLength = 0;
+                while(value + itemLength < end && !strchr(",; \t\r\n", value[itemLength]))
+                        itemLength++;
+
+                if(itemLength == tokenLength && !strncasecmp(value, token, tokenLength))
+                        return 1;
+                value += itemLength;
+                while(value < end && *value != ',')
+                        value++;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static long monotonicMs() {
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <sys/socket.h>
+
+/**
+ * proxy.h
+ *
+ * Reverse proxy: requests under a configured path prefix are forwarded to
+ * one of the route's upstream HTTP servers, picked round robin.
+ * Every upstream keeps a pool of idle keep-alive connections, so a request
+ * normally costs no connect. The response is relayed to the client as it
+ * arrives, through a small buffer - bodies are never held whole.
+ * An upstream that fails PROXY_MAX_FAILURES times in a row is ejected for
+ * PROXY_EJECT_MS; requests go to the other upstreams of its route meanwhile.
+ */
+
+#define PROXY_FAILED -1         //no upstream answered
+#define PROXY_TIMEOUT -2        //the upstream did not answer in time
+
+#define PROXY_POOL_SIZE 16              //idle connections kept per upstream
+#define PROXY_MAX_FAILURES 3
+#define PROXY_EJECT_MS 10000
+
+typedef struct upstream_st {
+        char* name;                     //host:port as configured
+        struct sockaddr_storage addr;
+        socklen_t addr_length;
+
+        pthread_mutex_t lock;           //guards idle
+        int idle[PROXY_POOL_SIZE];
+        int num_of_idle;
+
+        int failures;                   //in a row
+        long ejected_until;             //monotonic ms
+} upstream_t;
+
+typedef struct proxy_route_st {
+        char* prefix;
+        int prefix_length;
+        upstream_t* upstreams;
+        int num_of_upstreams;
+        unsigned int next;              //round robin
+        struct proxy_route_st* next_route;
+} proxy_route_t;
+
+typedef struct proxy_st {
+        proxy_route_t* routes;          //longest prefix first
+        int timeout_ms;
+} proxy_t;
+
+//receives the response for the client, returns 0 on success, -1 on failure
+typedef int (*proxy_sink_t)(void* arg, const char* data, int length);
+
+
+/**
+ * create_proxy creates a proxy without routes. timeout_ms bounds connecting
+ * to an upstream and every read or write on it.
+ * returns the proxy, NULL on failure.
+ */
+proxy_t* create_proxy(int timeout_ms);
+
+/**
+ * adds a route from a "prefix=host:port[,host:port...]" spec.
+ * returns 0 on success, -1 if the spec is malformed or a host does not resolve.
+ */
+int add_proxy_route(proxy_t* proxy, const char* spec);
+
+/**
+ * returns the route whose prefix path starts with, NULL if there is none.
+ * the prefix must end at a segment boundary of path.
+ */
+proxy_route_t* match_proxy_route(proxy_t* proxy, const char* path);
+
+/**
+ * forwards request (the client's header block, length bytes) to an upstream
+ * of route and passes the response to sink. hop-by-hop headers are dropped
+ * both ways and the response to the client ends with the connection.
+ * returns the upstream's status once its response went to sink (a failure
+ * after that cuts the response short), PROXY_FAILED or PROXY_TIMEOUT if
+ * nothing was sent.
+ */
+int proxy_forward(proxy_t* proxy, proxy_route_t* route, const char* request, int length,
+                  proxy_sink_t sink, void* arg);
+
+/**
+ * closes every pooled connection and frees the proxy.
+ */
+void destroy_proxy(proxy_t* proxy);
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define NS_PER_SEC 1000000000L
+
+static int makeKey(rate_limiter_t*, const struct sockaddr*, unsigned char*, unsigned*);
+static int findEntry(limit_shard_t*, const unsigned char*, unsigned);
+static int addEntry(limit_shard_t*, const unsigned char*, unsigned);
+static void unlinkEntry(limit_shard_t*, int, unsigned);
+static void touchEntry(limit_shard_t*, int);
+static void removeFromLru(limit_shard_t*, int);
+static void refillEntry(rate_limiter_t*, limit_entry_t*, long);
+static long monotonicNs();
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+rate_limiter_t* create_rate_limiter(double rate, double burst, int max_connections,
+                                    int ipv4_prefix, int ipv6_prefix, int capacity) {
+
+        rate_limiter_t* limiter = (rate_limiter_t*)calloc(1, sizeof(rate_limiter_t));
+        if(!limiter)
+                return NULL;
+
+        limiter->rate = rate;
+        limiter->burst = burst;
+        limiter->max_connections = max_connections;
+        limiter->ipv4_prefix = ipv4_prefix;
+        limiter->ipv6_prefix = ipv6_prefix;
+
+        int shard_capacity = 1;
+        while(shard_capacity * LIMIT_SHARDS < capacity)
+                shard_capacity <<= 1;
+
+        int i;
+        for(i = 0; i < LIMIT_SHARDS; i++) {
+
+                limit_shard_t* shard = &limiter->shards[i];
+                shard->capacity = shard_capacity;
+                shard->newest = shard->oldest = -1;
+                shard->entries = (limit_entry_t*)calloc(shard_capacity, sizeof(limit_entry_t));
+                shard->buckets = (int*)malloc(shard_capacity * sizeof(int));
+                if(!shard->entries || !shard->buckets) {
+                        free(shard->entries);
+                        free(shard->buckets);
+                        while(i--) {
+                                free(limiter->shards[i].entries);
+                                free(limiter->shards[i].buckets);
+                                pthread_mutex_destroy(&limiter->shards[i].lock);
+                        }
+                        free(limiter);
+                        return NULL;
+                }
+                memset(shard->buckets, -1, shard_capacity * sizeof(int));
+                pthread_mutex_init(&shard->lock, NULL);
+        }
+
+        return limiter;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int limit_admit(rate_limiter_t* limiter, const struct sockaddr* addr, int* tracked) {
+
+        *tracked = 0;
+        unsigned char key[LIMIT_KEY_SIZE];
+        unsigned hash;
+        if(makeKey(limiter, addr, key, &hash))
+                return LIMIT_OK; //not an IP client
+
+        limit_shard_t* shard = &limiter->shards[hash % LIMIT_SHARDS];
+        long now = monotonicNs();
+        int result = LIMIT_OK;
+
+        pthread_mutex_lock(&shard->lock);
+        int i = findEntry(shard, key, hash);
+        if(i < 0 && (i = addEntry(shard, key, hash)) >= 0) {
+                shard->entries[i].tokens = limiter->burst;
+                shard->entries[i].refilled = now;
+        }
+
+        if(i >= 0) {
+
+                limit_entry_t* entry = &shard->entries[i];
+                refillEntry(limiter, entry, now);
+
+                if(limiter->max_connections && entry->connections >= limiter->max_connections) {
+                        result = LIMIT_CONNECTIONS;
+                } else if(limiter->rate > 0 && entry->tokens < 1) {
+                        result = LIMIT_RATE;
+                } else {
+                        entry->tokens -= 1;
+                        entry->connections++;
+                        *tracked = 1;
+                }
+                touchEntry(shard, i);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        debug_print("limit_admit - %d\n", result);
+        return result;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int limit_take(rate_limiter_t* limiter, const struct sockaddr* addr) {
+
+        if(limiter->rate <= 0)
+                return LIMIT_OK;
+
+        unsigned char key[LIMIT_KEY_SIZE];
+        unsigned hash;
+        if(makeKey(limiter, addr, key, &hash))
+                return LIMIT_OK;
+
+        limit_shard_t* shard = &limiter->shards[hash % LIMIT_SHARDS];
+        long now = monotonicNs();
+        int result = LIMIT_OK;
+
+        //the client has a connection open, so it is normally still tracked.
+        //one recycled meanwhile was admitted untracked and stays unlimited
+        pthread_mutex_lock(&shard->lock);
+        int i = findEntry(shard, key, hash);
+        if(i >= 0) {
+                limit_entry_t* entry = &shard->entries[i];
+                refillEntry(limiter, entry, now);
+                if(entry->tokens < 1)
+                        result = LIMIT_RATE;
+                else
+                        entry->tokens -= 1;
+                touchEntry(shard, i);
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        debug_print("limit_take - %d\n", result);
+        return result;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void limit_release(rate_limiter_t* limiter, const struct sockaddr* addr) {
+
+        unsigned char key[LIMIT_KEY_SIZE];
+        unsigned hash;
+        if(makeKey(limiter, addr, key, &hash))
+                return;
+
+        limit_shard_t* shard = &limiter->shards[hash % LIMIT_SHARDS];
+        pthread_mutex_lock(&shard->lock);
+        int i = findEntry(shard, key, hash);
+        if(i >= 0 && shard->entries[i].connections > 0)
+                shard->entries[i].connections--;
+        pthread_mutex_unlock(&shard->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_rate_limiter(rate_limiter_t* limiter) {
+
+        int i;
+        for(i = 0; i < LIMIT_SHARDS; i++) {
+                free(limiter->shards[i].entries);
+                free(limiter->shards[i].buckets);
+                pthread_mutex_destroy(&limiter->shards[i].lock);
+        }
+        free(limiter);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//key is the family and the address masked to the client's prefix.
+//returns 0 on success, -1 if addr is not an IP address
+static int makeKey(rate_limiter_t* limiter, const struct sockaddr* addr, unsigned char* key, unsigned* hash) {
+
+        const unsigned char* bytes;
+        int size;
+        int prefix;
+        if(addr->sa_family == AF_INET) {
+                bytes = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+                size = 4;
+                prefix = limiter->ipv4_prefix;
+        } else if(addr->sa_family == AF_INET6) {
+                bytes = (const unsigned char*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+                size = 16;
+                prefix = limiter->ipv6_prefix;
+        } else {
+                return -1;
+        }
+
+        memset(key, 0, LIMIT_KEY_SIZE);
+        key[0] = addr->sa_family;
+
+        int i;
+        for(i = 0; i < size && prefix > 0; i++, prefix -= 8)
+                key[i + 1] = prefix >= 8 ? bytes[i] : bytes[i] & (0xff << (8 - prefix));
+
+        *hash = fnv1a(key, LIMIT_KEY_SIZE);
+        return 0;
+}
+
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the shard picks from the low bits of hash, its bucket from the ones above.
+//returns the entry's index, -1 if the client is not tracked
+static int findEntry(limit_shard_t* shard, const unsigned char* key, unsigned hash) {
+
+        int i = shard->buckets[(hash / LIMIT_SHARDS) & (shard->capacity - 1)];
+        while(i >= 0 && memcmp(shard->entries[i].key, key, LIMIT_KEY_SIZE))
+                i = shard->entries[i].next;
+
+        return i;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//takes a free entry, or recycles the least recently seen one without
+//open connections.
+//returns the entry's index, -1 if every entry has open connections
+static int addEntry(limit_shard_t* shard, const unsigned char* key, unsigned hash) {
+
+        int i;
+        if(shard->count < shard->capacity) {
+
+                i = shard->count++;
+
+        } else {
+
+                for(i = shard->oldest; i >= 0 && shard->entries[i].connections; i = shard->entries[i].newer)
+                        ;
+                if(i < 0)
+                        return -1;
+
+                unlinkEntry(shard, i, fnv1a(shard->entries[i].key, LIMIT_KEY_SIZE));
+                removeFromLru(shard, i);
+        }
+
+        limit_entry_t* entry = &shard->entries[i];
+        memcpy(entry->key, key, LIMIT_KEY_SIZE);
+        entry->connections = 0;
+
+        int* bucket = &shard->buckets[(hash / LIMIT_SHARDS) & (shard->capacity - 1)];
+        entry->next = *bucket;
+        *bucket = i;
+
+        entry->newer = entry->older = -1;
+        return i;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//removes entry i from the chain of its bucket
+static void unlinkEntry(limit_shard_t* shard, int i, unsigned hash) {
+
+        int* link = &shard->buckets[(hash / LIMIT_SHARDS) & (shard->capacity - 1)];
+        while(*link != i)
+                link = &shard->entries[*link].next;
+        *link = shard->entries[i].next;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//makes entry i the most recently seen
+static void touchEntry(limit_shard_t* shard, int i) {
+
+        if(shard->newest == i)
+                return;
+
+        limit_entry_t* entry = &shard->entries[i];
+        if(entry->newer >= 0 || entry->older >= 0 || shard->oldest == i)
+                removeFromLru(shard, i);
+
+        entry->newer = -1;
+        entry->older = shard->newest;
+        if(shard->newest >= 0)
+                shard->entries[shard->newest].newer = i;
+        shard->newest = i;
+        if(shard->oldest < 0)
+                shard->oldest = i;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void removeFromLru(limit_shard_t* shard, int i) {
+
+        limit_entry_t* entry = &shard->entries[i];
+        if(entry->newer >= 0)
+                shard->entries[entry->newer].older = entry->older;
+        else
+                shard->newest = entry->older;
+
+        if(entry->older >= 0)
+                shard->entries[entry->older].newer = entry->newer;
+        else
+                shard->oldest = entry->newer;
+
+        entry->newer = entry->older = -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+//adds the tokens earned since the entry's last refill, up to the burst
+static void refillEntry(rate_limiter_t* limiter, limit_entry_t* entry, long now) {
+
+        if(limiter->rate <= 0)
+                return;
+
+        entry->tokens += (now - entry->refilled) * limiter->rate / NS_PER_SEC;
+        if(entry->tokens > limiter->burst)
+                entry->tokens = limiter->burst;
+        entry->refilled = now;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static long monotonicNs() {
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
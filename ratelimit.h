@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <sys/socket.h>
+
+/**
+ * ratelimit.h
+ *
+ * Per-client admission control, applied by the acceptor before a connection
+ * is dispatched: a token bucket limits the rate of new requests and a
+ * counter caps the connections a client has open at once.
+ * Clients are grouped by the leading ipv4_prefix/ipv6_prefix bits of their
+ * address, so a whole CIDR block can share one budget.
+ * The state lives in a fixed size hash table split into LIMIT_SHARDS shards,
+ * each with its own lock. A full shard recycles its least recently seen
+ * client without open connections - an idle client's bucket is full again,
+ * so forgetting it changes nothing.
+ */
+
+#define LIMIT_OK 0
+#define LIMIT_RATE 1            //the client's request rate is exceeded
+#define LIMIT_CONNECTIONS 2     //the client has too many connections open
+
+#define LIMIT_SHARDS 16
+#define LIMIT_KEY_SIZE 17       //family + masked address
+
+typedef struct limit_entry_st {
+        unsigned char key[LIMIT_KEY_SIZE];
+        int connections;
+        double tokens;
+        long refilled;          //monotonic ns of the last refill
+        int next;               //in its bucket, -1 ends the chain
+        int newer;              //LRU links, -1 at the ends
+        int older;
+} limit_entry_t;
+
+typedef struct limit_shard_st {
+        pthread_mutex_t lock;
+        limit_entry_t* entries;
+        int* buckets;           //first entry of each chain, -1 if empty
+        int capacity;           //entries and buckets, a power of two
+        int count;
+        int newest;
+        int oldest;
+} __attribute__((aligned(64))) limit_shard_t;
+
+typedef struct rate_limiter_st {
+        double rate;            //requests per second, 0 for no limit
+        double burst;
+        int max_connections;    //0 for no limit
+        int ipv4_prefix;
+        int ipv6_prefix;
+        limit_shard_t shards[LIMIT_SHARDS];
+} rate_limiter_t;
+
+
+/**
+ * create_rate_limiter tracks up to capacity clients (rounded up to a power
+ * of two per shard). rate requests per second with bursts of up to burst
+ * requests, max_connections open at once.
+ * returns the limiter, NULL on failure.
+ */
+rate_limiter_t* create_rate_limiter(double rate, double burst, int max_connections,
+                                    int ipv4_prefix, int ipv6_prefix, int capacity);
+
+/**
+ * takes a request token and a connection slot for the client at addr.
+ * returns LIMIT_OK if the connection may be served, LIMIT_RATE or
+ * LIMIT_CONNECTIONS if it must be rejected. a client that finds the table
+ * full of clients with open connections is admitted untracked.
+ * tracked is set to 1 if a connection slot was taken, 0 if not.
+ */
+int limit_admit(rate_limiter_t* limiter, const struct sockaddr* addr, int* tracked);
+
+/**
+ * takes a request token for the client at addr, for requests that arrive on
+ * a connection already admitted - h2 streams.
+ * returns LIMIT_OK if the request may be served, LIMIT_RATE if it must be
+ * rejected.
+ */
+int limit_take(rate_limiter_t* limiter, const struct sockaddr* addr);
+
+/**
+ * returns the connection slot taken by limit_admit, only to be called if
+ * it set tracked.
+ */
+void limit_release(rate_limiter_t* limiter, const struct sockaddr* addr);
+
+/**
+ * frees the limiter.
+ */
+void destroy_rate_limiter(rate_limiter_t* limiter);
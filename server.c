@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -7,7 +9,37 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <strings.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <linux/tcp.h>
 #include "threadpool.h"
+#include "datecache.h"
+#include "uring.h"
+#include "filecache.h"
+#include "timerwheel.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "h2.h"
+#include "tls.h"
+#include "accesslog.h"
+#include "proxy.h"
+#include "vhost.h"
+#include "ratelimit.h"
+#include "manifest.h"
+#include "bundle.h"
+#include "flight.h"
+#include "fiber.h"
+#include "bufpool.h"
+#include "fnv.h"
 
 #define DEBUG 0
 #define debug_print(fmt, ...) \
@@ -21,29 +53,109 @@
 #define MAX_ENTITY_LINE 500
 #define MAX_PORT 65535
 #define NUM_OF_COMMANDS 4
-#define PRINT_WRONG_CMD_USAGE "Usage: server <port> <pool-size> <max-number-of-request>\n"
+#define PRINT_WRONG_CMD_USAGE "Usage: server [-u] [-M] [-m mime-types-file] [-H handoff-socket] [-c cert-file [-k key-file]] [-l access-log [-B]] [-P prefix=host:port[,host:port...]] [-t upstream-timeout-ms] [-V host=root[,mime-types-file]] [-r rate[,burst]] [-n connections] [-g ipv4-prefix[,ipv6-prefix]] [-w manifest-file] [-W] [-f access-log[,count]] [-b bundle-file] [-L interactive-threads] [-F fiber-threads [-K idle-seconds]] [-S stack-kb] <port> <pool-size> <max-number-of-request>\n"
+#define SYSTEM_MIME_TYPES "/etc/mime.types"
+#define USER_MIME_TYPES ".mime.types" //relative to $HOME
 
 /****************************************/
 /***** Response Construction Macros *****/
 /****************************************/
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
 #define NUM_OF_EXPECTED_TOKENS 3
 #define COLS_DIR_CONTENTS 3
 #define DEFAULT_FILE "index.html"
-#define DIR_CONTENTS_TITLE "Index of %s"
+//a listing's head and rows are put together around the (escaped) path and names
+#define DIR_CONTENTS_HEAD_START "<HTML>\n<HEAD>\n<TITLE>Index of "
+#define DIR_CONTENTS_HEAD_MIDDLE "</TITLE>\n</HEAD>\n<BODY>\n<H4>Index of "
+#define DIR_CONTENTS_HEAD_END "</H4>\n<table CELLSPACING=8>\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\n"
+#define DIR_CONTENTS_ROW_START "<tr><td><A HREF=\""
+#define DIR_CONTENTS_ROW_LINK "\">"
+#define DIR_CONTENTS_ROW_DATE "</A></td><td>%s</td>"
+#define DIR_CONTENTS_TAIL "</table>\n<HR>\n<ADDRESS>" SERVER_NAME "</ADDRESS>\n\n</BODY>\n</HTML>\n"
 
 /***********************/
 /***** Size Macros *****/
 /***********************/
-#define SIZE_READ_BUFFER 2
 #define SIZE_WRITE_BUFFER 512
 #define SIZE_REQUEST 4000
 #define SIZE_RESPONSE 2048
-#define SIZE_RESPONSE_BODY 1024
-#define SIZE_HEADER 64
-#define SIZE_DATE_BUFFER 128
+#define SIZE_LOCATION SIZE_REQUEST //a redirect's percent-encoded path
+#define SIZE_RESPONSE_HEADERS (SIZE_RESPONSE + SIZE_LOCATION) //Location echoes the path
 #define SIZE_HTML_TAGS 128
-#define SIZE_DIR_ENTITY 500
+#define SIZE_DIR_ENTITY 128 //date and size cells of a listing row
+#define SIZE_ENCODED_NAME (3 * NAME_MAX + 1) //a percent-encoded file name
+#define SIZE_LISTING_BUFFER (16 * 1024) //a listing is sent in chunks of this size
+#define SIZE_LISTING_STEP (6 * SIZE_REQUEST + SIZE_HTML_TAGS) //most a listing step appends: an escaped path
+#define SIZE_URING_BUFFER (64 * 1024) //registered buffer: headers + one file chunk
+#define SIZE_FILE_CACHE (512L * 1024 * 1024) //address space for mapped files
+#define SIZE_LOG_RING (256 * 1024) //access log buffer of each worker
+
+/************************/
+/***** Proxy Macros *****/
+/************************/
+#define TIMEOUT_UPSTREAM_MS 5000        //connecting, and each read or write
+
+/*****************************/
+/***** Rate Limit Macros *****/
+/*****************************/
+#define SIZE_LIMIT_TABLE 65536          //clients the rate limiter keeps track of
+#define REJECT_LINGER_MS 500            //a rejected client's request is read and dropped after this
+
+/**************************/
+/***** Warm-up Macros *****/
+/**************************/
+#define WARMUP_THREADS 8                //walking the document roots
+#define DEFAULT_HOT_FILES 100           //pre-faulted from the access log
+#define SIZE_BULK_RESPONSE (1024 * 1024) //responses from this size on are served in the bulk lane
+#define SIZE_BULK_TABLE 4096            //request targets known to be bulk, a power of two
+#define SIZE_PEEK 512                   //of a new connection's request, to pick its lane
+#define SIZE_ACCEPT_BATCH 32            //connections taken off the backlog before they are dispatched
+#define SIZE_FIBER_STACK (128 * 1024)   //TLS and proxied connections run on it too, once detached
+#define MIN_STACK_KB 64                 //-S
+#define MAX_FREE_BUFFERS 64             //request buffers kept for reuse, the rest are freed
+#define DEFAULT_RESERVED_SHARE 4        //1 in 4 pool threads only serve the interactive lane
+#define SIZE_LOG_LINE 4096
+#define LOG_PATH_FIELD "\"path\":\""
+#define LOG_STATUS_OK ",\"status\":200,"
+
+/***************************/
+/***** io_uring Macros *****/
+/***************************/
+#define URING_ENTRIES 64
+#define MAX_STAT_BATCH 32       //deepest path whose stats are prefetched
+#define URING_FILE_SLOT 0       //direct descriptor of the file being sent
+
+//user_data of the ops in a file send chain
+#define URING_OP_OPEN 0
+#define URING_OP_READ 1
+#define URING_OP_SEND 2
+#define URING_OP_CLOSE 3
+
+//user_data of the acceptor's ops
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_CANCEL 3
+
+/**************************/
+/***** Timeout Macros *****/
+/**************************/
+#define TICK_MS 100
+#define TIMEOUT_HEADER_MS 10000         //whole request header, however it trickles in
+#define TIMEOUT_WRITE_STALL_MS 30000    //client acknowledged nothing for this long
+
+#define CONN_READING 0
+#define CONN_WRITING 1
+
+#define LISTING_RENDERING 0
+#define LISTING_DONE 1
+#define LISTING_FAILED 2
+
+#define LISTING_TITLE 0
+#define LISTING_HEADING 1
+#define LISTING_ROWS 2
+#define LISTING_COMPLETE 3
+
+//the part of the h2c preface readRequest stops reading at
+#define H2_REQUEST_LINE "PRI * HTTP/2.0\r\n\r\n"
 
 /**************************/
 /***** Response Codes *****/
@@ -53,8 +165,11 @@
 #define CODE_BAD 400
 #define CODE_FORBIDDEN 403
 #define CODE_NOT_FOUND 404
+#define CODE_TOO_MANY_REQUESTS 429
 #define CODE_INTERNAL_ERROR 500
 #define CODE_NOT_SUPPORTED 501
+#define CODE_BAD_GATEWAY 502
+#define CODE_GATEWAY_TIMEOUT 504
 
 #define CODE_EMPTY_REQUEST 999 //browser sends empty request on dir-contents link hover
 
@@ -66,8 +181,11 @@
 #define CODE_BAD_STRING "400 Bad Request"
 #define CODE_FORBIDDEN_STRING "403 Forbidden"
 #define CODE_NOT_FOUND_STRING "404 Not Found"
+#define CODE_TOO_MANY_REQUESTS_STRING "429 Too Many Requests"
 #define CODE_INTERNAL_ERROR_STRING "500 Internal Server Error"
 #define CODE_NOT_SUPPORTED_STRING "501 Not Supported"
+#define CODE_BAD_GATEWAY_STRING "502 Bad Gateway"
+#define CODE_GATEWAY_TIMEOUT_STRING "504 Gateway Timeout"
 
 
 /************************************/
@@ -77,10 +195,72 @@
 #define RESPONSE_BAD_REQUEST "Bad Request.\n"
 #define RESPONSE_FORBIDDEN "Access denied.\n"
 #define RESPONSE_NOT_FOUND "File not found.\n"
+#define RESPONSE_TOO_MANY_REQUESTS "Too many requests, try again later.\n"
 #define RESPONSE_INTERNAL_ERROR "Some server side error.\n"
 #define RESPONSE_NOT_SUPPORTED "Method is not supported.\n"
+#define RESPONSE_BAD_GATEWAY "The upstream server could not be reached.\n"
+#define RESPONSE_GATEWAY_TIMEOUT "The upstream server did not answer in time.\n"
 #define RESPONSE_BODY_TEMPLATE "<HTML>\n<HEAD>\n<TITLE>%s</TITLE>\n</HEAD>\n<BODY>\n<H4>%s</H4>\n%s\n</BODY>\n</HTML>\n"
 
+/*************************************/
+/***** Response Header Templates *****/
+/*************************************/
+#define SERVER_NAME "webserver/1.0"
+#define SERVER_HEADER "Server: " SERVER_NAME "\r\n"
+#define CONNECTION_HEADER "Connection: close\r\n\r\n"
+#define KEEP_ALIVE_HEADER "Connection: keep-alive\r\n\r\n"
+#define LOCATION_HEADER "Location: "
+#define RETRY_AFTER_HEADER "Retry-After: 1\r\n"
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+#define LAST_MODIFIED_HEADER "Last-Modified: "
+#define ETAG_HEADER "ETag: "
+#define GZIP_CODING "gzip"
+#define CHUNKED_HEADER "Transfer-Encoding: chunked\r\n"
+#define LAST_CHUNK "0\r\n\r\n"
+#define STATUS_TEMPLATE(status) "HTTP/1.0 " status "\r\n" SERVER_HEADER
+#define STATUS_TEMPLATE_HTTP11(status) "HTTP/1.1 " status "\r\n" SERVER_HEADER
+#define TEMPLATE(text) text, sizeof(text) - 1
+
+//precomputed header block for each status: status line + Server header
+typedef struct header_template_st {
+        int code;
+        const char* text;
+        int length;
+} header_template_t;
+
+static const header_template_t sStatusTemplates[] = {
+        { CODE_OK, TEMPLATE(STATUS_TEMPLATE(CODE_OK_STRING)) },
+        { CODE_FOUND, TEMPLATE(STATUS_TEMPLATE(CODE_FOUND_STRING)) },
+        { CODE_BAD, TEMPLATE(STATUS_TEMPLATE(CODE_BAD_STRING)) },
+        { CODE_FORBIDDEN, TEMPLATE(STATUS_TEMPLATE(CODE_FORBIDDEN_STRING)) },
+        { CODE_NOT_FOUND, TEMPLATE(STATUS_TEMPLATE(CODE_NOT_FOUND_STRING)) },
+        { CODE_TOO_MANY_REQUESTS, TEMPLATE(STATUS_TEMPLATE(CODE_TOO_MANY_REQUESTS_STRING)) },
+        { CODE_INTERNAL_ERROR, TEMPLATE(STATUS_TEMPLATE(CODE_INTERNAL_ERROR_STRING)) },
+        { CODE_NOT_SUPPORTED, TEMPLATE(STATUS_TEMPLATE(CODE_NOT_SUPPORTED_STRING)) },
+        { CODE_BAD_GATEWAY, TEMPLATE(STATUS_TEMPLATE(CODE_BAD_GATEWAY_STRING)) },
+        { CODE_GATEWAY_TIMEOUT, TEMPLATE(STATUS_TEMPLATE(CODE_GATEWAY_TIMEOUT_STRING)) },
+};
+#define NUM_OF_STATUS_TEMPLATES (sizeof(sStatusTemplates) / sizeof(sStatusTemplates[0]))
+
+//chunked transfer coding, and a persistent connection that stays so, need an HTTP/1.1 status line
+static const header_template_t sHttp11Template = { CODE_OK, TEMPLATE(STATUS_TEMPLATE_HTTP11(CODE_OK_STRING)) };
+
+//complete error/redirect response rendered once at startup.
+//only the Date header (and the Location path of a 302) is spliced in per request.
+typedef struct static_response_st {
+        int code;
+        char* text;
+        int length;
+        int date_offset;        //where the Date header line goes
+        int location_offset;    //where the path goes (CODE_FOUND only)
+} static_response_t;
+
+static static_response_t sStaticResponses[] = {
+        { CODE_FOUND }, { CODE_BAD }, { CODE_FORBIDDEN }, { CODE_NOT_FOUND }, { CODE_TOO_MANY_REQUESTS },
+        { CODE_INTERNAL_ERROR }, { CODE_NOT_SUPPORTED }, { CODE_BAD_GATEWAY }, { CODE_GATEWAY_TIMEOUT },
+};
+#define NUM_OF_STATIC_RESPONSES (sizeof(sStaticResponses) / sizeof(sStaticResponses[0]))
+
 
 /****************************/
 /***** Global Variables *****/
@@ -88,17 +268,159 @@
 int sPort = 0;
 int sPoolSize = 0;
 int sMaxRequests = 0;
+char* sMimeFile = NULL;
+mime_table_t* sMimeTypes = NULL;
+int sUseUring = 0;
+int sMapFiles = 0;
+file_cache_t* sFileCache = NULL;
+flight_group_t* sListings = NULL;     //listings being rendered, shared by their waiters
+timer_wheel_t* sTimers = NULL;
+char* sHandoffPath = NULL;
+int sHandoffSocket = -1;
+int sHandedOff = 0;
+int sDraining = 0;
+int sWakePipe[2];       //written once when draining starts, wakes the acceptor
+pthread_mutex_t sSignalLock = PTHREAD_MUTEX_INITIALIZER; //log rotation and bundle reload against teardown
+char* sCertFile = NULL;
+char* sKeyFile = NULL;  //defaults to sCertFile
+SSL_CTX* sTlsContext = NULL;
+char* sAccessLogFile = NULL;
+int sLogPolicy = ACCESS_LOG_DROP;
+access_log_t* sAccessLog = NULL;
+proxy_t* sProxy = NULL;         //only with -P routes
+int sUpstreamTimeout = TIMEOUT_UPSTREAM_MS;
+char** sHostSpecs = NULL;       //-V arguments, added once the mime types are loaded
+int sNumOfHostSpecs = 0;
+vhost_table_t* sHosts = NULL;
+double sClientRate = 0;         //requests per second per client, 0 - unlimited
+double sClientBurst = 0;        //defaults to a second's worth
+int sClientConnections = 0;     //open at once per client, 0 - unlimited
+int sIpv4Prefix = 32;           //clients sharing these leading bits share a limit
+int sIpv6Prefix = 64;
+rate_limiter_t* sLimiter = NULL;
+char* sManifestFile = NULL;     //loaded for the default host
+int sWalkRoots = 0;             //build the manifest of every root at startup
+char* sHotLog = NULL;           //access log naming the files to pre-fault
+int sHotFiles = DEFAULT_HOT_FILES;
+manifest_t* sManifest = NULL;
+char* sBundleFile = NULL;
+bundle_store_t* sBundles = NULL;        //-b: every request is answered from the bundle
+int sReservedThreads = -1;      //-L, -1 for a share of the pool
+unsigned sBulkTargets[SIZE_BULK_TABLE]; //hashes of canonical paths answered with bulk responses
+int sFiberThreads = 0;          //-F, pool threads running a fiber scheduler each
+fiber_scheduler_t** sSchedulers = NULL; //connections are handled as fibers on these, with -F
+int sNextScheduler = 0;
+threadpool* sPool = NULL;
+long sStackSize = 0;            //-S, of pool threads and fibers, 0 for the defaults
+int sIdleTimeout = 0;           //-K, seconds a kept-alive connection may sit idle, 0 - close after each response
+buffer_pool_t* sBuffers = NULL; //request and path of the requests being served
+int sOpenConnections = 0;       //admitted and not closed yet
+int sPeakConnections = 0;
+
+//per connection state, lives on the handler's stack
+typedef struct conn_st {
+        int sockfd;
+        int stage;                      //CONN_READING or CONN_WRITING
+        unsigned long long acked;       //bytes the client acknowledged at the last check
+        wheel_timer_t timer;
+        tls_conn_t* tls;                //NULL for plain HTTP
+
+        //for the access log
+        struct timespec start;
+        int status;                     //of the response sent, 0 - none
+        char* request;                  //request line, once read
+        char* path;
+
+        struct sockaddr_storage peer;
+        int admitted;                   //holds a slot of sLimiter
+        struct client_st* client;       //freed with the connection
+        char* buffer;                   //from sBuffers, holds request and path
+} conn_t;
+
+//what the acceptor hands a worker. with -K it is all a connection holds
+//between its requests.
+typedef struct client_st {
+        int sockfd;
+        struct sockaddr_storage addr;
+        int kept;                       //served a request already, was kept alive
+        int admitted;                   //holds a slot of sLimiter
+        wheel_timer_t idle;             //closes it if no next request comes
+} client_t;
+
+//a path of a previous access log and how often it was served
+typedef struct hot_file_st {
+        char* path;
+        int hits;
+} hot_file_t;
+
+//a connection rejected by the acceptor, closed once its request arrived
+typedef struct rejected_st {
+        wheel_timer_t timer;
+        int sockfd;
+} rejected_t;
+
+//each worker lazily sets up its own ring, a failure falls back to classic I/O
+static __thread uring_t* tRing = NULL;
+static __thread int tRingFailed = 0;
+
+//TLS session of the connection the worker is serving, NULL for plain HTTP
+static __thread tls_conn_t* tTls = NULL;
+
+//bytes sent on the connection the worker is serving, for the access log
+static __thread long tBytesSent = 0;
+
+//client of the h2c connection the worker is serving, charged a token per
+//stream. the token taken when the connection was admitted pays the first
+static __thread struct sockaddr_storage* tH2Peer = NULL;
+static __thread int tH2Prepaid = 0;
+
+//stats of a path and its ancestors, fetched with one batched statx submission
+typedef struct stat_entry_st {
+        char* path;
+        int result;             //0 or -errno
+        struct statx stx;
+} stat_entry_t;
+
+typedef struct stat_batch_st {
+        int count;
+        char* paths;            //one allocation holding every entry's path
+        stat_entry_t entries[MAX_STAT_BATCH];
+} stat_batch_t;
 
 //struct to hold response related variables
 typedef struct response_info_st {
         int isPathDir;
         int foundFile;
-        int numOfFiles;
-        struct dirent** fileList;
+        int isHttp11;           //request was HTTP/1.1, a listing can be chunked
+        int keepAlive;          //the connection stays open for the next request
         char* absPath;
-        char* root;
+        const vhost_t* host;    //whose root absPath is under
+        const mime_type_t* mime;
+        const manifest_entry_t* meta;   //the file's manifest entry, NULL if it has none
+        struct stat fileStats;  //of the file being sent
+        stat_batch_t* stats;    //io_uring mode only
 } response_info_t;
 
+//a listing shared by the requests that joined its flight. they get it as
+//soon as it is being rendered and send it as it grows
+typedef struct rendered_listing_st {
+        int fd;                 //anonymous file, read with explicit offsets only
+        long length;            //rendered so far
+        int state;              //LISTING_RENDERING until it is done or failed
+        pthread_mutex_t lock;
+        pthread_cond_t grown;
+} rendered_listing_t;
+
+//a directory listing, rendered into buf a piece at a time
+typedef struct listing_st {
+        DIR* dir;
+        char* title;            //the request's path
+        int stage;              //LISTING_TITLE to LISTING_COMPLETE
+        int length;             //of the piece in buf
+        int read;               //of it by readListing
+        char buf[SIZE_LISTING_BUFFER + SIZE_LISTING_STEP];
+} listing_t;
+
 
 
 /*******************************/
@@ -107,29 +429,114 @@ typedef struct response_info_st {
 //Server Initialization
 int parseArguments(int, char**);
 int verifyPort(char*);
+void initMimeTypes();
+void initVirtualHosts();
 int initServer();
 void initServerSocket(int*);
+void warmUp();
+void prefaultHotFiles();
+void prefaultFile(char*);
+int compareHotFiles(const void*, const void*);
+int acceptWithUring(int, threadpool*);
+int acceptConnection(int, struct sockaddr_storage*);
+int admitConnection(int, struct sockaddr_storage*, batch_job_t*);
+void dispatchConnections(threadpool*, batch_job_t*, int);
+void abandonConnection(client_t*);
+void countConnection(int);
+void startSchedulers(threadpool*, int);
+void stopSchedulers();
+void detachToPool(fiber_t*);
+int runDetached(void*);
+int classifyConnection(int);
+void learnResponseSize(const char*, long);
+const char* findTarget(const char*, int, int*);
+unsigned hashTarget(const char*, int);
+void rejectConnection(int);
+int closeRejected(void*);
+void initSignals();
+void* handleSignals(void*);
+void* serveHandoff(void*);
+void startDrain();
+int isDraining();
 
 //Request Handling
 int handler(void*);
-int readRequest(char*, int);
-int parseRequest(char*, char*);
+void openConnection(conn_t*, int);
+void startWriting(conn_t*);
+void endRequest(conn_t*);
+void closeConnection(conn_t*);
+int expireConnection(void*);
+int wantsKeepAlive(char*, int, response_info_t*);
+int parkConnection(conn_t*);
+int expireIdle(void*);
+int acceptTls(conn_t*);
+void leaveScheduler(conn_t*);
+int inUserSpaceTls();
+int proxyRequest(conn_t*, proxy_route_t*, char*, int);
+int serveFromBundle(conn_t*, char*, char*);
+const bundle_entry_t* findInBundle(bundle_t*, char*, int*);
+const bundle_body_t* pickBundleBody(const bundle_entry_t*, const char*, int);
+int sendToClient(void*, const char*, int);
+void logRequest(const char*, int, const char*, int, long, struct timespec*);
+int readRequest(char*, int, int*);
+int parseRequest(char*, char*, response_info_t*);
+int normalizePath(char*);
+char* findHeader(char*, const char*, int*);
 int parsePath(char*, response_info_t*);
-int hasPermissions(char*, char*);
+int checkPermissions(char*, struct stat*, response_info_t*);
+int hasPermissions(char*, response_info_t*);
+int statPath(response_info_t*, char*, struct stat*);
+const char* relativePath(response_info_t*, const char*);
+void prefetchStats(response_info_t*);
 
 //Response Handling
 int sendResponse(int, int, char*, response_info_t*);
-char* constructResponse(int, char*, response_info_t*);
+int constructResponse(char*, response_info_t*, char*);
+const header_template_t* getStatusTemplate(int);
+void initStaticResponses();
+int sendStaticResponse(int, int, char*);
 char* getResponseBody(int);
-char* getDirContents(response_info_t*);
-char* get_mime_type(char*);
-int writeResponse(int, char*, char*, response_info_t*);
-int writeFile(int, char*);
+listing_t* openListing(response_info_t*);
+int renderListingPiece(listing_t*);
+void appendRow(listing_t*);
+void appendListing(listing_t*, const char*, int);
+void appendHtml(listing_t*, const char*);
+int readListing(void*, char*, int);
+void closeListing(void*);
+int streamListing(int, response_info_t*);
+rendered_listing_t* shareListing(flight_t*, response_info_t*);
+void discardListing(void*, void*);
+int sendListing(int, rendered_listing_t*, int);
+int writeListingChunk(int, const char*, int, int);
+int writeListing(int, response_info_t*);
+const mime_type_t* get_mime_type(char*);
+int getEtag(response_info_t*, struct stat*, char*);
+int writeResponse(int, char*, int, char*, response_info_t*);
+int writeFile(int, response_info_t*);
+int sendOpenFile(int, int, long);
+int writeMappedFile(int, char*, int, response_info_t*);
+int writeFileUring(uring_t*, int, char*, int, response_info_t*);
+int writeAll(int, struct iovec*, int);
+int waitForSocket(int, int);
+
+//HTTP/2
+void serveH2Request(h2_request_t*, h2_response_t*);
+int constructH2Response(response_info_t*, h2_response_t*);
+void constructH2Error(int, char*, h2_response_t*);
+int constructH2FromBundle(h2_request_t*, char*, h2_response_t*);
+char* encodeH2Common(char*);
+
+//io_uring
+uring_t* getThreadRing();
+int reapCompletions(uring_t*, int*, int, int);
+void closeFileUring(uring_t*);
 
 //Misc
 void initResponseInfo(response_info_t*);
 void freeResponseInfo(response_info_t*);
-int replaceSubstring(char*, char*, char*);
+int hexValue(char);
+char* appendNumber(char*, long);
+int encodePath(const char*, char*, int);
 
 /******************************************************************************/
 /******************************************************************************/
@@ -139,16 +546,14 @@ int replaceSubstring(char*, char*, char*);
 
 int main(int argc, char* argv[]) {
 
-        if(argc != NUM_OF_COMMANDS) {
-                printf(PRINT_WRONG_CMD_USAGE);
-                exit(EXIT_FAILURE);
-        }
-
         if(parseArguments(argc, argv)) {
                 printf(PRINT_WRONG_CMD_USAGE);
                 exit(EXIT_FAILURE);
         }
 
+        initMimeTypes();
+        initVirtualHosts();
+        initStaticResponses();
         initServer(argc, argv);
 
         return EXIT_SUCCESS;
@@ -162,6 +567,138 @@ int main(int argc, char* argv[]) {
 
 int parseArguments(int argc, char** argv) {
 
+        int opt;
+        while((opt = getopt(argc, argv, "uMm:H:c:k:l:BP:t:V:r:n:g:w:Wf:b:L:F:K:S:")) != -1) {
+                switch (opt) {
+
+                case 'u':
+                        sUseUring = 1;
+                        break;
+
+                case 'M':
+                        sMapFiles = 1;
+                        break;
+
+                case 'H':
+                        sHandoffPath = optarg;
+                        break;
+
+                case 'm':
+                        sMimeFile = optarg;
+                        break;
+
+                case 'c':
+                        sCertFile = optarg;
+                        break;
+
+                case 'k':
+                        sKeyFile = optarg;
+                        break;
+
+                case 'l':
+                        sAccessLogFile = optarg;
+                        break;
+
+                case 'B':
+                        sLogPolicy = ACCESS_LOG_BLOCK;
+                        break;
+
+                case 'P':
+                        if(!sProxy && !(sProxy = create_proxy(sUpstreamTimeout)))
+                                return -1;
+                        if(add_proxy_route(sProxy, optarg))
+                                return -1;
+                        break;
+
+                case 't':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || !(sUpstreamTimeout = atoi(optarg)))
+                                return -1;
+                        break;
+
+                case 'V': {
+                        char** specs = (char**)realloc(sHostSpecs, (sNumOfHostSpecs + 1) * sizeof(char*));
+                        if(!specs)
+                                return -1;
+                        sHostSpecs = specs;
+                        sHostSpecs[sNumOfHostSpecs++] = optarg;
+                        break;
+                }
+
+                case 'r': {
+                        int fields = sscanf(optarg, "%lf,%lf", &sClientRate, &sClientBurst);
+                        if(fields < 1 || sClientRate <= 0 || (fields == 2 && sClientBurst < 1))
+                                return -1;
+                        break;
+                }
+
+                case 'n':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || !(sClientConnections = atoi(optarg)))
+                                return -1;
+                        break;
+
+                case 'g':
+                        if(sscanf(optarg, "%d,%d", &sIpv4Prefix, &sIpv6Prefix) < 1 ||
+                           sIpv4Prefix < 0 || sIpv4Prefix > 32 || sIpv6Prefix < 0 || sIpv6Prefix > 128)
+                                return -1;
+                        break;
+
+                case 'w':
+                        sManifestFile = optarg;
+                        break;
+
+                case 'W':
+                        sWalkRoots = 1;
+                        break;
+
+                case 'f': {
+                        //"access-log,count"
+                        char* count = strrchr(optarg, ',');
+                        if(count) {
+                                *count++ = '\0';
+                                if(strspn(count, "0123456789") != strlen(count) || !(sHotFiles = atoi(count)))
+                                        return -1;
+                        }
+                        sHotLog = optarg;
+                        break;
+                }
+
+                case 'b':
+                        sBundleFile = optarg;
+                        break;
+
+                case 'L':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || !*optarg)
+                                return -1;
+                        sReservedThreads = atoi(optarg);
+                        break;
+
+                case 'F':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || !(sFiberThreads = atoi(optarg)))
+                                return -1;
+                        break;
+
+                case 'K':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || !(sIdleTimeout = atoi(optarg)))
+                                return -1;
+                        break;
+
+                case 'S':
+                        if(strspn(optarg, "0123456789") != strlen(optarg) || atoi(optarg) < MIN_STACK_KB)
+                                return -1;
+                        sStackSize = atol(optarg) * 1024;
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(argc - optind != NUM_OF_COMMANDS - 1 || (sKeyFile && !sCertFile) || (sIdleTimeout && !sFiberThreads))
+                return -1;
+        if(sProxy)
+                sProxy->timeout_ms = sUpstreamTimeout; //-t may follow -P
+        argv += optind - 1; //positional arguments at argv[1..3]
+
         if(verifyPort(argv[1]))
                 return -1;
 
@@ -199,14 +736,67 @@ int verifyPort(char* port_string) {
         return 0;
 }
 
+/*********************************/
+/*********************************/
+/*********************************/
+//built-in types, overridden by -m file or by the system and user mime.types
+void initMimeTypes() {
+
+        sMimeTypes = create_mime_table(NULL);
+        if(!sMimeTypes || add_builtin_mime_types(sMimeTypes)) {
+                fprintf(stderr, "initMimeTypes\n");
+                exit(-1);
+        }
+
+        if(sMimeFile) {
+                if(load_mime_types(sMimeTypes, sMimeFile) < 0) {
+                        perror(sMimeFile);
+                        exit(EXIT_FAILURE);
+                }
+                return;
+        }
+
+        load_mime_types(sMimeTypes, SYSTEM_MIME_TYPES);
+
+        char* home = getenv("HOME");
+        if(home) {
+                char userFile[strlen(home) + strlen(USER_MIME_TYPES) + 2];
+                sprintf(userFile, "%s/%s", home, USER_MIME_TYPES);
+                load_mime_types(sMimeTypes, userFile);
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the working directory is the default host, serving requests for any other name
+void initVirtualHosts() {
+
+        char* cwd = getcwd(NULL, 0);
+        if(!cwd || !(sHosts = create_vhost_table(cwd, sMimeTypes))) {
+                fprintf(stderr, "initVirtualHosts\n");
+                exit(-1);
+        }
+        free(cwd);
+
+        int i;
+        for(i = 0; i < sNumOfHostSpecs; i++) {
+                if(add_vhost(sHosts, sHostSpecs[i], sMimeTypes)) {
+                        fprintf(stderr, "invalid virtual host %s\n", sHostSpecs[i]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        free(sHostSpecs);
+        sHostSpecs = NULL;
+}
+
 /*********************************/
 /*********************************/
 /*********************************/
 
 int initServer() {
         debug_print("%s\n", "initServer");
-        int server_socket = 0;
-        initServerSocket(&server_socket);
+        initSignals();
 
         struct sigaction sa;
         memset(&sa, 0, sizeof(sa));
@@ -217,30 +807,170 @@ int initServer() {
                 exit(1);
         }
 
-        threadpool* pool = create_threadpool(sPoolSize);
+        if(sCertFile && !(sTlsContext = create_tls_context(sCertFile, sKeyFile ? sKeyFile : sCertFile))) {
+                fprintf(stderr, "cannot load certificate %s\n", sCertFile);
+                exit(1);
+        }
 
-        int* new_sockfd;
-        int i;
-        for(i = 0; i < sMaxRequests; i++) {
+        if(sUseUring && uring_probe()) {
+                fprintf(stderr, "io_uring is not supported by this kernel, using classic I/O\n");
+                sUseUring = 0;
+        }
 
-                new_sockfd = (int*)calloc(1, sizeof(int));
-                if(!new_sockfd) {
-                        perror("calloc");
-                        continue;
-                }
+        if(sMapFiles && !(sFileCache = create_file_cache(SIZE_FILE_CACHE))) {
+                perror("create_file_cache");
+                exit(1);
+        }
+
+        if(!(sListings = create_flight_group(discardListing, NULL))) {
+                perror("create_flight_group");
+                exit(1);
+        }
+
+        if(!(sTimers = create_timer_wheel(TICK_MS))) {
+                perror("create_timer_wheel");
+                exit(1);
+        }
+
+        if(!(sBuffers = create_buffer_pool(2 * SIZE_REQUEST, MAX_FREE_BUFFERS))) {
+                perror("create_buffer_pool");
+                exit(1);
+        }
+
+        if(sAccessLogFile && !(sAccessLog = create_access_log(sAccessLogFile, SIZE_LOG_RING, sLogPolicy))) {
+                perror("create_access_log");
+                exit(1);
+        }
+
+        if((sClientRate || sClientConnections) &&
+           !(sLimiter = create_rate_limiter(sClientRate, sClientBurst ? sClientBurst : (sClientRate > 1 ? sClientRate : 1),
+                                            sClientConnections, sIpv4Prefix, sIpv6Prefix, SIZE_LIMIT_TABLE))) {
+                perror("create_rate_limiter");
+                exit(1);
+        }
+
+        if(sBundleFile && !(sBundles = create_bundle_store(sBundleFile))) {
+                perror(sBundleFile);
+                exit(1);
+        }
+
+        //a replacement takes the listening socket over only once it is warm
+        warmUp();
+
+        int server_socket = 0;
+        initServerSocket(&server_socket);
+
+        pthread_t handoff_thread;
+        if(sHandoffSocket >= 0 && pthread_create(&handoff_thread, NULL, serveHandoff, &server_socket)) {
+                perror("pthread_create");
+                exit(1);
+        }
+
+        if(notify_ready())
+                perror("notify_ready");
 
-                // NULL - dont care about client's IP & Port
-                if((*new_sockfd = accept(server_socket, NULL, NULL)) < 0) {
-                        perror("accept");
+        //a share of the pool never runs bulk responses
+        int reserved = sReservedThreads >= 0 ? sReservedThreads : sPoolSize / DEFAULT_RESERVED_SHARE;
+        threadpool* pool = create_threadpool_stack(sPoolSize, reserved, sStackSize);
+        if(!pool) {
+                perror("create_threadpool_stack");
+                exit(1);
+        }
+        sPool = pool;
+        if(sFiberThreads)
+                startSchedulers(pool, reserved);
+
+        //what the server holds before its first connection
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long baselineKb = usage.ru_maxrss;
+
+        int i = sUseUring ? acceptWithUring(server_socket, pool) : 0;
+        while(i < sMaxRequests && !isDraining()) {
+
+                struct sockaddr_storage addr;
+                int sockfd = acceptConnection(server_socket, &addr);
+                i++;
+                if(sockfd < 0) {
+                        if(!isDraining())
+                                perror("accept");
                         continue;
                 }
 
-                dispatch(pool, handler, (void*)new_sockfd);
+                //the rest of the backlog goes to the pool together
+                batch_job_t batch[SIZE_ACCEPT_BATCH];
+                int count = 0;
+                while(1) {
+                        count += !admitConnection(sockfd, &addr, &batch[count]);
+                        if(count == SIZE_ACCEPT_BATCH || i == sMaxRequests)
+                                break;
+
+                        socklen_t length = sizeof(addr);
+                        if((sockfd = accept(server_socket, (struct sockaddr*)&addr, &length)) < 0)
+                                break; //empty, an error is met again by acceptConnection
+                        i++;
+                }
 
+                dispatchConnections(pool, batch, count);
         }
 
+        //the handoff thread must not send a socket that is closed (or reused).
+        //draining also closes kept-alive connections that have no request waiting.
+        startDrain();
+        if(sHandoffSocket >= 0)
+                pthread_join(handoff_thread, NULL);
+
+        //the replacement (if any) keeps accepting on its copy of the socket
         close(server_socket);
+        if(sHandoffSocket >= 0 && !__atomic_load_n(&sHandedOff, __ATOMIC_ACQUIRE))
+                unlink(sHandoffPath);
+
+        //in-flight and queued requests are finished before the pool goes away.
+        //fibers may still detach to the pool until their schedulers stopped.
+        if(sSchedulers)
+                stopSchedulers();
         destroy_threadpool(pool);
+        if(sSchedulers) {
+                int j;
+                for(j = 0; j < sFiberThreads; j++)
+                        destroy_fiber_scheduler(sSchedulers[j]);
+                free(sSchedulers);
+        }
+        destroy_timer_wheel(sTimers);
+
+        //a late SIGHUP or SIGUSR1 finds nothing left to rotate or reload
+        pthread_mutex_lock(&sSignalLock);
+        access_log_t* log = sAccessLog;
+        bundle_store_t* bundles = sBundles;
+        sAccessLog = NULL;
+        sBundles = NULL;
+        pthread_mutex_unlock(&sSignalLock);
+
+        if(log)
+                destroy_access_log(log);
+        if(sFileCache)
+                destroy_file_cache(sFileCache);
+        destroy_flight_group(sListings);
+        if(sProxy)
+                destroy_proxy(sProxy);
+        if(sLimiter)
+                destroy_rate_limiter(sLimiter);
+        if(sManifest)
+                destroy_manifest(sManifest);
+        if(bundles)
+                destroy_bundle_store(bundles);
+        destroy_buffer_pool(sBuffers);
+
+        char metrics[SIZE_RESPONSE];
+        format_metrics(metrics, sizeof(metrics));
+        fprintf(stderr, "%s", metrics);
+
+        //resident memory the busiest moment added, spread over its connections.
+        //socket buffers are the kernel's and not included.
+        getrusage(RUSAGE_SELF, &usage);
+        int peak = __atomic_load_n(&sPeakConnections, __ATOMIC_RELAXED);
+        fprintf(stderr, "peak_connections %d\npeak_rss_kb %ld\nbytes_per_connection %ld\n", peak, usage.ru_maxrss,
+                peak ? (usage.ru_maxrss - baselineKb) * 1024 / peak : 0);
         return 0;
 }
 
@@ -248,139 +978,1362 @@ int initServer() {
 /*********************************/
 /*********************************/
 
+//takes the listening socket over from a running server if there is one at
+//sHandoffPath, binds a new one otherwise
 void initServerSocket(int* sockfd) {
 
         debug_print("\t%s\n", "initServerSocket");
-        if((*sockfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-                perror("socket");
-                exit(-1);
-        }
-
-        struct sockaddr_in srv;
-        srv.sin_family = AF_INET;
-        srv.sin_port = htons(sPort);
-        srv.sin_addr.s_addr = htonl(INADDR_ANY);
-
-        if(bind(*sockfd, (struct sockaddr*) &srv, sizeof(srv)) < 0) {
-                perror("bind");
-                exit(1);
-        }
+        if(sHandoffPath && (*sockfd = receive_listener(sHandoffPath)) >= 0) {
 
-        if(listen(*sockfd, 5) < 0) {
-                perror("listen");
-                exit(1);
-        }
-
-
-}
+                debug_print("\treceived listening socket %d\n", *sockfd);
 
-/******************************************************************************/
-/******************************************************************************/
-/*********************** Handler Method - Thread ******************************/
-/******************************************************************************/
-/******************************************************************************/
+        } else {
 
-int handler(void* arg) {
-        debug_print("handler - tid = %d\n", (int)pthread_self());
+                if((*sockfd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+                        perror("socket");
+                        exit(-1);
+                }
 
-        if(!arg)
-                return -1;
+                //with -H, SO_REUSEPORT lets a new binary bind next to a running
+                //one. without it a second server fails with EADDRINUSE.
+                int on = 1;
+                if(setsockopt(*sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+                   (sHandoffPath && setsockopt(*sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+                        perror("setsockopt");
+                        exit(1);
+                }
 
-        int* temp = (int*)(arg);
-        int sockfd = *temp;
-        free(arg);
+                struct sockaddr_in srv;
+                srv.sin_family = AF_INET;
+                srv.sin_port = htons(sPort);
+                srv.sin_addr.s_addr = htonl(INADDR_ANY);
 
+                if(bind(*sockfd, (struct sockaddr*) &srv, sizeof(srv)) < 0) {
+                        perror("bind");
+                        exit(1);
+                }
 
-        response_info_t* resp_info = (response_info_t*)calloc(1, sizeof(response_info_t));
-        if(!resp_info) {
-                sendResponse(sockfd, CODE_INTERNAL_ERROR, NULL, NULL);
-                close(sockfd);
-                return -1;
+                //connections keep queueing while a server drains and its replacement starts
+                if(listen(*sockfd, SOMAXCONN) < 0) {
+                        perror("listen");
+                        exit(1);
+                }
         }
-        initResponseInfo(resp_info);
 
-        int return_code;
+        //when lanes are picked, a connection is accepted once its request arrived.
+        //fibers take connections unpeeked and TLS requests can't be peeked at,
+        //so then it is not delayed. set either way, a taken over socket keeps
+        //what its last owner set
+        int deferSeconds = !sFiberThreads && !sTlsContext;
+        if(setsockopt(*sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(deferSeconds)) < 0)
+                perror("setsockopt TCP_DEFER_ACCEPT");
+
+        //accept never blocks, so draining can always interrupt the acceptor
+        if(fcntl(*sockfd, F_SETFL, fcntl(*sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+                perror("fcntl");
+                exit(1);
+        }
 
-        char request[SIZE_REQUEST];
-        char path[SIZE_REQUEST];
-        memset(request, 0, sizeof(request));
-        memset(path, 0, sizeof(path));
+        if(sHandoffPath && (sHandoffSocket = create_handoff_socket(sHandoffPath)) < 0) {
+                perror(sHandoffPath);
+                exit(1);
+        }
+}
 
-        if((return_code = readRequest(request, sockfd)) || (return_code = parseRequest(request, path))) {
-                if(return_code != CODE_EMPTY_REQUEST)
-                        sendResponse(sockfd, return_code, NULL, resp_info);
+/*********************************/
+/*********************************/
+/*********************************/
+//fills the manifest and pre-faults the hot files. runs before the server
+//listens (or takes the socket over), so it is only ever seen warm
+void warmUp() {
 
-                freeResponseInfo(resp_info);
-                close(sockfd);
-                return -1;
+        if((sManifestFile || sWalkRoots) && !(sManifest = create_manifest())) {
+                perror("create_manifest");
+                exit(1);
         }
-        debug_print("handler - request = %s\n", request);
 
-        if((return_code =  parsePath(path, resp_info))) {
-                sendResponse(sockfd, return_code, path, resp_info);
-                freeResponseInfo(resp_info);
-                close(sockfd);
-                return -1;
+        vhost_t* host = sHosts->default_host;
+        if(sManifestFile && load_manifest(sManifest, host->root, host->mime, sManifestFile) < 0) {
+                perror(sManifestFile);
+                exit(1);
         }
-        debug_print("handler - path = %s\n", path);
 
-        if(sendResponse(sockfd, CODE_OK, path, resp_info)) {
-                sendResponse(sockfd, CODE_INTERNAL_ERROR, NULL, resp_info);
-                freeResponseInfo(resp_info);
-                close(sockfd);
-                return -1;
-        }
+        //the default host, then every virtual host
+        int i;
+        for(i = -1; sWalkRoots && i < sHosts->capacity; i++) {
 
+                host = i < 0 ? sHosts->default_host : sHosts->entries[i];
+                if(host && build_manifest(sManifest, host->root, host->mime, WARMUP_THREADS) < 0) {
+                        fprintf(stderr, "cannot walk %s\n", host->root);
+                        exit(1);
+                }
+        }
 
-        freeResponseInfo(resp_info);
-        close(sockfd);
-        return 0;
+        if(sHotLog)
+                prefaultHotFiles();
 }
 
-/******************************************************************************/
-/******************************************************************************/
-/*************************** Request Methods **********************************/
-/******************************************************************************/
-/******************************************************************************/
-
-//returns 0 on success, error number on failure
-int readRequest(char* request, int sockfd) {
-        debug_print("%s\n", "readRequest");
+/*********************************/
+/*********************************/
+/*********************************/
+//pre-faults the sHotFiles paths most often answered with a 200 in an
+//earlier access log
+void prefaultHotFiles() {
 
-        int nBytes;
-        char buffer[SIZE_READ_BUFFER + 1];
-        memset(buffer, 0, sizeof(buffer));
-        int bytes_read = 0;
+        FILE* fp = fopen(sHotLog, "r");
+        if(!fp) {
+                perror(sHotLog); //nothing logged yet, start cold
+                return;
+        }
 
-        while((nBytes = read(sockfd, buffer, SIZE_READ_BUFFER)) > 0) {
+        hot_file_t* files = NULL;
+        int count = 0;
+        int capacity = 0;
+        char line[SIZE_LOG_LINE];
+        while(fgets(line, sizeof(line), fp)) {
 
-                if(nBytes < 0) {
-                        debug_print("\t%s\n", "reading request failed");
-                        return CODE_INTERNAL_ERROR;
+                char* path = strstr(line, LOG_PATH_FIELD);
+                if(!path || !strstr(line, LOG_STATUS_OK))
+                        continue;
+                path += strlen(LOG_PATH_FIELD);
+
+                //undo the JSON escaping in place. a path with a control
+                //character (\u escape) is not worth warming
+                char* in = path;
+                char* out = path;
+                while(*in && *in != '"') {
+                        if(*in == '\\' && in[1] != '"' && in[1] != '\\')
+                                break;
+                        if(*in == '\\')
+                                in++;
+                        *out++ = *in++;
                 }
+                if(*in != '"')
+                        continue;
+                *out = '\0';
 
-                bytes_read += nBytes;
-                strncat(request, buffer, nBytes);
-
-                //Server implementation reads only first line of the request.
-                if(strchr(buffer, '\r'))
+                if(count == capacity) {
+                        capacity = capacity ? capacity * 2 : 1024;
+                        hot_file_t* grown = (hot_file_t*)realloc(files, capacity * sizeof(hot_file_t));
+                        if(!grown)
+                                break;
+                        files = grown;
+                }
+                if(!(files[count].path = strdup(path)))
                         break;
+                files[count++].hits = 1;
         }
-        debug_print("\tbytes read = %d\n", bytes_read);
-        if(!bytes_read)
-                return CODE_EMPTY_REQUEST;
+        fclose(fp);
 
-        return 0;
+        //equal paths next to each other, counted, then the most hit first
+        int i;
+        int unique = 0;
+        qsort(files, count, sizeof(hot_file_t), compareHotFiles);
+        for(i = 0; i < count; i++) {
+                if(unique && !strcmp(files[unique - 1].path, files[i].path)) {
+                        files[unique - 1].hits++;
+                        free(files[i].path);
+                } else {
+                        files[unique++] = files[i];
+                }
+        }
+        qsort(files, unique, sizeof(hot_file_t), compareHotFiles);
+
+        for(i = 0; i < unique; i++) {
+                if(i < sHotFiles)
+                        prefaultFile(files[i].path);
+                free(files[i].path);
+        }
+        free(files);
 }
 
 /*********************************/
 /*********************************/
 /*********************************/
+//brings a file of the default host into memory - the file cache with -M,
+//the page cache otherwise. path is checked like a request's
+void prefaultFile(char* path) {
 
-//returns 0 on success, error number on failure
-int parseRequest(char* request, char* path) {
-        debug_print("%s\n", "parseRequest START");
-        char method[4];
+        response_info_t resp_info;
+        initResponseInfo(&resp_info);
+        resp_info.host = sHosts->default_host;
+
+        //logged paths are canonical already
+        char absPath[resp_info.host->root_length + strlen(path) + 1];
+        sprintf(absPath, "%s%s", resp_info.host->root, path);
+
+        struct stat st;
+        if(statPath(&resp_info, absPath, &st) || !S_ISREG(st.st_mode) || checkPermissions(absPath, &st, &resp_info))
+                return;
+        debug_print("prefaultFile - %s\n", absPath);
+
+        mapped_file_t* file = sFileCache ? acquire_mapped_file(sFileCache, absPath, &st, 1) : NULL;
+        if(file) {
+
+                //touch every page, so no request takes the faults
+                volatile char sum = 0;
+                long page = sysconf(_SC_PAGESIZE);
+                size_t offset;
+                for(offset = 0; offset < file->size; offset += page)
+                        sum += file->data[offset];
+
+                release_mapped_file(sFileCache, file);
+                return;
+        }
+
+        int fd = openat(resp_info.host->root_fd, relativePath(&resp_info, absPath), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+                return;
+        readahead(fd, 0, st.st_size);
+        close(fd);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//by hits, most first, then by path
+int compareHotFiles(const void* a, const void* b) {
+
+        const hot_file_t* first = (const hot_file_t*)a;
+        const hot_file_t* second = (const hot_file_t*)b;
+        if(first->hits != second->hits)
+                return second->hits - first->hits;
+
+        return strcmp(first->path, second->path);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//addr is set to the client's address.
+//returns a connected socket, -1 on failure or once draining started
+int acceptConnection(int server_socket, struct sockaddr_storage* addr) {
+
+        while(1) {
+
+                socklen_t length = sizeof(*addr);
+                int sockfd = accept(server_socket, (struct sockaddr*)addr, &length);
+                if(sockfd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                        return sockfd;
+
+                //queue is empty - sleep until a connection or the drain
+                struct pollfd fds[2];
+                fds[0].fd = server_socket;
+                fds[0].events = POLLIN;
+                fds[1].fd = sWakePipe[0];
+                fds[1].events = POLLIN;
+                if(poll(fds, 2, -1) < 0 && errno != EINTR)
+                        return -1;
+
+                if(fds[1].revents)
+                        return -1;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sets job to handle the connection, unless its client is over its limits.
+//returns 0 if job was set, -1 if the connection was turned away
+int admitConnection(int sockfd, struct sockaddr_storage* addr, batch_job_t* job) {
+
+        int admitted = 0;
+        if(sLimiter && limit_admit(sLimiter, (struct sockaddr*)addr, &admitted) != LIMIT_OK) {
+                rejectConnection(sockfd);
+                return -1;
+        }
+
+        client_t* client = (client_t*)malloc(sizeof(client_t));
+        if(!client) {
+                perror("malloc");
+                if(admitted)
+                        limit_release(sLimiter, (struct sockaddr*)addr);
+                close(sockfd);
+                return -1;
+        }
+        client->sockfd = sockfd;
+        client->addr = *addr;
+        client->kept = 0;
+        client->admitted = admitted;
+        countConnection(1);
+
+        //fibers never block on a slow response, there is no lane to pick
+        job->lane = sSchedulers ? LANE_INTERACTIVE : classifyConnection(sockfd);
+        job->routine = handler;
+        job->arg = (void*)client;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//connections the pool did not take are closed. with -F they are spread
+//over the fiber schedulers in turn instead, and never block.
+void dispatchConnections(threadpool* pool, batch_job_t* batch, int count) {
+
+        int i;
+        if(sSchedulers) {
+                for(i = 0; i < count; i++) {
+
+                        client_t* client = (client_t*)batch[i].arg;
+                        fiber_scheduler_t* scheduler = sSchedulers[sNextScheduler++ % sFiberThreads];
+                        if(fcntl(client->sockfd, F_SETFL, fcntl(client->sockfd, F_GETFL) | O_NONBLOCK) < 0 ||
+                           spawn_fiber(scheduler, handler, client))
+                                abandonConnection(client);
+                }
+                return;
+        }
+
+        for(i = dispatch_batch(pool, batch, count); i < count; i++)
+                abandonConnection((client_t*)batch[i].arg);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void abandonConnection(client_t* client) {
+
+        if(client->admitted)
+                limit_release(sLimiter, (struct sockaddr*)&client->addr);
+        close(client->sockfd);
+        free(client);
+        countConnection(-1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//keeps track of the open connections and their peak, for the memory report
+void countConnection(int change) {
+
+        int open = __atomic_add_fetch(&sOpenConnections, change, __ATOMIC_RELAXED);
+        int peak = __atomic_load_n(&sPeakConnections, __ATOMIC_RELAXED);
+        while(open > peak && !__atomic_compare_exchange_n(&sPeakConnections, &peak, open, 0,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//each scheduler holds a shared pool thread for good. one thread at least
+//is left for the fibers that detach.
+void startSchedulers(threadpool* pool, int reserved) {
+
+        if(sFiberThreads > sPoolSize - reserved || sFiberThreads >= sPoolSize) {
+                fprintf(stderr, "-F: at most %d fiber threads with this pool\n",
+                        sPoolSize - reserved < sPoolSize - 1 ? sPoolSize - reserved : sPoolSize - 1);
+                exit(1);
+        }
+
+        sSchedulers = (fiber_scheduler_t**)calloc(sFiberThreads, sizeof(fiber_scheduler_t*));
+        if(!sSchedulers) {
+                perror("calloc");
+                exit(1);
+        }
+
+        //reserved threads never take bulk jobs
+        int i;
+        for(i = 0; i < sFiberThreads; i++) {
+                if(!(sSchedulers[i] = create_fiber_scheduler(sStackSize ? sStackSize : SIZE_FIBER_STACK, detachToPool))) {
+                        perror("create_fiber_scheduler");
+                        exit(1);
+                }
+                dispatch_lane(pool, LANE_BULK, run_fiber_scheduler, sSchedulers[i]);
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns once every scheduler's fibers ended or detached
+void stopSchedulers() {
+
+        int i;
+        for(i = 0; i < sFiberThreads; i++)
+                stop_fiber_scheduler(sSchedulers[i]);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs on the fiber's scheduler. a pool that is going away finishes it there.
+void detachToPool(fiber_t* fiber) {
+
+        batch_job_t job;
+        job.lane = LANE_INTERACTIVE;
+        job.routine = runDetached;
+        job.arg = fiber;
+        if(!dispatch_batch(sPool, &job, 1))
+                run_detached_fiber(fiber);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int runDetached(void* fiber) {
+
+        run_detached_fiber((fiber_t*)fiber);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//picks the lane of a new connection by the expected size of its response:
+//request targets recently answered with SIZE_BULK_RESPONSE bytes or more,
+//or files that large in the manifest, are bulk. the request is peeked at
+//without waiting - one that has not arrived, or is encrypted, is interactive.
+int classifyConnection(int sockfd) {
+
+        if(sTlsContext)
+                return LANE_INTERACTIVE;
+
+        char peek[SIZE_PEEK + 1];
+        int length = recv(sockfd, peek, SIZE_PEEK, MSG_PEEK | MSG_DONTWAIT);
+        int target_length;
+        const char* target = length > 0 ? findTarget(peek, length, &target_length) : NULL;
+        if(!target)
+                return LANE_INTERACTIVE;
+
+        //known by its canonical path, however it is spelled
+        char path[SIZE_PEEK];
+        memcpy(path, target, target_length);
+        path[target_length] = '\0';
+        if(normalizePath(path))
+                return LANE_INTERACTIVE;
+
+        unsigned hash = hashTarget(path, strlen(path));
+        int bulk = __atomic_load_n(&sBulkTargets[hash & (SIZE_BULK_TABLE - 1)], __ATOMIC_RELAXED) == hash;
+
+        //the manifest is looked up under the request's host. with virtual
+        //hosts a Host header past the peeked bytes leaves it unknown
+        if(!bulk && sManifest) {
+                peek[length] = '\0';
+                int host_length;
+                char* name = findHeader(peek, "Host", &host_length);
+                const vhost_t* host = name ? lookup_vhost(sHosts, name, host_length) :
+                                      sHosts->count ? NULL : sHosts->default_host;
+                if(host) {
+                        char absPath[host->root_length + strlen(path) + 1];
+                        sprintf(absPath, "%s%s", host->root, path);
+                        const manifest_entry_t* entry = lookup_manifest(sManifest, absPath, NULL);
+                        bulk = entry && entry->size >= SIZE_BULK_RESPONSE;
+                }
+        }
+
+        if(!bulk)
+                return LANE_INTERACTIVE;
+
+        metric_inc(METRIC_BULK);
+        return LANE_BULK;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//remembers whether the response for the canonical path (size bytes) was
+//bulk, for classifyConnection. a path whose response shrank is forgotten.
+void learnResponseSize(const char* path, long size) {
+
+        unsigned hash = hashTarget(path, strlen(path));
+        unsigned* slot = &sBulkTargets[hash & (SIZE_BULK_TABLE - 1)];
+        if(size >= SIZE_BULK_RESPONSE)
+                __atomic_store_n(slot, hash, __ATOMIC_RELAXED);
+        else if(__atomic_load_n(slot, __ATOMIC_RELAXED) == hash)
+                __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the request-target of the request line at the start of buf
+//(length bytes) and sets its length, NULL if the line is incomplete
+const char* findTarget(const char* buf, int length, int* target_length) {
+
+        const char* space = memchr(buf, ' ', length);
+        if(!space)
+                return NULL;
+
+        const char* target = space + 1;
+        const char* end = memchr(target, ' ', buf + length - target);
+        if(!end || end == target)
+                return NULL;
+
+        *target_length = end - target;
+        return target;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//FNV-1a, never 0 - an empty slot of sBulkTargets
+unsigned hashTarget(const char* target, int length) {
+
+        unsigned hash = fnv1a(target, length);
+        return hash ? hash : 1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//answers 429 on the acceptor, without taking a worker. the response fits
+//the empty send buffer of a new socket, so it never blocks. the socket is
+//closed once the wheel finds the client's request there to drop - closing
+//it unread would reset the connection and could lose the response.
+void rejectConnection(int sockfd) {
+
+        metric_inc(METRIC_REJECTED);
+        rejected_t* rejected = (rejected_t*)malloc(sizeof(rejected_t));
+        if(!rejected || sendStaticResponse(sockfd, CODE_TOO_MANY_REQUESTS, NULL)) {
+                free(rejected);
+                close(sockfd);
+                return;
+        }
+
+        shutdown(sockfd, SHUT_WR);
+        rejected->sockfd = sockfd;
+        init_timer(&rejected->timer, closeRejected, rejected);
+        add_timer(sTimers, &rejected->timer, REJECT_LINGER_MS);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs on the wheel thread
+int closeRejected(void* arg) {
+
+        rejected_t* rejected = (rejected_t*)arg;
+        char buf[SIZE_REQUEST];
+        while(recv(rejected->sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+                ;
+        close(rejected->sockfd);
+        free(rejected);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//signals are handled synchronously by one thread. every other thread
+//inherits the blocked mask, so it must be set before any thread starts.
+void initSignals() {
+
+        if(pipe2(sWakePipe, O_CLOEXEC) < 0) {
+                perror("pipe");
+                exit(1);
+        }
+
+        sigset_t* set = (sigset_t*)malloc(sizeof(sigset_t));
+        if(!set) {
+                perror("malloc");
+                exit(1);
+        }
+        sigemptyset(set);
+        sigaddset(set, SIGTERM);
+        sigaddset(set, SIGINT);
+        sigaddset(set, SIGHUP);
+        sigaddset(set, SIGUSR1);
+
+        pthread_t thread;
+        if(pthread_sigmask(SIG_BLOCK, set, NULL) || pthread_create(&thread, NULL, handleSignals, set)) {
+                perror("initSignals");
+                exit(1);
+        }
+        pthread_detach(thread);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//SIGTERM/SIGINT start a graceful drain, a second one exits right away.
+//SIGHUP rotates the access log, SIGUSR1 swaps in the bundle on disk
+void* handleSignals(void* arg) {
+
+        sigset_t* set = (sigset_t*)arg;
+        while(1) {
+
+                int sig;
+                if(sigwait(set, &sig))
+                        continue;
+                debug_print("handleSignals - %d\n", sig);
+
+                if(sig == SIGHUP) {
+                        pthread_mutex_lock(&sSignalLock);
+                        if(sAccessLog)
+                                rotate_access_log(sAccessLog);
+                        pthread_mutex_unlock(&sSignalLock);
+                        continue;
+                }
+
+                if(sig == SIGUSR1) {
+                        pthread_mutex_lock(&sSignalLock);
+                        if(sBundles && reload_bundle(sBundles))
+                                fprintf(stderr, "server: %s not reloaded, still serving the old bundle\n", sBundleFile);
+                        pthread_mutex_unlock(&sSignalLock);
+                        continue;
+                }
+
+                if(isDraining()) {
+                        fprintf(stderr, "server: forced exit\n");
+                        exit(EXIT_FAILURE);
+                }
+
+                fprintf(stderr, "server: draining\n");
+                startDrain();
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//hands the listening socket to the first replacement that asks, then drains
+void* serveHandoff(void* arg) {
+
+        int server_socket = *(int*)arg;
+        while(!isDraining()) {
+
+                //the wake pipe stays readable once draining started, the
+                //listening socket may be closed right after
+                struct pollfd fds[2];
+                fds[0].fd = sHandoffSocket;
+                fds[0].events = POLLIN;
+                fds[1].fd = sWakePipe[0];
+                fds[1].events = POLLIN;
+                if(poll(fds, 2, -1) < 0 || fds[1].revents || !fds[0].revents)
+                        continue;
+
+                if(send_listener(sHandoffSocket, server_socket))
+                        continue;
+
+                __atomic_store_n(&sHandedOff, 1, __ATOMIC_RELEASE);
+                fprintf(stderr, "server: listening socket handed over, draining\n");
+                startDrain();
+        }
+
+        close(sHandoffSocket);
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//stops the acceptor, requests already accepted are still answered
+void startDrain() {
+
+        if(__atomic_exchange_n(&sDraining, 1, __ATOMIC_ACQ_REL))
+                return;
+
+        if(write(sWakePipe[1], "x", 1) < 0)
+                perror("write");
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int isDraining() {
+        return __atomic_load_n(&sDraining, __ATOMIC_ACQUIRE);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//accepts with a single multishot accept, one completion per connection.
+//returns number of connections handled, the classic loop takes over from
+//there if multishot accept is unavailable or the ring fails.
+int acceptWithUring(int server_socket, threadpool* pool) {
+        debug_print("\t%s\n", "acceptWithUring");
+
+        uring_t* ring = create_uring(URING_ENTRIES, 0);
+        if(!ring)
+                return 0;
+
+        //completes when draining starts
+        struct io_uring_sqe* sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = sWakePipe[0];
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_WAKE;
+
+        int i = 0;
+        int armed = 0;
+        int cancelled = 0;
+        int supported = 1;
+        while(supported) {
+
+                //on the way out, collect what the accept still delivers
+                int stop = i >= sMaxRequests || isDraining();
+                if(stop && !armed)
+                        break;
+
+                if(stop && !cancelled) {
+                        sqe = uring_get_sqe(ring);
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = URING_ACCEPT;
+                        sqe->user_data = URING_CANCEL;
+                        cancelled = 1;
+                }
+
+                if(!stop && !armed) {
+                        sqe = uring_get_sqe(ring);
+                        sqe->opcode = IORING_OP_ACCEPT;
+                        sqe->fd = server_socket;
+                        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                        sqe->user_data = URING_ACCEPT;
+                        armed = 1;
+                }
+
+                if(uring_submit_and_wait(ring, 1) < 0)
+                        break;
+
+                //every connection this round reaped goes to the pool together
+                batch_job_t batch[SIZE_ACCEPT_BATCH];
+                int count = 0;
+                struct io_uring_cqe* cqe;
+                while((cqe = uring_peek_cqe(ring))) {
+
+                        int res = cqe->res;
+                        int tag = cqe->user_data;
+                        unsigned flags = cqe->flags;
+                        uring_cqe_seen(ring);
+
+                        if(tag != URING_ACCEPT)
+                                continue; //woken up to stop
+
+                        if(!(flags & IORING_CQE_F_MORE))
+                                armed = 0; //terminated, rearm on the next round
+
+                        //kernels before multishot accept reject the flag
+                        if(res == -EINVAL && !i) {
+                                supported = 0;
+                                break;
+                        }
+
+                        if(res == -ECANCELED)
+                                continue;
+
+                        if(i == sMaxRequests) {
+                                if(res >= 0)
+                                        close(res);
+                                continue;
+                        }
+                        i++;
+
+                        if(res < 0) {
+                                errno = -res;
+                                perror("accept");
+                                continue;
+                        }
+
+                        //multishot accept has no room for the address, only the limiter needs it
+                        struct sockaddr_storage addr;
+                        socklen_t length = sizeof(addr);
+                        addr.ss_family = AF_UNSPEC;
+                        if(sLimiter)
+                                getpeername(res, (struct sockaddr*)&addr, &length);
+                        count += !admitConnection(res, &addr, &batch[count]);
+                        if(count == SIZE_ACCEPT_BATCH) {
+                                dispatchConnections(pool, batch, count);
+                                count = 0;
+                        }
+                }
+
+                dispatchConnections(pool, batch, count);
+        }
+
+        destroy_uring(ring);
+        return i;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*********************** Handler Method - Thread ******************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int handler(void* arg) {
+        debug_print("handler - tid = %d\n", (int)pthread_self());
+
+        if(!arg)
+                return -1;
+
+        client_t* client = (client_t*)arg;
+        int sockfd = client->sockfd;
+
+        if(client->kept) {
+                cancel_timer(sTimers, &client->idle);
+
+                //a stopping scheduler starts every parked connection
+                char first;
+                if(isDraining() && recv(sockfd, &first, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+                        abandonConnection(client);
+                        return 0;
+                }
+        } else {
+                metric_inc(METRIC_CONNECTIONS);
+        }
+
+        conn_t conn;
+        openConnection(&conn, sockfd);
+        conn.peer = client->addr;
+        conn.admitted = client->admitted;
+        conn.client = client;
+        if(acceptTls(&conn)) {
+                closeConnection(&conn);
+                return -1;
+        }
+
+        //only taken once there is something to read
+        response_info_t* resp_info = (response_info_t*)calloc(1, sizeof(response_info_t));
+        if(!resp_info || !(conn.buffer = take_buffer(sBuffers))) {
+                conn.status = CODE_INTERNAL_ERROR;
+                sendResponse(sockfd, CODE_INTERNAL_ERROR, NULL, NULL);
+                free(resp_info);
+                closeConnection(&conn);
+                return -1;
+        }
+        initResponseInfo(resp_info);
+
+        int return_code;
+
+        char* request = conn.buffer;
+        char* path = conn.buffer + SIZE_REQUEST;
+        request[0] = '\0';
+        path[0] = '\0';
+
+        int length = 0;
+        return_code = readRequest(request, sockfd, &length);
+        startWriting(&conn);
+        conn.request = request;
+        if(!return_code && client->kept)
+                metric_inc(METRIC_KEPT_ALIVE);
+
+        //h2c with prior knowledge - the connection is served as a whole here
+        if(!return_code && !conn.tls && !strncmp(request, H2_REQUEST_LINE, strlen(H2_REQUEST_LINE))) {
+                leaveScheduler(&conn);
+                tH2Peer = &conn.peer;
+                tH2Prepaid = 1;
+                return_code = serve_h2(sockfd, request, length, serveH2Request);
+                tH2Peer = NULL;
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return return_code;
+        }
+
+        if(return_code || (return_code = parseRequest(request, path, resp_info))) {
+                if(return_code != CODE_EMPTY_REQUEST) {
+                        conn.status = return_code;
+                        sendResponse(sockfd, return_code, NULL, resp_info);
+                }
+
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return -1;
+        }
+        debug_print("handler - request = %s\n", request);
+        conn.path = path;
+
+        proxy_route_t* route;
+        if(sProxy && (route = match_proxy_route(sProxy, path))) {
+                leaveScheduler(&conn);
+                return_code = proxyRequest(&conn, route, request, length);
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return return_code;
+        }
+
+        if(sBundles) {
+                return_code = serveFromBundle(&conn, path, request);
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return return_code;
+        }
+
+        int host_length;
+        char* host = findHeader(request, "Host", &host_length);
+        resp_info->host = host ? lookup_vhost(sHosts, host, host_length) : sHosts->default_host;
+
+        if((return_code =  parsePath(path, resp_info))) {
+                conn.status = return_code;
+                sendResponse(sockfd, return_code, path, resp_info);
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return -1;
+        }
+        debug_print("handler - path = %s\n", path);
+
+        conn.status = CODE_OK;
+        resp_info->keepAlive = wantsKeepAlive(request, length, resp_info) && !conn.tls;
+        if(sendResponse(sockfd, CODE_OK, path, resp_info)) {
+                conn.status = CODE_INTERNAL_ERROR;
+                sendResponse(sockfd, CODE_INTERNAL_ERROR, NULL, resp_info);
+                freeResponseInfo(resp_info);
+                closeConnection(&conn);
+                return -1;
+        }
+
+        int keepAlive = resp_info->keepAlive;
+        freeResponseInfo(resp_info);
+        if(!keepAlive || parkConnection(&conn))
+                closeConnection(&conn);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//arms the header deadline
+void openConnection(conn_t* conn, int sockfd) {
+
+        conn->sockfd = sockfd;
+        conn->stage = CONN_READING;
+        conn->acked = 0;
+        conn->tls = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &conn->start);
+        conn->status = 0;
+        conn->request = NULL;
+        conn->path = NULL;
+        conn->client = NULL;
+        conn->buffer = NULL;
+        tBytesSent = 0;
+        init_timer(&conn->timer, expireConnection, conn);
+        add_timer(sTimers, &conn->timer, TIMEOUT_HEADER_MS);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//request was read, from now on only a stalled client times out
+void startWriting(conn_t* conn) {
+
+        conn->stage = CONN_WRITING;
+        add_timer(sTimers, &conn->timer, TIMEOUT_WRITE_STALL_MS);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the timer goes first - it must not shut down an fd that was reused
+void endRequest(conn_t* conn) {
+
+        cancel_timer(sTimers, &conn->timer);
+        if(conn->status == CODE_OK && conn->path && !conn->tls)
+                learnResponseSize(conn->path, tBytesSent);
+        if(conn->status) {
+                const char* method = conn->request ? conn->request : "";
+                logRequest(method, strcspn(method, " \r\n"), conn->path && conn->path[0] ? conn->path : NULL,
+                           conn->status, tBytesSent, &conn->start);
+        }
+        if(conn->buffer) {
+                release_buffer(sBuffers, conn->buffer);
+                conn->buffer = NULL;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void closeConnection(conn_t* conn) {
+
+        endRequest(conn);
+        if(conn->tls) {
+                tls_close(conn->tls);
+                tTls = NULL;
+        }
+        close(conn->sockfd);
+        if(conn->admitted)
+                limit_release(sLimiter, (struct sockaddr*)&conn->peer);
+        free(conn->client);
+        countConnection(-1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs on the wheel thread. shutting the socket down wakes the handler up
+//from whatever read/write it is blocked in, and it closes the connection.
+int expireConnection(void* arg) {
+
+        conn_t* conn = (conn_t*)arg;
+        if(conn->stage == CONN_WRITING) {
+
+                //a slow reader that still makes progress gets another period
+                struct tcp_info info;
+                socklen_t length = sizeof(info);
+                if(!getsockopt(conn->sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) &&
+                   length >= offsetof(struct tcp_info, tcpi_bytes_acked) + sizeof(info.tcpi_bytes_acked) &&
+                   info.tcpi_bytes_acked != conn->acked) {
+                        conn->acked = info.tcpi_bytes_acked;
+                        return TIMEOUT_WRITE_STALL_MS;
+                }
+                metric_inc(METRIC_TIMEOUT_WRITE);
+
+        } else {
+                metric_inc(METRIC_TIMEOUT_HEADER);
+        }
+
+        debug_print("expireConnection - %d, stage %d\n", conn->sockfd, conn->stage);
+        shutdown(conn->sockfd, SHUT_RDWR);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//with -K a plain connection served by a fiber stays open if its client
+//asked for it and sent nothing past the request yet. rate limited ones
+//close, their slot is per connection.
+//returns 1 if the connection can be kept alive, 0 otherwise
+int wantsKeepAlive(char* request, int length, response_info_t* resp_info) {
+
+        if(!sIdleTimeout || sLimiter || !current_fiber() || isDraining())
+                return 0;
+
+        char* end = strstr(request, "\r\n\r\n");
+        if(!end || end + 4 != request + length)
+                return 0;
+
+        int value_length;
+        char* value = findHeader(request, "Connection", &value_length);
+        if(resp_info->isHttp11)
+                return !value || value_length != strlen("close") || strncasecmp(value, "close", value_length);
+        return value && value_length == strlen("keep-alive") && !strncasecmp(value, "keep-alive", value_length);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//ends the request and leaves only the client record waiting for the next
+//one: no stack, no buffers. the handler starts over once it arrives.
+//returns 0 if parked, -1 if the connection must be closed instead
+int parkConnection(conn_t* conn) {
+
+        client_t* client = conn->client;
+        client->kept = 1;
+        init_timer(&client->idle, expireIdle, client);
+        if(park_fiber(conn->sockfd, handler, client))
+                return -1;
+
+        //the parked handler only starts once this fiber ended
+        endRequest(conn);
+        add_timer(sTimers, &client->idle, sIdleTimeout * 1000);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs on the wheel thread. the parked handler wakes up to the shutdown
+//and closes the connection.
+int expireIdle(void* arg) {
+
+        client_t* client = (client_t*)arg;
+        metric_inc(METRIC_TIMEOUT_IDLE);
+        shutdown(client->sockfd, SHUT_RDWR);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//with a certificate loaded HTTPS shares the port, told apart by the first byte.
+//the handshake runs under the header deadline.
+//returns 0 if the connection can be served, -1 if the handshake failed
+int acceptTls(conn_t* conn) {
+
+        if(!sTlsContext)
+                return 0;
+
+        unsigned char first;
+        int peeked;
+        while((peeked = recv(conn->sockfd, &first, 1, MSG_PEEK)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+              !waitForSocket(conn->sockfd, EPOLLIN))
+                ;
+        if(peeked != 1 || first != TLS_RECORD_HANDSHAKE)
+                return 0;
+
+        leaveScheduler(conn);
+        if(!(conn->tls = tls_accept(sTlsContext, conn->sockfd)))
+                return -1;
+
+        metric_inc(METRIC_TLS_HANDSHAKES);
+        if(conn->tls->offloaded)
+                metric_inc(METRIC_TLS_OFFLOADED);
+        tTls = conn->tls;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//TLS, h2 and upstream code blocks on its own, so a fiber leaves its
+//scheduler for a pool thread before running it, with a blocking socket
+void leaveScheduler(conn_t* conn) {
+
+        if(!current_fiber())
+                return;
+
+        fcntl(conn->sockfd, F_SETFL, fcntl(conn->sockfd, F_GETFL) & ~O_NONBLOCK);
+
+        //the connection's thread-locals move along
+        long sent = tBytesSent;
+        tls_conn_t* tls = tTls;
+        detach_fiber();
+        tBytesSent = sent;
+        tTls = tls;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//adds a request to the access log, if there is one
+void logRequest(const char* method, int method_length, const char* path, int status, long bytes, struct timespec* start) {
+
+        if(!sAccessLog)
+                return;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        access_record_t record;
+        record.method = method;
+        record.method_length = method_length;
+        record.path = path;
+        record.status = status;
+        record.bytes = bytes;
+        record.duration_us = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+        log_access(sAccessLog, &record);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//TLS without kernel offload - writes must be encrypted by the worker.
+//with kTLS the socket takes plain bytes and every send path works unchanged.
+int inUserSpaceTls() {
+        return tTls && !tTls->offloaded;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//forwards the request to the route's upstreams, the response is streamed
+//back as it arrives. the route was matched on the canonical path, so that is
+//what the upstream is asked for, encoded again and with the client's query -
+//never the raw target, which can spell a path outside the prefix
+//("/api/../admin"). returns 0 on success, -1 on failure
+int proxyRequest(conn_t* conn, proxy_route_t* route, char* request, int length) {
+
+        char encoded[SIZE_LOCATION];
+        int target_length;
+        const char* target = findTarget(request, length, &target_length);
+        int encoded_length = target ? encodePath(conn->path, encoded, sizeof(encoded)) : -1;
+        if(encoded_length < 0) {
+                conn->status = CODE_BAD;
+                sendResponse(conn->sockfd, conn->status, NULL, NULL);
+                return -1;
+        }
+
+        const char* query = memchr(target, '?', target_length);
+        int query_length = query ? target + target_length - query : 0;
+        const char* rest = target + target_length;
+
+        char forwarded[length + sizeof(encoded)];
+        char* pos = mempcpy(forwarded, request, target - request);
+        pos = mempcpy(pos, encoded, encoded_length);
+        if(query)
+                pos = mempcpy(pos, query, query_length);
+        pos = mempcpy(pos, rest, request + length - rest);
+
+        int status = proxy_forward(sProxy, route, forwarded, pos - forwarded, sendToClient, &conn->sockfd);
+        if(status > 0) {
+                metric_inc(METRIC_REQUESTS);
+                conn->status = status;
+                return 0;
+        }
+
+        conn->status = status == PROXY_TIMEOUT ? CODE_GATEWAY_TIMEOUT : CODE_BAD_GATEWAY;
+        sendResponse(conn->sockfd, conn->status, NULL, NULL);
+        return -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//proxy_sink_t writing to the client (through TLS if needed)
+int sendToClient(void* arg, const char* data, int length) {
+
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = length;
+        return writeAll(*(int*)arg, &iov, 1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//answers from the bundle: one index lookup and one writev straight from the
+//mapping, the file system is never touched.
+//returns 0 on success, -1 on failure
+int serveFromBundle(conn_t* conn, char* path, char* request) {
+
+        bundle_t* bundle = acquire_bundle(sBundles);
+        int code;
+        const bundle_entry_t* entry = findInBundle(bundle, path, &code);
+        if(!entry) {
+                release_bundle(sBundles, bundle);
+                conn->status = code;
+                sendResponse(conn->sockfd, code, path, NULL);
+                return -1;
+        }
+
+        int accept_length = 0;
+        char* accept = findHeader(request, "Accept-Encoding", &accept_length);
+        const bundle_body_t* body = pickBundleBody(entry, accept, accept_length);
+
+        const header_template_t* status = getStatusTemplate(CODE_OK);
+        char date[DATE_HEADER_LENGTH];
+        get_date_header(date);
+
+        struct iovec iov[4];
+        iov[0].iov_base = (char*)status->text;
+        iov[0].iov_len = status->length;
+        iov[1].iov_base = date;
+        iov[1].iov_len = DATE_HEADER_LENGTH;
+        iov[2].iov_base = bundle->data + body->headers_offset;
+        iov[2].iov_len = body->headers_length;
+        iov[3].iov_base = bundle->data + body->offset;
+        iov[3].iov_len = body->length;
+
+        metric_inc(METRIC_REQUESTS);
+        conn->status = CODE_OK;
+        int ret = writeAll(conn->sockfd, iov, body->length ? 4 : 3);
+        release_bundle(sBundles, bundle);
+        return ret;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//looks path up the way parsePath would resolve it. a directory named
+//without its trailing slash is redirected.
+//returns the entry, NULL with code set to the error to answer with
+const bundle_entry_t* findInBundle(bundle_t* bundle, char* path, int* code) {
+
+        int length = strlen(path);
+        const bundle_entry_t* entry = lookup_bundle(bundle, path, length);
+        if(entry)
+                return entry;
+
+        char directory[length + 2];
+        sprintf(directory, "%s/", path);
+        *code = length && path[length - 1] != '/' && lookup_bundle(bundle, directory, length + 1) ?
+                CODE_FOUND : CODE_NOT_FOUND;
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the gzip variant if the entry has one and the Accept-Encoding value
+//(accept, length bytes - NULL if the header is missing) takes it
+const bundle_body_t* pickBundleBody(const bundle_entry_t* entry, const char* accept, int length) {
+
+        if(!entry->gzip.length || !accept)
+                return &entry->identity;
+
+        const char* end = accept + length;
+        const char* token = accept;
+        while(token < end) {
+
+                const char* next = memchr(token, ',', end - token);
+                if(!next)
+                        next = end;
+                while(token < next && (*token == ' ' || *token == '\t'))
+                        token++;
+
+                int name_length = strcspn(token, ";, \t");
+                if(token + name_length > next)
+                        name_length = next - token;
+
+                if(name_length == strlen(GZIP_CODING) && !strncasecmp(token, GZIP_CODING, name_length)) {
+
+                        //"gzip;q=0" (or 0.0, 0.00, 0.000) refuses it
+                        const char* q = memmem(token, next - token, "q=", 2);
+                        if(!q)
+                                return &entry->gzip;
+                        for(q += 2; q < next && (*q == '0' || *q == '.'); q++)
+                                ;
+                        if(q < next && *q >= '1' && *q <= '9')
+                                return &entry->gzip;
+                        return &entry->identity;
+                }
+
+                token = next + 1;
+        }
+
+        return &entry->identity;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Request Methods **********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+//length is set to the number of bytes read.
+//returns 0 on success, error number on failure
+int readRequest(char* request, int sockfd, int* length) {
+        debug_print("%s\n", "readRequest");
+
+        int nBytes;
+        int bytes_read = 0;
+
+        //Server uses only the first line of the request, but the whole header
+        //block is consumed - closing a socket with unread data resets the
+        //connection and drops the unsent part of the response.
+        while(bytes_read < SIZE_REQUEST - 1) {
+
+                nBytes = tTls ? tls_read(tTls, request + bytes_read, SIZE_REQUEST - 1 - bytes_read) :
+                         read(sockfd, request + bytes_read, SIZE_REQUEST - 1 - bytes_read);
+                if(nBytes < 0) {
+                        if((errno == EAGAIN || errno == EWOULDBLOCK) && !waitForSocket(sockfd, EPOLLIN))
+                                continue;
+                        debug_print("\t%s\n", "reading request failed");
+                        return CODE_INTERNAL_ERROR;
+                }
+                if(!nBytes)
+                        break;
+
+                int from = bytes_read > 3 ? bytes_read - 3 : 0;
+                bytes_read += nBytes;
+                request[bytes_read] = '\0';
+
+                if(strstr(request + from, "\r\n\r\n"))
+                        break;
+        }
+        debug_print("\tbytes read = %d\n", bytes_read);
+        *length = bytes_read;
+        if(!bytes_read)
+                return CODE_EMPTY_REQUEST;
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+//returns 0 on success, error number on failure
+int parseRequest(char* request, char* path, response_info_t* resp_info) {
+        debug_print("%s\n", "parseRequest START");
+        char method[5];
         char protocol[64];
         memset(method, 0, sizeof(method));
         memset(protocol, 0, sizeof(protocol));
@@ -391,6 +2344,8 @@ int parseRequest(char* request, char* path) {
                 cut[0] = '\0';
 
         int assigned = sscanf(request, "%4s %s %8s", method, path, protocol);
+        if(cut)
+                cut[0] = '\r'; //the headers are forwarded if the path is proxied
         debug_print("\tassigned = %d\n", assigned);
         if(assigned != NUM_OF_EXPECTED_TOKENS)
                 return CODE_BAD;
@@ -400,6 +2355,7 @@ int parseRequest(char* request, char* path) {
 
         if(strcmp(protocol, "HTTP/1.0") && strcmp(protocol, "HTTP/1.1"))
                 return CODE_BAD;
+        resp_info->isHttp11 = !strcmp(protocol, "HTTP/1.1");
 
         //extract path from HTTP/1.0 requests
         //"http://host[:port]/path" - remove http:// and find first '/'
@@ -414,8 +2370,104 @@ int parseRequest(char* request, char* path) {
                 memcpy(path, temp, strlen(temp));
                 debug_print("\tpath = %s\n", path);
         }
-        debug_print("%s\n", "parseRequest END");
-        return 0;
+        debug_print("%s\n", "parseRequest END");
+        return normalizePath(path);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//turns path into the canonical form every cache and the access log are keyed
+//by, in place and in a single pass: percent-escapes are decoded, the query
+//is dropped, repeated slashes are collapsed and "." and ".." segments are
+//resolved, never above the root (RFC 3986 5.2.4). an escaped slash or dot
+//counts as one.
+//returns 0 on success, CODE_BAD for a relative path, an invalid escape or
+//a control character
+int normalizePath(char* path) {
+
+        if(path[0] != '/')
+                return CODE_BAD;
+
+        char* in = path + 1;
+        char* out = path + 1;
+        char* segment = out;    //start of the segment being written
+        while(1) {
+
+                char c = *in;
+                if(c == '%') {
+                        int high = hexValue(in[1]);
+                        int low = high < 0 ? -1 : hexValue(in[2]);
+                        if(low < 0)
+                                return CODE_BAD;
+                        c = (char)(high << 4 | low);
+                        in += 3;
+                        if(!c)
+                                return CODE_BAD; //not the end of the path
+                } else if(c == '?' || c == '#') {
+                        c = '\0';
+                } else if(c) {
+                        in++;
+                }
+
+                if(c && c != '/') {
+                        if((unsigned char)c < 0x20 || c == 0x7f)
+                                return CODE_BAD;
+                        *out++ = c;
+                        continue;
+                }
+
+                //a segment ended, out is past it
+                int length = out - segment;
+                if(length == 1 && segment[0] == '.') {
+                        out = segment;
+                } else if(length == 2 && segment[0] == '.' && segment[1] == '.') {
+                        //back to the start of the parent, if there is one
+                        out = segment;
+                        if(out - 1 > path)
+                                for(out--; out[-1] != '/'; out--)
+                                        ;
+                } else if(length && c) {
+                        *out++ = '/';
+                }
+                segment = out;
+
+                if(!c)
+                        break;
+        }
+
+        *out = '\0';
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the value of header name in the request's header block (length set
+//to its length, surrounding spaces excluded), NULL if it is missing
+char* findHeader(char* request, const char* name, int* length) {
+
+        int name_length = strlen(name);
+        char* line = strchr(request, '\n');
+        while(line && line[1] != '\r' && line[1] != '\n') {
+
+                line++;
+                char* next = strchr(line, '\n');
+                if(!strncasecmp(line, name, name_length) && line[name_length] == ':') {
+
+                        char* value = line + name_length + 1;
+                        char* end = next ? next : value + strlen(value);
+                        while(value < end && (*value == ' ' || *value == '\t'))
+                                value++;
+                        while(end > value && isspace((unsigned char)end[-1]))
+                                end--;
+                        *length = end - value;
+                        return value;
+                }
+                line = next;
+        }
+
+        return NULL;
 }
 
 /*********************************/
@@ -425,32 +2477,26 @@ int parseRequest(char* request, char* path) {
 //returns 0 on success, error number on failure
 int parsePath(char* path, response_info_t* resp_info) {
         debug_print("parsePath START - path = %s\n", path);
-        int i;
-        // char* absPath;// = (*(resp_info->absPath));
-        struct dirent** fileList; // = (*(resp_info->fileList));
 
-        replaceSubstring(path, "%20", " ");
-        debug_print("path = %s\n", path);
-
-        //make sAbsPath hold absolute path
-        char* rootPath = getcwd(NULL, 0);
-        if(!rootPath)
-                return -1;
-
-        int absPath_length = strlen(rootPath) + strlen(path) + strlen(DEFAULT_FILE) + 1;
+        //make sAbsPath hold absolute path, under the root of the request's host
+        const vhost_t* host = resp_info->host;
+        int absPath_length = host->root_length + strlen(path) + strlen(DEFAULT_FILE) + 1;
         char* absPath = (char*)calloc(absPath_length, sizeof(char));
         if(!absPath)
                 return -1;
         resp_info->absPath = absPath;
-        strcat(absPath, rootPath);
+        strcat(absPath, host->root);
         strcat(absPath, path);
 
-        resp_info->root = rootPath;
         debug_print("absPath = %s\n", absPath);
 
+        //the manifest already knows what the ancestors' stats would say
+        if(!sManifest || !lookup_manifest(sManifest, absPath, NULL))
+                prefetchStats(resp_info);
+
         //Check path exists
         struct stat pathStats;
-        if(stat(absPath, &pathStats)) {
+        if(statPath(resp_info, absPath, &pathStats)) {
                 debug_print("\t%s\n", "stat return -1");
                 return CODE_NOT_FOUND;
         }
@@ -469,26 +2515,17 @@ int parsePath(char* path, response_info_t* resp_info) {
                         return CODE_FOUND;
 
 
-                resp_info->numOfFiles = scandir(absPath, &fileList, NULL, alphasort);
-                if(resp_info->numOfFiles < 0)
-                        return CODE_INTERNAL_ERROR;
-
-                resp_info->fileList = fileList;
-
-                debug_print("\tPrinting scandir retval, numOfFiles = %d\n", resp_info->numOfFiles);
-                for(i = 0; i < resp_info->numOfFiles; i++) {
-                        debug_print("\t%s [%d]\n", fileList[i]->d_name, i);
-                        if(!strcmp(fileList[i]->d_name, DEFAULT_FILE)) {
-
-                                resp_info->foundFile = 1;
-                                strcat(absPath, DEFAULT_FILE);
-                                break;
-                        }
-                }
+                //one lookup for the index file, the directory is only read to list it
+                struct stat indexStats;
+                strcat(absPath, DEFAULT_FILE);
+                if(!statPath(resp_info, absPath, &indexStats) && S_ISREG(indexStats.st_mode))
+                        resp_info->foundFile = 1;
+                else
+                        absPath[strlen(absPath) - strlen(DEFAULT_FILE)] = '\0';
 
                 debug_print("\tsFoundFile = %d\n", resp_info->foundFile);
 
-                if(hasPermissions(absPath, resp_info->root)) {
+                if(checkPermissions(absPath, resp_info->foundFile ? &indexStats : &pathStats, resp_info)) {
                         resp_info->foundFile = 0; //dont write file
                         return CODE_FORBIDDEN;
                 }
@@ -497,17 +2534,22 @@ int parsePath(char* path, response_info_t* resp_info) {
 
                 //copy dir path
                 int dir_path_length = strlen(absPath) - strlen(strrchr(absPath, '/') + 1);
-                char dir_path[dir_path_length];
+                char dir_path[dir_path_length + 1];
                 memset(dir_path, 0, sizeof(dir_path));
                 strncat(dir_path, absPath, dir_path_length);
 
-                if(!S_ISREG(pathStats.st_mode) || hasPermissions(absPath, resp_info->root)) {
+                if(!S_ISREG(pathStats.st_mode) || checkPermissions(absPath, &pathStats, resp_info)) {
                         resp_info->isPathDir = 1; //dont write file.
                         resp_info->foundFile = 0;
                         return CODE_FORBIDDEN;
                 }
 
         }
+        if(resp_info->meta && !resp_info->isPathDir)
+                resp_info->mime = resp_info->meta->mime;
+        else
+                resp_info->mime = lookup_mime_type(host->mime, resp_info->isPathDir ? DEFAULT_FILE : strrchr(absPath, '/'));
+
         debug_print("sAbsPath = %s\n", absPath);
         debug_print("%s\n", "parsePath END");
         return 0;
@@ -522,22 +2564,23 @@ int parsePath(char* path, response_info_t* resp_info) {
 //returns 0 on success, -1 on failure
 int sendResponse(int sockfd, int type, char* path, response_info_t* resp_info) {
         debug_print("sendResponse - %d\n", type);
+        metric_inc(type == CODE_OK ? METRIC_REQUESTS : METRIC_ERRORS);
 
+        if(type != CODE_OK)
+                return sendStaticResponse(sockfd, type, path);
 
-        char* response = constructResponse(type, path, resp_info);
-        if(!response)
+        char headers[SIZE_RESPONSE_HEADERS];
+
+        int length = constructResponse(path, resp_info, headers);
+        if(length < 0)
                 return -1;
 
-        debug_print("response = \n%s\n", response);
+        debug_print("response = \n%.*s\n", length, headers);
 
-        if(writeResponse(sockfd, response, path, resp_info)) {
-                free(response);
+        if(writeResponse(sockfd, headers, length, path, resp_info))
                 return -1;
-        }
 
         debug_print("%s\n", "sendResponse END");
-
-        free(response);
         return 0;
 }
 
@@ -545,159 +2588,179 @@ int sendResponse(int sockfd, int type, char* path, response_info_t* resp_info) {
 /*********************************/
 /*********************************/
 
-//returns 0 on success, -1 on failure
-char* constructResponse(int type, char* path, response_info_t* resp_info) {
+//builds the headers of a 200 response into headers (SIZE_RESPONSE_HEADERS
+//bytes) from the precomputed templates. a directory listing is streamed, its
+//length is not known up front.
+//returns length of the headers, -1 on failure
+int constructResponse(char* path, response_info_t* resp_info, char* headers) {
 
         debug_print("constructResponse - path = %s\n", path);
 
-        char server_header[SIZE_HEADER] = "Server: webserver/1.0\r\n";
-        char connection[SIZE_HEADER] = "Connection: close\r\n\r\n";
+        int isListing = resp_info->isPathDir && !resp_info->foundFile;
+        const header_template_t* status = (isListing || resp_info->keepAlive) && resp_info->isHttp11 ?
+                                          &sHttp11Template : getStatusTemplate(CODE_OK);
 
-        int path_length = path ? strlen(path) : 0;
+        char* pos = headers;
+        pos = mempcpy(pos, status->text, status->length);
+        pos += get_date_header(pos);
 
-        char location_header[SIZE_HEADER + path_length];
-        char type_string[SIZE_HEADER];
-        char response_type[SIZE_HEADER];
-        char date_string[SIZE_HEADER + SIZE_DATE_BUFFER];
-        char timebuf[SIZE_DATE_BUFFER];
-        char last_modified[SIZE_HEADER + SIZE_DATE_BUFFER];
-        char content_length[SIZE_HEADER];
-        char content_type[SIZE_HEADER];
-
-        memset(type_string, 0, sizeof(type_string));
-        memset(response_type, 0, sizeof(response_type));
-        memset(location_header, 0, sizeof(location_header));
-        memset(date_string, 0, sizeof(date_string));
-        memset(timebuf, 0, sizeof(timebuf));
-        memset(last_modified, 0, sizeof(last_modified));
-        memset(content_length, 0, sizeof(content_length));
-        memset(content_type, 0, sizeof(content_type));
-
-
-        switch (type) {
-
-        case CODE_OK:
-                strcat(type_string, CODE_OK_STRING);
-                break;
-
-        case CODE_FOUND:
-                strcat(type_string, CODE_FOUND_STRING);
-                sprintf(location_header, "Location: %s/\r\n", path);
-                break;
+        debug_print("\tsIsPathDir = %d\n", resp_info->isPathDir);
+        if(resp_info->mime)
+                pos = mempcpy(pos, resp_info->mime->header, resp_info->mime->header_length);
 
-        case CODE_BAD:
-                strcat(type_string, CODE_BAD_STRING);
-                break;
+        struct stat statBuff;
+        if(statPath(resp_info, resp_info->absPath, &statBuff))
+                return -1;
 
-        case CODE_FORBIDDEN:
-                strcat(type_string, CODE_FORBIDDEN_STRING);
-                break;
+        if(!isListing) {
 
-        case CODE_NOT_FOUND:
-                strcat(type_string, CODE_NOT_FOUND_STRING);
-                break;
+                debug_print("\t%s\n", "file! Content-Length = file size");
+                resp_info->fileStats = statBuff;
+                pos = mempcpy(pos, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER));
+                pos = appendNumber(pos, statBuff.st_size);
 
-        case CODE_INTERNAL_ERROR:
-                strcat(type_string, CODE_INTERNAL_ERROR_STRING);
-                break;
+                pos = mempcpy(pos, ETAG_HEADER, strlen(ETAG_HEADER));
+                pos += getEtag(resp_info, &statBuff, pos);
+                pos = mempcpy(pos, "\r\n", 2);
 
-        case CODE_NOT_SUPPORTED:
-                strcat(type_string, CODE_NOT_SUPPORTED_STRING);
-                break;
+        } else if(resp_info->isHttp11) {
 
+                debug_print("\t%s\n", "dir! chunked listing");
+                pos = mempcpy(pos, CHUNKED_HEADER, strlen(CHUNKED_HEADER));
         }
+        //an HTTP/1.0 listing simply ends when the connection is closed
+
+        pos = mempcpy(pos, LAST_MODIFIED_HEADER, strlen(LAST_MODIFIED_HEADER));
+        pos += format_http_date(statBuff.st_mtime, pos);
+        pos = mempcpy(pos, "\r\n", 2);
+
+        if(isListing && !resp_info->isHttp11)
+                resp_info->keepAlive = 0;
+        if(resp_info->keepAlive)
+                pos = mempcpy(pos, KEEP_ALIVE_HEADER, strlen(KEEP_ALIVE_HEADER));
+        else
+                pos = mempcpy(pos, CONNECTION_HEADER, strlen(CONNECTION_HEADER));
+        return pos - headers;
+}
 
+/*********************************/
+/*********************************/
+/*********************************/
 
-        sprintf(response_type, "HTTP/1.0 %s\r\n", type_string);
-
-
-        //Get Date
-        time_t now;
-        now = time(NULL);
-        strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-        sprintf(date_string, "Date: %s\r\n", timebuf);
-
-        debug_print("\tsIsPathDir = %d\n", resp_info->isPathDir);
-        char* mime = resp_info->isPathDir || !(type == CODE_OK) ?
-                     get_mime_type(DEFAULT_FILE) : get_mime_type(strrchr(path, '/'));
-        if(mime)
-                sprintf(content_type, "Content-Type: %s\r\n", mime);
-
-        debug_print("\tmime = %s\n", mime);
-
-        //get ResponseBody or if file, get its size.
-        char* responseBody =  NULL;
-        if(type == CODE_OK) {
+const header_template_t* getStatusTemplate(int type) {
 
-                struct stat statBuff;
-                if(stat(resp_info->absPath, &statBuff))
-                        return NULL;
+        int i;
+        for(i = 0; i < NUM_OF_STATUS_TEMPLATES; i++)
+                if(sStatusTemplates[i].code == type)
+                        return &sStatusTemplates[i];
 
-                if(!resp_info->isPathDir || resp_info->foundFile) {
+        return NULL;
+}
 
-                        debug_print("\t%s\n", "file! Content-Length = file size");
-                        sprintf(content_length, "Content-Length: %ld\r\n", statBuff.st_size);
+/*********************************/
+/*********************************/
+/*********************************/
+//render every error/redirect response, called once before serving
+void initStaticResponses() {
 
-                } else {
+        const mime_type_t* html = get_mime_type(DEFAULT_FILE);
 
-                        debug_print("\t%s\n", "dir! Content-Length = length of dircontents");
-                        responseBody = getDirContents(resp_info);
-                        if(!responseBody)
-                                return NULL;
-                        sprintf(content_length, "Content-Length: %d\r\n", (int)strlen(responseBody));
+        int i;
+        for(i = 0; i < NUM_OF_STATIC_RESPONSES; i++) {
+
+                static_response_t* resp = &sStaticResponses[i];
+                const header_template_t* status = getStatusTemplate(resp->code);
+                char* body = getResponseBody(resp->code);
+                if(!status || !body) {
+                        fprintf(stderr, "initStaticResponses - %d\n", resp->code);
+                        exit(-1);
                 }
 
+                char text[SIZE_RESPONSE];
+                char* pos = text;
+                pos = mempcpy(pos, status->text, status->length);
+                resp->date_offset = pos - text;
 
-                strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statBuff.st_mtime));
-                sprintf(last_modified, "Last-Modified: %s\r\n", timebuf);
-
-        } else {
-                responseBody = getResponseBody(type);
-                if(!responseBody)
-                        return NULL;
-                sprintf(content_length, "Content-Length: %d\r\n", (int)strlen(responseBody));
+                if(resp->code == CODE_FOUND) {
+                        pos = mempcpy(pos, LOCATION_HEADER, strlen(LOCATION_HEADER));
+                        resp->location_offset = pos - text;
+                        pos = mempcpy(pos, "/\r\n", 3);
+                }
+                if(resp->code == CODE_TOO_MANY_REQUESTS)
+                        pos = mempcpy(pos, RETRY_AFTER_HEADER, strlen(RETRY_AFTER_HEADER));
+
+                pos = mempcpy(pos, html->header, html->header_length);
+                pos = mempcpy(pos, CONTENT_LENGTH_HEADER, strlen(CONTENT_LENGTH_HEADER));
+                pos = appendNumber(pos, strlen(body));
+                pos = mempcpy(pos, CONNECTION_HEADER, strlen(CONNECTION_HEADER));
+                pos = mempcpy(pos, body, strlen(body));
+                free(body);
+
+                resp->length = pos - text;
+                resp->text = (char*)malloc(resp->length);
+                if(!resp->text) {
+                        perror("malloc");
+                        exit(-1);
+                }
+                memcpy(resp->text, text, resp->length);
         }
+}
 
+/*********************************/
+/*********************************/
+/*********************************/
+//sends a prerendered response with a single writev, no allocation.
+//unknown codes are answered with CODE_INTERNAL_ERROR.
+//returns 0 on success, -1 on failure
+int sendStaticResponse(int sockfd, int type, char* path) {
 
-        int responseBody_length = !responseBody ? 0 : (int)strlen(responseBody);
-        int length = strlen(response_type)
-                     + strlen(server_header)
-                     + strlen(date_string)
-                     + strlen(location_header)
-                     + strlen(content_type)
-                     + strlen(content_length)
-                     + strlen(last_modified)
-                     + strlen(connection)
-                     + responseBody_length;
-
+        static_response_t* resp = NULL;
+        static_response_t* fallback = NULL;
+        int i;
+        for(i = 0; i < NUM_OF_STATIC_RESPONSES; i++) {
+                if(sStaticResponses[i].code == type)
+                        resp = &sStaticResponses[i];
+                if(sStaticResponses[i].code == CODE_INTERNAL_ERROR)
+                        fallback = &sStaticResponses[i];
+        }
 
-        char* response = (char*)calloc(length + 1, sizeof(char));
-        if(!response) {
-                free(responseBody);
-                return NULL;
+        //the path is decoded, Location carries it encoded again
+        char location[SIZE_LOCATION];
+        int location_length = -1;
+        if(resp && resp->code == CODE_FOUND && path)
+                location_length = encodePath(path, location, sizeof(location));
+        if(!resp || (resp->code == CODE_FOUND && location_length < 0))
+                resp = fallback;
+
+        char date[DATE_HEADER_LENGTH];
+        get_date_header(date);
+
+        struct iovec iov[5];
+        int iovcnt = 0;
+        iov[iovcnt].iov_base = resp->text;
+        iov[iovcnt++].iov_len = resp->date_offset;
+        iov[iovcnt].iov_base = date;
+        iov[iovcnt++].iov_len = DATE_HEADER_LENGTH;
+
+        int rest = resp->date_offset;
+        if(resp->code == CODE_FOUND) {
+                iov[iovcnt].iov_base = resp->text + rest;
+                iov[iovcnt++].iov_len = resp->location_offset - rest;
+                iov[iovcnt].iov_base = location;
+                iov[iovcnt++].iov_len = location_length;
+                rest = resp->location_offset;
         }
 
-        sprintf(response, "%s%s%s%s%s%s%s%s%s",
-                response_type,
-                server_header,
-                date_string,
-                location_header,
-                content_type,
-                content_length,
-                last_modified,
-                connection,
-                responseBody ? responseBody : ""); //attach body only if not file
+        iov[iovcnt].iov_base = resp->text + rest;
+        iov[iovcnt++].iov_len = resp->length - rest;
 
-        if(responseBody)
-                free(responseBody);
-        return response;
+        return writeAll(sockfd, iov, iovcnt);
 }
 
-
 /*********************************/
 /*********************************/
 /*********************************/
-//returns Server Error Messages response body
+//returns Server Error Messages response body, used to render sStaticResponses
 char* getResponseBody(int type) {
 
         char title[SIZE_HTML_TAGS];
@@ -738,208 +2801,874 @@ char* getResponseBody(int type) {
                 strcat(body, RESPONSE_NOT_SUPPORTED);
                 break;
 
+        case CODE_TOO_MANY_REQUESTS:
+                strcat(title, CODE_TOO_MANY_REQUESTS_STRING);
+                strcat(body, RESPONSE_TOO_MANY_REQUESTS);
+                break;
+
+        case CODE_BAD_GATEWAY:
+                strcat(title, CODE_BAD_GATEWAY_STRING);
+                strcat(body, RESPONSE_BAD_GATEWAY);
+                break;
+
+        case CODE_GATEWAY_TIMEOUT:
+                strcat(title, CODE_GATEWAY_TIMEOUT_STRING);
+                strcat(body, RESPONSE_GATEWAY_TIMEOUT);
+                break;
+
+        }
+
+        int length = strlen(RESPONSE_BODY_TEMPLATE) + 2*strlen(title) + strlen(body);
+
+        char* responseBody = (char*)calloc(length + 1, sizeof(char));
+        if(!responseBody)
+                return NULL;
+
+        sprintf(responseBody, RESPONSE_BODY_TEMPLATE, title, title, body);
+
+        return responseBody;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//opens the listing of resp_info->absPath (a dir), rendered a piece at a time
+//by renderListingPiece. entries come in directory order and are stat()ed one
+//at a time relative to the open dir, so memory use does not grow with the
+//directory.
+//returns NULL on failure
+listing_t* openListing(response_info_t* resp_info) {
+
+        char* path = resp_info->absPath;
+        debug_print("openListing\n\tpath = %s\n", path);
+
+        int dirfd = openat(resp_info->host->root_fd, relativePath(resp_info, path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dirfd < 0)
+                return NULL;
+        DIR* dir = fdopendir(dirfd);
+        if(!dir) {
+                close(dirfd);
+                return NULL;
+        }
+
+        //titled with the request's path, not where the root is on disk
+        const char* shown = path + resp_info->host->root_length;
+        if(*shown != '/' && shown > path)
+                shown--;
+
+        listing_t* listing = (listing_t*)malloc(sizeof(listing_t));
+        if(!listing || !(listing->title = strdup(shown))) {
+                free(listing);
+                closedir(dir);
+                return NULL;
+        }
+        listing->dir = dir;
+        listing->stage = LISTING_TITLE;
+        listing->length = 0;
+        listing->read = 0;
+        return listing;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//renders the next piece of the listing into its buffer, a step (part of the
+//head, a row or the tail) at a time until it holds SIZE_LISTING_BUFFER bytes.
+//returns the length of the piece, 0 once the listing is complete
+int renderListingPiece(listing_t* listing) {
+
+        listing->length = 0;
+        listing->read = 0;
+        while(listing->length < SIZE_LISTING_BUFFER && listing->stage != LISTING_COMPLETE) {
+
+                switch(listing->stage) {
+                case LISTING_TITLE:
+                        appendListing(listing, TEMPLATE(DIR_CONTENTS_HEAD_START));
+                        appendHtml(listing, listing->title);
+                        appendListing(listing, TEMPLATE(DIR_CONTENTS_HEAD_MIDDLE));
+                        listing->stage = LISTING_HEADING;
+                        break;
+
+                case LISTING_HEADING:
+                        appendHtml(listing, listing->title);
+                        appendListing(listing, TEMPLATE(DIR_CONTENTS_HEAD_END));
+                        listing->stage = LISTING_ROWS;
+                        break;
+
+                default:
+                        appendRow(listing);
+                }
+        }
+
+        return listing->length;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//appends the row of the next entry, or the tail once there is none
+void appendRow(listing_t* listing) {
+
+        struct dirent* file;
+        while((file = readdir(listing->dir))) {
+
+                //a file removed since readdir() is simply left out
+                struct stat statBuff;
+                if(fstatat(dirfd(listing->dir), file->d_name, &statBuff, 0))
+                        continue;
+
+                char timebuf[DATE_VALUE_LENGTH + 1];
+                format_http_date(statBuff.st_mtime, timebuf);
+
+                char href[SIZE_ENCODED_NAME];
+                int href_length = encodePath(file->d_name, href, sizeof(href));
+                if(href_length < 0)
+                        continue;
+
+                char entity[SIZE_DIR_ENTITY];
+                int length;
+                if(S_ISDIR(statBuff.st_mode))
+                        length = snprintf(entity, sizeof(entity), DIR_CONTENTS_ROW_DATE "<td></td></tr>\n", timebuf);
+                else
+                        length = snprintf(entity, sizeof(entity), DIR_CONTENTS_ROW_DATE "<td>%ld</td></tr>\n",
+                                          timebuf, statBuff.st_size);
+                if(length >= (int)sizeof(entity))
+                        length = sizeof(entity) - 1;
+
+                appendListing(listing, TEMPLATE(DIR_CONTENTS_ROW_START));
+                appendListing(listing, href, href_length);
+                appendListing(listing, TEMPLATE(DIR_CONTENTS_ROW_LINK));
+                appendHtml(listing, file->d_name);
+                appendListing(listing, entity, length);
+                return;
+        }
+
+        appendListing(listing, TEMPLATE(DIR_CONTENTS_TAIL));
+        listing->stage = LISTING_COMPLETE;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a step appends at most SIZE_LISTING_STEP bytes past SIZE_LISTING_BUFFER,
+//so it always fits
+void appendListing(listing_t* listing, const char* data, int length) {
+
+        memcpy(listing->buf + listing->length, data, length);
+        listing->length += length;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//appends text with the characters HTML gives a meaning escaped
+void appendHtml(listing_t* listing, const char* text) {
+
+        while(*text) {
+
+                int plain = strcspn(text, "&<>\"'");
+                appendListing(listing, text, plain);
+                text += plain;
+
+                const char* entity = NULL;
+                switch(*text) {
+                case '&': entity = "&amp;"; break;
+                case '<': entity = "&lt;"; break;
+                case '>': entity = "&gt;"; break;
+                case '"': entity = "&quot;"; break;
+                case '\'': entity = "&#39;"; break;
+                }
+                if(!entity)
+                        break;
+                appendListing(listing, entity, strlen(entity));
+                text++;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//h2_read_fn of a listing, rendered as it is read
+int readListing(void* source, char* buf, int size) {
+
+        listing_t* listing = (listing_t*)source;
+        if(listing->read == listing->length && !renderListingPiece(listing))
+                return 0;
+
+        int chunk = listing->length - listing->read < size ? listing->length - listing->read : size;
+        memcpy(buf, listing->buf + listing->read, chunk);
+        listing->read += chunk;
+        return chunk;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void closeListing(void* source) {
+
+        listing_t* listing = (listing_t*)source;
+        closedir(listing->dir);
+        free(listing->title);
+        free(listing);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//streams the listing straight from the directory, a piece at a time.
+//returns 0 on success, -1 on failure
+int streamListing(int sockfd, response_info_t* resp_info) {
+
+        listing_t* listing = openListing(resp_info);
+        if(!listing)
+                return -1;
+
+        int length;
+        int ret = 0;
+        while(!ret && (length = renderListingPiece(listing)) > 0)
+                ret = writeListingChunk(sockfd, listing->buf, length, resp_info->isHttp11);
+
+        closeListing(listing);
+        return ret;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//renders the listing into an anonymous file shared through the flight,
+//unless another request did so first. nothing is sent meanwhile, so it is
+//rendered as fast as the directory is read.
+//returns the shared listing, NULL on failure
+rendered_listing_t* shareListing(flight_t* flight, response_info_t* resp_info) {
+
+        if(flight->result)
+                return (rendered_listing_t*)flight->result;
+
+        rendered_listing_t* created = (rendered_listing_t*)malloc(sizeof(rendered_listing_t));
+        if(created && (created->fd = memfd_create("listing", MFD_CLOEXEC)) < 0) {
+                free(created);
+                created = NULL;
+        }
+        if(!created)
+                return NULL;
+        created->length = 0;
+        created->state = LISTING_RENDERING;
+        pthread_mutex_init(&created->lock, NULL);
+        pthread_cond_init(&created->grown, NULL);
+
+        listing_t* listing = openListing(resp_info);
+        rendered_listing_t* shared = listing ? (rendered_listing_t*)publish_flight(sListings, flight, created) : NULL;
+        if(shared != created) {
+                if(listing)
+                        closeListing(listing);
+                discardListing(NULL, created);
+                return shared;
+        }
+
+        int length;
+        int error = 0;
+        while(!error && (length = renderListingPiece(listing)) > 0) {
+
+                //a plain write, the listing file is not the connection
+                char* data = listing->buf;
+                int left = length;
+                while(left > 0) {
+                        ssize_t nBytes = write(shared->fd, data, left);
+                        if((error = nBytes < 0))
+                                break;
+                        data += nBytes;
+                        left -= nBytes;
+                }
+
+                pthread_mutex_lock(&shared->lock);
+                shared->length += length - left;
+                pthread_cond_broadcast(&shared->grown);
+                pthread_mutex_unlock(&shared->lock);
+        }
+        closeListing(listing);
+
+        pthread_mutex_lock(&shared->lock);
+        shared->state = error ? LISTING_FAILED : LISTING_DONE;
+        pthread_cond_broadcast(&shared->grown);
+        pthread_mutex_unlock(&shared->lock);
+        return shared;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a shared listing no request holds anymore
+void discardListing(void* arg, void* listing) {
+
+        rendered_listing_t* rendered = (rendered_listing_t*)listing;
+        close(rendered->fd);
+        pthread_cond_destroy(&rendered->grown);
+        pthread_mutex_destroy(&rendered->lock);
+        free(rendered);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sends a shared listing as it is rendered, waiting whenever everything
+//rendered so far went out. pieces are sent as HTTP/1.1 chunks if chunked.
+//returns 0 on success, -1 on failure
+int sendListing(int sockfd, rendered_listing_t* listing, int chunked) {
+
+        char* buf = (char*)malloc(SIZE_LISTING_BUFFER);
+        if(!buf)
+                return -1;
+
+        long sent = 0;
+        int state = LISTING_RENDERING;
+        int ret = 0;
+        while(!ret) {
+
+                pthread_mutex_lock(&listing->lock);
+                while(listing->length == sent && listing->state == LISTING_RENDERING)
+                        pthread_cond_wait(&listing->grown, &listing->lock);
+                long length = listing->length;
+                state = listing->state;
+                pthread_mutex_unlock(&listing->lock);
+
+                if(length == sent)
+                        break; //rendering is over
+
+                while(!ret && sent < length) {
+                        long chunk = length - sent < SIZE_LISTING_BUFFER ? length - sent : SIZE_LISTING_BUFFER;
+                        ssize_t nBytes = pread(listing->fd, buf, chunk, sent);
+                        if(nBytes <= 0 || writeListingChunk(sockfd, buf, nBytes, chunked))
+                                ret = -1;
+                        else
+                                sent += nBytes;
+                }
+        }
+
+        free(buf);
+        return ret || state == LISTING_FAILED ? -1 : 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+int writeListingChunk(int sockfd, const char* data, int length, int chunked) {
+
+        char size[24];
+        struct iovec iov[3] = { { size, 0 }, { (char*)data, length }, { "\r\n", 2 } };
+        if(!chunked)
+                return writeAll(sockfd, &iov[1], 1);
+
+        iov[0].iov_len = sprintf(size, "%x\r\n", length);
+        return writeAll(sockfd, iov, 3);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//sends the listing of resp_info->absPath, in HTTP/1.1 chunks if the client
+//asked for HTTP/1.1. a request alone streams it straight from the directory.
+//one that finds another request streaming it shares a copy rendered into an
+//anonymous file instead, rendered once for every request joining meanwhile
+//and sent by each as it grows. a fiber renders its own, waiting for the copy
+//would block its scheduler's thread.
+//returns 0 on success, -1 on failure
+int writeListing(int sockfd, response_info_t* resp_info) {
+
+        int leader = 1;
+        flight_t* flight = current_fiber() ? NULL : join_flight(sListings, resp_info->absPath, &leader, 0);
+        rendered_listing_t* shared = flight && !leader ? shareListing(flight, resp_info) : NULL;
+
+        int ret = shared ? sendListing(sockfd, shared, resp_info->isHttp11) : streamListing(sockfd, resp_info);
+        if(!ret && resp_info->isHttp11) {
+                struct iovec last = { LAST_CHUNK, strlen(LAST_CHUNK) };
+                ret = writeAll(sockfd, &last, 1);
+        }
+
+        if(flight) {
+                if(leader)
+                        land_flight(sListings, flight, NULL);
+                leave_flight(sListings, flight);
+        }
+        return ret;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+const mime_type_t* get_mime_type(char* name) {
+
+        debug_print("\t%s\n", "get_mime_type");
+        return lookup_mime_type(sMimeTypes, name);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//writes the ETag value of the file being sent (st is its stat) into buf
+//(MANIFEST_ETAG_SIZE bytes): the manifest's, unless the file changed since
+//parsePath. returns its length
+int getEtag(response_info_t* resp_info, struct stat* st, char* buf) {
+
+        const manifest_entry_t* meta = resp_info->meta;
+        if(meta && meta->size == st->st_size && meta->mtime.tv_sec == st->st_mtim.tv_sec) {
+                memcpy(buf, meta->etag, meta->etag_length);
+                return meta->etag_length;
+        }
+
+        return format_etag(buf, st);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+//headers go out first, followed by the file or the streamed listing.
+//in mmap and io_uring modes a file goes out together with the headers instead.
+int writeResponse(int sockfd, char* headers, int headers_length, char* path, response_info_t* resp_info) {
+        debug_print("%s\n", "writeResponse START");
+
+        int isFile = path && (resp_info->foundFile || !resp_info->isPathDir);
+        if(isFile && sFileCache)
+                return writeMappedFile(sockfd, headers, headers_length, resp_info);
+
+        uring_t* ring = isFile && !inUserSpaceTls() && !current_fiber() ? getThreadRing() : NULL;
+        if(ring)
+                return writeFileUring(ring, sockfd, headers, headers_length, resp_info);
+
+        struct iovec iov;
+        iov.iov_base = headers;
+        iov.iov_len = headers_length;
+
+        if(writeAll(sockfd, &iov, 1)) {
+                debug_print("%s\n", "writing response failed");
+                return -1;
+        }
+
+        if(isFile) {
+                debug_print("sFoundFile = %d, sIsPathDir = %d, path = %s\n", resp_info->foundFile, resp_info->isPathDir, path);
+                //if sending DEFAULT_FILE or another file
+                return writeFile(sockfd, resp_info);
         }
 
-        int length = strlen(RESPONSE_BODY_TEMPLATE) + 2*strlen(title) + strlen(body);
+        debug_print("%s\n", "writeResponse END");
+        return writeListing(sockfd, resp_info);
+}
 
-        char* responseBody = (char*)calloc(length + 1, sizeof(char));
-        if(!responseBody)
-                return NULL;
+/*********************************/
+/*********************************/
+/*********************************/
+//send file to client, copied by the kernel straight from the page cache
+int writeFile(int sockfd, response_info_t* resp_info) {
+        debug_print("%s\n", "writeFile START");
 
-        sprintf(responseBody, RESPONSE_BODY_TEMPLATE, title, title, body);
+        int fd = openat(resp_info->host->root_fd, relativePath(resp_info, resp_info->absPath), O_RDONLY);
+        if(fd < 0) {
+                debug_print("\t%s\n", "open file failed");
+                return -1;
+        }
 
-        return responseBody;
+        int ret = sendOpenFile(sockfd, fd, resp_info->fileStats.st_size);
+        close(fd);
+        debug_print("%s\n", "writeFile END");
+        return ret;
 }
 
 /*********************************/
 /*********************************/
 /*********************************/
-//returns dir contents of path (path is dir)
-char* getDirContents(response_info_t* resp_info) {
+//sends the first size bytes of fd. reads at explicit offsets, so fd may be
+//shared with other threads.
+//returns 0 on success, -1 on failure
+int sendOpenFile(int sockfd, int fd, long size) {
 
-        char* path = resp_info->absPath;
-        struct dirent** fileList = resp_info->fileList;
-        int numOfFiles = resp_info->numOfFiles;
+        if(inUserSpaceTls()) {
+                int ret = tls_send_file(tTls, fd, size);
+                if(!ret)
+                        tBytesSent += size;
+                return ret;
+        }
 
-        debug_print("getDirContents\n\tpath = %s\n", path);
+        off_t offset = 0;
+        while(offset < size) {
 
-        debug_print("\t%s\n", "reading dir");
-        int i;
+                ssize_t nBytes = sendfile(sockfd, fd, &offset, size - offset);
+                if(nBytes < 0) {
+                        if((errno == EAGAIN || errno == EWOULDBLOCK) && !waitForSocket(sockfd, EPOLLOUT))
+                                continue;
+                        debug_print("%s\n", "sending file failed");
+                        return -1;
+                }
+                if(!nBytes)
+                        break; //file was truncated, nothing more to send
+        }
+        tBytesSent += offset;
 
+        return 0;
+}
 
-        char title[strlen(DIR_CONTENTS_TITLE) + strlen(path) + 1];
-        char body[SIZE_DIR_ENTITY * (numOfFiles + 1)];
+/*********************************/
+/*********************************/
+/*********************************/
+//writes headers and the file's shared mapping in one writev.
+//falls back to writeFile when the file can't be mapped.
+//returns 0 on success, -1 on failure
+int writeMappedFile(int sockfd, char* headers, int headers_length, response_info_t* resp_info) {
+        debug_print("%s\n", "writeMappedFile START");
+
+        //a fiber must not block its scheduler waiting for another thread's mapping
+        mapped_file_t* file = acquire_mapped_file(sFileCache, resp_info->absPath, &resp_info->fileStats, !current_fiber());
+
+        struct iovec iov[2];
+        iov[0].iov_base = headers;
+        iov[0].iov_len = headers_length;
+        iov[1].iov_base = file ? file->data : NULL;
+        iov[1].iov_len = file ? file->size : 0;
+
+        //a file truncated under the mapping makes writev fail with EFAULT, no SIGBUS
+        int ret = writeAll(sockfd, iov, file ? 2 : 1);
+        if(file)
+                release_mapped_file(sFileCache, file);
+        else if(!ret)
+                ret = writeFile(sockfd, resp_info);
+
+        debug_print("%s\n", "writeMappedFile END");
+        return ret;
+}
 
-        memset(title, 0, sizeof(title));
-        memset(body, 0, sizeof(body));
+/*********************************/
+/*********************************/
+/*********************************/
+//sends headers and file with linked openat -> read_fixed -> send chains, one
+//submission per registered buffer worth of file (typically just one).
+//the file is opened as a direct descriptor, it never gets a regular fd.
+//returns 0 on success, -1 on failure
+int writeFileUring(uring_t* ring, int sockfd, char* headers, int headers_length, response_info_t* resp_info) {
+        debug_print("%s\n", "writeFileUring START");
+
+        char* buffer = ring->buffer;
+        memcpy(buffer, headers, headers_length);
+        int head = headers_length;
+        long size = resp_info->fileStats.st_size;
+        long offset = 0;
+
+        while(1) {
+
+                long chunk = size - offset;
+                if(chunk > ring->buffer_size - head)
+                        chunk = ring->buffer_size - head;
+                int last = offset + chunk >= size;
+
+                int ops = 0;
+                struct io_uring_sqe* sqe;
+                if(!offset) {
+                        sqe = uring_get_sqe(ring);
+                        sqe->opcode = IORING_OP_OPENAT;
+                        sqe->fd = AT_FDCWD;
+                        sqe->addr = (unsigned long)resp_info->absPath;
+                        sqe->open_flags = O_RDONLY;
+                        sqe->file_index = URING_FILE_SLOT + 1;
+                        sqe->flags = IOSQE_IO_LINK;
+                        sqe->user_data = URING_OP_OPEN;
+                        ops++;
+                }
 
+                if(chunk > 0) {
+                        sqe = uring_get_sqe(ring);
+                        sqe->opcode = IORING_OP_READ_FIXED;
+                        sqe->fd = URING_FILE_SLOT;
+                        sqe->addr = (unsigned long)(buffer + head);
+                        sqe->len = chunk;
+                        sqe->off = offset;
+                        sqe->buf_index = 0;
+                        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK; //a short read cancels the send
+                        sqe->user_data = URING_OP_READ;
+                        ops++;
+                }
 
-        sprintf(title, "Index of %s", path);
+                sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = sockfd;
+                sqe->addr = (unsigned long)buffer;
+                sqe->len = head + chunk;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+                sqe->user_data = URING_OP_SEND;
+                ops++;
+
+                //not linked, so it runs whether the chain failed or not
+                if(last) {
+                        sqe = uring_get_sqe(ring);
+                        sqe->opcode = IORING_OP_CLOSE;
+                        sqe->file_index = URING_FILE_SLOT + 1;
+                        sqe->flags = IOSQE_IO_DRAIN;
+                        sqe->user_data = URING_OP_CLOSE;
+                        ops++;
+                }
 
-        strcat(body, "<table CELLSPACING=8>\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\n");
+                int results[URING_OP_CLOSE + 1] = { 0 };
+                if(reapCompletions(ring, results, URING_OP_CLOSE + 1, ops))
+                        return -1;
 
-        for(i = 0; i < numOfFiles; i++) {
+                if(results[URING_OP_OPEN] < 0 || results[URING_OP_READ] < 0 || results[URING_OP_SEND] < 0) {
+                        debug_print("\twriteFileUring failed - %d %d %d\n", results[URING_OP_OPEN],
+                                    results[URING_OP_READ], results[URING_OP_SEND]);
+                        if(!last)
+                                closeFileUring(ring);
+                        return -1;
+                }
 
-                // if(!strcmp(fileList[i]->d_name, ".") || !strcmp(fileList[i]->d_name, ".."))
-                //         continue;
+                //MSG_WAITALL should leave nothing behind, but finish a short send anyway
+                int sent = results[URING_OP_SEND];
+                tBytesSent += sent;
+                if(sent < head + chunk) {
+                        struct iovec iov;
+                        iov.iov_base = buffer + sent;
+                        iov.iov_len = head + chunk - sent;
+                        if(writeAll(sockfd, &iov, 1)) {
+                                if(!last)
+                                        closeFileUring(ring);
+                                return -1;
+                        }
+                }
 
-                char tempPath[strlen(path) + strlen(fileList[i]->d_name) + 1];
-                memset(tempPath, 0, sizeof(tempPath));
-                strcat(tempPath, path);
-                strcat(tempPath, fileList[i]->d_name);
-                debug_print("tempPath = %s\n", tempPath);
+                if(last)
+                        break;
+                offset += chunk;
+                head = 0;
+        }
 
-                struct stat statBuff;
-                if(stat(tempPath, &statBuff))
-                        return NULL;
-                char timebuf[SIZE_DATE_BUFFER];
-                strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&statBuff.st_mtime));
+        debug_print("%s\n", "writeFileUring END");
+        return 0;
+}
 
 
-                char entity[SIZE_DIR_ENTITY];
-                sprintf(entity, "<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td>",
-                        fileList[i]->d_name,
-                        fileList[i]->d_name,
-                        timebuf);
+/******************************************************************************/
+/******************************************************************************/
+/***************************** HTTP/2 Methods *********************************/
+/******************************************************************************/
+/******************************************************************************/
+//h2 request handler, runs on the connection's thread.
+//every failure becomes an error response, the stream is always answered.
+void serveH2Request(h2_request_t* request, h2_response_t* response) {
+        debug_print("serveH2Request - stream %u\n", request->stream_id);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-                if(S_ISDIR(statBuff.st_mode)) {
-                        debug_print("%s\n", "dir - not file size");
-                        strcat(entity, "<td></td></tr>\n");
+        char path[SIZE_REQUEST];
+        memset(path, 0, sizeof(path));
 
+        int code = CODE_OK;
+        if(!request->method || !request->path || strlen(request->path) >= SIZE_REQUEST ||
+           normalizePath(strcpy(path, request->path))) {
+                path[0] = '\0';
+                code = CODE_BAD;
+        } else if(strcmp(request->method, "GET"))
+                code = CODE_NOT_SUPPORTED;
+        else if(sProxy && match_proxy_route(sProxy, path))
+                code = CODE_NOT_SUPPORTED; //proxied paths are served over HTTP/1.x only
+        else if(sLimiter && tH2Peer && !tH2Prepaid &&
+                limit_take(sLimiter, (struct sockaddr*)tH2Peer) != LIMIT_OK)
+                code = CODE_TOO_MANY_REQUESTS;
+        tH2Prepaid = 0;
+
+        response_info_t* resp_info = NULL;
+        if(code == CODE_OK && sBundles) {
+
+                code = constructH2FromBundle(request, path, response);
+
+        } else if(code == CODE_OK) {
+
+                resp_info = (response_info_t*)calloc(1, sizeof(response_info_t));
+                if(resp_info) {
+                        initResponseInfo(resp_info);
+                        resp_info->host = request->authority ?
+                                          lookup_vhost(sHosts, request->authority, strlen(request->authority)) :
+                                          sHosts->default_host;
+                        code = parsePath(path, resp_info);
+                        if(!code)
+                                code = CODE_OK;
                 } else {
-                        debug_print("%s\n", "getting file size");
-                        char fileSize[64];
-                        sprintf(fileSize, "<td>%ld</td></tr>\n", statBuff.st_size);
-                        strcat(entity, fileSize);
-
+                        code = CODE_INTERNAL_ERROR;
                 }
-                strcat(body, entity);
         }
 
-        strcat(body, "</table>\n<HR>\n<ADDRESS>webserver/1.0</ADDRESS>\n");
+        if(code == CODE_OK && resp_info && constructH2Response(resp_info, response))
+                code = CODE_INTERNAL_ERROR;
+        if(!getStatusTemplate(code))
+                code = CODE_INTERNAL_ERROR; //parsePath failed
 
-        int length = strlen(RESPONSE_BODY_TEMPLATE) + 2*strlen(title) + strlen(body);
-        char* responseBody = (char*)calloc(length + 1, sizeof(char));
-        if(!responseBody)
-                return NULL;
-
-        sprintf(responseBody, RESPONSE_BODY_TEMPLATE, title, title, body);
-        debug_print("%s\n", "getDirContents END");
-        return responseBody;
-}
-
-/*********************************/
-/*********************************/
-/*********************************/
-
-char* get_mime_type(char* name) {
-
-        debug_print("\t%s\n", "get_mime_type");
-        char *ext = strrchr(name, '.');
-        if (!ext)
-                return NULL;
+        if(code != CODE_OK)
+                constructH2Error(code, path, response);
 
-        if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0)
-                return "text/html";
-        if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-                return "image/jpeg";
-        if (strcmp(ext, ".gif") == 0)
-                return "image/gif";
-        if (strcmp(ext, ".png") == 0)
-                return "image/png";
-        if (strcmp(ext, ".css") == 0)
-                return "text/css";
-        if (strcmp(ext, ".au") == 0)
-                return "audio/basic";
-        if (strcmp(ext, ".wav") == 0)
-                return "audio/wav";
-        if (strcmp(ext, ".avi") == 0)
-                return "video/x-msvideo";
-        if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0)
-                return "video/mpeg";
-        if (strcmp(ext, ".mp3") == 0)
-                return "audio/mpeg";
+        metric_inc(code == CODE_OK ? METRIC_REQUESTS : METRIC_ERRORS);
+        freeResponseInfo(resp_info);
 
-        return NULL;
+        //the body is still to be sent, its length is logged
+        const char* method = request->method ? request->method : "";
+        logRequest(method, strlen(method), path[0] ? path : request->path, code, response->headers_length + response->length, &start);
 }
 
 /*********************************/
 /*********************************/
 /*********************************/
+//the h2 counterpart of constructResponse. a file is opened and left to the
+//h2 layer, which sends it with sendfile().
+//returns 0 on success, -1 on failure
+int constructH2Response(response_info_t* resp_info, h2_response_t* response) {
 
-int writeResponse(int sockfd, char* response, char* path, response_info_t* resp_info) {
-        debug_print("%s\n", "writeResponse START");
-        int response_length = strlen(response);
-        int bytes_written = 0;
-        int nBytes;
+        struct stat statBuff;
+        if(statPath(resp_info, resp_info->absPath, &statBuff))
+                return -1;
 
-        while(bytes_written < response_length) {
+        if(!resp_info->isPathDir || resp_info->foundFile) {
+
+                response->fd = openat(resp_info->host->root_fd, relativePath(resp_info, resp_info->absPath), O_RDONLY | O_CLOEXEC);
+                if(response->fd < 0)
+                        return -1;
 
-                if((nBytes = write(sockfd, response, response_length)) < 0) {
-                        debug_print("%s\n", "writing response failed");
+                //the length sent must be the one of the file opened
+                if(fstat(response->fd, &statBuff)) {
+                        close(response->fd);
+                        response->fd = -1;
                         return -1;
                 }
+                response->length = statBuff.st_size;
 
-                bytes_written += nBytes;
-        }
+        } else {
 
-        if(path && (resp_info->foundFile || !resp_info->isPathDir)) {
-                debug_print("sFoundFile = %d, sIsPathDir = %d, path = %s\n", resp_info->foundFile, resp_info->isPathDir, path);
-                //if sending DEFAULT_FILE or another file
-                return writeFile(sockfd, resp_info->absPath);
+                //h2 frames the body itself: the listing is rendered as its DATA
+                //frames are sent, and ends with the last one
+                listing_t* listing = openListing(resp_info);
+                if(!listing)
+                        return -1;
+
+                response->length = -1;
+                response->read = readListing;
+                response->close = closeListing;
+                response->source = listing;
         }
 
-        debug_print("%s\n", "writeResponse END");
+        char number[32];
+        char date[DATE_VALUE_LENGTH + 1];
+        char etag[MANIFEST_ETAG_SIZE];
+
+        char* pos = response->headers;
+        pos += hpack_encode_status(pos, CODE_OK);
+        pos = encodeH2Common(pos);
+        if(resp_info->mime)
+                pos += hpack_encode_header(pos, HPACK_CONTENT_TYPE, resp_info->mime->type, strlen(resp_info->mime->type));
+        if(response->length >= 0)
+                pos += hpack_encode_header(pos, HPACK_CONTENT_LENGTH, number, sprintf(number, "%ld", response->length));
+        if(!resp_info->isPathDir || resp_info->foundFile)
+                pos += hpack_encode_header(pos, HPACK_ETAG, etag, getEtag(resp_info, &statBuff, etag));
+        pos += hpack_encode_header(pos, HPACK_LAST_MODIFIED, date, format_http_date(statBuff.st_mtime, date));
+
+        response->headers_length = pos - response->headers;
         return 0;
 }
 
 /*********************************/
 /*********************************/
 /*********************************/
-//read file and write to client
-int writeFile(int sockfd, char* absPath) {
-        debug_print("%s\n", "writeFile START");
-
-        int fd = open(absPath, O_RDONLY);
-        if(fd < 0) {
-                debug_print("\t%s\n", "open file failed");
-                return -1;
+//the h2 counterpart of serveFromBundle. the body is sent with sendfile()
+//from the bundle file, which stays readable after a swap for as long as
+//the descriptor is open.
+//returns CODE_OK, or the error to answer with
+int constructH2FromBundle(h2_request_t* request, char* path, h2_response_t* response) {
+
+        bundle_t* bundle = acquire_bundle(sBundles);
+        int code;
+        const bundle_entry_t* entry = findInBundle(bundle, path, &code);
+        if(!entry) {
+                release_bundle(sBundles, bundle);
+                return code;
         }
 
-        int nBytes;
-        int mBytes;
-        char buffer[SIZE_WRITE_BUFFER + 1];
-        memset(buffer, 0, sizeof(buffer));
-        int bytes_read = 0;
-        int bytes_written = 0;
-
-        while((nBytes = read(fd, buffer, SIZE_WRITE_BUFFER)) > 0) {
-
-                if(nBytes < 0) {
-                        debug_print("\t%s\n", "reading file failed");
-                        close(fd);
-                        return -1;
+        const char* accept = NULL;
+        int accept_length = 0;
+        int i;
+        for(i = 0; i < request->num_of_headers; i++) {
+                if(!strcmp(request->headers[i].name, "accept-encoding")) {
+                        accept = request->headers[i].value;
+                        accept_length = request->headers[i].value_length;
                 }
+        }
+        const bundle_body_t* body = pickBundleBody(entry, accept, accept_length);
 
-                bytes_read += nBytes;
-                bytes_written = 0;
-                while(bytes_written < nBytes) {
+        if(body->length && (response->fd = fcntl(bundle->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+                release_bundle(sBundles, bundle);
+                return CODE_INTERNAL_ERROR;
+        }
+        response->offset = body->offset;
+        response->length = body->length;
+
+        char number[32];
+        char date[DATE_VALUE_LENGTH + 1];
+
+        char* pos = response->headers;
+        pos += hpack_encode_status(pos, CODE_OK);
+        pos = encodeH2Common(pos);
+        if(entry->type_length)
+                pos += hpack_encode_header(pos, HPACK_CONTENT_TYPE, bundle->data + entry->type_offset, entry->type_length);
+        pos += hpack_encode_header(pos, HPACK_CONTENT_LENGTH, number, sprintf(number, "%ld", response->length));
+        pos += hpack_encode_header(pos, HPACK_ETAG, bundle->data + body->etag_offset, body->etag_length);
+        pos += hpack_encode_header(pos, HPACK_LAST_MODIFIED, date, format_http_date(entry->mtime, date));
+        if(body == &entry->gzip)
+                pos += hpack_encode_header(pos, HPACK_CONTENT_ENCODING, GZIP_CODING, strlen(GZIP_CODING));
+        if(entry->gzip.length)
+                pos += hpack_encode_header(pos, HPACK_VARY, "accept-encoding", strlen("accept-encoding"));
+
+        response->headers_length = pos - response->headers;
+        release_bundle(sBundles, bundle);
+        return CODE_OK;
+}
 
-                        if((mBytes = write(sockfd, buffer, nBytes - bytes_written)) < 0) {
-                                debug_print("%s\n", "writing file failed");
-                                close(fd);
-                                return -1;
-                        }
+/*********************************/
+/*********************************/
+/*********************************/
+//the h2 counterpart of sendStaticResponse, unknown codes become CODE_INTERNAL_ERROR
+void constructH2Error(int type, char* path, h2_response_t* response) {
+
+        char location[SIZE_LOCATION + 1];
+        int location_length = type == CODE_FOUND ? encodePath(path, location, SIZE_LOCATION) : 0;
+        if(!getStatusTemplate(type) || type == CODE_OK || location_length < 0)
+                type = CODE_INTERNAL_ERROR;
+
+        response->body = getResponseBody(type);
+        response->length = response->body ? strlen(response->body) : 0;
+
+        const mime_type_t* html = get_mime_type(DEFAULT_FILE);
+        char number[32];
+
+        char* pos = response->headers;
+        pos += hpack_encode_status(pos, type);
+        pos = encodeH2Common(pos);
+        if(type == CODE_FOUND) {
+                location[location_length++] = '/';
+                pos += hpack_encode_header(pos, HPACK_LOCATION, location, location_length);
+        }
+        if(type == CODE_TOO_MANY_REQUESTS)
+                pos += hpack_encode_header(pos, HPACK_RETRY_AFTER, "1", 1);
+        pos += hpack_encode_header(pos, HPACK_CONTENT_TYPE, html->type, strlen(html->type));
+        pos += hpack_encode_header(pos, HPACK_CONTENT_LENGTH, number, sprintf(number, "%ld", response->length));
 
-                        bytes_written += mBytes;
-                }
+        response->headers_length = pos - response->headers;
+}
 
-        }
+/*********************************/
+/*********************************/
+/*********************************/
+//server and date, sent with every h2 response. returns the new end of buf
+char* encodeH2Common(char* buf) {
 
+        char date[DATE_HEADER_LENGTH];
+        get_date_header(date);
 
-        close(fd);
-        debug_print("%s\n", "writeFile END");
-        return 0;
+        buf += hpack_encode_header(buf, HPACK_SERVER, SERVER_NAME, strlen(SERVER_NAME));
+        buf += hpack_encode_header(buf, HPACK_DATE, date + DATE_VALUE_OFFSET, DATE_VALUE_LENGTH);
+        return buf;
 }
 
 
@@ -951,10 +3680,14 @@ void initResponseInfo(response_info_t* resp_info) {
 
         resp_info->isPathDir = 0;
         resp_info->foundFile = 0;
-        resp_info->numOfFiles = 0;
-        resp_info->fileList = NULL;
+        resp_info->isHttp11 = 0;
+        resp_info->keepAlive = 0;
         resp_info->absPath = NULL;
-        resp_info->root = NULL;
+        resp_info->host = NULL;
+        resp_info->mime = NULL;
+        resp_info->meta = NULL;
+        memset(&resp_info->fileStats, 0, sizeof(resp_info->fileStats));
+        resp_info->stats = NULL;
 }
 
 /*********************************/
@@ -973,17 +3706,9 @@ void freeResponseInfo(response_info_t* resp_info) {
                 free(resp_info->absPath);
         }
 
-        if(resp_info->root) {
-                debug_print("\t%s\n", "freeing root");
-                free(resp_info->root);
-        }
-
-        if(resp_info->fileList) {
-                debug_print("\t%s\n", "freeing sFileList");
-                int i;
-                for(i = 0; i < resp_info->numOfFiles; i++)
-                        free(resp_info->fileList[i]);
-                free(resp_info->fileList);
+        if(resp_info->stats) {
+                free(resp_info->stats->paths);
+                free(resp_info->stats);
         }
         free(resp_info);
         debug_print("%s\n", "freeResponseInfo END");
@@ -992,42 +3717,159 @@ void freeResponseInfo(response_info_t* resp_info) {
 /*********************************/
 /*********************************/
 /*********************************/
-//replace occurences of orig in str with replace.
-//since str is static, lenght of replace must be <= from lenght of orig
-int replaceSubstring(char* str, char* orig, char* replace) {
-        debug_print("%s\n", "replaceSubstring START");
+//returns the value of a hex digit, -1 if c is not one
+int hexValue(char c) {
+
+        if(c >= '0' && c <= '9')
+                return c - '0';
+        if(c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
 
-        int orig_length = strlen(orig);
-        if(strlen(replace) > orig_length)
-                return -1;
+/*********************************/
+/*********************************/
+/*********************************/
+//percent-encodes every byte of path but unreserved ones and '/' into target,
+//size bytes - so it can go into a URL, an HTML attribute or a header as is.
+//returns the length written, -1 if it does not fit
+int encodePath(const char* path, char* target, int size) {
+
+        static const char hex[] = "0123456789ABCDEF";
+        int length = 0;
+        for(; *path; path++) {
+
+                unsigned char c = *path;
+                if(length + 4 > size)
+                        return -1;
+                if(isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' || c == '/') {
+                        target[length++] = c;
+                } else {
+                        target[length++] = '%';
+                        target[length++] = hex[c >> 4];
+                        target[length++] = hex[c & 0xf];
+                }
+        }
 
-        char* origPtr;
+        target[length] = '\0';
+        return length;
+}
 
-        while((origPtr = strstr(str, orig))) {
+/*********************************/
+/*********************************/
+/*********************************/
+//writev until every iovec was written (through the TLS session if it is
+//not offloaded). returns 0 on success, -1 on failure
+int writeAll(int fd, struct iovec* iov, int iovcnt) {
 
-                //create char* with replace
-                char temp[strlen(origPtr) + orig_length + 1];
-                memset(temp, 0, sizeof(temp));
-                strcat(temp, replace);
-                strcat(temp, origPtr + orig_length);
+        long total = 0;
+        int i;
+        for(i = 0; i < iovcnt; i++)
+                total += iov[i].iov_len;
+
+        if(inUserSpaceTls()) {
+                if(tls_writev(tTls, iov, iovcnt))
+                        return -1;
+                tBytesSent += total;
+                return 0;
+        }
+
+        while(iovcnt > 0) {
+
+                ssize_t nBytes = writev(fd, iov, iovcnt);
+                if(nBytes < 0) {
+                        if((errno == EAGAIN || errno == EWOULDBLOCK) && !waitForSocket(fd, EPOLLOUT))
+                                continue;
+                        return -1;
+                }
+
+                //skip what was written, possibly part of an iovec
+                while(iovcnt > 0 && nBytes >= (ssize_t)iov->iov_len) {
+                        nBytes -= iov->iov_len;
+                        iov++;
+                        iovcnt--;
+                }
+                if(iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + nBytes;
+                        iov->iov_len -= nBytes;
+                }
+        }
+
+        tBytesSent += total;
+        return 0;
+}
 
-                //replace rest of str with temp
-                memset(origPtr, 0, strlen(origPtr));
-                strcat(origPtr, temp);
-                debug_print("\torigPtr = %s, temp = %s, str = %s\n", origPtr, temp, str);
+/*********************************/
+/*********************************/
+/*********************************/
+//waits until the non-blocking sockfd is ready for events (EPOLLIN or
+//EPOLLOUT): a fiber suspends, other threads poll.
+//returns 0 when ready, -1 on failure
+int waitForSocket(int sockfd, int events) {
+
+        //other fibers run meanwhile, on this thread
+        long sent = tBytesSent;
+        tls_conn_t* tls = tTls;
+        if(wait_for_fd(sockfd, events)) {
+
+                //EPOLLIN and EPOLLOUT are POLLIN and POLLOUT
+                struct pollfd pfd;
+                pfd.fd = sockfd;
+                pfd.events = events;
+                if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                        return -1;
         }
+        tBytesSent = sent;
+        tTls = tls;
 
-        debug_print("%s\n", "replaceSubstring END");
         return 0;
 }
 
+/*********************************/
+/*********************************/
+/*********************************/
+//writes value followed by CRLF, returns position after it
+char* appendNumber(char* buf, long value) {
+
+        char digits[24];
+        int i = sizeof(digits);
+
+        do {
+                digits[--i] = '0' + value % 10;
+                value /= 10;
+        } while(value > 0);
+
+        buf = mempcpy(buf, digits + i, sizeof(digits) - i);
+        return mempcpy(buf, "\r\n", 2);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//hasPermissions, answered by the manifest when it has a current entry of
+//path (st is its fresh stat)
+int checkPermissions(char* path, struct stat* st, response_info_t* resp_info) {
+
+        const manifest_entry_t* meta = sManifest ? lookup_manifest(sManifest, path, st) : NULL;
+        if(!meta)
+                return hasPermissions(path, resp_info);
+
+        metric_inc(METRIC_MANIFEST_HITS);
+        resp_info->meta = meta;
+        return meta->permitted ? 0 : -1;
+}
+
 /*********************************/
 /*********************************/
 /*********************************/
 
-int hasPermissions(char* path, char* root) {
+int hasPermissions(char* path, response_info_t* resp_info) {
         debug_print("%s\n", "hasPermissions");
 
+        char* root = resp_info->host->root;
+
         char temp[strlen(path) + 1];
         memset(temp, 0, sizeof(temp));
         strcat(temp, path);
@@ -1042,7 +3884,7 @@ int hasPermissions(char* path, char* root) {
         debug_print("\t%s\n", "starting while loop");
         while((s = strrchr(t, '/'))) {
                 debug_print("\t\tpath = %s\n", t);
-                stat(t, &statbuf);
+                statPath(resp_info, t, &statbuf);
 
                 if(S_ISDIR(statbuf.st_mode) && !(statbuf.st_mode & S_IXOTH)) {
                         flag = -1;
@@ -1062,6 +3904,196 @@ int hasPermissions(char* path, char* root) {
         return flag;
 }
 
+/*********************************/
+/*********************************/
+/*********************************/
+//stat() that is answered from the prefetched batch when the path is in it
+int statPath(response_info_t* resp_info, char* path, struct stat* buf) {
+
+        stat_batch_t* batch = resp_info->stats;
+        int i;
+        for(i = 0; batch && i < batch->count; i++) {
+
+                stat_entry_t* entry = &batch->entries[i];
+                if(strcmp(entry->path, path))
+                        continue;
+
+                if(entry->result < 0) {
+                        errno = -entry->result;
+                        return -1;
+                }
+
+                //only the fields the server and the file cache look at
+                memset(buf, 0, sizeof(*buf));
+                buf->st_mode = entry->stx.stx_mode;
+                buf->st_size = entry->stx.stx_size;
+                buf->st_mtim.tv_sec = entry->stx.stx_mtime.tv_sec;
+                buf->st_mtim.tv_nsec = entry->stx.stx_mtime.tv_nsec;
+                buf->st_ctim.tv_sec = entry->stx.stx_ctime.tv_sec;
+                buf->st_ctim.tv_nsec = entry->stx.stx_ctime.tv_nsec;
+                buf->st_ino = entry->stx.stx_ino;
+                buf->st_dev = makedev(entry->stx.stx_dev_major, entry->stx.stx_dev_minor);
+                return 0;
+        }
+
+        return fstatat(resp_info->host->root_fd, relativePath(resp_info, path), buf, 0);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//path (under the host's root) relative to the root, for the *at() calls
+//resolving it from the host's root_fd. lookups skip walking the root itself.
+const char* relativePath(response_info_t* resp_info, const char* path) {
+
+        const vhost_t* host = resp_info->host;
+        if(strncmp(path, host->root, host->root_length))
+                return path; //absolute paths ignore the fd
+
+        path += host->root_length;
+        while(*path == '/')
+                path++;
+        return *path ? path : ".";
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//statx absPath and every ancestor up to root (what parsePath and
+//hasPermissions look at) in a single submission. no-op without io_uring.
+void prefetchStats(response_info_t* resp_info) {
+
+        uring_t* ring = getThreadRing();
+        if(!ring)
+                return;
+
+        stat_batch_t* batch = (stat_batch_t*)calloc(1, sizeof(stat_batch_t));
+        if(!batch)
+                return;
+
+        //a directory may be answered with its DEFAULT_FILE, stat that chain too
+        char* absPath = resp_info->absPath;
+        int absPath_length = strlen(absPath);
+        int isDir = absPath_length && absPath[absPath_length - 1] == '/';
+        char full[absPath_length + strlen(DEFAULT_FILE) + 1];
+        sprintf(full, "%s%s", absPath, isDir ? DEFAULT_FILE : "");
+
+        int lengths[MAX_STAT_BATCH];
+        int count = 0;
+        int total = 0;
+        if(isDir) {
+                lengths[count++] = absPath_length;
+                total += absPath_length + 1;
+        }
+
+        int length = strlen(full);
+        int root_length = resp_info->host->root_length;
+        while(length > 0 && count < MAX_STAT_BATCH) {
+
+                lengths[count++] = length;
+                total += length + 1;
+                if(length == root_length && !strncmp(full, resp_info->host->root, length))
+                        break;
+
+                char* s = memrchr(full, '/', length);
+                if(!s)
+                        break;
+                length = s - full;
+        }
+
+        batch->paths = (char*)malloc(total);
+        if(!batch->paths) {
+                free(batch);
+                return;
+        }
+
+        int i;
+        char* pos = batch->paths;
+        for(i = 0; i < count; i++) {
+
+                stat_entry_t* entry = &batch->entries[i];
+                entry->path = pos;
+                pos = mempcpy(pos, full, lengths[i]);
+                *pos++ = '\0';
+
+                struct io_uring_sqe* sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (unsigned long)entry->path;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (unsigned long)&entry->stx;
+                sqe->user_data = i;
+        }
+
+        int results[MAX_STAT_BATCH];
+        if(reapCompletions(ring, results, count, count)) {
+                free(batch->paths);
+                free(batch);
+                return;
+        }
+
+        for(i = 0; i < count; i++)
+                batch->entries[i].result = results[i];
+        batch->count = count;
+        resp_info->stats = batch;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the calling thread's ring, NULL when io_uring is off or unavailable
+uring_t* getThreadRing() {
+
+        if(!sUseUring || tRing || tRingFailed)
+                return tRing;
+
+        tRing = create_uring(URING_ENTRIES, SIZE_URING_BUFFER);
+        if(!tRing) {
+                fprintf(stderr, "io_uring setup failed, worker uses classic I/O\n");
+                tRingFailed = 1;
+        }
+
+        return tRing;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//submits the prepared ops and waits for ops completions.
+//results[user_data] gets each op's result.
+//returns 0 on success, -1 on failure
+int reapCompletions(uring_t* ring, int* results, int num_of_results, int ops) {
+
+        if(uring_submit_and_wait(ring, ops) < 0)
+                return -1;
+
+        struct io_uring_cqe* cqe;
+        while(ops > 0 && (cqe = uring_peek_cqe(ring))) {
+
+                if(cqe->user_data < num_of_results)
+                        results[cqe->user_data] = cqe->res;
+                uring_cqe_seen(ring);
+                ops--;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//closes the direct descriptor of a chain that did not reach its close
+void closeFileUring(uring_t* ring) {
+
+        struct io_uring_sqe* sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = URING_FILE_SLOT + 1;
+        sqe->user_data = URING_OP_CLOSE;
+
+        int results[URING_OP_CLOSE + 1];
+        reapCompletions(ring, results, URING_OP_CLOSE + 1, 1);
+}
+
 /******************************************************************************/
 /******************************************************************************/
 /******************************************************************************/
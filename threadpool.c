@@ -7,17 +7,39 @@
 #define debug_print(fmt, ...) \
            do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
 
-pthread_t* initThreads(threadpool*, int);
-int enqueue_job(threadpool*, work_t*);
+pthread_t* initThreads(threadpool*, int, size_t);
+int enqueue_job(threadpool*, int, work_t*);
+void wake_worker(threadpool*, int);
+work_t* take_job(threadpool*, int);
 
 /******************************************************************************/
 /******************************************************************************/
 /******************************************************************************/
 
 threadpool* create_threadpool(int num_threads_in_pool) {
-        debug_print("%s\n", "create_threadpool");
+
+        return create_threadpool_lanes(num_threads_in_pool, 0);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+threadpool* create_threadpool_lanes(int num_threads_in_pool, int reserved) {
+
+        return create_threadpool_stack(num_threads_in_pool, reserved, 0);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+threadpool* create_threadpool_stack(int num_threads_in_pool, int reserved, size_t stack_size) {
+        debug_print("%s\n", "create_threadpool_stack");
         if(num_threads_in_pool <= 0 || num_threads_in_pool > MAXT_IN_POOL)
                 return NULL;
+        if(reserved < 0 || reserved >= num_threads_in_pool)
+                return NULL;
 
         threadpool* pool = (threadpool*)calloc(1, sizeof(threadpool));
         if(pool == NULL) {
@@ -26,9 +48,8 @@ threadpool* create_threadpool(int num_threads_in_pool) {
         }
 
         pool->num_threads = num_threads_in_pool;
+        pool->reserved = reserved;
         pool->qsize = 0;
-        pool->qhead = NULL;
-        pool->qtail = NULL;
         pool->shutdown = 0;
         pool->dont_accept = 0;
 
@@ -40,12 +61,12 @@ threadpool* create_threadpool(int num_threads_in_pool) {
                 fprintf(stderr, "pthread_cond_init\n");
                 exit(-1);
         }
-        if(pthread_cond_init(&pool->q_empty, NULL)) {
+        if(pthread_cond_init(&pool->q_empty, NULL) || pthread_cond_init(&pool->q_reserved, NULL)) {
                 fprintf(stderr, "pthread_cond_init\n");
                 exit(-1);
         }
 
-        pool->threads = initThreads(pool, num_threads_in_pool);
+        pool->threads = initThreads(pool, num_threads_in_pool, stack_size);
 
         return pool;
 }
@@ -54,7 +75,7 @@ threadpool* create_threadpool(int num_threads_in_pool) {
 /*********************************/
 /*********************************/
 
-pthread_t* initThreads(threadpool* pool, int num_of_threads) {
+pthread_t* initThreads(threadpool* pool, int num_of_threads, size_t stack_size) {
 
         pthread_t* threads = (pthread_t*)calloc(num_of_threads, sizeof(pthread_t));
         if(threads == NULL) {
@@ -62,15 +83,23 @@ pthread_t* initThreads(threadpool* pool, int num_of_threads) {
                 exit(-1);
         }
 
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(stack_size && pthread_attr_setstacksize(&attr, stack_size)) {
+                fprintf(stderr, "pthread_attr_setstacksize\n");
+                exit(-1);
+        }
+
         int i;
         for(i = 0; i < num_of_threads; i++) {
 
-                if(pthread_create(&threads[i], NULL, do_work, pool)) {
+                if(pthread_create(&threads[i], &attr, do_work, pool)) {
                         fprintf(stderr, "pthread_create\n");
                         exit(-1);
                 }
         }
 
+        pthread_attr_destroy(&attr);
         return threads;
 }
 
@@ -81,7 +110,16 @@ pthread_t* initThreads(threadpool* pool, int num_of_threads) {
 
 void dispatch(threadpool* from_me, dispatch_fn dispath_to_here, void* arg) {
 
-        if(from_me == NULL || dispath_to_here == NULL) {
+        dispatch_lane(from_me, LANE_INTERACTIVE, dispath_to_here, arg);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void dispatch_lane(threadpool* from_me, int lane, dispatch_fn dispath_to_here, void* arg) {
+
+        if(from_me == NULL || dispath_to_here == NULL || lane < 0 || lane >= NUM_OF_LANES) {
                 fprintf(stderr, "dispatch - param passed is NULL\n");
                 return;
         }
@@ -108,7 +146,7 @@ void dispatch(threadpool* from_me, dispatch_fn dispath_to_here, void* arg) {
         new_job->arg = arg;
         new_job->next = NULL;
 
-        if(enqueue_job(from_me, new_job))
+        if(enqueue_job(from_me, lane, new_job))
                 return;
         debug_print("\t%s\n", "done");
         pthread_mutex_unlock(&from_me->qlock);
@@ -118,26 +156,116 @@ void dispatch(threadpool* from_me, dispatch_fn dispath_to_here, void* arg) {
 /*********************************/
 /*********************************/
 
-int enqueue_job(threadpool* pool, work_t* job) {
-        debug_print("\t%s\n", "enqueue_job");
-        if(pool->qsize == 0) {
-                debug_print("\t\t%s\n", "1st job");
-                pool->qhead = job;
-                pool->qtail = job;
-                pool->qsize++;
-                if(pthread_cond_signal(&pool->q_empty)) {
-                        pthread_mutex_unlock(&pool->qlock);
-                        fprintf(stderr, "pthread_cond_signal\n");
-                        return -1;
-                }
+int dispatch_batch(threadpool* from_me, batch_job_t* jobs, int count) {
+
+        if(from_me == NULL || jobs == NULL || count <= 0) {
+                if(count)
+                        fprintf(stderr, "dispatch_batch - param passed is NULL\n");
                 return 0;
         }
 
-        pool->qtail->next = job;
-        pool->qtail = job;
+        //allocated before the lock is taken, so it is held only to link them
+        work_t* new_jobs[count];
+        int i;
+        for(i = 0; i < count; i++) {
+
+                if(jobs[i].routine == NULL || jobs[i].lane < 0 || jobs[i].lane >= NUM_OF_LANES) {
+                        fprintf(stderr, "dispatch_batch - param passed is NULL\n");
+                        break;
+                }
+                if(!(new_jobs[i] = (work_t*)calloc(1, sizeof(work_t))))
+                        break;
+
+                new_jobs[i]->routine = jobs[i].routine;
+                new_jobs[i]->arg = jobs[i].arg;
+        }
+        int allocated = i;
+        int ready = i;
+
+        debug_print("dispatch_batch - %d jobs\n", ready);
+        if(pthread_mutex_lock(&from_me->qlock)) {
+                fprintf(stderr, "pthread_mutex_lock\n");
+                ready = 0;
+        } else if(from_me->dont_accept) {
+                pthread_mutex_unlock(&from_me->qlock);
+                ready = 0;
+        } else {
+                //each one wakes a thread only while some idle one is not signaled yet
+                for(i = 0; i < ready; i++)
+                        enqueue_job(from_me, jobs[i].lane, new_jobs[i]);
+                pthread_mutex_unlock(&from_me->qlock);
+        }
+
+        for(i = ready; i < allocated; i++)
+                free(new_jobs[i]);
+        return ready;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int enqueue_job(threadpool* pool, int lane, work_t* job) {
+        debug_print("\t%s %d\n", "enqueue_job - lane", lane);
+        lane_t* queue = &pool->lanes[lane];
+        if(queue->qsize == 0)
+                queue->qhead = job;
+        else
+                queue->qtail->next = job;
+        queue->qtail = job;
+        queue->qsize++;
         pool->qsize++;
+
+        wake_worker(pool, lane);
         return 0;
+}
 
+/*********************************/
+/*********************************/
+/*********************************/
+//signals one idle thread that can run a job of lane, if none was signaled
+//for it already. interactive jobs go to reserved threads first. qlock held.
+void wake_worker(threadpool* pool, int lane) {
+
+        if(lane == LANE_INTERACTIVE && pool->idle_reserved > pool->woken_reserved) {
+                pool->woken_reserved++;
+                pthread_cond_signal(&pool->q_reserved);
+                return;
+        }
+
+        if(pool->idle_shared > pool->woken_shared) {
+                pool->woken_shared++;
+                pthread_cond_signal(&pool->q_empty);
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//dequeues the next job a thread may run, NULL if there is none.
+//interactive jobs go first, but a waiting bulk job is taken after
+//LANE_WEIGHT of them in a row. qlock held.
+work_t* take_job(threadpool* pool, int reserved) {
+
+        lane_t* interactive = &pool->lanes[LANE_INTERACTIVE];
+        lane_t* bulk = &pool->lanes[LANE_BULK];
+
+        lane_t* queue = interactive;
+        if(!reserved && bulk->qsize && (!interactive->qsize || pool->streak >= LANE_WEIGHT))
+                queue = bulk;
+        if(!queue->qsize)
+                return NULL;
+
+        if(queue == bulk)
+                pool->streak = 0;
+        else if(bulk->qsize)
+                pool->streak++;
+
+        work_t* job = queue->qhead;
+        queue->qhead = job->next;
+        queue->qsize--;
+        pool->qsize--;
+        return job;
 }
 
 /******************************************************************************/
@@ -153,6 +281,11 @@ void* do_work(void* p) {
 
         threadpool* pool = (threadpool*) p;
 
+        //the first threads to start are the reserved ones
+        pthread_mutex_lock(&pool->qlock);
+        int reserved = pool->started++ < pool->reserved;
+        pthread_mutex_unlock(&pool->qlock);
+
         while(1) {
                 debug_print("\t attemping mutex - tid = %d\n", (int)pthread_self());
                 if(pthread_mutex_lock(&pool->qlock)) {
@@ -166,26 +299,30 @@ void* do_work(void* p) {
                         return 0;
                 }
 
-                if(!(pool->qsize)) {
+                //another thread may take the job between the signal and our wakeup
+                work_t* job;
+                while(!(job = take_job(pool, reserved)) && !pool->shutdown) {
                         debug_print("\tqueue empty -> waiting - tid = %d\n", (int)pthread_self());
-                        if(pthread_cond_wait(&pool->q_empty, &pool->qlock)) {
+                        int* idle = reserved ? &pool->idle_reserved : &pool->idle_shared;
+                        int* woken = reserved ? &pool->woken_reserved : &pool->woken_shared;
+                        (*idle)++;
+                        int error = pthread_cond_wait(reserved ? &pool->q_reserved : &pool->q_empty, &pool->qlock);
+                        (*idle)--;
+                        if(*woken > 0)
+                                (*woken)--;
+                        if(error) {
                                 pthread_mutex_unlock(&pool->qlock);
                                 fprintf(stderr, "pthread_cond_wait\n");
                                 return 0;
                         }
                 }
 
-                if(pool->shutdown) {
+                if(!job) {
                         pthread_mutex_unlock(&pool->qlock);
                         debug_print("\tshutdown 2 - tid = %d\n", (int)pthread_self());
                         return 0;
                 }
-
-                debug_print("\tdequeueing job - tid = %d\n", (int)pthread_self());
-                //dequeue job
-                work_t* job = pool->qhead;
-                pool->qhead = job->next;
-                pool->qsize--;
+                debug_print("\tdequeued job - tid = %d\n", (int)pthread_self());
 
 
                 //notify destroy function
@@ -242,6 +379,7 @@ void destroy_threadpool(threadpool* destroyme) {
         destroyme->shutdown = 1;
         //wake sleeping threads
         pthread_cond_broadcast(&destroyme->q_empty);
+        pthread_cond_broadcast(&destroyme->q_reserved);
 
         pthread_mutex_unlock(&destroyme->qlock);
         int i;
@@ -253,6 +391,7 @@ void destroy_threadpool(threadpool* destroyme) {
         debug_print("%s\n", "destroying pool");
         pthread_mutex_destroy(&destroyme->qlock);
         pthread_cond_destroy(&destroyme->q_empty);
+        pthread_cond_destroy(&destroyme->q_reserved);
         pthread_cond_destroy(&destroyme->q_not_empty);
         free(destroyme->threads);
         free(destroyme);
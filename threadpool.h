@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <stddef.h>
 
 /**
  * threadpool.h
@@ -10,6 +11,14 @@
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
+// lanes, each with its own queue. a few threads are reserved for the
+// interactive lane, so small responses don't wait behind a burst of bulk
+// jobs holding every other thread.
+#define LANE_INTERACTIVE 0      // cheap jobs, and those of unknown cost
+#define LANE_BULK 1             // long running jobs, e.g. large downloads
+#define NUM_OF_LANES 2
+#define LANE_WEIGHT 4           // interactive jobs a shared thread runs in a row while bulk jobs wait
+
 
 /**
  * the pool holds a queue of this structure
@@ -21,18 +30,35 @@ typedef struct work_st{
 } work_t;
 
 
+/**
+ * one lane's queue
+ */
+typedef struct lane_st {
+      work_t* qhead;            //queue head pointer
+      work_t* qtail;            //queue tail pointer
+      int qsize;                //number in this lane
+} lane_t;
+
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
  	int num_threads;	//number of active threads
-	int qsize;	        //number in the queue
+	int qsize;	        //number in the queue, all lanes
 	pthread_t *threads;	//pointer to threads
-	work_t* qhead;		//queue head pointer
-	work_t* qtail;		//queue tail pointer
+	lane_t lanes[NUM_OF_LANES];
 	pthread_mutex_t qlock;		//lock on the queue list
 	pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
-	pthread_cond_t q_empty;
+	pthread_cond_t q_empty;         //shared threads wait here
+	pthread_cond_t q_reserved;      //threads reserved for LANE_INTERACTIVE wait here
+      int reserved;             //threads that only run LANE_INTERACTIVE jobs
+      int started;              //threads that took their role so far
+      int idle_shared;          //threads waiting on q_empty
+      int idle_reserved;        //threads waiting on q_reserved
+      int woken_shared;         //of those, already signaled
+      int woken_reserved;
+      int streak;               //interactive jobs run in a row while bulk jobs wait
       int shutdown;            //1 if the pool is in distruction process     
       int dont_accept;       //1 if destroy function has begun
 } threadpool;
@@ -46,6 +72,16 @@ typedef struct _threadpool_st {
 
 typedef int (*dispatch_fn)(void *);
 
+
+/**
+ * one job of a batch given to dispatch_batch
+ */
+typedef struct batch_job_st {
+      int lane;                 //LANE_INTERACTIVE or LANE_BULK
+      dispatch_fn routine;
+      void* arg;
+} batch_job_t;
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -58,6 +94,21 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_lanes creates a pool like create_threadpool, of which
+ * reserved threads only ever run LANE_INTERACTIVE jobs. the others run
+ * both lanes, interactive first, but never more than LANE_WEIGHT
+ * interactive jobs in a row while a bulk job waits.
+ * reserved must be less than num_threads_in_pool.
+ */
+threadpool* create_threadpool_lanes(int num_threads_in_pool, int reserved);
+
+/**
+ * create_threadpool_stack creates a pool like create_threadpool_lanes,
+ * whose threads get stacks of stack_size bytes (0 for the default).
+ */
+threadpool* create_threadpool_stack(int num_threads_in_pool, int reserved, size_t stack_size);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -72,6 +123,21 @@ threadpool* create_threadpool(int num_threads_in_pool);
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_lane enters a job like dispatch, into the queue of lane
+ * (LANE_INTERACTIVE or LANE_BULK). dispatch uses LANE_INTERACTIVE.
+ */
+void dispatch_lane(threadpool* from_me, int lane, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_batch enters count jobs, in order, like dispatch_lane does, but
+ * under one lock acquisition, and wakes one idle thread per job at most -
+ * no more than there are idle threads that may run them.
+ * returns the number of jobs entered (the first ones), less than count if
+ * the pool is being destroyed or memory ran out.
+ */
+int dispatch_batch(threadpool* from_me, batch_job_t* jobs, int count);
+
 /**
  * The work function of the thread
  * this function should:
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "timerwheel.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_TICKS ((1UL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1)
+
+static void* runWheel(void*);
+static void advanceWheel(timer_wheel_t*);
+static void cascade(timer_wheel_t*, int);
+static void insertTimer(timer_wheel_t*, wheel_timer_t*);
+static void unlinkTimer(timer_wheel_t*, wheel_timer_t*);
+static unsigned long ticksOf(timer_wheel_t*, int);
+static long nowMs();
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+timer_wheel_t* create_timer_wheel(int tick_ms) {
+
+        timer_wheel_t* wheel = (timer_wheel_t*)calloc(1, sizeof(timer_wheel_t));
+        if(!wheel)
+                return NULL;
+
+        wheel->tick_ms = tick_ms;
+        pthread_mutex_init(&wheel->lock, NULL);
+
+        //the thread sleeps until monotonic tick deadlines
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wheel->stop, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if(pthread_create(&wheel->thread, NULL, runWheel, wheel)) {
+                pthread_mutex_destroy(&wheel->lock);
+                pthread_cond_destroy(&wheel->stop);
+                free(wheel);
+                return NULL;
+        }
+
+        return wheel;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void init_timer(wheel_timer_t* timer, timer_fn callback, void* arg) {
+
+        memset(timer, 0, sizeof(wheel_timer_t));
+        timer->callback = callback;
+        timer->arg = arg;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void add_timer(timer_wheel_t* wheel, wheel_timer_t* timer, int timeout_ms) {
+
+        pthread_mutex_lock(&wheel->lock);
+
+        if(timer->pending)
+                unlinkTimer(wheel, timer);
+        timer->expires = wheel->now + ticksOf(wheel, timeout_ms);
+        insertTimer(wheel, timer);
+
+        pthread_mutex_unlock(&wheel->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void cancel_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+
+        //callbacks run under the lock, so taking it waits for a running one
+        pthread_mutex_lock(&wheel->lock);
+        if(timer->pending)
+                unlinkTimer(wheel, timer);
+        pthread_mutex_unlock(&wheel->lock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_timer_wheel(timer_wheel_t* wheel) {
+
+        pthread_mutex_lock(&wheel->lock);
+        wheel->shutdown = 1;
+        pthread_cond_signal(&wheel->stop);
+        pthread_mutex_unlock(&wheel->lock);
+
+        pthread_join(wheel->thread, NULL);
+        pthread_mutex_destroy(&wheel->lock);
+        pthread_cond_destroy(&wheel->stop);
+        free(wheel);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//wheel thread - catches up with the clock every tick, so a late wakeup
+//doesn't stretch the timeouts
+static void* runWheel(void* arg) {
+
+        timer_wheel_t* wheel = (timer_wheel_t*)arg;
+        long start = nowMs();
+
+        pthread_mutex_lock(&wheel->lock);
+        while(!wheel->shutdown) {
+
+                long next = start + (long)(wheel->now + 1) * wheel->tick_ms;
+                if(next > nowMs()) {
+                        struct timespec deadline;
+                        deadline.tv_sec = next / 1000;
+                        deadline.tv_nsec = (next % 1000) * 1000000;
+                        pthread_cond_timedwait(&wheel->stop, &wheel->lock, &deadline);
+                        continue;
+                }
+
+                advanceWheel(wheel);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//one tick: cascade wrapped levels, then expire the current level 0 slot
+static void advanceWheel(timer_wheel_t* wheel) {
+
+        wheel->now++;
+
+        int level;
+        for(level = 1; level < WHEEL_LEVELS; level++) {
+                if((wheel->now >> ((level - 1) * WHEEL_SLOT_BITS)) & SLOT_MASK)
+                        break;
+                cascade(wheel, level);
+        }
+
+        wheel_timer_t** slot = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while(*slot) {
+
+                wheel_timer_t* timer = *slot;
+                unlinkTimer(wheel, timer);
+
+                int again = timer->callback(timer->arg);
+                if(again > 0) {
+                        timer->expires = wheel->now + ticksOf(wheel, again);
+                        insertTimer(wheel, timer);
+                }
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//moves the current slot of level one level down
+static void cascade(timer_wheel_t* wheel, int level) {
+
+        int index = (wheel->now >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK;
+        wheel_timer_t* timer = wheel->slots[level][index];
+        wheel->slots[level][index] = NULL;
+
+        while(timer) {
+                wheel_timer_t* next = timer->next;
+                insertTimer(wheel, timer);
+                timer = next;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void insertTimer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+
+        unsigned long delta = timer->expires - wheel->now;
+
+        //the lowest level whose range covers delta
+        int level = 0;
+        while(level < WHEEL_LEVELS - 1 && delta >= (1UL << ((level + 1) * WHEEL_SLOT_BITS)))
+                level++;
+
+        int index = (timer->expires >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK;
+        wheel_timer_t** slot = &wheel->slots[level][index];
+
+        timer->prev = NULL;
+        timer->next = *slot;
+        if(*slot)
+                (*slot)->prev = timer;
+        *slot = timer;
+        timer->pending = 1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static void unlinkTimer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+
+        if(timer->prev) {
+                timer->prev->next = timer->next;
+        } else {
+                //first in its slot - find which one
+                int level;
+                for(level = 0; level < WHEEL_LEVELS; level++) {
+                        int index = (timer->expires >> (level * WHEEL_SLOT_BITS)) & SLOT_MASK;
+                        if(wheel->slots[level][index] == timer) {
+                                wheel->slots[level][index] = timer->next;
+                                break;
+                        }
+                }
+        }
+
+        if(timer->next)
+                timer->next->prev = timer->prev;
+
+        timer->prev = NULL;
+        timer->next = NULL;
+        timer->pending = 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//ms -> ticks, at least one tick and within the wheel's range
+static unsigned long ticksOf(timer_wheel_t* wheel, int timeout_ms) {
+
+        unsigned long ticks = (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+        if(ticks < 1)
+                ticks = 1;
+        if(ticks > MAX_TICKS)
+                ticks = MAX_TICKS;
+
+        return ticks;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static long nowMs() {
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,73 @@
+#include <pthread.h>
+
+/**
+ * timerwheel.h
+ *
+ * Hierarchical timer wheel shared by all connections.
+ * WHEEL_LEVELS wheels of WHEEL_SLOTS slots each; level 0 slots are one tick
+ * wide, every level above is WHEEL_SLOTS times coarser. Adding and
+ * cancelling a timer are O(1). Timers on a coarse level are moved down
+ * (cascaded) when the level below wraps around.
+ * A thread created with the wheel advances it every tick and runs the
+ * expired timers' callbacks.
+ */
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+/**
+ * runs on the wheel thread with the wheel locked: must be short, must not
+ * block and must not call into the wheel.
+ * returns 0 when done, or the number of ms after which to run again.
+ */
+typedef int (*timer_fn)(void* arg);
+
+typedef struct wheel_timer_st {
+        unsigned long expires;          //tick
+        timer_fn callback;
+        void* arg;
+        int pending;                    //1 while in a slot
+        struct wheel_timer_st* prev;
+        struct wheel_timer_st* next;
+} wheel_timer_t;
+
+typedef struct timer_wheel_st {
+        wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        unsigned long now;              //ticks since the wheel was created
+        int tick_ms;
+        pthread_mutex_t lock;
+        pthread_cond_t stop;            //wakes the thread up for shutdown
+        pthread_t thread;
+        int shutdown;
+} timer_wheel_t;
+
+
+/**
+ * create_timer_wheel creates a wheel advancing every tick_ms and starts its
+ * thread. returns NULL on failure.
+ */
+timer_wheel_t* create_timer_wheel(int tick_ms);
+
+/**
+ * init_timer sets the callback of a timer that is not pending.
+ */
+void init_timer(wheel_timer_t* timer, timer_fn callback, void* arg);
+
+/**
+ * (re)arms timer to expire in timeout_ms, rounded up to a whole tick.
+ * timeouts beyond the wheel's range are clamped to it.
+ */
+void add_timer(timer_wheel_t* wheel, wheel_timer_t* timer, int timeout_ms);
+
+/**
+ * disarms timer. once this returns the callback is neither running nor
+ * going to run, so the timer (and its arg) may be freed.
+ */
+void cancel_timer(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+/**
+ * destroy_timer_wheel stops the thread and frees the wheel.
+ * pending timers are dropped without running.
+ */
+void destroy_timer_wheel(timer_wheel_t* wheel);
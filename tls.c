@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define SIZE_RECORD 16384       //largest TLS record payload
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+SSL_CTX* create_tls_context(const char* cert_file, const char* key_file) {
+
+        SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+        if(!ctx)
+                return NULL;
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+        if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+           SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+           SSL_CTX_check_private_key(ctx) != 1) {
+                ERR_print_errors_fp(stderr);
+                SSL_CTX_free(ctx);
+                return NULL;
+        }
+
+        return ctx;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+tls_conn_t* tls_accept(SSL_CTX* ctx, int sockfd) {
+
+        tls_conn_t* conn = (tls_conn_t*)calloc(1, sizeof(tls_conn_t));
+        if(!conn)
+                return NULL;
+
+        conn->sockfd = sockfd;
+        conn->ssl = SSL_new(ctx);
+        if(!conn->ssl || SSL_set_fd(conn->ssl, sockfd) != 1 || SSL_accept(conn->ssl) != 1) {
+                debug_print("tls_accept - handshake failed on %d\n", sockfd);
+                ERR_clear_error();
+                SSL_free(conn->ssl);
+                free(conn);
+                return NULL;
+        }
+
+        //OpenSSL switched the socket to kTLS during the handshake, if it could
+        conn->offloaded = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+        debug_print("tls_accept - %d, %s, offloaded = %d\n", sockfd, SSL_get_version(conn->ssl), conn->offloaded);
+        return conn;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int tls_read(tls_conn_t* conn, char* buf, int size) {
+
+        int nBytes = SSL_read(conn->ssl, buf, size);
+        if(nBytes > 0)
+                return nBytes;
+
+        int error = SSL_get_error(conn->ssl, nBytes);
+        ERR_clear_error();
+        return error == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//small iovecs (headers) are gathered so they share a record with what follows
+int tls_writev(tls_conn_t* conn, struct iovec* iov, int iovcnt) {
+
+        char record[SIZE_RECORD];
+        int length = 0;
+
+        int i;
+        for(i = 0; i < iovcnt; i++) {
+
+                char* data = (char*)iov[i].iov_base;
+                size_t left = iov[i].iov_len;
+                while(left > 0) {
+
+                        size_t chunk = SIZE_RECORD - length;
+                        if(chunk > left)
+                                chunk = left;
+                        memcpy(record + length, data, chunk);
+                        length += chunk;
+                        data += chunk;
+                        left -= chunk;
+
+                        if(length == SIZE_RECORD) {
+                                if(SSL_write(conn->ssl, record, length) != length)
+                                        return -1;
+                                length = 0;
+                        }
+                }
+        }
+
+        if(length && SSL_write(conn->ssl, record, length) != length)
+                return -1;
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int tls_send_file(tls_conn_t* conn, int fd, long size) {
+
+        off_t offset = 0;
+        while(offset < size) {
+
+                char record[SIZE_RECORD];
+                long chunk = size - offset < SIZE_RECORD ? size - offset : SIZE_RECORD;
+                ssize_t nBytes = pread(fd, record, chunk, offset);
+                if(nBytes > 0 && SSL_write(conn->ssl, record, nBytes) != nBytes)
+                        return -1;
+
+                if(nBytes < 0)
+                        return -1;
+                if(!nBytes)
+                        break; //file was truncated, nothing more to send
+                offset += nBytes;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void tls_close(tls_conn_t* conn) {
+
+        if(!conn)
+                return;
+
+        //one way close_notify, the client's is not waited for
+        SSL_shutdown(conn->ssl);
+        ERR_clear_error();
+        SSL_free(conn->ssl);
+        free(conn);
+}
@@ -0,0 +1,60 @@
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+/**
+ * tls.h
+ *
+ * HTTPS with kernel TLS (kTLS) offload.
+ * The handshake runs in user space (OpenSSL); OpenSSL then installs the
+ * session keys into the socket where the kernel supports it. From that point
+ * the socket takes plain bytes: write(), writev() and sendfile() on it are
+ * encrypted by the kernel, so the server's regular send paths keep working
+ * and files still never pass through user space.
+ * Without kernel support the session stays in user space and everything
+ * sent has to go through tls_writev/tls_send_file.
+ */
+
+#define TLS_RECORD_HANDSHAKE 0x16       //first byte a TLS client sends
+
+typedef struct tls_conn_st {
+        SSL* ssl;
+        int sockfd;
+        int offloaded;          //the kernel encrypts what is written to sockfd
+} tls_conn_t;
+
+
+/**
+ * create_tls_context loads the certificate chain and the private key (PEM).
+ * returns the context shared by all connections, NULL on failure.
+ */
+SSL_CTX* create_tls_context(const char* cert_file, const char* key_file);
+
+/**
+ * runs the server side handshake on sockfd (blocking).
+ * returns the session, NULL if the handshake failed.
+ */
+tls_conn_t* tls_accept(SSL_CTX* ctx, int sockfd);
+
+/**
+ * reads decrypted bytes into buf.
+ * returns bytes read, 0 once the client closed, -1 on failure.
+ */
+int tls_read(tls_conn_t* conn, char* buf, int size);
+
+/**
+ * encrypts and sends every iovec.
+ * returns 0 on success, -1 on failure.
+ */
+int tls_writev(tls_conn_t* conn, struct iovec* iov, int iovcnt);
+
+/**
+ * sends size bytes of fd from its start through a user space session,
+ * one record at a time. an offloaded socket takes sendfile() directly.
+ * returns 0 on success, -1 on failure.
+ */
+int tls_send_file(tls_conn_t* conn, int fd, long size);
+
+/**
+ * sends close_notify and frees the session. sockfd is left to the caller.
+ */
+void tls_close(tls_conn_t* conn);
@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# bench.sh
+#
+# End-to-end benchmark driven by "make bench".
+# Generates a document root mixing small files, large files, directory
+# listings and 404s, starts ./server on it and runs tools/loadgen in
+# closed- and open-loop mode. Every scenario prints one JSON line.
+#
+# Tunables (environment): BENCH_PORT, BENCH_POOL, BENCH_THREADS,
+# BENCH_DURATION, BENCH_RATE, BENCH_LARGE_MB, BENCH_SERVER_ARGS
+
+set -e
+
+ROOT_DIR=$(cd "$(dirname "$0")/.." && pwd)
+SERVER="$ROOT_DIR/server"
+LOADGEN="$ROOT_DIR/tools/loadgen"
+
+PORT=${BENCH_PORT:-18080}
+POOL=${BENCH_POOL:-8}
+THREADS=${BENCH_THREADS:-8}
+DURATION=${BENCH_DURATION:-5}
+RATE=${BENCH_RATE:-2000}
+LARGE_MB=${BENCH_LARGE_MB:-16}
+MAX_REQUESTS=2000000000
+
+DOC_ROOT=$(mktemp -d /tmp/http-bench.XXXXXX)
+SERVER_PID=
+
+cleanup() {
+        [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null || true
+        rm -rf "$DOC_ROOT"
+}
+trap cleanup EXIT INT TERM
+
+##########################
+##### Document Root ######
+##########################
+mkdir -p "$DOC_ROOT/small" "$DOC_ROOT/large" "$DOC_ROOT/dir/big" "$DOC_ROOT/dir/index"
+
+i=0
+while [ $i -lt 200 ]; do
+        head -c $(( (i % 16 + 1) * 1024 )) /dev/urandom > "$DOC_ROOT/small/f$i.html"
+        i=$((i + 1))
+done
+
+i=0
+while [ $i -lt 4 ]; do
+        head -c $((LARGE_MB * 1024 * 1024)) /dev/urandom > "$DOC_ROOT/large/l$i.bin"
+        i=$((i + 1))
+done
+
+i=0
+while [ $i -lt 1000 ]; do
+        : > "$DOC_ROOT/dir/big/entry$i.txt"
+        i=$((i + 1))
+done
+
+echo "<html><body>index</body></html>" > "$DOC_ROOT/dir/index/index.html"
+echo "<html><body>root</body></html>" > "$DOC_ROOT/index.html"
+chmod -R o+rX "$DOC_ROOT"
+
+{
+        i=0
+        while [ $i -lt 200 ]; do
+                echo "/small/f$i.html"
+                i=$((i + 1))
+        done
+} > "$DOC_ROOT/.paths-small"
+
+{
+        i=0
+        while [ $i -lt 40 ]; do
+                echo "/small/f$((i * 5)).html"
+                echo "/missing/nope$i.html"
+                i=$((i + 1))
+        done
+        echo "/dir/big/"
+        echo "/dir/index/"
+        echo "/dir/big"
+        echo "/large/l0.bin"
+} > "$DOC_ROOT/.paths-mixed"
+
+echo "/large/l0.bin /large/l1.bin /large/l2.bin /large/l3.bin" | tr ' ' '\n' > "$DOC_ROOT/.paths-large"
+
+################
+##### Run ######
+################
+(cd "$DOC_ROOT" && exec "$SERVER" $BENCH_SERVER_ARGS "$PORT" "$POOL" "$MAX_REQUESTS") &
+SERVER_PID=$!
+
+tries=0
+until (exec 3<>/dev/tcp/127.0.0.1/"$PORT") 2>/dev/null; do
+        tries=$((tries + 1))
+        if [ $tries -gt 50 ]; then
+                echo "bench: server did not start on port $PORT" >&2
+                exit 1
+        fi
+        sleep 0.1
+done
+
+run() {
+        "$LOADGEN" -H 127.0.0.1 -p "$PORT" -d "$DURATION" "$@"
+}
+
+run -l small-closed -t "$THREADS" -f "$DOC_ROOT/.paths-small"
+run -l small-open -t "$THREADS" -r "$RATE" -f "$DOC_ROOT/.paths-small"
+run -l mixed-closed -t "$THREADS" -f "$DOC_ROOT/.paths-mixed"
+run -l large-closed -t 2 -f "$DOC_ROOT/.paths-large"
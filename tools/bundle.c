@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "../mime.h"
+#include "../manifest.h"
+#include "../datecache.h"
+#include "../bundle.h"
+
+/**
+ * bundle.c
+ *
+ * Packs a document root into one bundle file for the server's -b mode.
+ * Only what the server would serve goes in: regular files that pass its
+ * permission check (world readable, world searchable ancestors). A
+ * directory's index.html is also stored as "/dir/", sharing the body.
+ * -z adds a gzip variant of text-like files, kept only if it is smaller.
+ * The bundle is written next to its destination and renamed over it, so a
+ * server reloading it (SIGUSR1) never sees a half written file.
+ * Prints one JSON line with what was packed.
+ */
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PRINT_WRONG_CMD_USAGE "Usage: bundle [-z] [-m mime-types-file] [-j threads] <root> <bundle-file>\n"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_FILE "index.html"
+#define SYSTEM_MIME_TYPES "/etc/mime.types"
+#define MIN_GZIP_SIZE 256               //smaller bodies barely shrink
+#define ALIGNMENT 8
+
+//the header lines the server sends with a file, after Date
+#define CONTENT_LENGTH_HEADER "Content-Length: "
+#define ETAG_HEADER "ETag: "
+#define LAST_MODIFIED_HEADER "Last-Modified: "
+#define CONTENT_ENCODING_HEADER "Content-Encoding: gzip\r\n"
+#define VARY_HEADER "Vary: Accept-Encoding\r\n"
+#define CONNECTION_HEADER "Connection: close\r\n\r\n"
+
+//a path going into the bundle
+typedef struct item_st {
+        char* path;             //relative to the root
+        int path_length;
+        const manifest_entry_t* meta;
+        int source;             //item whose body this one shares, itself for a file
+        bundle_entry_t entry;   //offsets are filled in while writing
+} item_t;
+
+//strings section being built
+typedef struct strings_st {
+        char* data;
+        uint64_t length;
+        uint64_t capacity;
+        uint64_t base;          //file offset of the section
+} strings_t;
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+int sCompress = 0;
+int sThreads = DEFAULT_THREADS;
+char* sMimeFile = NULL;
+char* sRoot = NULL;
+char* sOutput = NULL;
+long sGzipped = 0;
+
+/*******************************/
+/***** Method Declarations *****/
+/*******************************/
+int parseArguments(int, char**);
+item_t* collectItems(manifest_t*, const char*, int*);
+int addItem(item_t**, int*, int*, const char*, int, const manifest_entry_t*, int);
+int compareItems(const void*, const void*);
+int writeBodies(int, item_t*, int, uint64_t*);
+int writeBody(int, uint64_t*, const char*, uint64_t, bundle_body_t*);
+int isCompressible(const manifest_entry_t*);
+char* gzipBody(const char*, uint64_t, uint64_t*);
+int addStrings(strings_t*, item_t*, int);
+int addHeaders(strings_t*, item_t*, bundle_body_t*, int, int);
+uint64_t appendString(strings_t*, const char*, uint64_t);
+int writeAt(int, uint64_t, const void*, uint64_t);
+
+/******************************************************************************/
+/******************************************************************************/
+/***************************** Main Method ************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+        if(parseArguments(argc, argv)) {
+                fprintf(stderr, PRINT_WRONG_CMD_USAGE);
+                exit(EXIT_FAILURE);
+        }
+
+        //the same types the server starts with
+        mime_table_t* mime = create_mime_table(NULL);
+        if(!mime || add_builtin_mime_types(mime)) {
+                fprintf(stderr, "create_mime_table\n");
+                exit(EXIT_FAILURE);
+        }
+        if(load_mime_types(mime, sMimeFile ? sMimeFile : SYSTEM_MIME_TYPES) < 0 && sMimeFile) {
+                perror(sMimeFile);
+                exit(EXIT_FAILURE);
+        }
+
+        char* root = realpath(sRoot, NULL);
+        if(root && !strcmp(root, "/"))
+                root[0] = '\0'; //keyed like the server keys the root "/"
+
+        manifest_t* manifest = create_manifest();
+        if(!root || !manifest || build_manifest(manifest, root, mime, sThreads) < 0) {
+                perror(sRoot);
+                exit(EXIT_FAILURE);
+        }
+
+        int count;
+        item_t* items = collectItems(manifest, root, &count);
+        if(!items) {
+                perror("collectItems");
+                exit(EXIT_FAILURE);
+        }
+
+        char temp[strlen(sOutput) + 5];
+        sprintf(temp, "%s.tmp", sOutput);
+        int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+                perror(temp);
+                exit(EXIT_FAILURE);
+        }
+
+        //header, bodies, strings, index - the header goes in last
+        uint64_t offset = sizeof(bundle_header_t);
+        strings_t strings;
+        memset(&strings, 0, sizeof(strings));
+        if(writeBodies(fd, items, count, &offset) ||
+           (strings.base = offset, addStrings(&strings, items, count)) ||
+           writeAt(fd, strings.base, strings.data, strings.length)) {
+                perror(temp);
+                unlink(temp);
+                exit(EXIT_FAILURE);
+        }
+
+        bundle_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LENGTH);
+        header.index_offset = (strings.base + strings.length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        header.index_count = count;
+        header.size = header.index_offset + count * sizeof(bundle_entry_t);
+
+        //sorted the way the server searches the index
+        qsort(items, count, sizeof(item_t), compareItems);
+        int i;
+        for(i = 0; i < count; i++) {
+                if(writeAt(fd, header.index_offset + i * sizeof(bundle_entry_t), &items[i].entry, sizeof(bundle_entry_t))) {
+                        perror(temp);
+                        unlink(temp);
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        if(writeAt(fd, 0, &header, sizeof(header)) || fsync(fd) || close(fd) || rename(temp, sOutput)) {
+                perror(sOutput);
+                unlink(temp);
+                exit(EXIT_FAILURE);
+        }
+
+        printf("{\"root\":\"%s\",\"entries\":%d,\"gzipped\":%ld,\"bytes\":%lu}\n",
+               *root ? root : "/", count, sGzipped, (unsigned long)header.size);
+        return EXIT_SUCCESS;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int parseArguments(int argc, char** argv) {
+
+        int opt;
+        while((opt = getopt(argc, argv, "zm:j:")) != -1) {
+                switch (opt) {
+
+                case 'z':
+                        sCompress = 1;
+                        break;
+
+                case 'm':
+                        sMimeFile = optarg;
+                        break;
+
+                case 'j':
+                        sThreads = atoi(optarg);
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(argc - optind != 2 || sThreads <= 0)
+                return -1;
+
+        sRoot = argv[optind];
+        sOutput = argv[optind + 1];
+        return 0;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Bundle Methods ***********************************/
+/******************************************************************************/
+/******************************************************************************/
+//the servable files of the manifest, each alias right after its file.
+//returns the items (count set), NULL on failure
+item_t* collectItems(manifest_t* manifest, const char* root, int* count) {
+
+        int root_length = strlen(root);
+        item_t* items = NULL;
+        int capacity = 0;
+        *count = 0;
+
+        int i;
+        for(i = 0; i < manifest->capacity; i++) {
+
+                const manifest_entry_t* meta = manifest->entries[i];
+                if(!meta || !S_ISREG(meta->mode) || !meta->permitted)
+                        continue;
+
+                const char* path = meta->path + root_length;
+                int length = strlen(path);
+                int file = *count;
+                if(length > BUNDLE_MAX_PATH || addItem(&items, count, &capacity, path, length, meta, file))
+                        return NULL;
+
+                //"/dir/index.html" answers "/dir/" too
+                const char* name = strrchr(path, '/') + 1;
+                if(!strcmp(name, DEFAULT_FILE) && addItem(&items, count, &capacity, path, name - path, meta, file))
+                        return NULL;
+        }
+
+        return items;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+int addItem(item_t** items, int* count, int* capacity, const char* path, int length,
+            const manifest_entry_t* meta, int source) {
+
+        if(*count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 1024;
+                item_t* grown = (item_t*)realloc(*items, *capacity * sizeof(item_t));
+                if(!grown)
+                        return -1;
+                *items = grown;
+        }
+
+        item_t* item = &(*items)[(*count)++];
+        memset(item, 0, sizeof(item_t));
+        item->path = strndup(path, length);
+        item->path_length = length;
+        item->meta = meta;
+        item->source = source;
+        return item->path ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int compareItems(const void* a, const void* b) {
+
+        const item_t* first = (const item_t*)a;
+        const item_t* second = (const item_t*)b;
+        return compare_bundle_paths(first->path, first->path_length, second->path, second->path_length);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//appends the body (and gzip variant) of every file at *offset. an alias
+//shares the body of its file.
+//returns 0 on success, -1 on failure
+int writeBodies(int fd, item_t* items, int count, uint64_t* offset) {
+
+        int i;
+        for(i = 0; i < count; i++) {
+
+                item_t* item = &items[i];
+                if(item->source != i)
+                        continue;
+
+                int file = open(item->meta->path, O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if(file < 0 || fstat(file, &st)) {
+                        perror(item->meta->path);
+                        return -1;
+                }
+
+                char* data = (char*)malloc(st.st_size ? st.st_size : 1);
+                uint64_t length = 0;
+                ssize_t nBytes = 1;
+                while(data && length < st.st_size && (nBytes = read(file, data + length, st.st_size - length)) > 0)
+                        length += nBytes;
+                close(file);
+                if(!data || nBytes < 0) {
+                        free(data);
+                        return -1;
+                }
+
+                item->entry.mtime = st.st_mtime;
+                if(writeBody(fd, offset, data, length, &item->entry.identity)) {
+                        free(data);
+                        return -1;
+                }
+
+                uint64_t gzip_length;
+                char* gzip = sCompress && isCompressible(item->meta) ? gzipBody(data, length, &gzip_length) : NULL;
+                if(gzip && gzip_length < length) {
+                        sGzipped++;
+                        if(writeBody(fd, offset, gzip, gzip_length, &item->entry.gzip)) {
+                                free(gzip);
+                                free(data);
+                                return -1;
+                        }
+                }
+
+                free(gzip);
+                free(data);
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//writes length bytes of data at *offset, aligned, and records them in body.
+//returns 0 on success, -1 on failure
+int writeBody(int fd, uint64_t* offset, const char* data, uint64_t length, bundle_body_t* body) {
+
+        *offset = (*offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        if(writeAt(fd, *offset, data, length))
+                return -1;
+
+        body->offset = *offset;
+        body->length = length;
+        *offset += length;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//text, and the structured formats that are text underneath
+int isCompressible(const manifest_entry_t* meta) {
+
+        if(meta->size < MIN_GZIP_SIZE || !meta->mime)
+                return 0;
+
+        const char* type = meta->mime->type;
+        return !strncmp(type, "text/", 5) || strstr(type, "json") || strstr(type, "xml") ||
+               strstr(type, "javascript") || !strcmp(type, "application/wasm");
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the gzip stream of data (length set), NULL on failure
+char* gzipBody(const char* data, uint64_t length, uint64_t* gzip_length) {
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        //15 window bits, +16 for a gzip header instead of zlib's
+        if(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+
+        uLong bound = deflateBound(&stream, length);
+        char* gzip = (char*)malloc(bound);
+        if(!gzip) {
+                deflateEnd(&stream);
+                return NULL;
+        }
+
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = length;
+        stream.next_out = (Bytef*)gzip;
+        stream.avail_out = bound;
+        if(deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+                deflateEnd(&stream);
+                free(gzip);
+                return NULL;
+        }
+
+        *gzip_length = stream.total_out;
+        deflateEnd(&stream);
+        return gzip;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//paths, types, ETags and header blocks of every item. an alias copies
+//everything but its path from its file.
+//returns 0 on success, -1 on failure
+int addStrings(strings_t* strings, item_t* items, int count) {
+
+        int i;
+        for(i = 0; i < count; i++) {
+
+                item_t* item = &items[i];
+                if(item->source != i)
+                        continue;
+
+                bundle_entry_t* entry = &item->entry;
+                const struct mime_type_st* mime = item->meta->mime;
+                if(mime) {
+                        entry->type_length = strlen(mime->type);
+                        entry->type_offset = appendString(strings, mime->type, entry->type_length);
+                }
+
+                int hasGzip = entry->gzip.length > 0;
+                if(addHeaders(strings, item, &entry->identity, 0, hasGzip) ||
+                   (hasGzip && addHeaders(strings, item, &entry->gzip, 1, hasGzip)))
+                        return -1;
+        }
+
+        for(i = 0; i < count; i++) {
+
+                item_t* item = &items[i];
+                if(item->source != i)
+                        item->entry = items[item->source].entry;
+
+                item->entry.path_length = item->path_length;
+                item->entry.path_offset = appendString(strings, item->path, item->path_length);
+        }
+
+        return strings->data ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the ETag and header lines of one variant of item
+//returns 0 on success, -1 on failure
+int addHeaders(strings_t* strings, item_t* item, bundle_body_t* body, int isGzip, int hasGzip) {
+
+        //the identity ETag is the one the server makes from the file, the
+        //gzip variant is a different representation and needs its own
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mtime = item->entry.mtime;
+        st.st_size = item->entry.identity.length;
+
+        char etag[MANIFEST_ETAG_SIZE + 4];
+        int etag_length = format_etag(etag, &st);
+        if(isGzip)
+                etag_length = sprintf(etag + etag_length - 1, "-gz\"") + etag_length - 1;
+        body->etag_length = etag_length;
+        body->etag_offset = appendString(strings, etag, etag_length);
+
+        char date[DATE_VALUE_LENGTH + 1];
+        format_http_date(item->entry.mtime, date);
+
+        char headers[1024];
+        char* pos = headers;
+        if(item->meta->mime)
+                pos += sprintf(pos, "%s", item->meta->mime->header);
+        pos += sprintf(pos, CONTENT_LENGTH_HEADER "%lu\r\n", (unsigned long)body->length);
+        pos += sprintf(pos, ETAG_HEADER "%s\r\n", etag);
+        pos += sprintf(pos, LAST_MODIFIED_HEADER "%s\r\n", date);
+        if(isGzip)
+                pos += sprintf(pos, CONTENT_ENCODING_HEADER);
+        if(hasGzip)
+                pos += sprintf(pos, VARY_HEADER);
+        pos += sprintf(pos, CONNECTION_HEADER);
+
+        body->headers_length = pos - headers;
+        body->headers_offset = appendString(strings, headers, body->headers_length);
+        return strings->data ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the file offset str will have
+uint64_t appendString(strings_t* strings, const char* str, uint64_t length) {
+
+        if(strings->length + length > strings->capacity) {
+                uint64_t capacity = strings->capacity ? strings->capacity : 64 * 1024;
+                while(strings->length + length > capacity)
+                        capacity *= 2;
+
+                char* grown = (char*)realloc(strings->data, capacity);
+                if(!grown) {
+                        free(strings->data);
+                        strings->data = NULL; //checked by the callers
+                        strings->length = strings->capacity = 0;
+                        return 0;
+                }
+                strings->data = grown;
+                strings->capacity = capacity;
+        }
+
+        uint64_t offset = strings->base + strings->length;
+        memcpy(strings->data + strings->length, str, length);
+        strings->length += length;
+        return offset;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+int writeAt(int fd, uint64_t offset, const void* data, uint64_t length) {
+
+        const char* pos = (const char*)data;
+        while(length > 0) {
+                ssize_t nBytes = pwrite(fd, pos, length, offset);
+                if(nBytes <= 0)
+                        return -1;
+                pos += nBytes;
+                offset += nBytes;
+                length -= nBytes;
+        }
+
+        return 0;
+}
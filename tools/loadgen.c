@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+
+/**
+ * loadgen.c
+ *
+ * Multi-threaded HTTP load generator used by "make bench".
+ * closed-loop: every thread keeps exactly one request in flight.
+ * open-loop:   requests are issued on a fixed schedule (-r total rate) and
+ *              latency is measured from the scheduled send time, so a slow
+ *              server is not hidden by the generator backing off.
+ *
+ * Results are printed as a single JSON object on stdout.
+ */
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PRINT_WRONG_CMD_USAGE "Usage: loadgen [-H host] [-p port] [-t threads] [-d seconds] [-r rate] [-l label] (-f paths-file | path...)\n"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "8080"
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 5
+#define SIZE_REQUEST 4000
+#define SIZE_READ_BUFFER 65536
+#define SIZE_PATH 1024
+#define MAX_STATUS 600
+
+/************************************/
+/***** Latency Histogram Macros *****/
+/************************************/
+//log-linear buckets: exact below 64us, then 32 sub-buckets per power of two
+#define HIST_LINEAR 64
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_SIZE (HIST_LINEAR + (HIST_MAX_EXP - 6 + 1) * HIST_SUB)
+
+typedef struct stats_st {
+        long requests;
+        long errors;
+        long bytes;
+        long status[MAX_STATUS];
+        long hist[HIST_SIZE];
+} stats_t;
+
+typedef struct worker_st {
+        int id;
+        pthread_t tid;
+        stats_t stats;
+} worker_t;
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+char* sHost = DEFAULT_HOST;
+char* sPort = DEFAULT_PORT;
+char* sLabel = "";
+int sThreads = DEFAULT_THREADS;
+int sDuration = DEFAULT_DURATION;
+double sRate = 0; //0 - closed loop
+char** sPaths = NULL;
+int sNumOfPaths = 0;
+struct addrinfo* sAddr = NULL;
+double sStart = 0;
+
+/*******************************/
+/***** Method Declarations *****/
+/*******************************/
+int parseArguments(int, char**);
+int loadPaths(char*);
+void* runWorker(void*);
+int doRequest(char*, long*);
+double now();
+void sleepUntil(double);
+void recordLatency(stats_t*, long);
+int histIndex(long);
+long histValue(int);
+long percentile(stats_t*, double);
+void printResults(stats_t*, double);
+
+/******************************************************************************/
+/******************************************************************************/
+/***************************** Main Method ************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+        if(parseArguments(argc, argv)) {
+                fprintf(stderr, PRINT_WRONG_CMD_USAGE);
+                exit(EXIT_FAILURE);
+        }
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc;
+        if((rc = getaddrinfo(sHost, sPort, &hints, &sAddr))) {
+                fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+                exit(EXIT_FAILURE);
+        }
+
+        worker_t* workers = (worker_t*)calloc(sThreads, sizeof(worker_t));
+        if(!workers) {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+        }
+
+        sStart = now();
+        int i;
+        for(i = 0; i < sThreads; i++) {
+                workers[i].id = i;
+                if(pthread_create(&workers[i].tid, NULL, runWorker, &workers[i])) {
+                        fprintf(stderr, "pthread_create\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        stats_t total;
+        memset(&total, 0, sizeof(total));
+        for(i = 0; i < sThreads; i++) {
+                pthread_join(workers[i].tid, NULL);
+
+                int j;
+                total.requests += workers[i].stats.requests;
+                total.errors += workers[i].stats.errors;
+                total.bytes += workers[i].stats.bytes;
+                for(j = 0; j < MAX_STATUS; j++)
+                        total.status[j] += workers[i].stats.status[j];
+                for(j = 0; j < HIST_SIZE; j++)
+                        total.hist[j] += workers[i].stats.hist[j];
+        }
+
+        printResults(&total, now() - sStart);
+
+        freeaddrinfo(sAddr);
+        free(workers);
+        return EXIT_SUCCESS;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/************************ Initialize Methods **********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int parseArguments(int argc, char** argv) {
+
+        int opt;
+        while((opt = getopt(argc, argv, "H:p:t:d:r:l:f:")) != -1) {
+                switch (opt) {
+
+                case 'H':
+                        sHost = optarg;
+                        break;
+
+                case 'p':
+                        sPort = optarg;
+                        break;
+
+                case 't':
+                        sThreads = atoi(optarg);
+                        break;
+
+                case 'd':
+                        sDuration = atoi(optarg);
+                        break;
+
+                case 'r':
+                        sRate = atof(optarg);
+                        break;
+
+                case 'l':
+                        sLabel = optarg;
+                        break;
+
+                case 'f':
+                        if(loadPaths(optarg))
+                                return -1;
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(sThreads <= 0 || sDuration <= 0 || sRate < 0)
+                return -1;
+
+        //remaining arguments are paths
+        for(; optind < argc; optind++) {
+                sPaths = (char**)realloc(sPaths, (sNumOfPaths + 1) * sizeof(char*));
+                if(!sPaths)
+                        return -1;
+                sPaths[sNumOfPaths++] = argv[optind];
+        }
+
+        return sNumOfPaths ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//read request paths from file, one per line
+int loadPaths(char* fileName) {
+
+        FILE* file = fopen(fileName, "r");
+        if(!file) {
+                perror("fopen");
+                return -1;
+        }
+
+        char line[SIZE_PATH];
+        while(fgets(line, sizeof(line), file)) {
+
+                line[strcspn(line, "\r\n")] = '\0';
+                if(!line[0])
+                        continue;
+
+                sPaths = (char**)realloc(sPaths, (sNumOfPaths + 1) * sizeof(char*));
+                if(!sPaths || !(sPaths[sNumOfPaths] = strdup(line))) {
+                        fclose(file);
+                        return -1;
+                }
+                sNumOfPaths++;
+        }
+
+        fclose(file);
+        return 0;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Worker Methods ***********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+void* runWorker(void* arg) {
+
+        worker_t* worker = (worker_t*)arg;
+        double end = sStart + sDuration;
+
+        //open loop - each thread owns an equal share of the total rate
+        double interval = sRate > 0 ? sThreads / sRate : 0;
+        double scheduled = sStart + (interval * worker->id) / sThreads;
+
+        int next = worker->id % sNumOfPaths;
+        while(1) {
+
+                double sendTime = now();
+                if(interval > 0) {
+                        if(scheduled >= end)
+                                break;
+                        sleepUntil(scheduled);
+                        sendTime = scheduled;
+                        scheduled += interval;
+
+                } else if(sendTime >= end) {
+                        break;
+                }
+
+                long bytes = 0;
+                int status = doRequest(sPaths[next], &bytes);
+                next = (next + 1) % sNumOfPaths;
+
+                worker->stats.requests++;
+                if(status <= 0 || status >= MAX_STATUS) {
+                        worker->stats.errors++;
+                        continue;
+                }
+
+                worker->stats.status[status]++;
+                worker->stats.bytes += bytes;
+                recordLatency(&worker->stats, (long)((now() - sendTime) * 1e6));
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns response status code, -1 on failure
+int doRequest(char* path, long* bytes) {
+
+        int sockfd = socket(sAddr->ai_family, sAddr->ai_socktype, sAddr->ai_protocol);
+        if(sockfd < 0)
+                return -1;
+
+        if(connect(sockfd, sAddr->ai_addr, sAddr->ai_addrlen) < 0) {
+                debug_print("connect: %s\n", strerror(errno));
+                close(sockfd);
+                return -1;
+        }
+
+        char request[SIZE_REQUEST];
+        int length = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, sHost);
+        int written = 0;
+        int nBytes;
+        while(written < length) {
+                if((nBytes = write(sockfd, request + written, length - written)) < 0) {
+                        close(sockfd);
+                        return -1;
+                }
+                written += nBytes;
+        }
+
+        //server closes the connection after the response. It may also reset
+        //it because it never reads our headers, so a reset only counts as an
+        //error when the body is shorter than Content-Length.
+        static __thread char buffer[SIZE_READ_BUFFER];
+        char head[SIZE_REQUEST + 1];
+        int headLength = 0;
+        long bodyStart = -1;
+        long contentLength = -1;
+        long total = 0;
+        while((nBytes = read(sockfd, buffer, sizeof(buffer))) > 0) {
+
+                if(bodyStart < 0 && headLength < SIZE_REQUEST) {
+                        int n = nBytes < SIZE_REQUEST - headLength ? nBytes : SIZE_REQUEST - headLength;
+                        memcpy(head + headLength, buffer, n);
+                        headLength += n;
+                        head[headLength] = '\0';
+
+                        char* end = strstr(head, "\r\n\r\n");
+                        if(end) {
+                                bodyStart = end - head + 4;
+                                char* length = strstr(head, "Content-Length:");
+                                if(length && length < end)
+                                        contentLength = atol(length + strlen("Content-Length:"));
+                        }
+                }
+                total += nBytes;
+        }
+
+        close(sockfd);
+        if(bodyStart < 0 || strncmp(head, "HTTP/1.", 7))
+                return -1;
+        if(nBytes < 0 && (contentLength < 0 || total - bodyStart < contentLength))
+                return -1;
+
+        *bytes = total;
+        return atoi(head + 9);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Misc Methods *************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+double now() {
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void sleepUntil(double when) {
+
+        struct timespec ts;
+        ts.tv_sec = (time_t)when;
+        ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void recordLatency(stats_t* stats, long usec) {
+        stats->hist[histIndex(usec)]++;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int histIndex(long value) {
+
+        if(value < HIST_LINEAR)
+                return value < 0 ? 0 : (int)value;
+
+        int exp = 63 - __builtin_clzl(value);
+        if(exp > HIST_MAX_EXP)
+                return HIST_SIZE - 1;
+
+        int sub = (int)(value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+        return HIST_LINEAR + (exp - 6) * HIST_SUB + sub;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the lower bound of a bucket
+long histValue(int index) {
+
+        if(index < HIST_LINEAR)
+                return index;
+
+        int exp = (index - HIST_LINEAR) / HIST_SUB + 6;
+        int sub = (index - HIST_LINEAR) % HIST_SUB;
+        return (1L << exp) + ((long)sub << (exp - HIST_SUB_BITS));
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+long percentile(stats_t* stats, double fraction) {
+
+        long count = 0;
+        int i;
+        for(i = 0; i < HIST_SIZE; i++)
+                count += stats->hist[i];
+        if(!count)
+                return 0;
+
+        long target = (long)(count * fraction);
+        if(target >= count)
+                target = count - 1;
+
+        long seen = 0;
+        for(i = 0; i < HIST_SIZE; i++) {
+                seen += stats->hist[i];
+                if(seen > target)
+                        return histValue(i);
+        }
+        return histValue(HIST_SIZE - 1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void printResults(stats_t* stats, double elapsed) {
+
+        printf("{\"label\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"rate\":%.0f,"
+               "\"duration_s\":%.3f,\"requests\":%ld,\"errors\":%ld,"
+               "\"rps\":%.1f,\"bytes\":%ld,\"throughput_MBps\":%.2f,"
+               "\"p50_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld,\"status\":{",
+               sLabel,
+               sRate > 0 ? "open" : "closed",
+               sThreads,
+               sRate,
+               elapsed,
+               stats->requests,
+               stats->errors,
+               (stats->requests - stats->errors) / elapsed,
+               stats->bytes,
+               stats->bytes / elapsed / (1024 * 1024),
+               percentile(stats, 0.50),
+               percentile(stats, 0.99),
+               percentile(stats, 0.999));
+
+        int i;
+        int first = 1;
+        for(i = 0; i < MAX_STATUS; i++) {
+                if(!stats->status[i])
+                        continue;
+                printf("%s\"%d\":%ld", first ? "" : ",", i, stats->status[i]);
+                first = 0;
+        }
+        printf("}}\n");
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include "../manifest.h"
+
+/**
+ * manifest.c
+ *
+ * Precomputes the manifest of a document root ahead of a deploy, so the
+ * server (-w) loads it at startup instead of walking the root itself.
+ * The root is walked by several threads. Prints one JSON line with the
+ * number of entries and how long the walk took.
+ */
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PRINT_WRONG_CMD_USAGE "Usage: manifest [-j threads] <root> <manifest-file>\n"
+
+#define DEFAULT_THREADS 8
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+int sThreads = DEFAULT_THREADS;
+char* sRoot = NULL;
+char* sOutput = NULL;
+
+/*******************************/
+/***** Method Declarations *****/
+/*******************************/
+int parseArguments(int, char**);
+double now();
+
+/******************************************************************************/
+/******************************************************************************/
+/***************************** Main Method ************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+        if(parseArguments(argc, argv)) {
+                fprintf(stderr, PRINT_WRONG_CMD_USAGE);
+                exit(EXIT_FAILURE);
+        }
+
+        //the server keys entries by the real path of its root
+        char* root = realpath(sRoot, NULL);
+        if(!root) {
+                perror(sRoot);
+                exit(EXIT_FAILURE);
+        }
+        if(!strcmp(root, "/"))
+                root[0] = '\0';
+
+        manifest_t* manifest = create_manifest();
+        if(!manifest) {
+                perror("create_manifest");
+                exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        int count = build_manifest(manifest, root, NULL, sThreads);
+        if(count < 0) {
+                fprintf(stderr, "cannot walk %s\n", sRoot);
+                exit(EXIT_FAILURE);
+        }
+        double elapsed = now() - start;
+
+        if(save_manifest(manifest, root, sOutput) < 0) {
+                perror(sOutput);
+                exit(EXIT_FAILURE);
+        }
+
+        printf("{\"root\":\"%s\",\"entries\":%d,\"threads\":%d,\"walk_ms\":%.1f}\n",
+               *root ? root : "/", count, sThreads, elapsed * 1000);
+
+        destroy_manifest(manifest);
+        free(root);
+        return EXIT_SUCCESS;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int parseArguments(int argc, char** argv) {
+
+        int opt;
+        while((opt = getopt(argc, argv, "j:")) != -1) {
+                switch (opt) {
+
+                case 'j':
+                        sThreads = atoi(optarg);
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(argc - optind != 2 || sThreads <= 0)
+                return -1;
+
+        sRoot = argv[optind];
+        sOutput = argv[optind + 1];
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//monotonic seconds
+double now() {
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,921 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+
+/**
+ * replay.c
+ *
+ * Replays a recorded access log against the server, so changes can be
+ * judged on a production mix instead of a synthetic one.
+ * The log is either the server's own (-l, one JSON object per line) or the
+ * common/combined log format. With -r, a document root skeleton is built
+ * first: every path logged with a 200 becomes a file of its logged size
+ * (a directory if it ends with '/'), so the replayed requests find what the
+ * recorded ones found.
+ * Requests are sent at their recorded offsets, sped up by -s, or back to
+ * back on every thread with -m. Latency is measured from the scheduled
+ * send time, so a server falling behind the recorded pace shows as latency.
+ * Prints one JSON line per URL class (listing, small, medium, large,
+ * redirect, error - by the recorded response) and one for all requests.
+ */
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PRINT_WRONG_CMD_USAGE "Usage: replay [-H host] [-p port] [-t threads] [-s speedup | -m] [-r root [-n]] [-l label] <access-log>\n"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "8080"
+#define DEFAULT_THREADS 16
+#define SIZE_REQUEST 4000
+#define SIZE_READ_BUFFER 65536
+#define SIZE_LINE 8192
+#define SIZE_FILL 65536                 //skeleton files are written in blocks of this size
+#define MAX_SMALL (16 * 1024)           //recorded bytes of a small response
+#define MAX_MEDIUM (1024 * 1024)
+#define LOG_TIME_FIELD "\"time\":\""
+#define LOG_METHOD_FIELD "\"method\":\""
+#define LOG_PATH_FIELD "\"path\":\""
+#define LOG_STATUS_FIELD "\"status\":"
+#define LOG_BYTES_FIELD "\"bytes\":"
+
+/************************************/
+/***** Latency Histogram Macros *****/
+/************************************/
+//log-linear buckets: exact below 64us, then 32 sub-buckets per power of two
+#define HIST_LINEAR 64
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_SIZE (HIST_LINEAR + (HIST_MAX_EXP - 6 + 1) * HIST_SUB)
+
+typedef enum url_class_en {
+        CLASS_LISTING,
+        CLASS_SMALL,
+        CLASS_MEDIUM,
+        CLASS_LARGE,
+        CLASS_REDIRECT,
+        CLASS_ERROR,
+        NUM_OF_CLASSES
+} url_class_t;
+
+static const char* sClassNames[NUM_OF_CLASSES] = {
+        "listing", "small", "medium", "large", "redirect", "error"
+};
+
+typedef struct record_st {
+        double time;            //seconds, recorded
+        char* method;
+        char* path;             //decoded
+        int status;             //recorded
+        long bytes;             //recorded
+        url_class_t class;
+} record_t;
+
+typedef struct stats_st {
+        long requests;
+        long errors;            //no response
+        long mismatched;        //answered with another status than recorded
+        long bytes;
+        long hist[HIST_SIZE];
+} stats_t;
+
+typedef struct worker_st {
+        pthread_t tid;
+        stats_t stats[NUM_OF_CLASSES];
+} worker_t;
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+char* sHost = DEFAULT_HOST;
+char* sPort = DEFAULT_PORT;
+char* sLabel = "";
+char* sLog = NULL;
+char* sRoot = NULL;
+int sBuildOnly = 0;
+int sThreads = DEFAULT_THREADS;
+double sSpeedup = 1;
+int sMaxRate = 0;
+record_t* sRecords = NULL;
+int sNumOfRecords = 0;
+int sNext = 0;                  //next record to send, taken atomically
+struct addrinfo* sAddr = NULL;
+double sStart = 0;
+
+/*******************************/
+/***** Method Declarations *****/
+/*******************************/
+int parseArguments(int, char**);
+int loadLog(char*);
+int parseJsonRecord(char*, record_t*);
+int parseCommonRecord(char*, record_t*);
+char* jsonString(char*, const char*);
+int decodePath(char*);
+url_class_t classify(record_t*);
+int compareRecords(const void*, const void*);
+int buildSkeleton(char*);
+int makeParents(char*);
+int fillFile(const char*, long);
+void* runWorker(void*);
+int doRequest(record_t*, long*);
+int encodePath(const char*, char*, int);
+double now();
+void sleepUntil(double);
+void recordLatency(stats_t*, long);
+int histIndex(long);
+long histValue(int);
+long percentile(stats_t*, double);
+long maximum(stats_t*);
+void printResults(const char*, stats_t*, double);
+
+/******************************************************************************/
+/******************************************************************************/
+/***************************** Main Method ************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+        if(parseArguments(argc, argv)) {
+                fprintf(stderr, PRINT_WRONG_CMD_USAGE);
+                exit(EXIT_FAILURE);
+        }
+
+        if(loadLog(sLog))
+                exit(EXIT_FAILURE);
+
+        if(sRoot && buildSkeleton(sRoot))
+                exit(EXIT_FAILURE);
+        if(sBuildOnly || !sNumOfRecords)
+                return EXIT_SUCCESS;
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int rc;
+        if((rc = getaddrinfo(sHost, sPort, &hints, &sAddr))) {
+                fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+                exit(EXIT_FAILURE);
+        }
+
+        worker_t* workers = (worker_t*)calloc(sThreads, sizeof(worker_t));
+        if(!workers) {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+        }
+
+        sStart = now();
+        int i;
+        for(i = 0; i < sThreads; i++) {
+                if(pthread_create(&workers[i].tid, NULL, runWorker, &workers[i])) {
+                        fprintf(stderr, "pthread_create\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        stats_t classes[NUM_OF_CLASSES];
+        stats_t total;
+        memset(classes, 0, sizeof(classes));
+        memset(&total, 0, sizeof(total));
+        for(i = 0; i < sThreads; i++) {
+                pthread_join(workers[i].tid, NULL);
+
+                int c;
+                for(c = 0; c < NUM_OF_CLASSES; c++) {
+
+                        stats_t* from = &workers[i].stats[c];
+                        stats_t* to[] = { &classes[c], &total };
+                        int k;
+                        for(k = 0; k < 2; k++) {
+                                to[k]->requests += from->requests;
+                                to[k]->errors += from->errors;
+                                to[k]->mismatched += from->mismatched;
+                                to[k]->bytes += from->bytes;
+
+                                int j;
+                                for(j = 0; j < HIST_SIZE; j++)
+                                        to[k]->hist[j] += from->hist[j];
+                        }
+                }
+        }
+        double elapsed = now() - sStart;
+
+        int c;
+        for(c = 0; c < NUM_OF_CLASSES; c++) {
+                if(classes[c].requests)
+                        printResults(sClassNames[c], &classes[c], elapsed);
+        }
+        printResults("all", &total, elapsed);
+
+        freeaddrinfo(sAddr);
+        free(workers);
+        return EXIT_SUCCESS;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/************************ Initialize Methods **********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int parseArguments(int argc, char** argv) {
+
+        int opt;
+        while((opt = getopt(argc, argv, "H:p:t:s:mr:nl:")) != -1) {
+                switch (opt) {
+
+                case 'H':
+                        sHost = optarg;
+                        break;
+
+                case 'p':
+                        sPort = optarg;
+                        break;
+
+                case 't':
+                        sThreads = atoi(optarg);
+                        break;
+
+                case 's':
+                        sSpeedup = atof(optarg);
+                        break;
+
+                case 'm':
+                        sMaxRate = 1;
+                        break;
+
+                case 'r':
+                        sRoot = optarg;
+                        break;
+
+                case 'n':
+                        sBuildOnly = 1;
+                        break;
+
+                case 'l':
+                        sLabel = optarg;
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(argc - optind != 1 || sThreads <= 0 || sSpeedup <= 0 || (sBuildOnly && !sRoot))
+                return -1;
+
+        sLog = argv[optind];
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//reads every record of the log (either format, line by line) sorted by time.
+//lines that are neither are skipped.
+//returns 0 on success, -1 on failure
+int loadLog(char* fileName) {
+
+        FILE* file = fopen(fileName, "r");
+        if(!file) {
+                perror(fileName);
+                return -1;
+        }
+
+        int capacity = 0;
+        int skipped = 0;
+        char line[SIZE_LINE];
+        while(fgets(line, sizeof(line), file)) {
+
+                record_t record;
+                int error = line[0] == '{' ? parseJsonRecord(line, &record) : parseCommonRecord(line, &record);
+                if(error) {
+                        skipped++;
+                        continue;
+                }
+
+                if(sNumOfRecords == capacity) {
+                        capacity = capacity ? capacity * 2 : 1024;
+                        record_t* grown = (record_t*)realloc(sRecords, capacity * sizeof(record_t));
+                        if(!grown) {
+                                perror("realloc");
+                                fclose(file);
+                                return -1;
+                        }
+                        sRecords = grown;
+                }
+
+                record.class = classify(&record);
+                sRecords[sNumOfRecords++] = record;
+        }
+        fclose(file);
+
+        //the server's rings are flushed together, its lines are only roughly in order
+        qsort(sRecords, sNumOfRecords, sizeof(record_t), compareRecords);
+
+        debug_print("loadLog - %d records, %d lines skipped\n", sNumOfRecords, skipped);
+        if(skipped)
+                fprintf(stderr, "%s: %d lines skipped\n", fileName, skipped);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//the server's format: {"time":"2026-10-18T12:28:53.123Z","method":"GET",
+//"path":"/a.html","status":200,"bytes":512,"duration_us":80}
+//returns 0 on success, -1 if line is not such a record
+int parseJsonRecord(char* line, record_t* record) {
+
+        char* time = strstr(line, LOG_TIME_FIELD);
+        char* method = strstr(line, LOG_METHOD_FIELD);
+        char* path = strstr(line, LOG_PATH_FIELD);
+        char* status = strstr(line, LOG_STATUS_FIELD);
+        char* bytes = strstr(line, LOG_BYTES_FIELD);
+        if(!time || !method || !path || !status || !bytes)
+                return -1;
+
+        struct tm tm;
+        int millis;
+        memset(&tm, 0, sizeof(tm));
+        if(sscanf(time + strlen(LOG_TIME_FIELD), "%4d-%2d-%2dT%2d:%2d:%2d.%3dZ", &tm.tm_year, &tm.tm_mon,
+                  &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &millis) != 7)
+                return -1;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        record->time = timegm(&tm) + millis / 1000.0;
+
+        record->status = atoi(status + strlen(LOG_STATUS_FIELD));
+        record->bytes = atol(bytes + strlen(LOG_BYTES_FIELD));
+
+        //unescaped in place, the ends are found before anything moves
+        method = jsonString(method + strlen(LOG_METHOD_FIELD), "method");
+        path = jsonString(path + strlen(LOG_PATH_FIELD), "path");
+        if(!method || !path)
+                return -1;
+
+        //logged after the server decoded it
+        record->method = strdup(method);
+        record->path = strdup(path);
+        if(!record->method || !record->path) {
+                free(record->method);
+                free(record->path);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//common (or combined) log format:
+//127.0.0.1 - - [10/Oct/2000:13:55:36 -0700] "GET /a.html HTTP/1.0" 200 2326
+//returns 0 on success, -1 if line is not such a record
+int parseCommonRecord(char* line, record_t* record) {
+
+        static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+        char* date = strchr(line, '[');
+        char* request = date ? strchr(date, '"') : NULL;
+        if(!request)
+                return -1;
+
+        struct tm tm;
+        char month[4];
+        char sign;
+        int zoneHours;
+        int zoneMinutes;
+        memset(&tm, 0, sizeof(tm));
+        if(sscanf(date, "[%2d/%3s/%4d:%2d:%2d:%2d %c%2d%2d]", &tm.tm_mday, month, &tm.tm_year,
+                  &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &sign, &zoneHours, &zoneMinutes) != 9)
+                return -1;
+
+        char* found = strstr(months, month);
+        if(!found || (found - months) % 3)
+                return -1;
+        tm.tm_mon = (found - months) / 3;
+        tm.tm_year -= 1900;
+        int zone = (zoneHours * 60 + zoneMinutes) * 60;
+        record->time = timegm(&tm) - (sign == '-' ? -zone : zone);
+
+        //"METHOD target PROTOCOL" status bytes
+        char* end = strchr(request + 1, '"');
+        if(!end)
+                return -1;
+        *end = '\0';
+
+        char method[16];
+        char target[SIZE_REQUEST];
+        char bytes[32];
+        if(sscanf(request + 1, "%15s %3999s", method, target) != 2 ||
+           sscanf(end + 1, "%d %31s", &record->status, bytes) != 2)
+                return -1;
+        record->bytes = atol(bytes); //"-" for none
+
+        if(decodePath(target))
+                return -1;
+
+        record->method = strdup(method);
+        record->path = strdup(target);
+        if(!record->method || !record->path) {
+                free(record->method);
+                free(record->path);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//unescapes the JSON string starting at str (just past its opening quote) in
+//place. a \u escape is only accepted for control characters.
+//returns str, NULL if it is malformed
+char* jsonString(char* str, const char* field) {
+
+        char* in = str;
+        char* out = str;
+        while(*in && *in != '"') {
+
+                if(*in != '\\') {
+                        *out++ = *in++;
+                        continue;
+                }
+
+                unsigned code;
+                if(in[1] == 'u' && sscanf(in + 2, "%4x", &code) == 1 && code > 0 && code < 0x80) {
+                        *out++ = code;
+                        in += 6;
+                } else if(in[1] == '"' || in[1] == '\\' || in[1] == '/') {
+                        *out++ = in[1];
+                        in += 2;
+                } else {
+                        debug_print("jsonString - bad escape in %s\n", field);
+                        return NULL;
+                }
+        }
+
+        if(*in != '"')
+                return NULL;
+        *out = '\0';
+        return str;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//decodes the %xx escapes of path in place.
+//returns 0 on success, -1 on a malformed escape or an escaped NUL
+int decodePath(char* path) {
+
+        char* in = path;
+        char* out = path;
+        while(*in) {
+
+                unsigned code;
+                if(*in == '%') {
+                        if(!isxdigit((unsigned char)in[1]) || !isxdigit((unsigned char)in[2]) ||
+                           sscanf(in + 1, "%2x", &code) != 1 || !code)
+                                return -1;
+                        *out++ = code;
+                        in += 3;
+                } else {
+                        *out++ = *in++;
+                }
+        }
+
+        *out = '\0';
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//a URL class by the recorded response
+url_class_t classify(record_t* record) {
+
+        if(record->status >= 400 || record->status < 200)
+                return CLASS_ERROR;
+        if(record->status >= 300)
+                return CLASS_REDIRECT;
+
+        int length = strcspn(record->path, "?");
+        if(length && record->path[length - 1] == '/')
+                return CLASS_LISTING;
+
+        if(record->bytes < MAX_SMALL)
+                return CLASS_SMALL;
+        return record->bytes < MAX_MEDIUM ? CLASS_MEDIUM : CLASS_LARGE;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//by time, stable
+int compareRecords(const void* a, const void* b) {
+
+        const record_t* first = (const record_t*)a;
+        const record_t* second = (const record_t*)b;
+        if(first->time != second->time)
+                return first->time < second->time ? -1 : 1;
+        return first < second ? -1 : 1;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/************************** Skeleton Methods **********************************/
+/******************************************************************************/
+/******************************************************************************/
+//creates, under root, every file answered with a 200 in the log, as large as
+//its largest logged response (headers included for the server's own log),
+//and every listed directory. paths with a ".." segment are left out.
+//returns 0 on success, -1 on failure
+int buildSkeleton(char* root) {
+
+        if(mkdir(root, 0755) && errno != EEXIST) {
+                perror(root);
+                return -1;
+        }
+
+        long files = 0;
+        long dirs = 0;
+        long bytes = 0;
+        long skipped = 0;
+        int i;
+        for(i = 0; i < sNumOfRecords; i++) {
+
+                record_t* record = &sRecords[i];
+                if(record->status != 200 || record->path[0] != '/')
+                        continue;
+
+                char path[strlen(root) + strlen(record->path) + 1];
+                sprintf(path, "%s%.*s", root, (int)strcspn(record->path, "?"), record->path);
+                if(strstr(path, "/../") || !strcmp(path + strlen(path) - 3, "/..")) {
+                        skipped++;
+                        continue;
+                }
+
+                struct stat st;
+                if(path[strlen(path) - 1] == '/') {
+                        if(!stat(path, &st))
+                                continue;
+                        if(makeParents(path)) {
+                                skipped++;
+                                continue;
+                        }
+                        dirs++;
+                        continue;
+                }
+
+                if(makeParents(path)) {
+                        skipped++;
+                        continue;
+                }
+
+                //a path logged several times keeps its largest size
+                if(!stat(path, &st) && (!S_ISREG(st.st_mode) || st.st_size >= record->bytes))
+                        continue;
+                if(fillFile(path, record->bytes)) {
+                        skipped++;
+                        continue;
+                }
+                if(st.st_size && S_ISREG(st.st_mode))
+                        bytes -= st.st_size;
+                else
+                        files++;
+                bytes += record->bytes;
+        }
+
+        printf("{\"root\":\"%s\",\"files\":%ld,\"dirs\":%ld,\"bytes\":%ld,\"skipped\":%ld}\n",
+               root, files, dirs, bytes, skipped);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//creates the missing directories leading to path.
+//returns 0 on success, -1 on failure
+int makeParents(char* path) {
+
+        char* slash = path;
+        while((slash = strchr(slash + 1, '/'))) {
+
+                *slash = '\0';
+                int error = mkdir(path, 0755) && errno != EEXIST;
+                *slash = '/';
+                if(error)
+                        return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//writes size bytes to path, real data rather than a hole, so reading it
+//back costs what the original file did
+int fillFile(const char* path, long size) {
+
+        static char block[SIZE_FILL];
+        memset(block, 'x', sizeof(block));
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+                return -1;
+
+        long written = 0;
+        while(written < size) {
+                long chunk = size - written < SIZE_FILL ? size - written : SIZE_FILL;
+                ssize_t nBytes = write(fd, block, chunk);
+                if(nBytes <= 0) {
+                        close(fd);
+                        return -1;
+                }
+                written += nBytes;
+        }
+
+        close(fd);
+        return 0;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Worker Methods ***********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+void* runWorker(void* arg) {
+
+        worker_t* worker = (worker_t*)arg;
+        double first = sRecords[0].time;
+
+        int next;
+        while((next = __atomic_fetch_add(&sNext, 1, __ATOMIC_RELAXED)) < sNumOfRecords) {
+
+                record_t* record = &sRecords[next];
+                double sendTime = now();
+                if(!sMaxRate) {
+                        double scheduled = sStart + (record->time - first) / sSpeedup;
+                        sleepUntil(scheduled);
+                        sendTime = scheduled;
+                }
+
+                long bytes = 0;
+                int status = doRequest(record, &bytes);
+
+                stats_t* stats = &worker->stats[record->class];
+                stats->requests++;
+                if(status <= 0) {
+                        stats->errors++;
+                        continue;
+                }
+
+                if(status != record->status)
+                        stats->mismatched++;
+                stats->bytes += bytes;
+                recordLatency(stats, (long)((now() - sendTime) * 1e6));
+        }
+
+        return NULL;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns response status code, -1 on failure
+int doRequest(record_t* record, long* bytes) {
+
+        char target[SIZE_REQUEST];
+        if(encodePath(record->path, target, sizeof(target)))
+                return -1;
+
+        int sockfd = socket(sAddr->ai_family, sAddr->ai_socktype, sAddr->ai_protocol);
+        if(sockfd < 0)
+                return -1;
+
+        if(connect(sockfd, sAddr->ai_addr, sAddr->ai_addrlen) < 0) {
+                debug_print("connect: %s\n", strerror(errno));
+                close(sockfd);
+                return -1;
+        }
+
+        char request[SIZE_REQUEST + 64];
+        int length = snprintf(request, sizeof(request), "%s %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                              record->method, target, sHost);
+        int written = 0;
+        int nBytes;
+        while(written < length) {
+                if((nBytes = write(sockfd, request + written, length - written)) < 0) {
+                        close(sockfd);
+                        return -1;
+                }
+                written += nBytes;
+        }
+
+        //server closes the connection after the response. It may also reset
+        //it because it never reads our headers, so a reset only counts as an
+        //error when the body is shorter than Content-Length.
+        static __thread char buffer[SIZE_READ_BUFFER];
+        char head[SIZE_REQUEST + 1];
+        int headLength = 0;
+        long bodyStart = -1;
+        long contentLength = -1;
+        long total = 0;
+        while((nBytes = read(sockfd, buffer, sizeof(buffer))) > 0) {
+
+                if(bodyStart < 0 && headLength < SIZE_REQUEST) {
+                        int n = nBytes < SIZE_REQUEST - headLength ? nBytes : SIZE_REQUEST - headLength;
+                        memcpy(head + headLength, buffer, n);
+                        headLength += n;
+                        head[headLength] = '\0';
+
+                        char* end = strstr(head, "\r\n\r\n");
+                        if(end) {
+                                bodyStart = end - head + 4;
+                                char* length = strstr(head, "Content-Length:");
+                                if(length && length < end)
+                                        contentLength = atol(length + strlen("Content-Length:"));
+                        }
+                }
+                total += nBytes;
+        }
+
+        close(sockfd);
+        if(bodyStart < 0 || strncmp(head, "HTTP/1.", 7))
+                return -1;
+        if(nBytes < 0 && (contentLength < 0 || total - bodyStart < contentLength))
+                return -1;
+
+        *bytes = total;
+        return atoi(head + 9);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//percent-encodes the bytes of path that can't appear in a request line (and
+//'%' itself) into target, size bytes.
+//returns 0 on success, -1 if it does not fit
+int encodePath(const char* path, char* target, int size) {
+
+        int length = 0;
+        for(; *path; path++) {
+
+                unsigned char c = *path;
+                if(length + 4 > size)
+                        return -1;
+                if(c <= ' ' || c >= 0x7f || c == '%')
+                        length += sprintf(target + length, "%%%02X", c);
+                else
+                        target[length++] = c;
+        }
+
+        target[length] = '\0';
+        return 0;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Misc Methods *************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+double now() {
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void sleepUntil(double when) {
+
+        struct timespec ts;
+        ts.tv_sec = (time_t)when;
+        ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void recordLatency(stats_t* stats, long usec) {
+        stats->hist[histIndex(usec)]++;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int histIndex(long value) {
+
+        if(value < HIST_LINEAR)
+                return value < 0 ? 0 : (int)value;
+
+        int exp = 63 - __builtin_clzl(value);
+        if(exp > HIST_MAX_EXP)
+                return HIST_SIZE - 1;
+
+        int sub = (int)(value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+        return HIST_LINEAR + (exp - 6) * HIST_SUB + sub;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns the lower bound of a bucket
+long histValue(int index) {
+
+        if(index < HIST_LINEAR)
+                return index;
+
+        int exp = (index - HIST_LINEAR) / HIST_SUB + 6;
+        int sub = (index - HIST_LINEAR) % HIST_SUB;
+        return (1L << exp) + ((long)sub << (exp - HIST_SUB_BITS));
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+long percentile(stats_t* stats, double fraction) {
+
+        long count = 0;
+        int i;
+        for(i = 0; i < HIST_SIZE; i++)
+                count += stats->hist[i];
+        if(!count)
+                return 0;
+
+        long target = (long)(count * fraction);
+        if(target >= count)
+                target = count - 1;
+
+        long seen = 0;
+        for(i = 0; i < HIST_SIZE; i++) {
+                seen += stats->hist[i];
+                if(seen > target)
+                        return histValue(i);
+        }
+        return histValue(HIST_SIZE - 1);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+long maximum(stats_t* stats) {
+
+        int i;
+        for(i = HIST_SIZE - 1; i >= 0; i--) {
+                if(stats->hist[i])
+                        return histValue(i);
+        }
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void printResults(const char* class, stats_t* stats, double elapsed) {
+
+        printf("{\"label\":\"%s\",\"class\":\"%s\",\"mode\":\"%s\",\"speedup\":%.2f,\"threads\":%d,"
+               "\"duration_s\":%.3f,\"requests\":%ld,\"errors\":%ld,\"mismatched\":%ld,"
+               "\"rps\":%.1f,\"bytes\":%ld,\"p50_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld,\"max_us\":%ld}\n",
+               sLabel,
+               class,
+               sMaxRate ? "max" : "timed",
+               sMaxRate ? 0 : sSpeedup,
+               sThreads,
+               elapsed,
+               stats->requests,
+               stats->errors,
+               stats->mismatched,
+               (stats->requests - stats->errors) / elapsed,
+               stats->bytes,
+               percentile(stats, 0.50),
+               percentile(stats, 0.99),
+               percentile(stats, 0.999),
+               maximum(stats));
+}
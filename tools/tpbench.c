@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "../threadpool.h"
+
+/**
+ * tpbench.c
+ *
+ * Microbenchmark of threadpool.c alone (no sockets, no files).
+ * For every pool size from 1 to MAXT_IN_POOL and every producer count it
+ * measures:
+ *   throughput - empty jobs completed per second
+ *   dispatch   - time spent inside dispatch(), i.e. qlock contention
+ *                (dispatch_batch() of -b jobs per call with -b)
+ *   wakeup     - dispatch() to job start while the pool is idle
+ *   fairness   - how evenly the jobs were spread over the workers
+ *                (Jain's index: 1.0 is perfectly even)
+ *
+ * Every configuration prints one JSON line.
+ */
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PRINT_WRONG_CMD_USAGE "Usage: tpbench [-n jobs] [-w wakeup-samples] [-T max-threads] [-P max-producers] [-b batch-size]\n"
+
+#define DEFAULT_JOBS 200000
+#define DEFAULT_WAKEUPS 200
+#define DEFAULT_MAX_PRODUCERS 8
+#define WAKEUP_IDLE_USEC 2000
+
+typedef struct producer_st {
+        pthread_t tid;
+        threadpool* pool;
+        int jobs;
+        double dispatchTotal;   //seconds spent in dispatch()
+        double dispatchMax;
+} producer_t;
+
+/****************************/
+/***** Global Variables *****/
+/****************************/
+int sJobs = DEFAULT_JOBS;
+int sWakeups = DEFAULT_WAKEUPS;
+int sMaxThreads = MAXT_IN_POOL;
+int sMaxProducers = DEFAULT_MAX_PRODUCERS;
+int sBatch = 1;                 //jobs per dispatch_batch(), 1 uses dispatch()
+
+pthread_mutex_t sDoneLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sDoneCond = PTHREAD_COND_INITIALIZER;
+long sDone = 0;
+long sTarget = 0;
+
+int sNextWorker = 0;            //every pool starts new threads, ids restart
+long sPerWorker[MAXT_IN_POOL];
+__thread int tWorker = -1;
+
+/*******************************/
+/***** Method Declarations *****/
+/*******************************/
+int parseArguments(int, char**);
+void runThroughput(int, int);
+void runWakeup(int);
+void* runProducer(void*);
+int emptyJob(void*);
+int wakeupJob(void*);
+void jobDone();
+void waitDone();
+double now();
+double fairness(int);
+int compareDouble(const void*, const void*);
+
+/******************************************************************************/
+/******************************************************************************/
+/***************************** Main Method ************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+        if(parseArguments(argc, argv)) {
+                fprintf(stderr, PRINT_WRONG_CMD_USAGE);
+                exit(EXIT_FAILURE);
+        }
+
+        int threads;
+        int producers;
+        //1, 2, 4 ... and always MAXT_IN_POOL (or -T) itself
+        for(threads = 1; ; threads *= 2) {
+
+                if(threads > sMaxThreads)
+                        threads = sMaxThreads;
+
+                for(producers = 1; producers <= sMaxProducers; producers *= 2)
+                        runThroughput(threads, producers);
+
+                runWakeup(threads);
+
+                if(threads == sMaxThreads)
+                        break;
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int parseArguments(int argc, char** argv) {
+
+        int opt;
+        while((opt = getopt(argc, argv, "n:w:T:P:b:")) != -1) {
+                switch (opt) {
+
+                case 'n':
+                        sJobs = atoi(optarg);
+                        break;
+
+                case 'w':
+                        sWakeups = atoi(optarg);
+                        break;
+
+                case 'T':
+                        sMaxThreads = atoi(optarg);
+                        break;
+
+                case 'P':
+                        sMaxProducers = atoi(optarg);
+                        break;
+
+                case 'b':
+                        sBatch = atoi(optarg);
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+
+        if(sJobs <= 0 || sWakeups <= 0 || sMaxProducers <= 0 || sBatch <= 0)
+                return -1;
+        if(sMaxThreads <= 0 || sMaxThreads > MAXT_IN_POOL)
+                return -1;
+
+        return 0;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/************************** Benchmark Methods *********************************/
+/******************************************************************************/
+/******************************************************************************/
+//empty-job throughput, dispatch latency and fairness
+void runThroughput(int threads, int producers) {
+
+        threadpool* pool = create_threadpool(threads);
+        if(!pool) {
+                fprintf(stderr, "create_threadpool failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        sNextWorker = 0;
+        memset(sPerWorker, 0, sizeof(sPerWorker));
+        sDone = 0;
+        sTarget = (long)(sJobs / producers) * producers;
+
+        producer_t* prods = (producer_t*)calloc(producers, sizeof(producer_t));
+        if(!prods) {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+        }
+
+        double start = now();
+        int i;
+        for(i = 0; i < producers; i++) {
+                prods[i].pool = pool;
+                prods[i].jobs = sJobs / producers;
+                if(pthread_create(&prods[i].tid, NULL, runProducer, &prods[i])) {
+                        fprintf(stderr, "pthread_create\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        double dispatchTotal = 0;
+        double dispatchMax = 0;
+        for(i = 0; i < producers; i++) {
+                pthread_join(prods[i].tid, NULL);
+                dispatchTotal += prods[i].dispatchTotal;
+                if(prods[i].dispatchMax > dispatchMax)
+                        dispatchMax = prods[i].dispatchMax;
+        }
+        double dispatched = now();
+
+        waitDone();
+        double elapsed = now() - start;
+
+        printf("{\"test\":\"throughput\",\"threads\":%d,\"producers\":%d,\"batch\":%d,\"jobs\":%ld,"
+               "\"jobs_per_s\":%.0f,\"dispatch_per_s\":%.0f,\"dispatch_avg_ns\":%.0f,"
+               "\"dispatch_max_us\":%.1f,\"workers_used\":%d,\"fairness\":%.3f}\n",
+               threads,
+               producers,
+               sBatch,
+               sTarget,
+               sTarget / elapsed,
+               sTarget / (dispatched - start),
+               dispatchTotal / sTarget * 1e9,
+               dispatchMax * 1e6,
+               sNextWorker,
+               fairness(threads));
+        fflush(stdout);
+
+        destroy_threadpool(pool);
+        free(prods);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//latency from dispatch() to job start while every worker sleeps on the queue
+void runWakeup(int threads) {
+
+        threadpool* pool = create_threadpool(threads);
+        if(!pool) {
+                fprintf(stderr, "create_threadpool failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        double* samples = (double*)calloc(sWakeups, sizeof(double));
+        if(!samples) {
+                perror("calloc");
+                exit(EXIT_FAILURE);
+        }
+
+        int i;
+        for(i = 0; i < sWakeups; i++) {
+
+                usleep(WAKEUP_IDLE_USEC); //let the workers go idle
+
+                sDone = 0;
+                sTarget = 1;
+                double sent = now();
+                samples[i] = sent;
+                dispatch(pool, wakeupJob, &samples[i]);
+                waitDone();
+        }
+
+        qsort(samples, sWakeups, sizeof(double), compareDouble);
+        printf("{\"test\":\"wakeup\",\"threads\":%d,\"samples\":%d,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+               threads,
+               sWakeups,
+               samples[sWakeups / 2] * 1e6,
+               samples[(int)(sWakeups * 0.99)] * 1e6,
+               samples[sWakeups - 1] * 1e6);
+        fflush(stdout);
+
+        destroy_threadpool(pool);
+        free(samples);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void* runProducer(void* arg) {
+
+        producer_t* prod = (producer_t*)arg;
+
+        batch_job_t batch[sBatch];
+        int i;
+        for(i = 0; i < sBatch; i++) {
+                batch[i].lane = LANE_INTERACTIVE;
+                batch[i].routine = emptyJob;
+                batch[i].arg = NULL;
+        }
+
+        for(i = 0; i < prod->jobs; i += sBatch) {
+
+                int count = prod->jobs - i < sBatch ? prod->jobs - i : sBatch;
+                double before = now();
+                if(sBatch == 1)
+                        dispatch(prod->pool, emptyJob, NULL);
+                else
+                        dispatch_batch(prod->pool, batch, count);
+                double took = now() - before;
+
+                prod->dispatchTotal += took;
+                if(took > prod->dispatchMax)
+                        prod->dispatchMax = took;
+        }
+
+        return NULL;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/****************************** Job Methods ***********************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int emptyJob(void* arg) {
+
+        if(tWorker < 0)
+                tWorker = __sync_fetch_and_add(&sNextWorker, 1);
+        __sync_fetch_and_add(&sPerWorker[tWorker], 1);
+
+        jobDone();
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//replaces the dispatch timestamp with the measured latency
+int wakeupJob(void* arg) {
+
+        double* sample = (double*)arg;
+        *sample = now() - *sample;
+
+        jobDone();
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+//only the last job takes the lock, so completion does not add contention
+void jobDone() {
+
+        if(__sync_add_and_fetch(&sDone, 1) != sTarget)
+                return;
+
+        pthread_mutex_lock(&sDoneLock);
+        pthread_cond_signal(&sDoneCond);
+        pthread_mutex_unlock(&sDoneLock);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void waitDone() {
+
+        pthread_mutex_lock(&sDoneLock);
+        while(__sync_fetch_and_add(&sDone, 0) < sTarget)
+                pthread_cond_wait(&sDoneCond, &sDoneLock);
+        pthread_mutex_unlock(&sDoneLock);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/*************************** Misc Methods *************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+double now() {
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//Jain's fairness index over all threads in the pool (idle workers count as 0)
+double fairness(int threads) {
+
+        double sum = 0;
+        double squares = 0;
+        int i;
+        for(i = 0; i < threads; i++) {
+                sum += sPerWorker[i];
+                squares += (double)sPerWorker[i] * sPerWorker[i];
+        }
+
+        if(!squares)
+                return 0;
+        return (sum * sum) / (threads * squares);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int compareDouble(const void* a, const void* b) {
+
+        double x = *(const double*)a;
+        double y = *(const double*)b;
+        return (x > y) - (x < y);
+}
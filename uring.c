@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define PROBE_OPS 256
+#define PROBE_FILE "/proc/self/exe"     //readable by any process
+#define PROBE_READ 64
+
+//opcodes used by the server
+static const int sRequiredOps[] = {
+        IORING_OP_ACCEPT,
+        IORING_OP_STATX,
+        IORING_OP_OPENAT,
+        IORING_OP_READ_FIXED,
+        IORING_OP_SEND,
+        IORING_OP_CLOSE,
+};
+#define NUM_OF_REQUIRED_OPS (sizeof(sRequiredOps) / sizeof(sRequiredOps[0]))
+
+static int mapRing(uring_t*, struct io_uring_params*);
+static int probeFileChain();
+static int registerResources(uring_t*, int);
+static unsigned cqReady(uring_t*);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+int uring_probe() {
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = syscall(__NR_io_uring_setup, 2, &params);
+        if(fd < 0) {
+                debug_print("uring_probe - io_uring_setup: %s\n", strerror(errno));
+                return -1;
+        }
+
+        size_t size = sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+        if(!probe) {
+                close(fd);
+                return -1;
+        }
+
+        int ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, PROBE_OPS);
+        close(fd);
+
+        int i;
+        for(i = 0; !ret && i < NUM_OF_REQUIRED_OPS; i++) {
+                int op = sRequiredOps[i];
+                if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                        debug_print("uring_probe - opcode %d not supported\n", op);
+                        ret = -1;
+                }
+        }
+
+        free(probe);
+        if(ret)
+                return -1;
+
+        //openat into a direct descriptor only came with 5.15: older kernels
+        //have the opcodes but fail every chain
+        return probeFileChain();
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+uring_t* create_uring(unsigned entries, int buffer_size) {
+
+        uring_t* ring = (uring_t*)calloc(1, sizeof(uring_t));
+        if(!ring)
+                return NULL;
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+        if(ring->fd < 0) {
+                debug_print("create_uring - io_uring_setup: %s\n", strerror(errno));
+                free(ring);
+                return NULL;
+        }
+
+        if(mapRing(ring, &params) || registerResources(ring, buffer_size)) {
+                destroy_uring(ring);
+                return NULL;
+        }
+
+        return ring;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+
+        unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if(ring->sq_local_tail - head > ring->sq_mask)
+                return NULL;
+
+        unsigned index = ring->sq_local_tail & ring->sq_mask;
+        ring->sq_array[index] = index;
+        ring->sq_local_tail++;
+
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr) {
+
+        unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+        int submitted = 0;
+        while(1) {
+
+                unsigned flags = wait_nr > cqReady(ring) ? IORING_ENTER_GETEVENTS : 0;
+                if(!to_submit && !flags)
+                        return submitted;
+
+                int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, flags ? wait_nr : 0, flags, NULL, 0);
+                if(ret < 0) {
+                        if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                                continue;
+                        return -errno;
+                }
+
+                //the kernel reports submissions even when the wait was interrupted
+                submitted += ret;
+                to_submit -= ret < to_submit ? ret : to_submit;
+        }
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+
+        unsigned head = *ring->cq_head;
+        if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        return &ring->cqes[head & ring->cq_mask];
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void uring_cqe_seen(uring_t* ring) {
+        __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+void destroy_uring(uring_t* ring) {
+
+        if(!ring)
+                return;
+
+        if(ring->sqes)
+                munmap(ring->sqes, ring->sqes_size);
+        if(ring->cq_ring && ring->cq_ring != ring->sq_ring)
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        if(ring->sq_ring)
+                munmap(ring->sq_ring, ring->sq_ring_size);
+
+        close(ring->fd);
+        free(ring->buffer);
+        free(ring);
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//returns 0 on success, -1 on failure
+static int mapRing(uring_t* ring, struct io_uring_params* p) {
+
+        ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+        //newer kernels map both rings with a single mmap
+        int single = p->features & IORING_FEAT_SINGLE_MMAP;
+        if(single && ring->cq_ring_size > ring->sq_ring_size)
+                ring->sq_ring_size = ring->cq_ring_size;
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if(ring->sq_ring == MAP_FAILED) {
+                ring->sq_ring = NULL;
+                return -1;
+        }
+
+        if(single) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+                if(ring->cq_ring == MAP_FAILED) {
+                        ring->cq_ring = NULL;
+                        return -1;
+                }
+        }
+
+        ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if(ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                return -1;
+        }
+
+        char* sq = (char*)ring->sq_ring;
+        ring->sq_head = (unsigned*)(sq + p->sq_off.head);
+        ring->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+        ring->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+        ring->sq_array = (unsigned*)(sq + p->sq_off.array);
+        ring->sq_local_tail = *ring->sq_tail;
+
+        char* cq = (char*)ring->cq_ring;
+        ring->cq_head = (unsigned*)(cq + p->cq_off.head);
+        ring->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+        ring->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//runs the server's file chain once - openat into a direct descriptor,
+//read_fixed from it and close it - on a file that always exists.
+//returns 0 if every step succeeded, -1 otherwise
+static int probeFileChain() {
+
+        uring_t* ring = create_uring(4, PROBE_READ);
+        if(!ring)
+                return -1;
+
+        struct io_uring_sqe* sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)PROBE_FILE;
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = 0;
+
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = 0;
+        sqe->addr = (unsigned long)ring->buffer;
+        sqe->len = PROBE_READ;
+        sqe->buf_index = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->user_data = 1;
+
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = 1;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->user_data = 2;
+
+        int results[3] = { -1, -1, -1 };
+        int reaped = 0;
+        if(uring_submit_and_wait(ring, 3) == 3) {
+                struct io_uring_cqe* cqe;
+                while(reaped < 3 && (cqe = uring_peek_cqe(ring))) {
+                        if(cqe->user_data < 3)
+                                results[cqe->user_data] = cqe->res;
+                        uring_cqe_seen(ring);
+                        reaped++;
+                }
+        }
+        destroy_uring(ring);
+
+        //a kernel ignoring file_index installed a regular descriptor
+        if(results[0] > 0)
+                close(results[0]);
+
+        debug_print("probeFileChain - open %d, read %d, close %d\n", results[0], results[1], results[2]);
+        return reaped == 3 && !results[0] && results[1] > 0 && !results[2] ? 0 : -1;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//registers buffer #0 and an empty direct descriptor table
+static int registerResources(uring_t* ring, int buffer_size) {
+
+        if(buffer_size > 0) {
+
+                ring->buffer = (char*)malloc(buffer_size);
+                if(!ring->buffer)
+                        return -1;
+                ring->buffer_size = buffer_size;
+
+                struct iovec iov;
+                iov.iov_base = ring->buffer;
+                iov.iov_len = buffer_size;
+                if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+                        debug_print("registerResources - buffers: %s\n", strerror(errno));
+                        return -1;
+                }
+        }
+
+        int files[URING_FILE_SLOTS];
+        int i;
+        for(i = 0; i < URING_FILE_SLOTS; i++)
+                files[i] = -1;
+
+        if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, URING_FILE_SLOTS) < 0) {
+                debug_print("registerResources - files: %s\n", strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+static unsigned cqReady(uring_t* ring) {
+        return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
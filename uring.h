@@ -0,0 +1,82 @@
+#include <linux/io_uring.h>
+
+/**
+ * uring.h
+ *
+ * Minimal io_uring wrapper on top of the raw syscalls (no liburing).
+ * A ring has one registered buffer (for READ_FIXED) and a sparse table of
+ * URING_FILE_SLOTS direct descriptors (for openat/read/close chains that
+ * never install a regular fd).
+ * A ring is not thread safe - the server keeps one per thread.
+ */
+
+#define URING_FILE_SLOTS 4
+
+typedef struct uring_st {
+        int fd;
+
+        //submission queue
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned sq_mask;
+        unsigned* sq_array;
+        struct io_uring_sqe* sqes;
+        unsigned sq_local_tail;         //prepared but not yet submitted
+
+        //completion queue
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe* cqes;
+
+        //mappings
+        void* sq_ring;
+        size_t sq_ring_size;
+        void* cq_ring;
+        size_t cq_ring_size;
+        size_t sqes_size;
+
+        //registered buffer #0
+        char* buffer;
+        int buffer_size;
+} uring_t;
+
+
+/**
+ * uring_probe checks that the running kernel has io_uring, supports every
+ * opcode the server uses, and runs an openat -> read_fixed -> close chain
+ * on a direct descriptor.
+ * returns 0 if it does, -1 otherwise.
+ */
+int uring_probe();
+
+/**
+ * create_uring sets up a ring with room for entries submissions, registers a
+ * buffer of buffer_size bytes (0 - none) and the sparse file table.
+ * returns NULL on failure (e.g. io_uring disabled).
+ */
+uring_t* create_uring(unsigned entries, int buffer_size);
+
+/**
+ * returns a zeroed sqe, NULL if the submission queue is full.
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+/**
+ * submits the prepared sqes and waits until at least wait_nr completions
+ * are available. one kernel transition.
+ * returns number of sqes submitted, -errno on failure.
+ */
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr);
+
+/**
+ * returns the oldest completion, NULL if there is none.
+ * uring_cqe_seen must be called once the cqe was consumed.
+ */
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+/**
+ * destroy_uring unmaps and closes the ring and frees its buffer.
+ */
+void destroy_uring(uring_t* ring);
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "vhost.h"
+#include "fnv.h"
+
+#define DEBUG 0
+#define debug_print(fmt, ...) \
+        do { if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define INITIAL_CAPACITY 64
+
+static vhost_t* createHost(const char*, int, const char*, mime_table_t*);
+static int insertHost(vhost_table_t*, vhost_t*);
+static int growTable(vhost_table_t*);
+static unsigned hashName(const char*, int);
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+
+vhost_table_t* create_vhost_table(const char* root, mime_table_t* mime) {
+
+        vhost_table_t* table = (vhost_table_t*)calloc(1, sizeof(vhost_table_t));
+        if(!table)
+                return NULL;
+
+        table->capacity = INITIAL_CAPACITY;
+        table->entries = (vhost_t**)calloc(table->capacity, sizeof(vhost_t*));
+        table->default_host = createHost("", 0, root, mime);
+        if(!table->entries || !table->default_host) {
+                free(table->entries);
+                free(table);
+                return NULL;
+        }
+
+        return table;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+int add_vhost(vhost_table_t* table, const char* spec, mime_table_t* mime) {
+
+        const char* root = strchr(spec, '=');
+        if(!root || root == spec || !root[1])
+                return -1;
+        int name_length = root - spec;
+        root++;
+
+        //"root,mime-types-file"
+        int root_length = strcspn(root, ",");
+        char rootPath[root_length + 1];
+        memcpy(rootPath, root, root_length);
+        rootPath[root_length] = '\0';
+
+        if(root[root_length]) {
+                mime_table_t* overrides = create_mime_table(mime);
+                if(!overrides || load_mime_types(overrides, root + root_length + 1) < 0)
+                        return -1;
+                mime = overrides;
+        }
+
+        vhost_t* host = createHost(spec, name_length, rootPath, mime);
+        if(!host)
+                return -1;
+
+        //a name given twice is a mistake in the configuration
+        if(lookup_vhost(table, host->name, name_length) != table->default_host || insertHost(table, host)) {
+                close(host->root_fd);
+                free(host->root);
+                free(host->name);
+                free(host);
+                return -1;
+        }
+
+        debug_print("add_vhost - %s -> %s\n", host->name, host->root);
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+
+const vhost_t* lookup_vhost(vhost_table_t* table, const char* host, int length) {
+
+        //"name:port", "[v6 address]:port"
+        const char* end = host[0] == '[' ? memchr(host, ']', length) : NULL;
+        end = memchr(end ? end : host, ':', length - (end ? end - host : 0));
+        if(end)
+                length = end - host;
+
+        if(!table->count || !length)
+                return table->default_host;
+
+        unsigned mask = table->capacity - 1;
+        unsigned i = hashName(host, length) & mask;
+        for(; table->entries[i]; i = (i + 1) & mask) {
+                vhost_t* entry = table->entries[i];
+                if(!strncasecmp(entry->name, host, length) && !entry->name[length])
+                        return entry;
+        }
+
+        return table->default_host;
+}
+
+/******************************************************************************/
+/******************************************************************************/
+/******************************************************************************/
+//returns the host serving root, NULL on failure
+static vhost_t* createHost(const char* name, int name_length, const char* root, mime_table_t* mime) {
+
+        vhost_t* host = (vhost_t*)calloc(1, sizeof(vhost_t));
+        if(!host)
+                return NULL;
+
+        host->name = strndup(name, name_length);
+        host->root = realpath(root, NULL);
+        if(!host->name || !host->root) {
+                if(host->name && !host->root)
+                        perror(root);
+                free(host->name);
+                free(host->root);
+                free(host);
+                return NULL;
+        }
+
+        host->root_fd = open(host->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if(host->root_fd < 0) {
+                perror(host->root);
+                free(host->name);
+                free(host->root);
+                free(host);
+                return NULL;
+        }
+
+        int i;
+        for(i = 0; i < name_length; i++)
+                host->name[i] = tolower((unsigned char)host->name[i]);
+
+        //"/" - request paths already start with one
+        if(!strcmp(host->root, "/"))
+                host->root[0] = '\0';
+        host->root_length = strlen(host->root);
+        host->mime = mime;
+        return host;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int insertHost(vhost_table_t* table, vhost_t* host) {
+
+        //keep the load factor at or below 1/2
+        if(2 * (table->count + 1) > table->capacity && growTable(table))
+                return -1;
+
+        unsigned mask = table->capacity - 1;
+        unsigned i = hashName(host->name, strlen(host->name)) & mask;
+        while(table->entries[i])
+                i = (i + 1) & mask;
+
+        table->entries[i] = host;
+        table->count++;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//returns 0 on success, -1 on failure
+static int growTable(vhost_table_t* table) {
+
+        int capacity = table->capacity * 2;
+        vhost_t** entries = (vhost_t**)calloc(capacity, sizeof(vhost_t*));
+        if(!entries)
+                return -1;
+
+        unsigned mask = capacity - 1;
+        int i;
+        for(i = 0; i < table->capacity; i++) {
+
+                vhost_t* host = table->entries[i];
+                if(!host)
+                        continue;
+
+                unsigned j = hashName(host->name, strlen(host->name)) & mask;
+                while(entries[j])
+                        j = (j + 1) & mask;
+                entries[j] = host;
+        }
+
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        return 0;
+}
+
+/*********************************/
+/*********************************/
+/*********************************/
+//FNV-1a of the lower cased name
+static unsigned hashName(const char* name, int length) {
+
+        unsigned hash = FNV_OFFSET;
+        int i;
+        for(i = 0; i < length; i++)
+                hash = fnv1a_add(hash, tolower((unsigned char)name[i]));
+
+        return hash;
+}
@@ -0,0 +1,49 @@
+#include "mime.h"
+
+/**
+ * vhost.h
+ *
+ * Name-based virtual hosts: Host header -> document root.
+ * Every host has its root opened once at startup, so paths under it are
+ * resolved relative to that fd (openat/fstatat) instead of from '/', and
+ * optionally its own mime.types overriding the server's types.
+ * Like the MIME registry the table is an open addressing hash table filled
+ * at startup and read-only afterwards - picking the host of a request is one
+ * hash of its name, however many hosts there are.
+ */
+
+typedef struct vhost_st {
+        char* name;             //lower case, without a port
+        char* root;             //absolute, without a trailing '/'
+        int root_length;
+        int root_fd;            //O_PATH descriptor of root
+        mime_table_t* mime;     //the host's types, falling back to the server's
+} vhost_t;
+
+typedef struct vhost_table_st {
+        vhost_t** entries;
+        int capacity;           //always a power of two
+        int count;
+        vhost_t* default_host;  //serves requests naming no known host
+} vhost_table_t;
+
+
+/**
+ * create_vhost_table creates a table whose default host serves root with
+ * the mime types of the server.
+ * returns NULL on failure.
+ */
+vhost_table_t* create_vhost_table(const char* root, mime_table_t* mime);
+
+/**
+ * adds a host from a "name=root[,mime-types-file]" spec. the host's types
+ * are looked up in the file first, then in mime.
+ * returns 0 on success, -1 if the spec is malformed or root can't be opened.
+ */
+int add_vhost(vhost_table_t* table, const char* spec, mime_table_t* mime);
+
+/**
+ * returns the host named by a Host header value (length bytes, any case,
+ * with or without a port), the default host if there is none.
+ */
+const vhost_t* lookup_vhost(vhost_table_t* table, const char* host, int length);